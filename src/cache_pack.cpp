@@ -0,0 +1,188 @@
+// This tool exports entries from a disk cache to a pack and imports packs
+// into a disk cache (see disk_cache::export_pack()). It's used to seed the
+// caches of new nodes.
+//
+// The cache must not be in use by a server while this runs, and the cache
+// directories, size limits and namespaces must match the server's config.
+// The directories and their size limits determine how keys are assigned to
+// shards, and opening a cache unpins any namespace that isn't listed as
+// pinned.
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include <cradle/inner/caching/disk_cache.h>
+
+using std::string;
+
+using namespace cradle;
+
+// Parse a --cache-namespace option, which has the form
+// NAME[,size-limit=LIMIT][,pinned].
+static disk_cache_namespace_config
+parse_namespace_config(string const& option)
+{
+    auto invalid = [&]() -> std::runtime_error {
+        return std::runtime_error("invalid --cache-namespace: " + option);
+    };
+    std::vector<string> parts;
+    for (size_t start = 0;;)
+    {
+        auto end = option.find(',', start);
+        parts.push_back(option.substr(start, end - start));
+        if (end == string::npos)
+            break;
+        start = end + 1;
+    }
+    disk_cache_namespace_config config;
+    config.name = parts.front();
+    if (config.name.empty())
+        throw invalid();
+    for (size_t i = 1; i != parts.size(); ++i)
+    {
+        string const size_limit_prefix = "size-limit=";
+        if (parts[i] == "pinned")
+        {
+            config.pinned = true;
+        }
+        else if (parts[i].starts_with(size_limit_prefix))
+        {
+            auto limit = parts[i].substr(size_limit_prefix.size());
+            size_t parsed_size = 0;
+            try
+            {
+                config.size_limit = std::stoull(limit, &parsed_size);
+            }
+            catch (std::exception&)
+            {
+                throw invalid();
+            }
+            if (parsed_size != limit.size())
+                throw invalid();
+        }
+        else
+        {
+            throw invalid();
+        }
+    }
+    return config;
+}
+
+int
+main(int argc, char const* const* argv)
+try
+{
+    namespace po = boost::program_options;
+
+    po::options_description desc("Supported options");
+    desc.add_options()("help", "show help message")(
+        "cache-dir",
+        po::value<std::vector<string>>()->required(),
+        "specify the cache directory (repeat this for a sharded cache)")(
+        "cache-size-limit",
+        po::value<std::vector<size_t>>()->default_value(
+            std::vector<size_t>{0x1'00'00'00'00}, "4294967296"),
+        "specify the size limit of the cache (either once for every shard or "
+        "once per --cache-dir, in the same order)")(
+        "cache-namespace",
+        po::value<std::vector<string>>(),
+        "specify a namespace's settings as NAME[,size-limit=LIMIT][,pinned] "
+        "(repeatable)")(
+        "export", po::value<string>(), "export entries to the given pack")(
+        "import", po::value<string>(), "import the given pack")(
+        "namespace",
+        po::value<std::vector<string>>(),
+        "only export entries in the given namespace (repeatable)")(
+        "key",
+        po::value<std::vector<string>>(),
+        "only export the entry with the given key (repeatable)")(
+        "size-limit",
+        po::value<size_t>(),
+        "only export the most recently used entries, up to this total size");
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << desc;
+        return 0;
+    }
+
+    po::notify(vm);
+
+    if (vm.count("export") == vm.count("import"))
+    {
+        std::cerr << "exactly one of --export and --import is required\n";
+        return 1;
+    }
+
+    auto const& dirs = vm["cache-dir"].as<std::vector<string>>();
+    auto const& size_limits
+        = vm["cache-size-limit"].as<std::vector<size_t>>();
+    if (size_limits.size() != 1 && size_limits.size() != dirs.size())
+    {
+        std::cerr << "--cache-size-limit must be given once or once per "
+                     "--cache-dir\n";
+        return 1;
+    }
+    auto get_size_limit = [&](size_t i) {
+        return size_limits.size() == 1 ? size_limits.front() : size_limits[i];
+    };
+    disk_cache_config config{dirs.front(), get_size_limit(0)};
+    if (dirs.size() > 1)
+    {
+        for (size_t i = 0; i != dirs.size(); ++i)
+        {
+            config.shards.push_back(
+                disk_cache_shard_config{dirs[i], get_size_limit(i)});
+        }
+    }
+    if (vm.count("cache-namespace"))
+    {
+        for (auto const& option :
+             vm["cache-namespace"].as<std::vector<string>>())
+        {
+            config.namespaces.push_back(parse_namespace_config(option));
+        }
+    }
+    // This is a one-off job, so there's no point in idle maintenance.
+    config.maintenance_interval = std::chrono::milliseconds(0);
+    disk_cache cache(config);
+
+    disk_cache_pack_info info;
+    if (vm.count("export"))
+    {
+        disk_cache_pack_selection selection;
+        if (vm.count("namespace"))
+            selection.namespaces = vm["namespace"].as<std::vector<string>>();
+        if (vm.count("key"))
+            selection.keys = vm["key"].as<std::vector<string>>();
+        if (vm.count("size-limit"))
+            selection.size_limit = vm["size-limit"].as<size_t>();
+        info = cache.export_pack(vm["export"].as<string>(), selection);
+        std::cout << "exported ";
+    }
+    else
+    {
+        info = cache.import_pack(vm["import"].as<string>());
+        std::cout << "imported ";
+    }
+    std::cout << info.entry_count << " entries (" << info.total_size
+              << " bytes), skipped " << info.skipped_count << "\n";
+    return 0;
+}
+catch (std::exception& e)
+{
+    std::cerr << e.what() << "\n";
+    return 1;
+}
+catch (...)
+{
+    std::cerr << "unknown error\n";
+    return 1;
+}
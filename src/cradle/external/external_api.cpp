@@ -61,7 +61,19 @@ make_service_config(api_service_config const& config)
                                "config.disk_cache_size_limit"));
         }
         result.disk_cache = cradle::service_disk_cache_config(
-            config.disk_cache_directory, config.disk_cache_size_limit.value());
+            config.disk_cache_directory,
+            config.disk_cache_size_limit.value(),
+            none,
+            none,
+            none,
+            none,
+            none,
+            none,
+            none,
+            none,
+            none,
+            none,
+            none);
     }
     result.request_concurrency = config.request_concurrency;
     result.compute_concurrency = config.compute_concurrency;
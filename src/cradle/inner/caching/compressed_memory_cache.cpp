@@ -0,0 +1,206 @@
+#include <cradle/inner/caching/compressed_memory_cache.h>
+
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include <cradle/inner/encodings/lz4.h>
+
+namespace cradle {
+
+namespace {
+
+struct compressed_entry
+{
+    std::string key;
+
+    // the stored data - This is LZ4-compressed iff :compressed is true.
+    std::shared_ptr<std::byte const> data;
+    size_t size;
+    bool compressed;
+
+    size_t original_size;
+};
+
+typedef std::list<compressed_entry> compressed_entry_list;
+
+} // namespace
+
+struct compressed_memory_cache_impl
+{
+    compressed_memory_cache_config config;
+
+    // all entries, in LRU order (least recently used first)
+    compressed_entry_list entries;
+    std::unordered_map<std::string, compressed_entry_list::iterator> index;
+
+    size_t total_size = 0;
+    size_t original_size = 0;
+    uint64_t hit_count = 0;
+    uint64_t miss_count = 0;
+
+    std::mutex mutex;
+};
+
+namespace {
+
+// Remove the entry at :i.
+// The cache mutex must be held by the caller.
+void
+remove_entry(
+    compressed_memory_cache_impl& cache, compressed_entry_list::iterator i)
+{
+    cache.total_size -= i->size;
+    cache.original_size -= i->original_size;
+    cache.index.erase(i->key);
+    cache.entries.erase(i);
+}
+
+// Evict least recently used entries until the cache is within its limit.
+// The cache mutex must be held by the caller.
+void
+enforce_size_limit(compressed_memory_cache_impl& cache)
+{
+    while (cache.total_size > cache.config.size_limit)
+        remove_entry(cache, cache.entries.begin());
+}
+
+// Compress :value for storage. If compression doesn't actually save
+// anything, the original data is shared instead.
+compressed_entry
+make_entry(std::string const& key, blob const& value)
+{
+    size_t max_compressed_size = lz4::max_compressed_size(value.size());
+    std::unique_ptr<std::byte[]> compressed_data(
+        new std::byte[max_compressed_size]);
+    size_t compressed_size = lz4::compress(
+        compressed_data.get(),
+        max_compressed_size,
+        value.data(),
+        value.size());
+    if (compressed_size >= value.size())
+    {
+        return compressed_entry{
+            key, value.shared_data(), value.size(), false, value.size()};
+    }
+    // Trim the buffer down to the actual compressed size so that the memory
+    // we hold matches what we account for.
+    std::shared_ptr<std::byte[]> trimmed_data(new std::byte[compressed_size]);
+    std::memcpy(trimmed_data.get(), compressed_data.get(), compressed_size);
+    return compressed_entry{
+        key,
+        std::static_pointer_cast<std::byte const>(std::move(trimmed_data)),
+        compressed_size,
+        true,
+        value.size()};
+}
+
+} // namespace
+
+compressed_memory_cache::compressed_memory_cache()
+{
+}
+
+compressed_memory_cache::compressed_memory_cache(
+    compressed_memory_cache_config const& config)
+{
+    reset(config);
+}
+
+compressed_memory_cache::~compressed_memory_cache()
+{
+}
+
+void
+compressed_memory_cache::reset(compressed_memory_cache_config const& config)
+{
+    impl_ = std::make_unique<compressed_memory_cache_impl>();
+    impl_->config = config;
+}
+
+void
+compressed_memory_cache::reset()
+{
+    impl_.reset();
+}
+
+compressed_memory_cache_info
+compressed_memory_cache::get_summary_info()
+{
+    auto& cache = *impl_;
+    std::scoped_lock<std::mutex> lock(cache.mutex);
+    return compressed_memory_cache_info{
+        cache.entries.size(),
+        cache.total_size,
+        cache.original_size,
+        cache.hit_count,
+        cache.miss_count};
+}
+
+void
+compressed_memory_cache::clear()
+{
+    auto& cache = *impl_;
+    std::scoped_lock<std::mutex> lock(cache.mutex);
+    cache.entries.clear();
+    cache.index.clear();
+    cache.total_size = 0;
+    cache.original_size = 0;
+}
+
+std::optional<blob>
+compressed_memory_cache::find(std::string const& key)
+{
+    auto& cache = *impl_;
+    compressed_entry entry;
+    {
+        std::scoped_lock<std::mutex> lock(cache.mutex);
+        auto i = cache.index.find(key);
+        if (i == cache.index.end())
+        {
+            ++cache.miss_count;
+            return none;
+        }
+        ++cache.hit_count;
+        // Move the entry to the back of the LRU list.
+        cache.entries.splice(cache.entries.end(), cache.entries, i->second);
+        // Copy out what we need so that we can decompress without holding
+        // the lock. (The data itself is shared, not copied.)
+        entry = *i->second;
+    }
+    if (!entry.compressed)
+        return blob(std::move(entry.data), entry.size);
+    std::shared_ptr<std::byte[]> decompressed_data(
+        new std::byte[entry.original_size]);
+    lz4::decompress(
+        decompressed_data.get(),
+        entry.original_size,
+        entry.data.get(),
+        entry.size);
+    return blob(
+        std::static_pointer_cast<std::byte const>(
+            std::move(decompressed_data)),
+        entry.original_size);
+}
+
+void
+compressed_memory_cache::insert(std::string const& key, blob const& value)
+{
+    auto& cache = *impl_;
+    auto entry = make_entry(key, value);
+    if (entry.size > cache.config.size_limit)
+        return;
+
+    std::scoped_lock<std::mutex> lock(cache.mutex);
+    auto existing = cache.index.find(key);
+    if (existing != cache.index.end())
+        remove_entry(cache, existing->second);
+    cache.total_size += entry.size;
+    cache.original_size += entry.original_size;
+    auto i = cache.entries.insert(cache.entries.end(), std::move(entry));
+    cache.index[key] = i;
+    enforce_size_limit(cache);
+}
+
+} // namespace cradle
@@ -0,0 +1,112 @@
+#ifndef CRADLE_INNER_CACHING_COMPRESSED_MEMORY_CACHE_H
+#define CRADLE_INNER_CACHING_COMPRESSED_MEMORY_CACHE_H
+
+#include <memory>
+#include <optional>
+#include <string>
+
+#include <cradle/inner/core/type_definitions.h>
+
+namespace cradle {
+
+// A compressed memory cache is a second in-memory tier that sits between the
+// immutable memory cache and the disk cache. It holds serialized values
+// (blobs) in LZ4-compressed form, so values that have been evicted from the
+// immutable cache can be recovered without reading, decompressing and
+// checking a file from the disk cache.
+
+// Entries are evicted in LRU order whenever the total compressed size of the
+// cache exceeds its size limit.
+
+// Values that don't compress well are stored as-is. (These are then returned
+// without any copying.)
+
+// A cache is internally protected by a mutex, so it can be used concurrently
+// from multiple threads. Compression and decompression happen outside of the
+// mutex.
+
+struct compressed_memory_cache_config
+{
+    // the maximum total size of the (compressed) data in the cache, in bytes
+    size_t size_limit;
+};
+
+struct compressed_memory_cache_info
+{
+    // the number of entries currently stored in the cache
+    size_t entry_count;
+
+    // the total size of the stored data (in bytes)
+    size_t total_size;
+
+    // the total original (decompressed) size of the stored data
+    size_t original_size;
+
+    // the number of lookups that found/didn't find an entry
+    uint64_t hit_count;
+    uint64_t miss_count;
+
+    auto
+    operator<=>(compressed_memory_cache_info const& other) const
+        = default;
+};
+
+struct compressed_memory_cache_impl;
+
+struct compressed_memory_cache
+{
+    // The default constructor creates an invalid cache that must be
+    // initialized via reset().
+    compressed_memory_cache();
+
+    // Create a cache that's initialized with the given config.
+    compressed_memory_cache(compressed_memory_cache_config const& config);
+
+    ~compressed_memory_cache();
+
+    // Reset the cache with a new config.
+    // After a call to this, the cache is considered initialized.
+    // Any existing entries are discarded.
+    void
+    reset(compressed_memory_cache_config const& config);
+
+    // Reset the cache to an uninitialized state.
+    void
+    reset();
+
+    // Is the cache initialized?
+    bool
+    is_initialized()
+    {
+        return impl_ ? true : false;
+    }
+
+    // The rest of this interface should only be used if is_initialized()
+    // returns true.
+
+    // Get summary information about the cache.
+    compressed_memory_cache_info
+    get_summary_info();
+
+    // Clear the cache of all data.
+    void
+    clear();
+
+    // Look up a key in the cache and return the (decompressed) value
+    // associated with it, if any.
+    std::optional<blob>
+    find(std::string const& key);
+
+    // Add an entry to the cache, replacing any existing entry for :key.
+    // Values whose stored size would exceed the size limit on their own are
+    // ignored.
+    void
+    insert(std::string const& key, blob const& value);
+
+ private:
+    std::unique_ptr<compressed_memory_cache_impl> impl_;
+};
+
+} // namespace cradle
+
+#endif
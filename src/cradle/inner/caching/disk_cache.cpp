@@ -1,16 +1,29 @@
 #include <cradle/inner/caching/disk_cache.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <filesystem>
+#include <fstream>
+#include <map>
 #include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/numeric/conversion/cast.hpp>
 
 #include <sqlite3.h>
 
 #include <hashids.h>
 
+#include <cradle/inner/encodings/base64.h>
 #include <cradle/inner/fs/app_dirs.h>
+#include <cradle/inner/fs/file_io.h>
 #include <cradle/inner/utilities/errors.h>
 #include <cradle/inner/utilities/text.h>
 
@@ -19,6 +32,24 @@ using std::string;
 
 namespace cradle {
 
+// a read-only connection to the index database (used in WAL mode)
+struct disk_cache_reader
+{
+    sqlite3* db = nullptr;
+    sqlite3_stmt* look_up_entry_query = nullptr;
+};
+
+// the steps of disk cache maintenance (in the order that they're done)
+enum class maintenance_phase
+{
+    ABANDONED_ENTRIES,
+    ORPHANED_FILES,
+    JOURNAL,
+    VACUUM,
+    REINDEX_ENTRIES,
+    REINDEX_CONTENTS
+};
+
 struct disk_cache_impl
 {
     file_path dir;
@@ -33,24 +64,108 @@ struct disk_cache_impl
     sqlite3_stmt* initiate_insert_statement = nullptr;
     sqlite3_stmt* finish_insert_statement = nullptr;
     sqlite3_stmt* remove_entry_statement = nullptr;
+    sqlite3_stmt* discard_entry_statement = nullptr;
     sqlite3_stmt* look_up_entry_query = nullptr;
     sqlite3_stmt* cache_size_query = nullptr;
     sqlite3_stmt* entry_count_query = nullptr;
     sqlite3_stmt* entry_list_query = nullptr;
     sqlite3_stmt* lru_entry_list_query = nullptr;
+    sqlite3_stmt* mru_entry_list_query = nullptr;
+    sqlite3_stmt* content_by_hash_query = nullptr;
+    sqlite3_stmt* insert_content_statement = nullptr;
+    sqlite3_stmt* link_content_statement = nullptr;
+    sqlite3_stmt* orphaned_contents_query = nullptr;
+    sqlite3_stmt* remove_content_statement = nullptr;
+    sqlite3_stmt* set_entry_namespace_statement = nullptr;
+    sqlite3_stmt* namespace_size_query = nullptr;
+    sqlite3_stmt* namespace_lru_entry_list_query = nullptr;
 
     int64_t size_limit;
 
+    // the configs for the namespaces that need special treatment (see
+    // disk_cache_namespace_config), indexed by name
+    std::map<string, disk_cache_namespace_config> namespaces;
+
     // used to track when we need to check if the cache is too big
     int64_t bytes_inserted_since_last_sweep = 0;
 
     // list of IDs that whose usage needs to be recorded
     std::vector<int64_t> usage_record_buffer;
 
-    std::chrono::time_point<std::chrono::system_clock> latest_activity;
+    // write batching (see disk_cache_config) - When batching is enabled,
+    // writes are made inside a transaction that stays open until
+    // :write_batch_size entries have been written or the batch deadline
+    // passes. The flusher thread takes care of the deadline.
+    unsigned write_batch_size = 1;
+    std::chrono::milliseconds write_batch_delay{0};
+    bool in_transaction = false;
+    unsigned batched_entry_count = 0;
+    // set during a bulk write (see begin_bulk_write()), which overrides
+    // the batching settings
+    bool in_bulk_write = false;
+    std::chrono::steady_clock::time_point batch_deadline;
+    std::thread flusher;
+    bool flusher_stopping = false;
+    std::condition_variable batch_opened;
+    // the files whose index rows have been removed in the open batch - These
+    // are only removed once the batch commits.
+    std::vector<file_path> files_to_remove;
+
+    // This is atomic because lookups through reader connections update it
+    // without holding :mutex.
+    std::atomic<std::chrono::time_point<std::chrono::system_clock>>
+        latest_activity;
 
-    // protects all access to the cache
+    // protects all access to the cache (except for the reader connections)
     std::mutex mutex;
+
+    // the read-only connections (if the cache is in WAL mode) - These are
+    // created and destroyed while holding :mutex, but they're otherwise
+    // managed as a pool: a reader is used by one thread at a time and
+    // :idle_readers holds the ones that are available. :readers and
+    // :idle_readers are both protected by :reader_mutex, and
+    // :reader_available is signaled whenever a reader is returned or the
+    // pool is closed. Once :readers_closing is set, no more readers are
+    // taken from the pool, so lookups fall back to the main connection.
+    std::vector<std::unique_ptr<disk_cache_reader>> readers;
+    std::vector<disk_cache_reader*> idle_readers;
+    bool readers_closing = false;
+    std::mutex reader_mutex;
+    std::condition_variable reader_available;
+
+    // the recovery journal (see "RECOVERY JOURNAL" below)
+    std::ofstream journal;
+
+    // Is this shard out of service? (See "SHARDS" below.) This is set
+    // without holding :mutex.
+    std::atomic<bool> failed{false};
+
+    // (see disk_cache_config::legacy_value_decoder)
+    std::function<optional<string>(string const& encoded)>
+        legacy_value_decoder;
+
+    // maintenance (see "MAINTENANCE" below) - Each run picks up where the
+    // previous one left off, as recorded by :next_maintenance_phase and
+    // :orphan_sweep_queue (the names of the files that the current sweep
+    // still has to check). The maintainer thread runs maintenance when the
+    // cache is idle.
+    std::chrono::milliseconds maintenance_interval{0};
+    std::chrono::milliseconds maintenance_time_budget{0};
+    std::chrono::seconds abandonment_age{0};
+    maintenance_phase next_maintenance_phase
+        = maintenance_phase::ABANDONED_ENTRIES;
+    std::vector<string> orphan_sweep_queue;
+    // Does the index database support incremental vacuuming? (See
+    // disk_cache_config::rebuild_legacy_index.)
+    bool supports_incremental_vacuum = false;
+    // Do the index database's indices need to be rebuilt? (This is only the
+    // case after recovery.)
+    bool needs_reindex = false;
+    disk_cache_maintenance_report maintenance_totals;
+    std::chrono::time_point<std::chrono::system_clock> latest_maintenance;
+    std::thread maintainer;
+    bool maintainer_stopping = false;
+    std::condition_variable maintainer_wakeup;
 };
 
 // SQLITE UTILITIES
@@ -117,15 +232,15 @@ check_sqlite_code(disk_cache_impl const& cache, int code)
     }
 }
 
-// Create a prepared statement.
+// Create a prepared statement on the given connection.
 // This checks to make sure that the creation was successful, so the returned
 // pointer is always valid.
 static sqlite3_stmt*
-prepare_statement(disk_cache_impl const& cache, string const& sql)
+prepare_statement(disk_cache_impl const& cache, sqlite3* db, string const& sql)
 {
     sqlite3_stmt* statement;
     auto code = sqlite3_prepare_v2(
-        cache.db,
+        db,
         sql.c_str(),
         boost::numeric_cast<int>(sql.length()),
         &statement,
@@ -145,6 +260,13 @@ prepare_statement(disk_cache_impl const& cache, string const& sql)
     return statement;
 }
 
+// Create a prepared statement on the cache's main connection.
+static sqlite3_stmt*
+prepare_statement(disk_cache_impl const& cache, string const& sql)
+{
+    return prepare_statement(cache, cache.db, sql);
+}
+
 // Bind a 32-bit integer to a parameter of a prepared statement.
 static void
 bind_int32(
@@ -206,6 +328,17 @@ bind_blob(
             SQLITE_STATIC));
 }
 
+// Bind a checksum algorithm to a parameter of a prepared statement.
+static void
+bind_checksum_algorithm(
+    disk_cache_impl const& cache,
+    sqlite3_stmt* statement,
+    int parameter_index,
+    disk_cache_checksum_algorithm algorithm)
+{
+    bind_int32(cache, statement, parameter_index, int(algorithm));
+}
+
 // Execute a prepared statement (with variables already bound to it) and check
 // that it finished successfully.
 // This should only be used for statements that don't return results.
@@ -264,8 +397,23 @@ read_string(sqlite_row& row, int column_index)
 static string
 read_blob(sqlite_row& row, int column_index)
 {
-    return reinterpret_cast<char const*>(
+    // Blobs can contain null bytes, so the size must be queried separately.
+    // (Note that this must be done after retrieving the data.)
+    auto data = reinterpret_cast<char const*>(
         sqlite3_column_blob(row.statement, column_index));
+    auto size = sqlite3_column_bytes(row.statement, column_index);
+    return data ? string(data, boost::numeric_cast<size_t>(size)) : string();
+}
+
+// Read a checksum algorithm (as stored by bind_checksum_algorithm()).
+// NULL indicates an entry from before the algorithm was recorded, which
+// means CRC-32.
+static disk_cache_checksum_algorithm
+read_checksum_algorithm(sqlite_row& row, int column_index)
+{
+    return has_value(row, column_index)
+               ? disk_cache_checksum_algorithm(read_int32(row, column_index))
+               : disk_cache_checksum_algorithm::CRC32;
 }
 
 // Execute a prepared statement (with variables already bound to it), pass all
@@ -368,7 +516,7 @@ std::vector<disk_cache_entry> static get_entry_list(disk_cache_impl& cache)
     execute_prepared_statement(
         cache,
         cache.entry_list_query,
-        expected_column_count{6},
+        expected_column_count{8},
         single_row_result{false},
         [&](sqlite_row& row) {
             disk_cache_entry e;
@@ -378,40 +526,156 @@ std::vector<disk_cache_entry> static get_entry_list(disk_cache_impl& cache)
             e.size = has_value(row, 3) ? read_int64(row, 3) : 0;
             e.original_size = has_value(row, 4) ? read_int64(row, 4) : 0;
             e.crc32 = has_value(row, 5) ? read_int32(row, 5) : 0;
+            e.content_id = has_value(row, 6) ? some(read_int64(row, 6)) : none;
+            e.checksum_algorithm = read_checksum_algorithm(row, 7);
             entries.push_back(e);
         });
     return entries;
 }
 
-// Get a list of entries in the cache in LRU order.
+// Get a list of the most recently used entries in the cache (with values),
+// up to a total original size of :size_limit.
+static std::vector<disk_cache_entry>
+get_recently_used_entries(disk_cache_impl& cache, int64_t size_limit)
+{
+    std::vector<disk_cache_entry> entries;
+    int64_t total_size = 0;
+    bool full = false;
+    execute_prepared_statement(
+        cache,
+        cache.mru_entry_list_query,
+        expected_column_count{9},
+        single_row_result{false},
+        [&](sqlite_row& row) {
+            int64_t original_size = has_value(row, 5) ? read_int64(row, 5) : 0;
+            full = full || total_size + original_size > size_limit;
+            if (full)
+                return;
+            total_size += original_size;
+            disk_cache_entry e;
+            e.key = read_string(row, 0);
+            e.id = read_int64(row, 1);
+            e.in_db = has_value(row, 2) && read_bool(row, 2);
+            e.value = has_value(row, 3) ? some(read_blob(row, 3)) : none;
+            e.size = has_value(row, 4) ? read_int64(row, 4) : 0;
+            e.original_size = original_size;
+            e.crc32 = has_value(row, 6) ? read_int32(row, 6) : 0;
+            e.content_id = has_value(row, 7) ? some(read_int64(row, 7)) : none;
+            e.checksum_algorithm = read_checksum_algorithm(row, 8);
+            entries.push_back(e);
+        });
+    return entries;
+}
+
+// Get a list of (up to :limit) entries in the cache in LRU order.
+// Invalid entries come first, since they're the first to go, and pinned
+// entries come last.
+// A negative :limit means no limit.
 struct lru_entry
 {
-    int64_t id, size;
+    int64_t id;
     bool in_db;
 };
 typedef std::vector<lru_entry> lru_entry_list;
 static lru_entry_list
-get_lru_entries(disk_cache_impl& cache)
+get_lru_entries(disk_cache_impl& cache, int64_t limit = -1)
 {
     lru_entry_list entries;
+    bind_int64(cache, cache.lru_entry_list_query, 1, limit);
     execute_prepared_statement(
         cache,
         cache.lru_entry_list_query,
-        expected_column_count{3},
+        expected_column_count{2},
         single_row_result{false},
         [&](sqlite_row& row) {
             lru_entry e;
             e.id = read_int64(row, 0);
-            e.size = has_value(row, 1) ? read_int64(row, 1) : 0;
-            e.in_db = has_value(row, 2) && read_bool(row, 2);
+            e.in_db = has_value(row, 1) && read_bool(row, 1);
+            entries.push_back(e);
+        });
+    return entries;
+}
+
+// Get the total size of each namespace.
+static std::map<string, int64_t>
+get_namespace_sizes(disk_cache_impl& cache)
+{
+    std::map<string, int64_t> sizes;
+    sqlite3_stmt* query = prepare_statement(
+        cache, "select name, total_size from namespaces;");
+    try
+    {
+        execute_prepared_statement(
+            cache,
+            query,
+            expected_column_count{2},
+            single_row_result{false},
+            [&](sqlite_row& row) {
+                sizes[read_string(row, 0)] = read_int64(row, 1);
+            });
+    }
+    catch (...)
+    {
+        sqlite3_finalize(query);
+        throw;
+    }
+    sqlite3_finalize(query);
+    return sizes;
+}
+
+// Get a list of (up to :limit) entries in the given namespace in LRU order.
+static lru_entry_list
+get_namespace_lru_entries(
+    disk_cache_impl& cache, string const& key_namespace, int64_t limit)
+{
+    lru_entry_list entries;
+    bind_string(cache, cache.namespace_lru_entry_list_query, 1, key_namespace);
+    bind_int64(cache, cache.namespace_lru_entry_list_query, 2, limit);
+    execute_prepared_statement(
+        cache,
+        cache.namespace_lru_entry_list_query,
+        expected_column_count{2},
+        single_row_result{false},
+        [&](sqlite_row& row) {
+            lru_entry e;
+            e.id = read_int64(row, 0);
+            e.in_db = has_value(row, 1) && read_bool(row, 1);
             entries.push_back(e);
         });
     return entries;
 }
 
+// Get the total size of the entries in the given namespace.
+static int64_t
+get_namespace_size(disk_cache_impl& cache, string const& key_namespace)
+{
+    int64_t size = 0;
+    bind_string(cache, cache.namespace_size_query, 1, key_namespace);
+    execute_prepared_statement(
+        cache,
+        cache.namespace_size_query,
+        expected_column_count{1},
+        single_row_result{false},
+        [&](sqlite_row& row) { size = read_int64(row, 0); });
+    return size;
+}
+
+// Are entries in the given namespace pinned?
+static bool
+is_pinned_namespace(disk_cache_impl const& cache, string const& key_namespace)
+{
+    auto config = cache.namespaces.find(key_namespace);
+    return config != cache.namespaces.end() && config->second.pinned;
+}
+
 // Get the entry associated with a particular key (if any).
+// :query is a look_up_entry_query for whichever connection is being used.
 static optional<disk_cache_entry>
-look_up(disk_cache_impl const& cache, string const& key, bool only_if_valid)
+look_up(
+    disk_cache_impl const& cache,
+    sqlite3_stmt* query,
+    string const& key,
+    bool only_if_valid)
 {
     bool exists = false;
     int64_t id = 0;
@@ -421,12 +685,14 @@ look_up(disk_cache_impl const& cache, string const& key, bool only_if_valid)
     int64_t size = 0;
     int64_t original_size = 0;
     uint32_t crc32 = 0;
+    optional<int64_t> content_id;
+    auto checksum_algorithm = disk_cache_checksum_algorithm::CRC32;
 
-    bind_string(cache, cache.look_up_entry_query, 1, key);
+    bind_string(cache, query, 1, key);
     execute_prepared_statement(
         cache,
-        cache.look_up_entry_query,
-        expected_column_count{7},
+        query,
+        expected_column_count{9},
         single_row_result{false},
         [&](sqlite_row& row) {
             id = read_int64(row, 0);
@@ -436,12 +702,203 @@ look_up(disk_cache_impl const& cache, string const& key, bool only_if_valid)
             size = has_value(row, 4) ? read_int64(row, 4) : 0;
             original_size = has_value(row, 5) ? read_int64(row, 5) : 0;
             crc32 = has_value(row, 6) ? read_int32(row, 6) : 0;
+            content_id = has_value(row, 7) ? some(read_int64(row, 7)) : none;
+            checksum_algorithm = read_checksum_algorithm(row, 8);
             exists = true;
         });
 
-    return (exists && (!only_if_valid || valid)) ? some(disk_cache_entry{
-               key, id, in_db, value, size, original_size, crc32})
-                                                 : none;
+    if (!exists || (only_if_valid && !valid))
+        return none;
+    return disk_cache_entry{
+        key,
+        id,
+        in_db,
+        value,
+        size,
+        original_size,
+        crc32,
+        content_id,
+        checksum_algorithm};
+}
+
+static optional<disk_cache_entry>
+look_up(disk_cache_impl const& cache, string const& key, bool only_if_valid)
+{
+    return look_up(cache, cache.look_up_entry_query, key, only_if_valid);
+}
+
+// WRITE BATCHING
+
+static bool
+is_batching(disk_cache_impl const& cache)
+{
+    return cache.write_batch_size > 1;
+}
+
+// This must be called before making any changes to the database.
+// If batching is enabled, it ensures that a batch transaction is open.
+static void
+begin_write(disk_cache_impl& cache)
+{
+    if (!is_batching(cache) || cache.in_transaction)
+        return;
+    execute_sql(cache, "begin;");
+    cache.in_transaction = true;
+    cache.batched_entry_count = 0;
+    cache.batch_deadline
+        = std::chrono::steady_clock::now() + cache.write_batch_delay;
+    cache.batch_opened.notify_one();
+}
+
+// Remove a file that the index no longer refers to. Failures are ignored,
+// since the orphan sweep (see "MAINTENANCE") will get it later.
+static void
+remove_unreferenced_file(file_path const& path)
+{
+    std::error_code error;
+    std::filesystem::remove(path, error);
+}
+
+// Remove the file at :path once the removal of the index row that refers to
+// it has been committed. (If there's no batch open, it already has been.)
+// This must be called after the row has been removed.
+static void
+remove_file_after_commit(disk_cache_impl& cache, file_path path)
+{
+    if (cache.in_transaction)
+        cache.files_to_remove.push_back(std::move(path));
+    else
+        remove_unreferenced_file(path);
+}
+
+// If :path is waiting to be removed, keep it after all. (Row IDs can be
+// reused within a batch, so a new entry may claim the same path.)
+static void
+keep_file(disk_cache_impl& cache, file_path const& path)
+{
+    std::erase(cache.files_to_remove, path);
+}
+
+// Write out the journal records that have been buffered since the last
+// flush. This happens once per batch (or once per write, without batching),
+// rather than once per record.
+static void
+flush_journal(disk_cache_impl& cache)
+{
+    if (cache.journal.is_open())
+        cache.journal.flush();
+}
+
+// Commit the open batch transaction (if any).
+static void
+commit_batch(disk_cache_impl& cache)
+{
+    if (!cache.in_transaction)
+        return;
+    flush_journal(cache);
+    try
+    {
+        execute_sql(cache, "commit;");
+    }
+    catch (...)
+    {
+        // Abandon the batch. (This is a cache, so losing a few writes is
+        // acceptable, but leaving the transaction open would block all
+        // future writes.) The rows that the batch removed are back, so
+        // their files have to stay.
+        sqlite3_exec(cache.db, "rollback;", 0, 0, 0);
+        cache.in_transaction = false;
+        cache.files_to_remove.clear();
+        throw;
+    }
+    cache.in_transaction = false;
+    for (auto const& path : cache.files_to_remove)
+        remove_unreferenced_file(path);
+    cache.files_to_remove.clear();
+}
+
+// This must be called after an entry is written to the database.
+// It commits the open batch if it's full. (Without a batch, the write has
+// already been committed, so only the journal needs flushing.)
+static void
+finish_entry_write(disk_cache_impl& cache)
+{
+    if (!cache.in_transaction)
+    {
+        flush_journal(cache);
+    }
+    else if (
+        !cache.in_bulk_write
+        && ++cache.batched_entry_count >= cache.write_batch_size)
+    {
+        commit_batch(cache);
+    }
+}
+
+// Start a bulk write. Until end_bulk_write() is called, all writes go into
+// a single transaction (whether or not batching is enabled).
+// The caller must hold the cache mutex for the whole bulk write.
+static void
+begin_bulk_write(disk_cache_impl& cache)
+{
+    commit_batch(cache);
+    execute_sql(cache, "begin;");
+    cache.in_transaction = true;
+    cache.in_bulk_write = true;
+}
+
+static void
+end_bulk_write(disk_cache_impl& cache)
+{
+    cache.in_bulk_write = false;
+    commit_batch(cache);
+}
+
+// This runs on the flusher thread and commits batches whose deadlines have
+// passed.
+static void
+run_flusher(disk_cache_impl& cache)
+{
+    std::unique_lock<std::mutex> lock(cache.mutex);
+    while (!cache.flusher_stopping)
+    {
+        if (!cache.in_transaction)
+        {
+            cache.batch_opened.wait(lock);
+        }
+        else if (std::chrono::steady_clock::now() < cache.batch_deadline)
+        {
+            cache.batch_opened.wait_until(lock, cache.batch_deadline);
+        }
+        else
+        {
+            try
+            {
+                commit_batch(cache);
+            }
+            catch (...)
+            {
+                // There's nobody to report this to, and the next write will
+                // simply start a new batch.
+            }
+        }
+    }
+}
+
+// Stop the flusher thread (if it's running).
+// This must NOT be called while holding the cache mutex.
+static void
+stop_flusher(disk_cache_impl& cache)
+{
+    if (!cache.flusher.joinable())
+        return;
+    {
+        std::scoped_lock<std::mutex> lock(cache.mutex);
+        cache.flusher_stopping = true;
+    }
+    cache.batch_opened.notify_one();
+    cache.flusher.join();
+    cache.flusher_stopping = false;
 }
 
 // OTHER UTILITIES
@@ -453,41 +910,198 @@ get_path_for_id(disk_cache_impl& cache, int64_t id)
     return cache.dir / hash.encode(&id, &id + 1);
 }
 
+static file_path
+get_path_for_content(disk_cache_impl& cache, int64_t content_id)
+{
+    // Hash IDs are purely alphanumeric, so this can't clash with the name of
+    // an entry's file.
+    hashidsxx::Hashids hash("cradle", 6);
+    return cache.dir
+           / ("content-" + hash.encode(&content_id, &content_id + 1));
+}
+
+// the ID encoded in the name of an entry's file (or a content file)
+struct entry_file_name
+{
+    bool is_content;
+    int64_t id;
+};
+
+// Parse a name produced by get_path_for_id() or get_path_for_content().
+// This returns none if :name isn't one.
+static optional<entry_file_name>
+parse_entry_file_name(string const& name)
+{
+    bool is_content = name.starts_with("content-");
+    string encoded_id = is_content ? name.substr(8) : name;
+    if (encoded_id.empty()
+        || !std::all_of(encoded_id.begin(), encoded_id.end(), [](char c) {
+               return std::isalnum(static_cast<unsigned char>(c));
+           }))
+    {
+        return none;
+    }
+    hashidsxx::Hashids hash("cradle", 6);
+    auto ids = hash.decode(encoded_id);
+    if (ids.size() != 1 || hash.encode(ids.begin(), ids.end()) != encoded_id)
+        return none;
+    return entry_file_name{is_content, int64_t(ids[0])};
+}
+
+// Is the file called :name one that the cache may remove? That's only the
+// case for entry and content files and for the temporary files that entry
+// files are written to before they're moved into place (named
+// "<entry file>.tmp<N>"). Anything else in the directory is left alone.
+static bool
+is_removable_cache_file(string const& name)
+{
+    auto suffix = name.find(".tmp");
+    if (suffix != string::npos)
+    {
+        auto counter = name.substr(suffix + 4);
+        if (counter.empty()
+            || !std::all_of(counter.begin(), counter.end(), [](char c) {
+                   return std::isdigit(static_cast<unsigned char>(c));
+               }))
+        {
+            return false;
+        }
+    }
+    return parse_entry_file_name(name.substr(0, suffix)).has_value();
+}
+
+// Remove any shared content that's no longer referenced by any entries.
+// (The reference counts are maintained by triggers, so this should be called
+// after anything that might have released a reference.)
+static void
+remove_orphaned_contents(disk_cache_impl& cache)
+{
+    std::vector<int64_t> orphans;
+    execute_prepared_statement(
+        cache,
+        cache.orphaned_contents_query,
+        expected_column_count{1},
+        single_row_result{false},
+        [&](sqlite_row& row) { orphans.push_back(read_int64(row, 0)); });
+    for (auto content_id : orphans)
+    {
+        bind_int64(cache, cache.remove_content_statement, 1, content_id);
+        execute_prepared_statement(cache, cache.remove_content_statement);
+        remove_file_after_commit(
+            cache, get_path_for_content(cache, content_id));
+    }
+}
+
 static void
 remove_entry(disk_cache_impl& cache, int64_t id, bool remove_file = true)
 {
-    file_path path = get_path_for_id(cache, id);
-    if (remove_file && exists(path))
-        remove(path);
+    begin_write(cache);
 
     bind_int64(cache, cache.remove_entry_statement, 1, id);
     execute_prepared_statement(cache, cache.remove_entry_statement);
+    if (remove_file)
+        remove_file_after_commit(cache, get_path_for_id(cache, id));
+
+    remove_orphaned_contents(cache);
+}
+
+// Get the ID of the shared content with the given hash (if any).
+static optional<int64_t>
+find_content(disk_cache_impl& cache, string const& content_hash)
+{
+    optional<int64_t> content_id;
+    bind_string(cache, cache.content_by_hash_query, 1, content_hash);
+    execute_prepared_statement(
+        cache,
+        cache.content_by_hash_query,
+        expected_column_count{1},
+        single_row_result{false},
+        [&](sqlite_row& row) { content_id = read_int64(row, 0); });
+    return content_id;
 }
 
+// Make the entry :id a valid entry that refers to the given shared content.
 static void
-enforce_cache_size_limit(disk_cache_impl& cache)
+link_entry_to_content(disk_cache_impl& cache, int64_t id, int64_t content_id)
 {
-    try
+    bind_int64(cache, cache.link_content_statement, 1, content_id);
+    bind_int64(cache, cache.link_content_statement, 2, id);
+    execute_prepared_statement(cache, cache.link_content_statement);
+}
+
+// the number of entries that enforce_cache_size_limit() considers at once
+int64_t const eviction_batch_size = 256;
+
+// Evict entries (in the order that :get_candidates lists them, in batches)
+// until :get_size reports that they're within :size_limit.
+template<class GetSize, class GetCandidates>
+static void
+evict_to_size_limit(
+    disk_cache_impl& cache,
+    int64_t size_limit,
+    GetSize const& get_size,
+    GetCandidates const& get_candidates)
+{
+    int64_t size = get_size();
+    while (size > size_limit)
     {
-        int64_t size = get_cache_size(cache);
-        if (size > cache.size_limit)
+        auto lru_entries = get_candidates();
+        bool made_progress = false;
+        for (auto const& entry : lru_entries)
         {
-            auto lru_entries = get_lru_entries(cache);
-            std::vector<lru_entry>::const_iterator i = lru_entries.begin(),
-                                                   end_i = lru_entries.end();
-            while (size > cache.size_limit && i != end_i)
+            if (size <= size_limit)
+                break;
+            try
             {
-                try
-                {
-                    remove_entry(cache, i->id, !i->in_db);
-                    size -= i->size;
-                }
-                catch (...)
-                {
-                }
-                ++i;
+                remove_entry(cache, entry.id, !entry.in_db);
+                // Removing an entry that shares its content with others
+                // doesn't free anything, so check what it actually did.
+                size = get_size();
+                made_progress = true;
             }
+            catch (...)
+            {
+            }
+        }
+        // If nothing could be removed, give up for now rather than
+        // retrying the same entries forever.
+        if (!made_progress)
+            break;
+    }
+}
+
+static void
+enforce_cache_size_limit(disk_cache_impl& cache)
+{
+    try
+    {
+        // The total sizes are maintained incrementally (see
+        // add_version_4_schema() and add_version_8_schema()), and the LRU
+        // entries come from indices, so the cost of this is proportional to
+        // the number of entries that are evicted, not the size of the cache.
+
+        // Namespaces with their own limits are brought within them first.
+        // (This also helps with the overall limit.)
+        for (auto const& [name, config] : cache.namespaces)
+        {
+            if (config.size_limit == 0)
+                continue;
+            evict_to_size_limit(
+                cache,
+                int64_t(config.size_limit),
+                [&] { return get_namespace_size(cache, name); },
+                [&] {
+                    return get_namespace_lru_entries(
+                        cache, name, eviction_batch_size);
+                });
         }
+
+        evict_to_size_limit(
+            cache,
+            cache.size_limit,
+            [&] { return get_cache_size(cache); },
+            [&] { return get_lru_entries(cache, eviction_batch_size); });
+
         cache.bytes_inserted_since_last_sweep = 0;
     }
     catch (...)
@@ -511,6 +1125,8 @@ record_usage_to_db(disk_cache_impl const& cache, int64_t id)
 static void
 write_usage_records(disk_cache_impl& cache)
 {
+    if (!cache.usage_record_buffer.empty())
+        begin_write(cache);
     for (auto const& record : cache.usage_record_buffer)
         record_usage_to_db(cache, record);
     cache.usage_record_buffer.clear();
@@ -528,40 +1144,395 @@ record_cache_growth(disk_cache_impl& cache, uint64_t size)
 }
 
 static void
-shut_down(disk_cache_impl& cache)
+close_readers(disk_cache_impl& cache)
 {
-    if (cache.db)
     {
-        sqlite3_finalize(cache.database_version_query);
-        sqlite3_finalize(cache.record_usage_statement);
-        sqlite3_finalize(cache.update_entry_value_statement);
-        sqlite3_finalize(cache.insert_new_value_statement);
-        sqlite3_finalize(cache.initiate_insert_statement);
-        sqlite3_finalize(cache.finish_insert_statement);
-        sqlite3_finalize(cache.remove_entry_statement);
-        sqlite3_finalize(cache.look_up_entry_query);
-        sqlite3_finalize(cache.cache_size_query);
-        sqlite3_finalize(cache.entry_count_query);
-        sqlite3_finalize(cache.entry_list_query);
-        sqlite3_finalize(cache.lru_entry_list_query);
-        sqlite3_close(cache.db);
-        cache.db = nullptr;
+        std::unique_lock<std::mutex> lock(cache.reader_mutex);
+        // Stop handing out readers, and wait for the ones that are in use to
+        // come back.
+        cache.readers_closing = true;
+        cache.reader_available.wait(lock, [&] {
+            return cache.idle_readers.size() == cache.readers.size();
+        });
+        for (auto& reader : cache.readers)
+        {
+            sqlite3_finalize(reader->look_up_entry_query);
+            sqlite3_close(reader->db);
+        }
+        cache.readers.clear();
+        cache.idle_readers.clear();
     }
+    // Anyone still waiting for a reader has to fall back now.
+    cache.reader_available.notify_all();
+}
+
+static void
+shut_down(disk_cache_impl& cache)
+{
+    close_readers(cache);
+    cache.journal.close();
+    if (cache.db)
+    {
+        // Persist any buffered usage so that the recency information survives
+        // restarts. (This is best effort, since we may be shutting down
+        // because the database is broken.)
+        try
+        {
+            write_usage_records(cache);
+        }
+        catch (...)
+        {
+        }
+        cache.usage_record_buffer.clear();
+        // Commit any pending batch.
+        try
+        {
+            commit_batch(cache);
+        }
+        catch (...)
+        {
+        }
+        cache.in_transaction = false;
+        cache.files_to_remove.clear();
+        sqlite3_finalize(cache.database_version_query);
+        sqlite3_finalize(cache.record_usage_statement);
+        sqlite3_finalize(cache.update_entry_value_statement);
+        sqlite3_finalize(cache.insert_new_value_statement);
+        sqlite3_finalize(cache.initiate_insert_statement);
+        sqlite3_finalize(cache.finish_insert_statement);
+        sqlite3_finalize(cache.remove_entry_statement);
+        sqlite3_finalize(cache.discard_entry_statement);
+        sqlite3_finalize(cache.look_up_entry_query);
+        sqlite3_finalize(cache.cache_size_query);
+        sqlite3_finalize(cache.entry_count_query);
+        sqlite3_finalize(cache.entry_list_query);
+        sqlite3_finalize(cache.lru_entry_list_query);
+        sqlite3_finalize(cache.mru_entry_list_query);
+        sqlite3_finalize(cache.content_by_hash_query);
+        sqlite3_finalize(cache.insert_content_statement);
+        sqlite3_finalize(cache.link_content_statement);
+        sqlite3_finalize(cache.orphaned_contents_query);
+        sqlite3_finalize(cache.remove_content_statement);
+        sqlite3_finalize(cache.set_entry_namespace_statement);
+        sqlite3_finalize(cache.namespace_size_query);
+        sqlite3_finalize(cache.namespace_lru_entry_list_query);
+        sqlite3_close(cache.db);
+        cache.db = nullptr;
+    }
+}
+
+// Add the parts of the schema that were introduced in version 4 to a
+// version 3 database (which may be freshly created):
+// - a metadata table that holds the running totals of the entries' sizes
+//   and the number of valid entries, maintained by triggers
+// - an index on the eviction order
+static void
+add_version_4_schema(disk_cache_impl& cache)
+{
+    execute_sql(
+        cache,
+        "create table metadata("
+        " total_size integer not null,"
+        " valid_count integer not null);");
+    execute_sql(
+        cache,
+        "insert into metadata"
+        " select coalesce(sum(size), 0), coalesce(sum(valid), 0)"
+        " from entries;");
+    execute_sql(
+        cache,
+        "create trigger entries_inserted after insert on entries begin"
+        " update metadata set"
+        "  total_size = total_size + coalesce(new.size, 0),"
+        "  valid_count = valid_count + new.valid;"
+        " end;");
+    execute_sql(
+        cache,
+        "create trigger entries_deleted after delete on entries begin"
+        " update metadata set"
+        "  total_size = total_size - coalesce(old.size, 0),"
+        "  valid_count = valid_count - old.valid;"
+        " end;");
+    execute_sql(
+        cache,
+        "create trigger entries_updated after update of size, valid"
+        " on entries begin"
+        " update metadata set"
+        "  total_size = total_size - coalesce(old.size, 0)"
+        "   + coalesce(new.size, 0),"
+        "  valid_count = valid_count - old.valid + new.valid;"
+        " end;");
+    execute_sql(
+        cache,
+        "create index entries_by_eviction_order"
+        " on entries(valid, last_accessed);");
+}
+
+// Convert a version 4 database to version 5.
+// Before version 5, the values of entries stored in the database were
+// encoded by the cache's user (as text) before being handed to the cache, so
+// they took up more space than necessary and had to be decoded on every
+// lookup. Since version 5, they're stored as raw bytes, and the user's
+// decoder (see disk_cache_config::legacy_value_decoder) is used to convert
+// them. (Entries whose values can't be decoded are simply dropped.)
+static void
+convert_to_version_5(disk_cache_impl& cache)
+{
+    // Convert the entries in batches (in ID order), so that memory usage
+    // stays bounded no matter how big the database is.
+    sqlite3_stmt* batch_query = nullptr;
+    sqlite3_stmt* update_statement = nullptr;
+    sqlite3_stmt* remove_statement = nullptr;
+    try
+    {
+        batch_query = prepare_statement(
+            cache,
+            "select id, value from entries"
+            " where in_db=1 and value is not null and id > ?1"
+            " order by id limit 1000;");
+        update_statement = prepare_statement(
+            cache,
+            "update entries set value=?1, size=?2, original_size=?2"
+            " where id=?3;");
+        remove_statement
+            = prepare_statement(cache, "delete from entries where id=?1;");
+
+        int64_t last_id = 0;
+        while (true)
+        {
+            std::vector<std::pair<int64_t, string>> batch;
+            bind_int64(cache, batch_query, 1, last_id);
+            execute_prepared_statement(
+                cache,
+                batch_query,
+                expected_column_count{2},
+                single_row_result{false},
+                [&](sqlite_row& row) {
+                    batch.emplace_back(read_int64(row, 0), read_blob(row, 1));
+                });
+            if (batch.empty())
+                break;
+            for (auto& [id, encoded] : batch)
+            {
+                optional<string> decoded;
+                if (cache.legacy_value_decoder)
+                {
+                    try
+                    {
+                        decoded = cache.legacy_value_decoder(encoded);
+                    }
+                    catch (...)
+                    {
+                    }
+                }
+                if (decoded)
+                {
+                    string const& value = *decoded;
+                    bind_blob(cache, update_statement, 1, value);
+                    bind_int64(
+                        cache,
+                        update_statement,
+                        2,
+                        boost::numeric_cast<int64_t>(value.size()));
+                    bind_int64(cache, update_statement, 3, id);
+                    execute_prepared_statement(cache, update_statement);
+                }
+                else
+                {
+                    bind_int64(cache, remove_statement, 1, id);
+                    execute_prepared_statement(cache, remove_statement);
+                }
+            }
+            last_id = batch.back().first;
+        }
+    }
+    catch (...)
+    {
+        sqlite3_finalize(batch_query);
+        sqlite3_finalize(update_statement);
+        sqlite3_finalize(remove_statement);
+        throw;
+    }
+    sqlite3_finalize(batch_query);
+    sqlite3_finalize(update_statement);
+    sqlite3_finalize(remove_statement);
+}
+
+// Add the parts of the schema that were introduced in version 6 to a
+// version 5 database (which may be freshly created):
+// - a table of shared (content-addressed) file contents, which file entries
+//   can point to instead of owning their own files - The contents' sizes are
+//   included in the running total, and their reference counts are
+//   maintained by triggers on the entries table.
+// - a view of the entries with their content info filled in
+static void
+add_version_6_schema(disk_cache_impl& cache)
+{
+    execute_sql(
+        cache,
+        "create table contents("
+        " id integer primary key,"
+        " hash text unique not null,"
+        " ref_count integer not null,"
+        " size integer,"
+        " original_size integer,"
+        " crc32 integer);");
+    execute_sql(cache, "alter table entries add column content_id integer;");
+    execute_sql(
+        cache,
+        "create index orphaned_contents on contents(id)"
+        " where ref_count = 0;");
+    execute_sql(
+        cache,
+        "create trigger contents_inserted after insert on contents begin"
+        " update metadata set total_size = total_size + coalesce(new.size, 0);"
+        " end;");
+    execute_sql(
+        cache,
+        "create trigger contents_deleted after delete on contents begin"
+        " update metadata set total_size = total_size - coalesce(old.size, 0);"
+        " end;");
+    execute_sql(
+        cache,
+        "create trigger entry_content_released after delete on entries"
+        " when old.content_id is not null begin"
+        " update contents set ref_count = ref_count - 1"
+        "  where id = old.content_id;"
+        " end;");
+    execute_sql(
+        cache,
+        "create trigger entry_content_changed after update of content_id"
+        " on entries when old.content_id is not new.content_id begin"
+        " update contents set ref_count = ref_count - 1"
+        "  where id = old.content_id;"
+        " update contents set ref_count = ref_count + 1"
+        "  where id = new.content_id;"
+        " end;");
+    execute_sql(
+        cache,
+        "create view entry_info as select"
+        " e.id, e.key, e.valid, e.last_accessed, e.in_db, e.value,"
+        " coalesce(c.size, e.size) as size,"
+        " coalesce(c.original_size, e.original_size) as original_size,"
+        " coalesce(c.crc32, e.crc32) as crc32,"
+        " e.content_id"
+        " from entries e left join contents c on c.id = e.content_id;");
+}
+
+// Add the parts of the schema that were introduced in version 7 to a
+// version 6 database (which may be freshly created): a record of which
+// algorithm was used for each file entry's checksum (see
+// disk_cache_checksum_algorithm)
+static void
+add_version_7_schema(disk_cache_impl& cache)
+{
+    execute_sql(
+        cache, "alter table entries add column checksum_algorithm integer;");
+    execute_sql(
+        cache, "alter table contents add column checksum_algorithm integer;");
+    execute_sql(cache, "drop view entry_info;");
+    execute_sql(
+        cache,
+        "create view entry_info as select"
+        " e.id, e.key, e.valid, e.last_accessed, e.in_db, e.value,"
+        " coalesce(c.size, e.size) as size,"
+        " coalesce(c.original_size, e.original_size) as original_size,"
+        " coalesce(c.crc32, e.crc32) as crc32,"
+        " e.content_id,"
+        " case when e.content_id is null then e.checksum_algorithm"
+        "  else c.checksum_algorithm end as checksum_algorithm"
+        " from entries e left join contents c on c.id = e.content_id;");
+}
+
+// Add the parts of the schema that were introduced in version 8 to a
+// version 7 database (which may be freshly created):
+// - the namespace of each entry (see disk_cache_namespace_config)
+// - whether each entry is pinned - This is determined by the entry's
+//   namespace, but it's stored with the entry so that it can be part of the
+//   eviction order index.
+// - a table that holds the running total of each namespace's size (and
+//   which namespaces are currently pinned), maintained by triggers
+// - an index on the eviction order within each namespace
+static void
+add_version_8_schema(disk_cache_impl& cache)
+{
+    execute_sql(
+        cache,
+        "alter table entries add column"
+        " key_namespace text not null default '';");
+    execute_sql(
+        cache,
+        "alter table entries add column"
+        " pinned boolean not null default 0;");
+    execute_sql(
+        cache,
+        "create table namespaces("
+        " name text primary key,"
+        " total_size integer not null,"
+        " pinned boolean not null default 0);");
+    execute_sql(
+        cache,
+        "insert into namespaces(name, total_size)"
+        " select e.key_namespace, coalesce(sum(coalesce(e.size, c.size)), 0)"
+        " from entries e left join contents c on c.id = e.content_id"
+        " group by e.key_namespace;");
+    // An entry's size is either its own or that of the content it refers
+    // to. (Contents' sizes never change, and contents are only removed once
+    // nothing refers to them.)
+    string const new_size = "coalesce(new.size, (select size from contents"
+                            " where id = new.content_id), 0)";
+    string const old_size = "coalesce(old.size, (select size from contents"
+                            " where id = old.content_id), 0)";
+    execute_sql(
+        cache,
+        "create trigger entries_inserted_into_namespace after insert"
+        " on entries begin"
+        " insert or ignore into namespaces(name, total_size)"
+        "  values(new.key_namespace, 0);"
+        " update namespaces set total_size = total_size + "
+            + new_size + " where name = new.key_namespace; end;");
+    execute_sql(
+        cache,
+        "create trigger entries_deleted_from_namespace after delete"
+        " on entries begin"
+        " update namespaces set total_size = total_size - "
+            + old_size + " where name = old.key_namespace; end;");
+    execute_sql(
+        cache,
+        "create trigger entries_updated_in_namespace after update"
+        " of size, content_id, key_namespace on entries begin"
+        " insert or ignore into namespaces(name, total_size)"
+        "  values(new.key_namespace, 0);"
+        " update namespaces set total_size = total_size - "
+            + old_size + " where name = old.key_namespace;"
+            + " update namespaces set total_size = total_size + " + new_size
+            + " where name = new.key_namespace; end;");
+    // Pinned entries go to the back of the eviction order.
+    execute_sql(cache, "drop index entries_by_eviction_order;");
+    execute_sql(
+        cache,
+        "create index entries_by_eviction_order"
+        " on entries(valid, pinned, last_accessed);");
+    execute_sql(
+        cache,
+        "create index entries_by_namespace_eviction_order"
+        " on entries(key_namespace, valid, last_accessed);");
 }
 
 // Open (or create) the database file and verify that the version number is
-// what we expect.
+// what we expect. Databases from earlier versions (back to version 3) are
+// upgraded in place.
 static void
 open_and_check_db(disk_cache_impl& cache)
 {
-    int const expected_database_version = 3;
+    int const expected_database_version = 8;
 
     open_db(&cache.db, cache.dir / "index.db");
 
     // Get the version number embedded in the database.
     cache.database_version_query
         = prepare_statement(cache, "pragma user_version;");
-    int database_version;
+    int database_version = 0;
     execute_prepared_statement(
         cache,
         cache.database_version_query,
@@ -572,6 +1543,11 @@ open_and_check_db(disk_cache_impl& cache)
     // A database_version of 0 indicates a fresh database, so initialize it.
     if (database_version == 0)
     {
+        // Maintenance relies on incremental vacuuming, which is cheapest to
+        // enable before any tables exist. (See initialize() for older
+        // databases.)
+        execute_sql(cache, "pragma auto_vacuum = incremental;");
+        execute_sql(cache, "begin;");
         execute_sql(
             cache,
             "create table entries("
@@ -584,10 +1560,35 @@ open_and_check_db(disk_cache_impl& cache)
             " size integer,"
             " original_size integer,"
             " crc32 integer);");
+        add_version_4_schema(cache);
+        add_version_6_schema(cache);
+        add_version_7_schema(cache);
+        add_version_8_schema(cache);
         execute_sql(
             cache,
             "pragma user_version = "
                 + lexical_cast<string>(expected_database_version) + ";");
+        execute_sql(cache, "commit;");
+    }
+    else if (
+        database_version >= 3 && database_version < expected_database_version)
+    {
+        execute_sql(cache, "begin;");
+        if (database_version < 4)
+            add_version_4_schema(cache);
+        if (database_version < 5)
+            convert_to_version_5(cache);
+        if (database_version < 6)
+            add_version_6_schema(cache);
+        if (database_version < 7)
+            add_version_7_schema(cache);
+        if (database_version < 8)
+            add_version_8_schema(cache);
+        execute_sql(
+            cache,
+            "pragma user_version = "
+                + lexical_cast<string>(expected_database_version) + ";");
+        execute_sql(cache, "commit;");
     }
     // If we find a database from a different version, abort.
     else if (database_version != expected_database_version)
@@ -599,84 +1600,1999 @@ open_and_check_db(disk_cache_impl& cache)
     }
 }
 
+// Open a read-only connection to the index and add it to the reader pool.
 static void
-initialize(disk_cache_impl& cache, disk_cache_config const& config)
+open_reader(disk_cache_impl& cache)
 {
-    cache.dir = config.directory ? file_path(*config.directory)
-                                 : get_shared_cache_dir(none, "cradle");
-    // Create the directory if it doesn't exist.
-    if (!exists(cache.dir))
-        create_directory(cache.dir);
+    auto reader = std::make_unique<disk_cache_reader>();
+    auto index_file = cache.dir / "index.db";
+    if (sqlite3_open_v2(
+            index_file.string().c_str(),
+            &reader->db,
+            SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+            nullptr)
+        != SQLITE_OK)
+    {
+        sqlite3_close(reader->db);
+        CRADLE_THROW(
+            disk_cache_failure()
+            << disk_cache_path_info(cache.dir)
+            << internal_error_message_info(
+                   "failed to open disk cache index file (index.db)"));
+    }
+    // Readers should only ever be blocked briefly (e.g., while the writer
+    // is recovering the WAL), so wait rather than failing immediately.
+    sqlite3_busy_timeout(reader->db, 1000);
+    try
+    {
+        reader->look_up_entry_query = prepare_statement(
+            cache,
+            reader->db,
+            "select id, valid, in_db, value, size, original_size, crc32,"
+            " content_id, checksum_algorithm from entry_info where key=?1;");
+    }
+    catch (...)
+    {
+        sqlite3_close(reader->db);
+        throw;
+    }
+    std::scoped_lock<std::mutex> lock(cache.reader_mutex);
+    cache.readers_closing = false;
+    cache.idle_readers.push_back(reader.get());
+    cache.readers.push_back(std::move(reader));
+}
 
-    cache.size_limit = config.size_limit;
+// RECOVERY JOURNAL
+//
+// If the index database is lost or corrupted, the entry files themselves are
+// still perfectly good, but without the index, there's no way to know which
+// keys they belong to (or how to check them). So, alongside the index, each
+// cache directory keeps an append-only journal of the metadata for its file
+// entries, which allows the index to be rebuilt from whatever files remain.
+//
+// The journal is a text file with one record per line:
+//
+//   I <entry ID> <key> [<namespace>]
+//     An entry was created for <key> (base64-encoded) in <namespace> (also
+//     base64-encoded, and omitted for the default namespace). This
+//     supersedes any earlier records for the same entry ID.
+//   F <entry ID> <size> <original size> <CRC> <checksum algorithm>
+//     The entry's data was written to its own file.
+//   C <content ID> <hash> <size> <original size> <CRC> <checksum algorithm>
+//     Shared content was created. This supersedes any earlier records for
+//     the same content ID (and any links to it).
+//   L <entry ID> <content ID>
+//     The entry was linked to shared content.
+//
+// Removals aren't recorded. Instead, records whose files no longer exist are
+// ignored during recovery, and the journal is rewritten (when the cache is
+// initialized, or during maintenance) once it grows well beyond what the
+// index would need. (Entries whose values are stored in the database
+// itself aren't recorded either, since they're small and cheap to recreate.)
+//
+// Recovered entries aren't checked against their checksums (which would
+// require reading the entire cache). Instead, they're checked as they're
+// read, and bad entries are discarded individually.
 
-    // Open the database file.
+static string const journal_header = "cradle disk cache journal 1";
+
+static file_path
+get_journal_path(disk_cache_impl& cache)
+{
+    return cache.dir / "entries.journal";
+}
+
+static string
+encode_journal_key(string const& key)
+{
+    return base64_encode(key, get_url_friendly_base64_character_set());
+}
+
+static string
+decode_journal_key(string const& encoded)
+{
+    auto decoded
+        = base64_decode(encoded, get_url_friendly_base64_character_set());
+    return string(
+        reinterpret_cast<char const*>(decoded.data()), decoded.size());
+}
+
+// Records are buffered until flush_journal() is called (or the buffer
+// fills up).
+static void
+append_to_journal(disk_cache_impl& cache, string const& record)
+{
+    // The journal is just a safety net, so errors writing it aren't fatal.
+    if (cache.journal.is_open())
+        cache.journal << record << '\n';
+}
+
+static string
+make_entry_record(int64_t id, string const& key, string const& key_namespace)
+{
+    auto record = "I " + std::to_string(id) + " " + encode_journal_key(key);
+    if (!key_namespace.empty())
+        record += " " + encode_journal_key(key_namespace);
+    return record;
+}
+
+static string
+make_file_record(
+    int64_t id,
+    int64_t size,
+    int64_t original_size,
+    uint32_t crc32,
+    disk_cache_checksum_algorithm checksum_algorithm)
+{
+    return "F " + std::to_string(id) + " " + std::to_string(size) + " "
+           + std::to_string(original_size) + " " + std::to_string(crc32)
+           + " " + std::to_string(int(checksum_algorithm));
+}
+
+static string
+make_content_record(
+    int64_t content_id,
+    string const& content_hash,
+    int64_t size,
+    int64_t original_size,
+    uint32_t crc32,
+    disk_cache_checksum_algorithm checksum_algorithm)
+{
+    return "C " + std::to_string(content_id) + " " + content_hash + " "
+           + std::to_string(size) + " " + std::to_string(original_size) + " "
+           + std::to_string(crc32) + " "
+           + std::to_string(int(checksum_algorithm));
+}
+
+static string
+make_link_record(int64_t id, int64_t content_id)
+{
+    return "L " + std::to_string(id) + " " + std::to_string(content_id);
+}
+
+// Rewrite the journal so that it describes exactly the file entries that are
+// currently in the index.
+static void
+rewrite_journal(disk_cache_impl& cache)
+{
+    cache.journal.close();
+
+    auto journal_path = get_journal_path(cache);
+    auto temporary_path = journal_path;
+    temporary_path += ".tmp";
+    {
+        std::ofstream output;
+        open_file(
+            output,
+            temporary_path,
+            std::ios::out | std::ios::trunc | std::ios::binary);
+        output << journal_header << '\n';
+
+        sqlite3_stmt* contents_query = nullptr;
+        sqlite3_stmt* entries_query = nullptr;
+        try
+        {
+            contents_query = prepare_statement(
+                cache,
+                "select id, hash, size, original_size, crc32,"
+                " checksum_algorithm from contents;");
+            execute_prepared_statement(
+                cache,
+                contents_query,
+                expected_column_count{6},
+                single_row_result{false},
+                [&](sqlite_row& row) {
+                    output << make_content_record(
+                        read_int64(row, 0),
+                        read_string(row, 1),
+                        read_int64(row, 2),
+                        read_int64(row, 3),
+                        uint32_t(read_int32(row, 4)),
+                        read_checksum_algorithm(row, 5))
+                           << '\n';
+                });
+            entries_query = prepare_statement(
+                cache,
+                "select id, key, content_id, size, original_size, crc32,"
+                " checksum_algorithm, key_namespace from entries"
+                " where valid = 1 and in_db = 0;");
+            execute_prepared_statement(
+                cache,
+                entries_query,
+                expected_column_count{8},
+                single_row_result{false},
+                [&](sqlite_row& row) {
+                    auto id = read_int64(row, 0);
+                    output << make_entry_record(
+                        id, read_string(row, 1), read_string(row, 7))
+                           << '\n';
+                    if (has_value(row, 2))
+                    {
+                        output << make_link_record(id, read_int64(row, 2))
+                               << '\n';
+                    }
+                    else
+                    {
+                        output << make_file_record(
+                            id,
+                            read_int64(row, 3),
+                            read_int64(row, 4),
+                            uint32_t(read_int32(row, 5)),
+                            read_checksum_algorithm(row, 6))
+                               << '\n';
+                    }
+                });
+        }
+        catch (...)
+        {
+            sqlite3_finalize(contents_query);
+            sqlite3_finalize(entries_query);
+            throw;
+        }
+        sqlite3_finalize(contents_query);
+        sqlite3_finalize(entries_query);
+    }
+    std::filesystem::rename(temporary_path, journal_path);
+
+    cache.journal.open(
+        journal_path, std::ios::out | std::ios::app | std::ios::binary);
+}
+
+// Get the size that the journal is allowed to grow to before it's
+// rewritten.
+static int64_t
+get_journal_size_allowance(disk_cache_impl& cache)
+{
+    return std::max<int64_t>(
+        0x10'00'00, 0x400 * get_cache_entry_count(cache));
+}
+
+// Open the journal for appending, rewriting it first if necessary.
+static void
+open_journal(disk_cache_impl& cache, bool force_rewrite)
+{
+    auto journal_path = get_journal_path(cache);
+    if (force_rewrite || !exists(journal_path)
+        || int64_t(file_size(journal_path))
+               > get_journal_size_allowance(cache))
+    {
+        rewrite_journal(cache);
+    }
+    else
+    {
+        cache.journal.open(
+            journal_path, std::ios::out | std::ios::app | std::ios::binary);
+    }
+}
+
+namespace {
+
+struct journaled_file_info
+{
+    int64_t size;
+    int64_t original_size;
+    uint32_t crc32;
+    int checksum_algorithm;
+};
+
+struct journaled_content
+{
+    string hash;
+    journaled_file_info info;
+    // incremented each time the content ID is (re)created
+    unsigned generation;
+    // the number of recovered entries that refer to this content
+    unsigned ref_count = 0;
+};
+
+struct journaled_entry
+{
+    string key;
+    string key_namespace;
+    // exactly one of these is set once the entry is finished
+    optional<journaled_file_info> file;
+    optional<int64_t> content_id;
+    // the generation of the content when the entry was linked to it
+    unsigned content_generation = 0;
+};
+
+} // namespace
+
+// Rebuild the index (which must be empty) from the journal and the files in
+// the cache directory. Any files that aren't accounted for are removed.
+static void
+rebuild_index_from_journal(disk_cache_impl& cache)
+{
+    std::map<int64_t, journaled_content> contents;
+    std::map<int64_t, journaled_entry> entries;
+    {
+        std::ifstream input(get_journal_path(cache), std::ios::binary);
+        string line;
+        if (input && std::getline(input, line) && line == journal_header)
+        {
+            // Records that can't be parsed (e.g., a partially written last
+            // line) are skipped.
+            while (std::getline(input, line))
+            {
+                std::istringstream record(line);
+                char type = 0;
+                int64_t id = 0;
+                record >> type >> id;
+                if (type == 'I')
+                {
+                    string key, key_namespace;
+                    if (record >> key)
+                    {
+                        record >> key_namespace;
+                        try
+                        {
+                            journaled_entry entry;
+                            entry.key = decode_journal_key(key);
+                            entry.key_namespace
+                                = decode_journal_key(key_namespace);
+                            entries[id] = std::move(entry);
+                        }
+                        catch (...)
+                        {
+                        }
+                    }
+                }
+                else if (type == 'F')
+                {
+                    journaled_file_info info;
+                    auto entry = entries.find(id);
+                    if (record >> info.size >> info.original_size
+                                  >> info.crc32 >> info.checksum_algorithm
+                        && entry != entries.end())
+                    {
+                        entry->second.file = info;
+                        entry->second.content_id = none;
+                    }
+                }
+                else if (type == 'C')
+                {
+                    string hash;
+                    journaled_file_info info;
+                    if (record >> hash >> info.size >> info.original_size
+                        >> info.crc32 >> info.checksum_algorithm)
+                    {
+                        auto& content = contents[id];
+                        content.hash = hash;
+                        content.info = info;
+                        ++content.generation;
+                    }
+                }
+                else if (type == 'L')
+                {
+                    int64_t content_id = 0;
+                    auto entry = entries.find(id);
+                    auto content = contents.end();
+                    if (record >> content_id)
+                        content = contents.find(content_id);
+                    if (content != contents.end() && entry != entries.end())
+                    {
+                        entry->second.file = none;
+                        entry->second.content_id = content_id;
+                        entry->second.content_generation
+                            = content->second.generation;
+                    }
+                }
+            }
+        }
+    }
+
+    // Check that the files are still there (and the right size).
+    auto file_is_intact = [](file_path const& path, int64_t size) {
+        std::error_code error;
+        auto actual_size = std::filesystem::file_size(path, error);
+        return !error && int64_t(actual_size) == size;
+    };
+    std::set<string> used_keys;
+    std::vector<int64_t> recovered_entry_ids;
+    // Later entries take precedence (in case a key appears more than once).
+    for (auto i = entries.rbegin(); i != entries.rend(); ++i)
+    {
+        auto& [id, entry] = *i;
+        if (used_keys.count(entry.key))
+            continue;
+        if (entry.file)
+        {
+            if (!file_is_intact(get_path_for_id(cache, id), entry.file->size))
+                continue;
+        }
+        else if (entry.content_id)
+        {
+            auto& content = contents.at(*entry.content_id);
+            if (content.generation != entry.content_generation)
+                continue;
+            ++content.ref_count;
+        }
+        else
+        {
+            continue;
+        }
+        used_keys.insert(entry.key);
+        recovered_entry_ids.push_back(id);
+    }
+    std::set<string> recovered_files;
+    for (auto& [content_id, content] : contents)
+    {
+        auto path = get_path_for_content(cache, content_id);
+        if (content.ref_count != 0 && file_is_intact(path, content.info.size))
+            recovered_files.insert(path.filename().string());
+        else
+            content.ref_count = 0;
+    }
+
+    // Add the entries to the index.
+    sqlite3_stmt* insert_content = nullptr;
+    sqlite3_stmt* insert_file_entry = nullptr;
+    sqlite3_stmt* insert_linked_entry = nullptr;
+    execute_sql(cache, "begin transaction;");
     try
     {
-        open_and_check_db(cache);
+        insert_content = prepare_statement(
+            cache,
+            "insert into contents(id, hash, ref_count, size, original_size,"
+            " crc32, checksum_algorithm) values(?1, ?2, ?3, ?4, ?5, ?6, ?7);");
+        insert_file_entry = prepare_statement(
+            cache,
+            "insert into entries(id, key, valid, in_db, size, original_size,"
+            " crc32, checksum_algorithm, key_namespace, last_accessed)"
+            " values(?1, ?2, 1, 0, ?3, ?4, ?5, ?6, ?7,"
+            " strftime('%Y-%m-%d %H:%M:%f', 'now'));");
+        insert_linked_entry = prepare_statement(
+            cache,
+            "insert into entries(id, key, valid, in_db, content_id,"
+            " key_namespace, last_accessed) values(?1, ?2, 1, 0, ?3, ?4,"
+            " strftime('%Y-%m-%d %H:%M:%f', 'now'));");
+
+        for (auto const& [content_id, content] : contents)
+        {
+            if (content.ref_count == 0)
+                continue;
+            auto const& info = content.info;
+            bind_int64(cache, insert_content, 1, content_id);
+            bind_string(cache, insert_content, 2, content.hash);
+            bind_int64(cache, insert_content, 3, content.ref_count);
+            bind_int64(cache, insert_content, 4, info.size);
+            bind_int64(cache, insert_content, 5, info.original_size);
+            bind_int32(cache, insert_content, 6, int(info.crc32));
+            bind_int32(cache, insert_content, 7, info.checksum_algorithm);
+            execute_prepared_statement(cache, insert_content);
+        }
+        for (auto id : recovered_entry_ids)
+        {
+            auto const& entry = entries.at(id);
+            if (entry.file)
+            {
+                auto const& info = *entry.file;
+                bind_int64(cache, insert_file_entry, 1, id);
+                bind_string(cache, insert_file_entry, 2, entry.key);
+                bind_int64(cache, insert_file_entry, 3, info.size);
+                bind_int64(cache, insert_file_entry, 4, info.original_size);
+                bind_int32(cache, insert_file_entry, 5, int(info.crc32));
+                bind_int32(
+                    cache, insert_file_entry, 6, info.checksum_algorithm);
+                bind_string(cache, insert_file_entry, 7, entry.key_namespace);
+                execute_prepared_statement(cache, insert_file_entry);
+                recovered_files.insert(
+                    get_path_for_id(cache, id).filename().string());
+            }
+            else if (contents.at(*entry.content_id).ref_count != 0)
+            {
+                bind_int64(cache, insert_linked_entry, 1, id);
+                bind_string(cache, insert_linked_entry, 2, entry.key);
+                bind_int64(cache, insert_linked_entry, 3, *entry.content_id);
+                bind_string(
+                    cache, insert_linked_entry, 4, entry.key_namespace);
+                execute_prepared_statement(cache, insert_linked_entry);
+            }
+        }
+        execute_sql(cache, "commit transaction;");
+    }
+    catch (...)
+    {
+        sqlite3_exec(cache.db, "rollback transaction;", 0, 0, 0);
+        recovered_files.clear();
+    }
+    sqlite3_finalize(insert_content);
+    sqlite3_finalize(insert_file_entry);
+    sqlite3_finalize(insert_linked_entry);
+
+    // Remove the other entry files. (Files that the cache didn't create
+    // are left alone.)
+    for (auto& p : std::filesystem::directory_iterator(cache.dir))
+    {
+        auto name = p.path().filename().string();
+        if (is_removable_cache_file(name) && !recovered_files.count(name))
+            remove_all(p.path());
+    }
+}
+
+// MAINTENANCE
+//
+// Over time, a cache accumulates things that normal operation doesn't clean
+// up:
+// - entries whose inserts were initiated but never finished (because the
+//   writer failed or the process died in between)
+// - files that the index doesn't refer to (e.g., because the process died
+//   between removing an entry and removing its file)
+// - records in the recovery journal for entries that are long gone
+// - free pages in the index database (which SQLite only returns to the file
+//   system when asked to) - Databases created by older versions have to be
+//   rebuilt once before incremental vacuuming works, but that's a single
+//   (long) operation, so it's only done at initialization, and only if it's
+//   requested (see disk_cache_config::rebuild_legacy_index).
+// - indices that may be inconsistent with their tables (after recovery)
+// Maintenance deals with these in small steps. The cache mutex is only held
+// during individual steps, and the deadline is checked in between them, so
+// maintenance can run alongside normal traffic.
+
+// the number of entries or files that a single maintenance step processes
+int const maintenance_step_size = 64;
+
+// the number of pages that a single incremental vacuum step frees
+int const vacuum_step_page_count = 256;
+
+// Add the counts from :report to :totals.
+static void
+add_maintenance_counts(
+    disk_cache_maintenance_report& totals,
+    disk_cache_maintenance_report const& report)
+{
+    totals.abandoned_entry_count += report.abandoned_entry_count;
+    totals.orphaned_file_count += report.orphaned_file_count;
+    totals.orphaned_file_bytes += report.orphaned_file_bytes;
+    totals.compacted_journal_bytes += report.compacted_journal_bytes;
+    totals.vacuumed_bytes += report.vacuumed_bytes;
+    totals.reindexed_table_count += report.reindexed_table_count;
+}
+
+// Get the (integer) value of an SQLite pragma.
+static int64_t
+query_pragma(disk_cache_impl const& cache, string const& pragma)
+{
+    sqlite3_stmt* query = prepare_statement(cache, "pragma " + pragma + ";");
+    int64_t value = 0;
+    try
+    {
+        execute_prepared_statement(
+            cache,
+            query,
+            expected_column_count{1},
+            single_row_result{true},
+            [&](sqlite_row& row) { value = read_int64(row, 0); });
+    }
+    catch (...)
+    {
+        sqlite3_finalize(query);
+        throw;
+    }
+    sqlite3_finalize(query);
+    return value;
+}
+
+// Remove a batch of abandoned entries.
+// This returns true iff there may be more to remove.
+static bool
+remove_abandoned_entries(
+    disk_cache_impl& cache, disk_cache_maintenance_report& report)
+{
+    // Entries from before initiate_insert() recorded the time have no
+    // timestamp, so they're definitely old enough.
+    sqlite3_stmt* query = prepare_statement(
+        cache,
+        "select id from entries where valid = 0 and (last_accessed is null"
+        " or last_accessed < strftime('%Y-%m-%d %H:%M:%f', 'now', ?1))"
+        " limit ?2;");
+    std::vector<int64_t> ids;
+    try
+    {
+        bind_string(
+            cache,
+            query,
+            1,
+            "-" + std::to_string(cache.abandonment_age.count())
+                + " seconds");
+        bind_int64(cache, query, 2, maintenance_step_size);
+        execute_prepared_statement(
+            cache,
+            query,
+            expected_column_count{1},
+            single_row_result{false},
+            [&](sqlite_row& row) { ids.push_back(read_int64(row, 0)); });
+    }
+    catch (...)
+    {
+        sqlite3_finalize(query);
+        throw;
+    }
+    sqlite3_finalize(query);
+
+    for (auto id : ids)
+    {
+        remove_entry(cache, id);
+        ++report.abandoned_entry_count;
+    }
+    return ids.size() == size_t(maintenance_step_size);
+}
+
+// Is the file called :name (in the cache directory) referenced by the index?
+static bool
+is_referenced_file(
+    disk_cache_impl& cache,
+    string const& name,
+    sqlite3_stmt* entry_query,
+    sqlite3_stmt* content_query)
+{
+    auto parsed = parse_entry_file_name(name);
+    if (!parsed)
+        return false;
+
+    sqlite3_stmt* query = parsed->is_content ? content_query : entry_query;
+    bind_int64(cache, query, 1, parsed->id);
+    int64_t count = 0;
+    execute_prepared_statement(
+        cache,
+        query,
+        expected_column_count{1},
+        single_row_result{true},
+        [&](sqlite_row& row) { count = read_int64(row, 0); });
+    return count != 0;
+}
+
+// List the files that the orphaned file sweep needs to check.
+static void
+start_orphaned_file_sweep(disk_cache_impl& cache)
+{
+    cache.orphan_sweep_queue.clear();
+    for (auto& p : std::filesystem::directory_iterator(cache.dir))
+    {
+        auto name = p.path().filename().string();
+        if (is_removable_cache_file(name))
+            cache.orphan_sweep_queue.push_back(name);
+    }
+}
+
+// Check a batch of files from the orphaned file sweep and remove the ones
+// that aren't referenced by the index.
+// This returns true iff there are more to check.
+static bool
+remove_orphaned_files(
+    disk_cache_impl& cache, disk_cache_maintenance_report& report)
+{
+    sqlite3_stmt* entry_query = prepare_statement(
+        cache,
+        "select count(*) from entries"
+        " where id=?1 and in_db=0 and content_id is null;");
+    sqlite3_stmt* content_query = nullptr;
+    try
+    {
+        content_query = prepare_statement(
+            cache, "select count(*) from contents where id=?1;");
+        auto const cutoff = std::filesystem::file_time_type::clock::now()
+                            - cache.abandonment_age;
+        for (int i = 0;
+             i != maintenance_step_size && !cache.orphan_sweep_queue.empty();
+             ++i)
+        {
+            auto name = std::move(cache.orphan_sweep_queue.back());
+            cache.orphan_sweep_queue.pop_back();
+            if (is_referenced_file(cache, name, entry_query, content_query))
+                continue;
+            // Files that can't be examined or removed (e.g., because they've
+            // disappeared in the meantime) are simply skipped.
+            std::error_code error;
+            auto path = cache.dir / name;
+            auto write_time = last_write_time(path, error);
+            if (error || write_time > cutoff)
+                continue;
+            auto size = is_regular_file(path, error) ? file_size(path, error)
+                                                     : uintmax_t(0);
+            if (error)
+                size = 0;
+            if (remove_all(path, error) == 0 || error)
+                continue;
+            ++report.orphaned_file_count;
+            report.orphaned_file_bytes += int64_t(size);
+        }
+    }
+    catch (...)
+    {
+        sqlite3_finalize(entry_query);
+        sqlite3_finalize(content_query);
+        throw;
+    }
+    sqlite3_finalize(entry_query);
+    sqlite3_finalize(content_query);
+    return !cache.orphan_sweep_queue.empty();
+}
+
+// Rewrite the recovery journal if it has outgrown its allowance.
+static void
+compact_journal(disk_cache_impl& cache, disk_cache_maintenance_report& report)
+{
+    // (If the journal couldn't be opened, there's nothing to compact.)
+    if (!cache.journal.is_open())
+        return;
+    auto journal_path = get_journal_path(cache);
+    std::error_code error;
+    auto original_size = file_size(journal_path, error);
+    if (error
+        || int64_t(original_size) <= get_journal_size_allowance(cache))
+    {
+        return;
+    }
+    rewrite_journal(cache);
+    report.compacted_journal_bytes
+        += int64_t(original_size) - int64_t(file_size(journal_path));
+}
+
+// Return a batch of free pages in the index database to the file system.
+// This returns true iff there may be more to return.
+static bool
+vacuum_index(disk_cache_impl& cache, disk_cache_maintenance_report& report)
+{
+    if (!cache.supports_incremental_vacuum)
+        return false;
+    auto free_page_count = query_pragma(cache, "freelist_count");
+    if (free_page_count == 0)
+        return false;
+    execute_sql(
+        cache,
+        "pragma incremental_vacuum("
+            + std::to_string(vacuum_step_page_count) + ");");
+    auto freed_page_count
+        = free_page_count - query_pragma(cache, "freelist_count");
+    report.vacuumed_bytes
+        += freed_page_count * query_pragma(cache, "page_size");
+    return freed_page_count > 0 && freed_page_count < free_page_count;
+}
+
+// Do a single step of maintenance.
+// This returns true iff that step finished a complete pass.
+static bool
+do_maintenance_step(
+    disk_cache_impl& cache, disk_cache_maintenance_report& report)
+{
+    switch (cache.next_maintenance_phase)
+    {
+        case maintenance_phase::ABANDONED_ENTRIES:
+            if (!remove_abandoned_entries(cache, report))
+            {
+                start_orphaned_file_sweep(cache);
+                cache.next_maintenance_phase
+                    = maintenance_phase::ORPHANED_FILES;
+            }
+            return false;
+        case maintenance_phase::ORPHANED_FILES:
+            if (!remove_orphaned_files(cache, report))
+                cache.next_maintenance_phase = maintenance_phase::JOURNAL;
+            return false;
+        case maintenance_phase::JOURNAL:
+            compact_journal(cache, report);
+            cache.next_maintenance_phase = maintenance_phase::VACUUM;
+            return false;
+        case maintenance_phase::VACUUM:
+            if (!vacuum_index(cache, report))
+            {
+                cache.next_maintenance_phase
+                    = maintenance_phase::REINDEX_ENTRIES;
+            }
+            return false;
+        case maintenance_phase::REINDEX_ENTRIES:
+            if (cache.needs_reindex)
+            {
+                execute_sql(cache, "reindex entries;");
+                ++report.reindexed_table_count;
+            }
+            cache.next_maintenance_phase
+                = maintenance_phase::REINDEX_CONTENTS;
+            return false;
+        case maintenance_phase::REINDEX_CONTENTS:
+        default:
+            if (cache.needs_reindex)
+            {
+                execute_sql(cache, "reindex contents;");
+                ++report.reindexed_table_count;
+                cache.needs_reindex = false;
+            }
+            // Let SQLite update its query planner statistics too.
+            execute_sql(cache, "pragma optimize;");
+            cache.next_maintenance_phase
+                = maintenance_phase::ABANDONED_ENTRIES;
+            return true;
+    }
+}
+
+// Do maintenance until a complete pass is finished or :time_budget runs out.
+// This must NOT be called while holding the cache mutex.
+static disk_cache_maintenance_report
+do_maintenance(disk_cache_impl& cache, std::chrono::milliseconds time_budget)
+{
+    auto const deadline = std::chrono::steady_clock::now() + time_budget;
+    disk_cache_maintenance_report report;
+    std::exception_ptr error;
+    try
+    {
+        do
+        {
+            std::scoped_lock<std::mutex> lock(cache.mutex);
+            if (do_maintenance_step(cache, report))
+            {
+                report.completed = true;
+                break;
+            }
+        } while (std::chrono::steady_clock::now() < deadline);
+    }
+    catch (...)
+    {
+        // Whatever was done before the failure still counts.
+        error = std::current_exception();
+    }
+
+    std::scoped_lock<std::mutex> lock(cache.mutex);
+    add_maintenance_counts(cache.maintenance_totals, report);
+    cache.maintenance_totals.completed = report.completed;
+    if (report.completed)
+        cache.latest_maintenance = std::chrono::system_clock::now();
+    if (error)
+        std::rethrow_exception(error);
+    return report;
+}
+
+// This runs on the maintainer thread and does maintenance whenever the cache
+// has been idle for the maintenance interval. (Once a pass has completed,
+// there's nothing more to do until the cache is used again.)
+static void
+run_maintainer(disk_cache_impl& cache)
+{
+    std::unique_lock<std::mutex> lock(cache.mutex);
+    while (!cache.maintainer_stopping)
+    {
+        cache.maintainer_wakeup.wait_for(lock, cache.maintenance_interval);
+        if (cache.maintainer_stopping)
+            break;
+        // A shard that has failed is left alone until the cache is reset.
+        if (cache.failed)
+            continue;
+        auto const latest_activity = cache.latest_activity.load();
+        if (std::chrono::system_clock::now() - latest_activity
+                < cache.maintenance_interval
+            || latest_activity < cache.latest_maintenance)
+        {
+            continue;
+        }
+        lock.unlock();
+        try
+        {
+            do_maintenance(cache, cache.maintenance_time_budget);
+        }
+        catch (...)
+        {
+            // There's nobody to report this to, and the next run will try
+            // again.
+        }
+        lock.lock();
+    }
+}
+
+// Stop the maintainer thread (if it's running).
+// This must NOT be called while holding the cache mutex.
+static void
+stop_maintainer(disk_cache_impl& cache)
+{
+    if (!cache.maintainer.joinable())
+        return;
+    {
+        std::scoped_lock<std::mutex> lock(cache.mutex);
+        cache.maintainer_stopping = true;
+    }
+    cache.maintainer_wakeup.notify_one();
+    cache.maintainer.join();
+    cache.maintainer_stopping = false;
+}
+
+// Bring the entries' pinned flags up to date with the namespace configs.
+// (The namespaces table records which namespaces were pinned before, so the
+// entries only have to be updated when that changes.)
+static void
+update_pinned_namespaces(disk_cache_impl& cache)
+{
+    std::set<string> pinned_namespaces;
+    for (auto const& [name, config] : cache.namespaces)
+    {
+        if (config.pinned)
+            pinned_namespaces.insert(name);
+    }
+
+    std::set<string> previously_pinned_namespaces;
+    sqlite3_stmt* pinned_query = prepare_statement(
+        cache, "select name from namespaces where pinned = 1;");
+    try
+    {
+        execute_prepared_statement(
+            cache,
+            pinned_query,
+            expected_column_count{1},
+            single_row_result{false},
+            [&](sqlite_row& row) {
+                previously_pinned_namespaces.insert(read_string(row, 0));
+            });
+    }
+    catch (...)
+    {
+        sqlite3_finalize(pinned_query);
+        throw;
+    }
+    sqlite3_finalize(pinned_query);
+    if (pinned_namespaces == previously_pinned_namespaces)
+        return;
+
+    sqlite3_stmt* add_namespace = nullptr;
+    sqlite3_stmt* pin_namespace = nullptr;
+    execute_sql(cache, "begin transaction;");
+    try
+    {
+        add_namespace = prepare_statement(
+            cache,
+            "insert or ignore into namespaces(name, total_size)"
+            " values(?1, 0);");
+        pin_namespace = prepare_statement(
+            cache, "update namespaces set pinned = 1 where name = ?1;");
+        execute_sql(cache, "update namespaces set pinned = 0;");
+        for (auto const& name : pinned_namespaces)
+        {
+            bind_string(cache, add_namespace, 1, name);
+            execute_prepared_statement(cache, add_namespace);
+            bind_string(cache, pin_namespace, 1, name);
+            execute_prepared_statement(cache, pin_namespace);
+        }
+        execute_sql(
+            cache,
+            "update entries set pinned = not pinned where pinned !="
+            " (key_namespace in"
+            "  (select name from namespaces where pinned = 1));");
+        execute_sql(cache, "commit transaction;");
+    }
+    catch (...)
+    {
+        sqlite3_exec(cache.db, "rollback transaction;", 0, 0, 0);
+        sqlite3_finalize(add_namespace);
+        sqlite3_finalize(pin_namespace);
+        throw;
+    }
+    sqlite3_finalize(add_namespace);
+    sqlite3_finalize(pin_namespace);
+}
+
+static void
+initialize(disk_cache_impl& cache, disk_cache_config const& config)
+{
+    cache.dir = config.directory ? file_path(*config.directory)
+                                 : get_shared_cache_dir(none, "cradle");
+    // Create the directory if it doesn't exist.
+    if (!exists(cache.dir))
+        create_directory(cache.dir);
+
+    cache.size_limit = config.size_limit;
+    for (auto const& namespace_config : config.namespaces)
+        cache.namespaces[namespace_config.name] = namespace_config;
+    cache.legacy_value_decoder = config.legacy_value_decoder;
+
+    // Open the database file.
+    // If the index is missing (but there's a journal), or if it's
+    // incompatible or corrupt, it's rebuilt from the journal (see above).
+    bool recovering
+        = !exists(cache.dir / "index.db") && exists(get_journal_path(cache));
+    try
+    {
+        open_and_check_db(cache);
+    }
+    catch (...)
+    {
+        shut_down(cache);
+        for (auto& p : std::filesystem::directory_iterator(cache.dir))
+        {
+            if (p.path().filename().string().starts_with("index.db"))
+                remove(p.path());
+        }
+        open_and_check_db(cache);
+        recovering = true;
+    }
+
+    // Set various performance tuning flags.
+    execute_sql(cache, "pragma synchronous = off;");
+    if (config.reader_count != 0)
+    {
+        // WAL mode allows readers to proceed concurrently with each other and
+        // with the writer. (This requires normal locking mode.)
+        execute_sql(cache, "pragma journal_mode = wal;");
+    }
+    else
+    {
+        execute_sql(cache, "pragma locking_mode = exclusive;");
+        execute_sql(cache, "pragma journal_mode = memory;");
+    }
+
+    // Databases that were created without incremental vacuuming have to be
+    // rebuilt (once) to enable it. That rewrites the whole database, so it's
+    // only done on request.
+    cache.supports_incremental_vacuum
+        = query_pragma(cache, "auto_vacuum") == 2;
+    if (!cache.supports_incremental_vacuum && config.rebuild_legacy_index)
+    {
+        execute_sql(cache, "pragma auto_vacuum = incremental;");
+        execute_sql(cache, "vacuum;");
+        cache.supports_incremental_vacuum = true;
+    }
+
+    if (recovering)
+    {
+        rebuild_index_from_journal(cache);
+        cache.needs_reindex = true;
+    }
+    update_pinned_namespaces(cache);
+
+    // Initialize our prepared statements.
+    cache.record_usage_statement = prepare_statement(
+        cache,
+        "update entries set last_accessed=strftime('%Y-%m-%d %H:%M:%f', "
+        "'now') "
+        "where id=?1;");
+    cache.update_entry_value_statement = prepare_statement(
+        cache,
+        "update entries set valid=1, in_db=1, size=?1, original_size=?2,"
+        " value=?3, content_id=null, key_namespace=?5, pinned=?6,"
+        " last_accessed=strftime('%Y-%m-%d %H:%M:%f', 'now')"
+        " where id=?4;");
+    cache.insert_new_value_statement = prepare_statement(
+        cache,
+        "insert into entries"
+        " (key, valid, in_db, size, original_size, value, key_namespace,"
+        " pinned, last_accessed)"
+        " values(?1, 1, 1, ?2, ?3, ?4, ?5, ?6,"
+        " strftime('%Y-%m-%d %H:%M:%f', 'now'));");
+    // The time that an insert was initiated is recorded so that maintenance
+    // can tell when it has been abandoned.
+    cache.initiate_insert_statement = prepare_statement(
+        cache,
+        "insert into entries(key, valid, in_db, key_namespace, pinned,"
+        " last_accessed) values (?1, 0, 0, ?2, ?3,"
+        " strftime('%Y-%m-%d %H:%M:%f', 'now'));");
+    cache.finish_insert_statement = prepare_statement(
+        cache,
+        "update entries set valid=1, in_db=0, size=?1, original_size=?2, "
+        " crc32=?3, checksum_algorithm=?5, content_id=null,"
+        " last_accessed=strftime('%Y-%m-%d %H:%M:%f', 'now')"
+        " where id=?4;");
+    cache.remove_entry_statement
+        = prepare_statement(cache, "delete from entries where id=?1;");
+    cache.discard_entry_statement = prepare_statement(
+        cache,
+        "delete from entries where id=?1 or content_id ="
+        " (select content_id from entries where id=?1);");
+    cache.look_up_entry_query = prepare_statement(
+        cache,
+        "select id, valid, in_db, value, size, original_size, crc32,"
+        " content_id, checksum_algorithm from entry_info where key=?1;");
+    cache.cache_size_query
+        = prepare_statement(cache, "select total_size from metadata;");
+    cache.entry_count_query
+        = prepare_statement(cache, "select valid_count from metadata;");
+    cache.entry_list_query = prepare_statement(
+        cache,
+        "select key, id, in_db, size, original_size, crc32, content_id,"
+        " checksum_algorithm from entry_info where valid = 1"
+        " order by last_accessed;");
+    cache.lru_entry_list_query = prepare_statement(
+        cache,
+        "select id, in_db from entries"
+        " order by valid, pinned, last_accessed limit ?1;");
+    cache.mru_entry_list_query = prepare_statement(
+        cache,
+        "select key, id, in_db, value, size, original_size, crc32,"
+        " content_id, checksum_algorithm from entry_info where valid = 1"
+        " order by last_accessed desc;");
+    cache.content_by_hash_query = prepare_statement(
+        cache, "select id from contents where hash=?1;");
+    cache.insert_content_statement = prepare_statement(
+        cache,
+        "insert into contents"
+        " (hash, ref_count, size, original_size, crc32, checksum_algorithm)"
+        " values(?1, 0, ?2, ?3, ?4, ?5);");
+    cache.link_content_statement = prepare_statement(
+        cache,
+        "update entries set valid=1, in_db=0, size=null, original_size=null,"
+        " crc32=null, checksum_algorithm=null, content_id=?1,"
+        " last_accessed=strftime('%Y-%m-%d %H:%M:%f', 'now')"
+        " where id=?2;");
+    cache.orphaned_contents_query = prepare_statement(
+        cache, "select id from contents where ref_count = 0;");
+    cache.remove_content_statement
+        = prepare_statement(cache, "delete from contents where id=?1;");
+    cache.set_entry_namespace_statement = prepare_statement(
+        cache,
+        "update entries set key_namespace=?1, pinned=?2,"
+        " last_accessed=strftime('%Y-%m-%d %H:%M:%f', 'now')"
+        " where id=?3;");
+    cache.namespace_size_query = prepare_statement(
+        cache, "select total_size from namespaces where name=?1;");
+    cache.namespace_lru_entry_list_query = prepare_statement(
+        cache,
+        "select id, in_db from entries where key_namespace=?1"
+        " order by valid, last_accessed limit ?2;");
+
+    open_journal(cache, recovering);
+
+    // Open the reader connections.
+    for (unsigned i = 0; i != config.reader_count; ++i)
+        open_reader(cache);
+
+    cache.write_batch_size = config.write_batch_size;
+    cache.write_batch_delay = config.write_batch_delay;
+    if (is_batching(cache))
+        cache.flusher = std::thread([&cache] { run_flusher(cache); });
+
+    // Do initial housekeeping.
+    record_activity(cache);
+    remove_orphaned_contents(cache);
+    enforce_cache_size_limit(cache);
+
+    cache.maintenance_interval = config.maintenance_interval;
+    cache.maintenance_time_budget = config.maintenance_time_budget;
+    cache.abandonment_age = config.abandonment_age;
+    if (cache.maintenance_interval.count() > 0)
+        cache.maintainer = std::thread([&cache] { run_maintainer(cache); });
+}
+
+// INSERTION
+
+// The following are the implementations of the corresponding API
+// functions within a single shard. (IDs here are local to the shard.)
+// The caller must hold the shard's mutex.
+
+static void
+insert(
+    disk_cache_impl& cache,
+    string const& key,
+    string const& value,
+    optional<size_t> original_size,
+    string const& key_namespace)
+{
+    record_activity(cache);
+    begin_write(cache);
+
+    auto entry = look_up(cache, key, false);
+    if (entry)
+    {
+        bind_int64(cache, cache.update_entry_value_statement, 1, value.size());
+        bind_int64(
+            cache,
+            cache.update_entry_value_statement,
+            2,
+            original_size ? *original_size : value.size());
+        bind_blob(cache, cache.update_entry_value_statement, 3, value);
+        bind_int64(cache, cache.update_entry_value_statement, 4, entry->id);
+        bind_string(
+            cache, cache.update_entry_value_statement, 5, key_namespace);
+        bind_int32(
+            cache,
+            cache.update_entry_value_statement,
+            6,
+            is_pinned_namespace(cache, key_namespace));
+        execute_prepared_statement(cache, cache.update_entry_value_statement);
+        // If the entry was stored in a file, supersede its journal records.
+        if (!entry->in_db)
+        {
+            append_to_journal(
+                cache, make_entry_record(entry->id, key, key_namespace));
+        }
+    }
+    else
+    {
+        bind_string(cache, cache.insert_new_value_statement, 1, key);
+        bind_int64(cache, cache.insert_new_value_statement, 2, value.size());
+        bind_int64(
+            cache,
+            cache.insert_new_value_statement,
+            3,
+            original_size ? *original_size : value.size());
+        bind_blob(cache, cache.insert_new_value_statement, 4, value);
+        bind_string(cache, cache.insert_new_value_statement, 5, key_namespace);
+        bind_int32(
+            cache,
+            cache.insert_new_value_statement,
+            6,
+            is_pinned_namespace(cache, key_namespace));
+        execute_prepared_statement(cache, cache.insert_new_value_statement);
+    }
+    // The entry may have previously referred to shared content.
+    remove_orphaned_contents(cache);
+
+    record_cache_growth(cache, value.size());
+    finish_entry_write(cache);
+}
+
+static int64_t
+initiate_insert(
+    disk_cache_impl& cache, string const& key, string const& key_namespace)
+{
+    record_activity(cache);
+
+    auto entry = look_up(cache, key, false);
+    bool const pinned = is_pinned_namespace(cache, key_namespace);
+    if (entry)
+    {
+        // This also refreshes the entry's timestamp so that maintenance
+        // doesn't consider this insert abandoned.
+        begin_write(cache);
+        bind_string(
+            cache, cache.set_entry_namespace_statement, 1, key_namespace);
+        bind_int32(cache, cache.set_entry_namespace_statement, 2, pinned);
+        bind_int64(cache, cache.set_entry_namespace_statement, 3, entry->id);
+        execute_prepared_statement(cache, cache.set_entry_namespace_statement);
+        return entry->id;
+    }
+
+    begin_write(cache);
+    bind_string(cache, cache.initiate_insert_statement, 1, key);
+    bind_string(cache, cache.initiate_insert_statement, 2, key_namespace);
+    bind_int32(cache, cache.initiate_insert_statement, 3, pinned);
+    execute_prepared_statement(cache, cache.initiate_insert_statement);
+
+    // Get the ID that was inserted.
+    entry = look_up(cache, key, false);
+    if (!entry)
+    {
+        // Since we checked that the insert succeeded, we really shouldn't
+        // get here.
+        CRADLE_THROW(
+            disk_cache_failure() << disk_cache_path_info(cache.dir)
+                                 << internal_error_message_info(
+                                        "failed to create entry in index.db"));
+    }
+    append_to_journal(cache, make_entry_record(entry->id, key, key_namespace));
+
+    // The caller is about to write this entry's file.
+    keep_file(cache, get_path_for_id(cache, entry->id));
+
+    return entry->id;
+}
+
+static void
+finish_insert(
+    disk_cache_impl& cache,
+    int64_t local_id,
+    uint32_t crc32,
+    optional<size_t> original_size,
+    disk_cache_checksum_algorithm checksum_algorithm)
+{
+    record_activity(cache);
+
+    int64_t size = file_size(get_path_for_id(cache, local_id));
+
+    begin_write(cache);
+    bind_int64(cache, cache.finish_insert_statement, 1, size);
+    bind_int64(
+        cache,
+        cache.finish_insert_statement,
+        2,
+        original_size ? *original_size : size);
+    bind_int32(cache, cache.finish_insert_statement, 3, crc32);
+    bind_int64(cache, cache.finish_insert_statement, 4, local_id);
+    bind_checksum_algorithm(
+        cache, cache.finish_insert_statement, 5, checksum_algorithm);
+    execute_prepared_statement(cache, cache.finish_insert_statement);
+    // The entry may have previously referred to shared content.
+    remove_orphaned_contents(cache);
+    append_to_journal(
+        cache,
+        make_file_record(
+            local_id,
+            size,
+            original_size ? int64_t(*original_size) : size,
+            crc32,
+            checksum_algorithm));
+
+    record_cache_growth(cache, size);
+    finish_entry_write(cache);
+}
+
+static bool
+finish_insert_with_existing_content(
+    disk_cache_impl& cache, int64_t local_id, string const& content_hash)
+{
+    record_activity(cache);
+
+    auto content_id = find_content(cache, content_hash);
+    if (!content_id)
+        return false;
+
+    begin_write(cache);
+    link_entry_to_content(cache, local_id, *content_id);
+    remove_orphaned_contents(cache);
+    append_to_journal(cache, make_link_record(local_id, *content_id));
+    finish_entry_write(cache);
+    return true;
+}
+
+static void
+finish_insert(
+    disk_cache_impl& cache,
+    int64_t local_id,
+    uint32_t crc32,
+    optional<size_t> original_size,
+    string const& content_hash,
+    disk_cache_checksum_algorithm checksum_algorithm)
+{
+    record_activity(cache);
+
+    file_path entry_path = get_path_for_id(cache, local_id);
+
+    begin_write(cache);
+    int64_t added_size = 0;
+    auto content_id = find_content(cache, content_hash);
+    if (content_id)
+    {
+        // Another entry got there first, so the new file isn't needed.
+        link_entry_to_content(cache, local_id, *content_id);
+        remove(entry_path);
+    }
+    else
+    {
+        int64_t size = file_size(entry_path);
+        // Registering the content, linking the entry to it and moving the
+        // file into place must all succeed or fail together.
+        execute_sql(cache, "savepoint new_content;");
+        try
+        {
+            bind_string(
+                cache, cache.insert_content_statement, 1, content_hash);
+            bind_int64(cache, cache.insert_content_statement, 2, size);
+            bind_int64(
+                cache,
+                cache.insert_content_statement,
+                3,
+                original_size ? *original_size : size);
+            bind_int32(cache, cache.insert_content_statement, 4, crc32);
+            bind_checksum_algorithm(
+                cache, cache.insert_content_statement, 5, checksum_algorithm);
+            execute_prepared_statement(cache, cache.insert_content_statement);
+            content_id = sqlite3_last_insert_rowid(cache.db);
+            link_entry_to_content(cache, local_id, *content_id);
+            auto content_path = get_path_for_content(cache, *content_id);
+            keep_file(cache, content_path);
+            rename(entry_path, content_path);
+        }
+        catch (...)
+        {
+            sqlite3_exec(
+                cache.db,
+                "rollback to new_content; release new_content;",
+                0,
+                0,
+                0);
+            throw;
+        }
+        execute_sql(cache, "release new_content;");
+        append_to_journal(
+            cache,
+            make_content_record(
+                *content_id,
+                content_hash,
+                size,
+                original_size ? int64_t(*original_size) : size,
+                crc32,
+                checksum_algorithm));
+        added_size = size;
+    }
+    append_to_journal(cache, make_link_record(local_id, *content_id));
+    // The entry may have previously referred to other shared content.
+    remove_orphaned_contents(cache);
+
+    record_cache_growth(cache, added_size);
+    finish_entry_write(cache);
+}
+
+// PACKS
+
+// A pack (see disk_cache::export_pack()) is a binary file that starts with
+// :pack_header and then holds a sequence of records, each starting with a
+// tag byte: 1 for an entry and 0 for the end of the pack. An entry record
+// consists of:
+// - the key
+// - the namespace
+// - whether the entry is stored in the database (1 byte)
+// - the original size (8 bytes)
+// - the checksum (4 bytes) and its algorithm (1 byte)
+// - the hash of the entry's shared content (or an empty string if its
+//   content isn't shared)
+// - the data (exactly as it's stored in the cache)
+// Integers are little-endian, and strings (including the data) are preceded
+// by their size (8 bytes).
+
+static string const pack_header = "cradle disk cache pack 1\n";
+
+static void
+write_pack_integer(std::ostream& output, uint64_t value, int size)
+{
+    for (int i = 0; i != size; ++i)
+        output.put(char((value >> (8 * i)) & 0xff));
+}
+
+static uint64_t
+read_pack_integer(std::istream& input, int size)
+{
+    uint64_t value = 0;
+    for (int i = 0; i != size; ++i)
+        value |= uint64_t(uint8_t(input.get())) << (8 * i);
+    return value;
+}
+
+static void
+write_pack_string(std::ostream& output, string const& value)
+{
+    write_pack_integer(output, value.size(), 8);
+    output.write(value.data(), value.size());
+}
+
+static string
+read_pack_bytes(std::istream& input, uint64_t size)
+{
+    string value(boost::numeric_cast<size_t>(size), '\0');
+    input.read(value.data(), value.size());
+    return value;
+}
+
+static string
+read_pack_string(std::istream& input)
+{
+    return read_pack_bytes(input, read_pack_integer(input, 8));
+}
+
+// Copy :size bytes from :input to :output.
+static void
+copy_pack_data(std::istream& input, std::ostream& output, uint64_t size)
+{
+    std::vector<char> buffer(0x10000);
+    while (size != 0)
+    {
+        auto chunk = std::min(size, uint64_t(buffer.size()));
+        input.read(buffer.data(), chunk);
+        output.write(buffer.data(), chunk);
+        size -= chunk;
+    }
+}
+
+[[noreturn]] static void
+throw_malformed_pack(file_path const& path)
+{
+    CRADLE_THROW(
+        disk_cache_failure() << disk_cache_path_info(path)
+                             << internal_error_message_info(
+                                    "malformed disk cache pack"));
+}
+
+// an entry that's going into or coming out of a pack
+struct pack_entry
+{
+    string key;
+    string key_namespace;
+    bool in_db = false;
+    // the value (if :in_db) or the file that holds it (otherwise) - These
+    // are only used on export.
+    string value;
+    file_path path;
+    // the size of the data, as stored in the cache
+    int64_t size = 0;
+    int64_t original_size = 0;
+    uint32_t crc32 = 0;
+    disk_cache_checksum_algorithm checksum_algorithm
+        = disk_cache_checksum_algorithm::CRC32;
+    // empty if the entry's content isn't shared
+    string content_hash;
+    string last_accessed;
+    // the shard that the entry came from (only used on export)
+    disk_cache_impl* shard = nullptr;
+};
+
+// Get the valid entries in the shard that pass :is_selected, from most to
+// least recently used.
+template<class Filter>
+static std::vector<pack_entry>
+get_pack_entries(disk_cache_impl& cache, Filter const& is_selected)
+{
+    std::vector<pack_entry> entries;
+    sqlite3_stmt* query = prepare_statement(
+        cache,
+        "select e.key, e.key_namespace, e.in_db, e.value,"
+        " coalesce(c.size, e.size),"
+        " coalesce(c.original_size, e.original_size),"
+        " coalesce(c.crc32, e.crc32),"
+        " case when e.content_id is null then e.checksum_algorithm"
+        "  else c.checksum_algorithm end,"
+        " c.hash, e.id, e.content_id, e.last_accessed"
+        " from entries e left join contents c on c.id = e.content_id"
+        " where e.valid = 1 order by e.last_accessed desc;");
+    try
+    {
+        execute_prepared_statement(
+            cache,
+            query,
+            expected_column_count{12},
+            single_row_result{false},
+            [&](sqlite_row& row) {
+                pack_entry e;
+                e.key = read_string(row, 0);
+                e.key_namespace = read_string(row, 1);
+                if (!is_selected(e))
+                    return;
+                e.in_db = has_value(row, 2) && read_bool(row, 2);
+                if (e.in_db)
+                    e.value = read_blob(row, 3);
+                e.size = has_value(row, 4) ? read_int64(row, 4) : 0;
+                e.original_size = has_value(row, 5) ? read_int64(row, 5) : 0;
+                e.crc32 = has_value(row, 6) ? read_int32(row, 6) : 0;
+                e.checksum_algorithm = read_checksum_algorithm(row, 7);
+                if (has_value(row, 8))
+                {
+                    e.content_hash = read_string(row, 8);
+                    e.path = get_path_for_content(cache, read_int64(row, 10));
+                }
+                else
+                {
+                    e.path = get_path_for_id(cache, read_int64(row, 9));
+                }
+                e.last_accessed = read_string(row, 11);
+                e.shard = &cache;
+                entries.push_back(std::move(e));
+            });
+    }
+    catch (...)
+    {
+        sqlite3_finalize(query);
+        throw;
+    }
+    sqlite3_finalize(query);
+    return entries;
+}
+
+// Does :entry (as listed by get_pack_entries()) still describe what's in
+// the cache? If its value is in a file, this checks that the entry still
+// refers to the same file (with the same data).
+// The caller must hold the shard's mutex.
+static bool
+is_current_pack_entry(disk_cache_impl& cache, pack_entry const& entry)
+{
+    auto current = look_up(cache, entry.key, true);
+    if (!current || current->in_db != entry.in_db)
+        return false;
+    if (entry.in_db)
+        return true;
+    // Content files never change, but an entry's own file is rewritten
+    // when its key is inserted again.
+    if (current->content_id)
+    {
+        return get_path_for_content(cache, *current->content_id)
+               == entry.path;
+    }
+    return get_path_for_id(cache, current->id) == entry.path
+           && current->size == entry.size && current->crc32 == entry.crc32;
+}
+
+// Write an entry record to a pack and return the size of its data.
+// If the entry's file no longer exists, nothing is written and this
+// returns none.
+static optional<int64_t>
+write_pack_entry(std::ostream& output, pack_entry const& entry)
+{
+    std::ifstream file;
+    int64_t size = boost::numeric_cast<int64_t>(entry.value.size());
+    if (!entry.in_db)
+    {
+        file.open(entry.path, std::ios::in | std::ios::binary);
+        if (!file)
+            return none;
+        file.exceptions(
+            std::ios::eofbit | std::ios::failbit | std::ios::badbit);
+        file.seekg(0, std::ios::end);
+        size = std::streamoff(file.tellg());
+        file.seekg(0, std::ios::beg);
+    }
+
+    write_pack_integer(output, 1, 1);
+    write_pack_string(output, entry.key);
+    write_pack_string(output, entry.key_namespace);
+    write_pack_integer(output, entry.in_db ? 1 : 0, 1);
+    write_pack_integer(output, entry.original_size, 8);
+    write_pack_integer(output, entry.crc32, 4);
+    write_pack_integer(output, int(entry.checksum_algorithm), 1);
+    write_pack_string(output, entry.content_hash);
+    if (entry.in_db)
+    {
+        write_pack_string(output, entry.value);
+    }
+    else
+    {
+        write_pack_integer(output, size, 8);
+        copy_pack_data(file, output, size);
+    }
+    return size;
+}
+
+// Read the next entry record from a pack (up to its data) into :entry and
+// return the size of its data. This returns none at the end of the pack.
+static optional<uint64_t>
+read_pack_entry(std::istream& input, file_path const& path, pack_entry& entry)
+{
+    switch (read_pack_integer(input, 1))
+    {
+        case 0:
+            return none;
+        case 1:
+            break;
+        default:
+            throw_malformed_pack(path);
+    }
+    entry.key = read_pack_string(input);
+    entry.key_namespace = read_pack_string(input);
+    entry.in_db = read_pack_integer(input, 1) != 0;
+    entry.original_size = int64_t(read_pack_integer(input, 8));
+    entry.crc32 = uint32_t(read_pack_integer(input, 4));
+    auto algorithm = read_pack_integer(input, 1);
+    if (algorithm > uint64_t(disk_cache_checksum_algorithm::CRC32C))
+        throw_malformed_pack(path);
+    entry.checksum_algorithm = disk_cache_checksum_algorithm(algorithm);
+    entry.content_hash = read_pack_string(input);
+    return read_pack_integer(input, 8);
+}
+
+// Import an entry (whose record has been read from :input up to its data)
+// into the shard. This returns false (and skips over the data) if the key
+// is already in the shard.
+// The caller must hold the shard's mutex.
+static bool
+import_pack_entry(
+    disk_cache_impl& cache,
+    std::istream& input,
+    pack_entry const& entry,
+    uint64_t size)
+{
+    if (look_up(cache, entry.key, true))
+    {
+        input.seekg(boost::numeric_cast<std::streamoff>(size), std::ios::cur);
+        return false;
+    }
+
+    if (entry.in_db)
+    {
+        insert(
+            cache,
+            entry.key,
+            read_pack_bytes(input, size),
+            entry.original_size,
+            entry.key_namespace);
+        return true;
+    }
+
+    auto id = initiate_insert(cache, entry.key, entry.key_namespace);
+    if (!entry.content_hash.empty()
+        && finish_insert_with_existing_content(cache, id, entry.content_hash))
+    {
+        input.seekg(boost::numeric_cast<std::streamoff>(size), std::ios::cur);
+        return true;
+    }
+    {
+        std::ofstream output;
+        open_file(
+            output,
+            get_path_for_id(cache, id),
+            std::ios::out | std::ios::trunc | std::ios::binary);
+        copy_pack_data(input, output, size);
+    }
+    if (entry.content_hash.empty())
+    {
+        finish_insert(
+            cache,
+            id,
+            entry.crc32,
+            entry.original_size,
+            entry.checksum_algorithm);
+    }
+    else
+    {
+        finish_insert(
+            cache,
+            id,
+            entry.crc32,
+            entry.original_size,
+            entry.content_hash,
+            entry.checksum_algorithm);
+    }
+    return true;
+}
+
+// SHARDS
+
+// A disk cache is made up of one or more shards, each of which is a
+// complete cache (with its own index database) in its own directory.
+struct disk_cache_shard
+{
+    // This is null if the shard couldn't be initialized.
+    std::unique_ptr<disk_cache_impl> impl;
+
+    // the shard's share of the keys (proportional to its size limit)
+    double weight;
+};
+
+struct disk_cache_shards
+{
+    std::vector<disk_cache_shard> shards;
+
+    // serializes marking shards as failed (so that the last available shard
+    // is never marked)
+    std::mutex failure_mutex;
+};
+
+// Is :shard available for use? A shard is unavailable if it couldn't be
+// initialized or if it has failed since.
+static bool
+is_available(disk_cache_shard const& shard)
+{
+    return shard.impl && !shard.impl->failed;
+}
+
+// The IDs that the API deals in identify both the shard and the entry
+// within the shard: the shard index is stored in the bits above
+// :shard_id_shift. (This leaves the IDs in the first shard unchanged.)
+int const shard_id_shift = 48;
+
+static int64_t
+make_global_id(size_t shard_index, int64_t local_id)
+{
+    return (int64_t(shard_index) << shard_id_shift) | local_id;
+}
+
+static int64_t
+get_local_id(int64_t id)
+{
+    return id & ((int64_t(1) << shard_id_shift) - 1);
+}
+
+static disk_cache_entry
+make_global_entry(size_t shard_index, disk_cache_entry entry)
+{
+    entry.id = make_global_id(shard_index, entry.id);
+    return entry;
+}
+
+// Get the shard that the given (global) ID belongs to.
+static disk_cache_impl&
+get_shard_for_id(disk_cache_shards& shards, int64_t id)
+{
+    auto index = size_t(id >> shard_id_shift);
+    if (index >= shards.shards.size() || !is_available(shards.shards[index]))
+    {
+        CRADLE_THROW(
+            disk_cache_failure()
+            << internal_error_message_info(
+                   "disk cache ID refers to an unavailable shard"));
+    }
+    return *shards.shards[index].impl;
+}
+
+// Compute a 64-bit hash of :key that's specific to a shard.
+// This needs to be stable across runs (and platforms), so it's FNV-1a
+// (seeded with the shard index) followed by the SplitMix64 finalizer.
+static uint64_t
+hash_key_for_shard(string const& key, size_t shard_index)
+{
+    uint64_t hash = 0xcbf29ce484222325 ^ (shard_index * 0x9e3779b97f4a7c15);
+    for (char c : key)
+    {
+        hash ^= uint8_t(c);
+        hash *= 0x100000001b3;
+    }
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111eb;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+// Get the index of the shard that :key is assigned to.
+// This uses weighted rendezvous hashing: each available shard scores the
+// key, and the highest score wins. When a shard is unavailable, only the
+// keys that would have gone to it are reassigned.
+static size_t
+get_shard_index_for_key(disk_cache_shards const& shards, string const& key)
+{
+    if (shards.shards.size() == 1)
+        return 0;
+    size_t best_index = 0;
+    double best_score = -1;
+    for (size_t i = 0; i != shards.shards.size(); ++i)
+    {
+        auto const& shard = shards.shards[i];
+        if (!is_available(shard))
+            continue;
+        // Map the hash to a uniformly distributed value in (0, 1).
+        double u = (double(hash_key_for_shard(key, i) >> 11) + 0.5)
+                   * (1.0 / double(uint64_t(1) << 53));
+        double score = -shard.weight / std::log(u);
+        if (score > best_score)
+        {
+            best_score = score;
+            best_index = i;
+        }
+    }
+    return best_index;
+}
+
+// Take the shard at :index out of service after it fails at runtime (with
+// an SQLite or I/O error), so that its keys go to the shard that's next in
+// their rendezvous order. This returns false (and leaves the shard alone)
+// if it's the only one left, in which case the error should be reported
+// like any other.
+static bool
+mark_shard_failed(disk_cache_shards& shards, size_t index)
+{
+    std::scoped_lock<std::mutex> lock(shards.failure_mutex);
+    auto available_count = std::count_if(
+        shards.shards.begin(), shards.shards.end(), [](auto const& shard) {
+            return is_available(shard);
+        });
+    auto& shard = shards.shards[index];
+    if (!is_available(shard) || available_count < 2)
+        return false;
+    shard.impl->failed = true;
+    return true;
+}
+
+// Call :fn(index, cache) on the shard that :key is assigned to and return
+// its result. If the shard fails, it's taken out of service and :fn is
+// retried on the key's next shard.
+template<class Fn>
+static auto
+with_shard_for_key(disk_cache_shards& shards, string const& key, Fn&& fn)
+{
+    for (;;)
+    {
+        auto index = get_shard_index_for_key(shards, key);
+        try
+        {
+            return fn(index, *shards.shards[index].impl);
+        }
+        catch (disk_cache_failure&)
+        {
+            if (!mark_shard_failed(shards, index))
+                throw;
+        }
+        catch (std::system_error&)
+        {
+            if (!mark_shard_failed(shards, index))
+                throw;
+        }
+    }
+}
+
+// Call :fn(index, cache) on every available shard. A shard that fails is
+// taken out of service (unless it's the last one).
+template<class Fn>
+static void
+for_each_available_shard(disk_cache_shards& shards, Fn&& fn)
+{
+    for (size_t i = 0; i != shards.shards.size(); ++i)
+    {
+        if (!is_available(shards.shards[i]))
+            continue;
+        try
+        {
+            fn(i, *shards.shards[i].impl);
+        }
+        catch (disk_cache_failure&)
+        {
+            if (!mark_shard_failed(shards, i))
+                throw;
+        }
+        catch (std::system_error&)
+        {
+            if (!mark_shard_failed(shards, i))
+                throw;
+        }
+    }
+}
+
+// Shut down all the shards (and forget about them).
+static void
+shut_down_shards(disk_cache_shards& shards)
+{
+    for (auto& shard : shards.shards)
+    {
+        if (shard.impl)
+        {
+            stop_maintainer(*shard.impl);
+            stop_flusher(*shard.impl);
+            std::scoped_lock<std::mutex> lock(shard.impl->mutex);
+            shut_down(*shard.impl);
+        }
+    }
+    shards.shards.clear();
+}
+
+static void
+initialize_shards(disk_cache_shards& shards, disk_cache_config const& config)
+{
+    // Without a list of shards, the cache is a single shard that's
+    // described by :config itself.
+    std::vector<disk_cache_config> shard_configs;
+    if (config.shards.empty())
+    {
+        shard_configs.push_back(config);
+    }
+    else
+    {
+        double total_size_limit = 0;
+        for (auto const& shard : config.shards)
+            total_size_limit += double(shard.size_limit);
+        for (auto const& shard : config.shards)
+        {
+            auto shard_config = config;
+            shard_config.directory = shard.directory;
+            shard_config.size_limit = shard.size_limit;
+            shard_config.shards.clear();
+            for (auto& namespace_config : shard_config.namespaces)
+            {
+                if (namespace_config.size_limit != 0)
+                {
+                    namespace_config.size_limit = std::max(
+                        size_t(double(namespace_config.size_limit)
+                               * double(shard.size_limit)
+                               / std::max(total_size_limit, 1.0)),
+                        size_t(1));
+                }
+            }
+            shard_configs.push_back(shard_config);
+        }
+    }
+
+    std::exception_ptr error;
+    for (auto const& shard_config : shard_configs)
+    {
+        disk_cache_shard shard;
+        shard.weight = double(std::max(shard_config.size_limit, size_t(1)));
+        shard.impl.reset(new disk_cache_impl);
+        try
+        {
+            std::scoped_lock<std::mutex> lock(shard.impl->mutex);
+            initialize(*shard.impl, shard_config);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+            stop_maintainer(*shard.impl);
+            stop_flusher(*shard.impl);
+            {
+                std::scoped_lock<std::mutex> lock(shard.impl->mutex);
+                shut_down(*shard.impl);
+            }
+            shard.impl.reset();
+        }
+        shards.shards.push_back(std::move(shard));
     }
-    catch (...)
+
+    // The cache as a whole only fails if none of its shards are available.
+    if (std::none_of(
+            shards.shards.begin(), shards.shards.end(), [](auto const& shard) {
+                return shard.impl != nullptr;
+            }))
     {
-        // If the first attempt fails, we may have an incompatible or corrupt
-        // database, so shut everything down, clear out the directory, and try
-        // again.
-        shut_down(cache);
-        for (auto& p : std::filesystem::directory_iterator(cache.dir))
-            remove_all(p.path());
-        open_and_check_db(cache);
+        shards.shards.clear();
+        std::rethrow_exception(error);
     }
-
-    // Set various performance tuning flags.
-    execute_sql(cache, "pragma synchronous = off;");
-    execute_sql(cache, "pragma locking_mode = exclusive;");
-    execute_sql(cache, "pragma journal_mode = memory;");
-
-    // Initialize our prepared statements.
-    cache.record_usage_statement = prepare_statement(
-        cache,
-        "update entries set last_accessed=strftime('%Y-%m-%d %H:%M:%f', "
-        "'now') "
-        "where id=?1;");
-    cache.update_entry_value_statement = prepare_statement(
-        cache,
-        "update entries set valid=1, in_db=1, size=?1, original_size=?2,"
-        " value=?3, last_accessed=strftime('%Y-%m-%d %H:%M:%f', 'now')"
-        " where id=?4;");
-    cache.insert_new_value_statement = prepare_statement(
-        cache,
-        "insert into entries"
-        " (key, valid, in_db, size, original_size, value, last_accessed)"
-        " values(?1, 1, 1, ?2, ?3, ?4, strftime('%Y-%m-%d %H:%M:%f',"
-        " 'now'));");
-    cache.initiate_insert_statement = prepare_statement(
-        cache, "insert into entries(key, valid, in_db) values (?1, 0, 0);");
-    cache.finish_insert_statement = prepare_statement(
-        cache,
-        "update entries set valid=1, in_db=0, size=?1, original_size=?2, "
-        " crc32=?3, last_accessed=strftime('%Y-%m-%d %H:%M:%f', 'now')"
-        " where id=?4;");
-    cache.remove_entry_statement
-        = prepare_statement(cache, "delete from entries where id=?1;");
-    cache.look_up_entry_query = prepare_statement(
-        cache,
-        "select id, valid, in_db, value, size, original_size, crc32"
-        " from entries where key=?1;");
-    cache.cache_size_query
-        = prepare_statement(cache, "select sum(size) from entries;");
-    cache.entry_count_query = prepare_statement(
-        cache, "select count(id) from entries where valid = 1;");
-    cache.entry_list_query = prepare_statement(
-        cache,
-        "select key, id, in_db, size, original_size, crc32 from entries"
-        " where valid = 1 order by last_accessed;");
-    cache.lru_entry_list_query = prepare_statement(
-        cache,
-        "select id, size, in_db from entries"
-        " order by valid, last_accessed;");
-
-    // Do initial housekeeping.
-    record_activity(cache);
-    enforce_cache_size_limit(cache);
 }
 
 // API
@@ -686,7 +3602,7 @@ disk_cache::disk_cache()
 }
 
 disk_cache::disk_cache(disk_cache_config const& config)
-    : impl_(new disk_cache_impl)
+    : impl_(new disk_cache_shards)
 {
     this->reset(config);
 }
@@ -694,84 +3610,225 @@ disk_cache::disk_cache(disk_cache_config const& config)
 disk_cache::~disk_cache()
 {
     if (this->impl_)
-        shut_down(*this->impl_);
+        shut_down_shards(*this->impl_);
 }
 
 void
 disk_cache::reset(disk_cache_config const& config)
 {
     if (!this->impl_)
-        this->impl_.reset(new disk_cache_impl);
-    auto& cache = *this->impl_;
-    std::scoped_lock<std::mutex> lock(cache.mutex);
-    shut_down(cache);
-    initialize(cache, config);
+        this->impl_.reset(new disk_cache_shards);
+    shut_down_shards(*this->impl_);
+    try
+    {
+        initialize_shards(*this->impl_, config);
+    }
+    catch (...)
+    {
+        impl_.reset();
+        throw;
+    }
 }
 
 void
 disk_cache::reset()
 {
     if (this->impl_)
-        shut_down(*impl_);
+        shut_down_shards(*this->impl_);
     impl_.reset();
 }
 
 disk_cache_info
 disk_cache::get_summary_info()
 {
-    auto& cache = *this->impl_;
-    std::scoped_lock<std::mutex> lock(cache.mutex);
-
     // Note that these are actually inconsistent since the size includes
     // invalid entries, while the entry count does not, but I think that's
     // reasonable behavior and in any case not a big deal.
     disk_cache_info info;
-    info.directory = cache.dir.string();
-    info.entry_count = get_cache_entry_count(cache);
-    info.total_size = get_cache_size(cache);
+    info.entry_count = 0;
+    info.total_size = 0;
+    info.maintenance.completed = true;
+    for (auto& shard : impl_->shards)
+    {
+        if (!is_available(shard))
+        {
+            ++info.failed_shard_count;
+            continue;
+        }
+        auto& cache = *shard.impl;
+        std::scoped_lock<std::mutex> lock(cache.mutex);
+        if (info.directory.empty())
+            info.directory = cache.dir.string();
+        info.entry_count += get_cache_entry_count(cache);
+        info.total_size += get_cache_size(cache);
+        for (auto const& [name, size] : get_namespace_sizes(cache))
+            info.namespace_sizes[name] += size;
+        add_maintenance_counts(info.maintenance, cache.maintenance_totals);
+        info.maintenance.completed = info.maintenance.completed
+                                     && cache.maintenance_totals.completed;
+    }
     return info;
 }
 
 std::vector<disk_cache_entry>
 disk_cache::get_entry_list()
 {
-    auto& cache = *this->impl_;
-    std::scoped_lock<std::mutex> lock(cache.mutex);
+    std::vector<disk_cache_entry> entries;
+    for (size_t i = 0; i != impl_->shards.size(); ++i)
+    {
+        if (!is_available(impl_->shards[i]))
+            continue;
+        auto& cache = *impl_->shards[i].impl;
+        std::scoped_lock<std::mutex> lock(cache.mutex);
+
+        for (auto& entry : cradle::get_entry_list(cache))
+            entries.push_back(make_global_entry(i, std::move(entry)));
+    }
+    return entries;
+}
+
+std::vector<disk_cache_entry>
+disk_cache::get_recently_used_entries(size_t size_limit)
+{
+    std::vector<std::vector<disk_cache_entry>> shard_lists;
+    for (size_t i = 0; i != impl_->shards.size(); ++i)
+    {
+        if (!is_available(impl_->shards[i]))
+            continue;
+        auto& cache = *impl_->shards[i].impl;
+        std::scoped_lock<std::mutex> lock(cache.mutex);
+
+        // Make sure that any buffered usage is reflected in the ordering.
+        cradle::write_usage_records(cache);
 
-    return cradle::get_entry_list(cache);
+        auto list = cradle::get_recently_used_entries(
+            cache, boost::numeric_cast<int64_t>(size_limit));
+        for (auto& entry : list)
+            entry = make_global_entry(i, std::move(entry));
+        shard_lists.push_back(std::move(list));
+    }
+    if (shard_lists.size() == 1)
+        return std::move(shard_lists.front());
+
+    // Interleave the shards' lists (which approximately preserves the
+    // overall ordering, since keys are spread evenly across shards) until
+    // the size limit is reached.
+    std::vector<disk_cache_entry> entries;
+    int64_t total_size = 0;
+    for (size_t position = 0;; ++position)
+    {
+        bool any_left = false;
+        for (auto& list : shard_lists)
+        {
+            if (position >= list.size())
+                continue;
+            any_left = true;
+            total_size += list[position].original_size;
+            if (total_size > boost::numeric_cast<int64_t>(size_limit))
+                return entries;
+            entries.push_back(std::move(list[position]));
+        }
+        if (!any_left)
+            return entries;
+    }
 }
 
 void
 disk_cache::remove_entry(int64_t id)
 {
-    auto& cache = *this->impl_;
+    auto& cache = get_shard_for_id(*impl_, id);
     std::scoped_lock<std::mutex> lock(cache.mutex);
 
-    cradle::remove_entry(cache, id);
+    cradle::remove_entry(cache, get_local_id(id));
 }
 
 void
-disk_cache::clear()
+disk_cache::discard_entry(int64_t id)
 {
-    auto& cache = *this->impl_;
+    auto& cache = get_shard_for_id(*impl_, id);
     std::scoped_lock<std::mutex> lock(cache.mutex);
 
-    for (auto const& entry : get_lru_entries(cache))
+    auto local_id = get_local_id(id);
+
+    begin_write(cache);
+
+    bind_int64(cache, cache.discard_entry_statement, 1, local_id);
+    execute_prepared_statement(cache, cache.discard_entry_statement);
+    remove_file_after_commit(cache, cradle::get_path_for_id(cache, local_id));
+
+    remove_orphaned_contents(cache);
+}
+
+void
+disk_cache::clear()
+{
+    for (auto& shard : impl_->shards)
+    {
+        if (!is_available(shard))
+            continue;
+        auto& cache = *shard.impl;
+        std::scoped_lock<std::mutex> lock(cache.mutex);
+
+        for (auto const& entry : get_lru_entries(cache))
+        {
+            try
+            {
+                cradle::remove_entry(cache, entry.id, !entry.in_db);
+            }
+            catch (...)
+            {
+            }
+        }
+    }
+}
+
+static optional<disk_cache_entry>
+find_in_shard(disk_cache_impl& cache, string const& key)
+{
+    // Take a reader from the pool (waiting if necessary). If there's no pool
+    // (or it's being closed), this falls through to the main connection.
+    disk_cache_reader* reader = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(cache.reader_mutex);
+        auto pool_is_open
+            = [&] { return !cache.readers.empty() && !cache.readers_closing; };
+        cache.reader_available.wait(lock, [&] {
+            return !pool_is_open() || !cache.idle_readers.empty();
+        });
+        if (pool_is_open())
+        {
+            reader = cache.idle_readers.back();
+            cache.idle_readers.pop_back();
+        }
+    }
+    if (reader)
     {
+        record_activity(cache);
+
+        // (Both close_readers() and other lookups may be waiting for this.)
+        auto return_reader = [&] {
+            {
+                std::scoped_lock<std::mutex> lock(cache.reader_mutex);
+                cache.idle_readers.push_back(reader);
+            }
+            cache.reader_available.notify_all();
+        };
         try
         {
-            cradle::remove_entry(cache, entry.id, !entry.in_db);
+            auto entry
+                = look_up(cache, reader->look_up_entry_query, key, true);
+            return_reader();
+            return entry;
         }
         catch (...)
         {
+            // Leave the statement ready for the next use.
+            sqlite3_reset(reader->look_up_entry_query);
+            return_reader();
+            throw;
         }
     }
-}
 
-optional<disk_cache_entry>
-disk_cache::find(string const& key)
-{
-    auto& cache = *this->impl_;
     std::scoped_lock<std::mutex> lock(cache.mutex);
 
     record_activity(cache);
@@ -779,137 +3836,339 @@ disk_cache::find(string const& key)
     return look_up(cache, key, true);
 }
 
+optional<disk_cache_entry>
+disk_cache::find(string const& key)
+{
+    return with_shard_for_key(
+        *impl_,
+        key,
+        [&](size_t shard_index,
+            disk_cache_impl& cache) -> optional<disk_cache_entry> {
+            auto entry = find_in_shard(cache, key);
+            if (!entry)
+                return none;
+            return make_global_entry(shard_index, std::move(*entry));
+        });
+}
+
 void
 disk_cache::insert(
-    string const& key, string const& value, optional<size_t> original_size)
+    string const& key,
+    string const& value,
+    optional<size_t> original_size,
+    string const& key_namespace)
 {
-    auto& cache = *this->impl_;
-    std::scoped_lock<std::mutex> lock(cache.mutex);
-
-    record_activity(cache);
-
-    auto entry = look_up(cache, key, false);
-    if (entry)
-    {
-        bind_int64(cache, cache.update_entry_value_statement, 1, value.size());
-        bind_int64(
-            cache,
-            cache.update_entry_value_statement,
-            2,
-            original_size ? *original_size : value.size());
-        bind_blob(cache, cache.update_entry_value_statement, 3, value);
-        bind_string(cache, cache.update_entry_value_statement, 4, key);
-        execute_prepared_statement(cache, cache.update_entry_value_statement);
-    }
-    else
-    {
-        bind_string(cache, cache.insert_new_value_statement, 1, key);
-        bind_int64(cache, cache.insert_new_value_statement, 2, value.size());
-        bind_int64(
-            cache,
-            cache.insert_new_value_statement,
-            3,
-            original_size ? *original_size : value.size());
-        bind_blob(cache, cache.insert_new_value_statement, 4, value);
-        execute_prepared_statement(cache, cache.insert_new_value_statement);
-    }
+    with_shard_for_key(*impl_, key, [&](size_t, disk_cache_impl& cache) {
+        std::scoped_lock<std::mutex> lock(cache.mutex);
 
-    record_cache_growth(cache, value.size());
+        cradle::insert(cache, key, value, original_size, key_namespace);
+    });
 }
 
 int64_t
-disk_cache::initiate_insert(string const& key)
+disk_cache::initiate_insert(string const& key, string const& key_namespace)
 {
-    auto& cache = *this->impl_;
-    std::scoped_lock<std::mutex> lock(cache.mutex);
+    return with_shard_for_key(
+        *impl_, key, [&](size_t shard_index, disk_cache_impl& cache) {
+            std::scoped_lock<std::mutex> lock(cache.mutex);
 
-    record_activity(cache);
+            return make_global_id(
+                shard_index,
+                cradle::initiate_insert(cache, key, key_namespace));
+        });
+}
 
-    auto entry = look_up(cache, key, false);
-    if (entry)
-        return entry->id;
+void
+disk_cache::finish_insert(
+    int64_t id,
+    uint32_t crc32,
+    optional<size_t> original_size,
+    disk_cache_checksum_algorithm checksum_algorithm)
+{
+    auto& cache = get_shard_for_id(*impl_, id);
+    std::scoped_lock<std::mutex> lock(cache.mutex);
 
-    bind_string(cache, cache.initiate_insert_statement, 1, key);
-    execute_prepared_statement(cache, cache.initiate_insert_statement);
+    cradle::finish_insert(
+        cache, get_local_id(id), crc32, original_size, checksum_algorithm);
+}
 
-    // Get the ID that was inserted.
-    entry = look_up(cache, key, false);
-    if (!entry)
-    {
-        // Since we checked that the insert succeeded, we really shouldn't
-        // get here.
-        CRADLE_THROW(
-            disk_cache_failure() << disk_cache_path_info(cache.dir)
-                                 << internal_error_message_info(
-                                        "failed to create entry in index.db"));
-    }
+bool
+disk_cache::finish_insert_with_existing_content(
+    int64_t id, string const& content_hash)
+{
+    auto& cache = get_shard_for_id(*impl_, id);
+    std::scoped_lock<std::mutex> lock(cache.mutex);
 
-    return entry->id;
+    return cradle::finish_insert_with_existing_content(
+        cache, get_local_id(id), content_hash);
 }
 
 void
 disk_cache::finish_insert(
-    int64_t id, uint32_t crc32, optional<size_t> original_size)
+    int64_t id,
+    uint32_t crc32,
+    optional<size_t> original_size,
+    string const& content_hash,
+    disk_cache_checksum_algorithm checksum_algorithm)
 {
-    auto& cache = *this->impl_;
+    auto& cache = get_shard_for_id(*impl_, id);
     std::scoped_lock<std::mutex> lock(cache.mutex);
 
-    record_activity(cache);
-
-    int64_t size = file_size(cradle::get_path_for_id(cache, id));
-
-    bind_int64(cache, cache.finish_insert_statement, 1, size);
-    bind_int64(
+    cradle::finish_insert(
         cache,
-        cache.finish_insert_statement,
-        2,
-        original_size ? *original_size : size);
-    bind_int32(cache, cache.finish_insert_statement, 3, crc32);
-    bind_int64(cache, cache.finish_insert_statement, 4, id);
-    execute_prepared_statement(cache, cache.finish_insert_statement);
+        get_local_id(id),
+        crc32,
+        original_size,
+        content_hash,
+        checksum_algorithm);
+}
 
-    record_cache_growth(cache, size);
+file_path
+disk_cache::get_path_for_entry(disk_cache_entry const& entry)
+{
+    auto& cache = get_shard_for_id(*impl_, entry.id);
+    std::scoped_lock<std::mutex> lock(cache.mutex);
+
+    return entry.content_id
+               ? get_path_for_content(cache, *entry.content_id)
+               : cradle::get_path_for_id(cache, get_local_id(entry.id));
 }
 
 file_path
 disk_cache::get_path_for_id(int64_t id)
 {
-    auto& cache = *this->impl_;
+    auto& cache = get_shard_for_id(*impl_, id);
     std::scoped_lock<std::mutex> lock(cache.mutex);
 
-    return cradle::get_path_for_id(cache, id);
+    return cradle::get_path_for_id(cache, get_local_id(id));
 }
 
 void
 disk_cache::record_usage(int64_t id)
 {
-    auto& cache = *this->impl_;
+    auto& cache = get_shard_for_id(*impl_, id);
     std::scoped_lock<std::mutex> lock(cache.mutex);
 
-    cache.usage_record_buffer.push_back(id);
+    cache.usage_record_buffer.push_back(get_local_id(id));
 }
 
 void
 disk_cache::write_usage_records()
 {
-    auto& cache = *this->impl_;
-    std::scoped_lock<std::mutex> lock(cache.mutex);
+    for_each_available_shard(*impl_, [](size_t, disk_cache_impl& cache) {
+        std::scoped_lock<std::mutex> lock(cache.mutex);
+
+        cradle::write_usage_records(cache);
+    });
+}
 
-    cradle::write_usage_records(cache);
+void
+disk_cache::flush()
+{
+    for_each_available_shard(*impl_, [](size_t, disk_cache_impl& cache) {
+        std::scoped_lock<std::mutex> lock(cache.mutex);
+
+        cradle::write_usage_records(cache);
+        commit_batch(cache);
+    });
 }
 
 void
 disk_cache::do_idle_processing()
 {
-    auto& cache = *this->impl_;
-    std::scoped_lock<std::mutex> lock(cache.mutex);
+    for_each_available_shard(*impl_, [](size_t, disk_cache_impl& cache) {
+        std::scoped_lock<std::mutex> lock(cache.mutex);
+
+        if (!cache.usage_record_buffer.empty()
+            && std::chrono::system_clock::now() - cache.latest_activity.load()
+                   > std::chrono::seconds(1))
+        {
+            cradle::write_usage_records(cache);
+        }
+    });
+}
+
+disk_cache_maintenance_report
+disk_cache::do_maintenance(std::chrono::milliseconds time_budget)
+{
+    // The budget is split evenly among the shards.
+    auto shard_count = size_t(std::count_if(
+        impl_->shards.begin(), impl_->shards.end(), [](auto const& shard) {
+            return is_available(shard);
+        }));
+    disk_cache_maintenance_report report;
+    report.completed = true;
+    for_each_available_shard(*impl_, [&](size_t, disk_cache_impl& cache) {
+        auto shard_report = cradle::do_maintenance(
+            cache, time_budget / std::max(shard_count, size_t(1)));
+        add_maintenance_counts(report, shard_report);
+        report.completed = report.completed && shard_report.completed;
+    });
+    return report;
+}
+
+disk_cache_pack_info
+disk_cache::export_pack(
+    file_path const& path, disk_cache_pack_selection const& selection)
+{
+    optional<std::set<string>> namespaces, keys;
+    if (selection.namespaces)
+    {
+        namespaces.emplace(
+            selection.namespaces->begin(), selection.namespaces->end());
+    }
+    if (selection.keys)
+        keys.emplace(selection.keys->begin(), selection.keys->end());
+    auto is_selected = [&](pack_entry const& entry) {
+        return (!namespaces || namespaces->count(entry.key_namespace))
+               && (!keys || keys->count(entry.key));
+    };
 
-    if (!cache.usage_record_buffer.empty()
-        && std::chrono::system_clock::now() - cache.latest_activity
-               > std::chrono::seconds(1))
+    std::vector<pack_entry> entries;
+    for (auto& shard : impl_->shards)
     {
+        if (!is_available(shard))
+            continue;
+        auto& cache = *shard.impl;
+        std::scoped_lock<std::mutex> lock(cache.mutex);
+
+        // Make sure that any buffered usage is reflected in the ordering.
         cradle::write_usage_records(cache);
+
+        auto list = get_pack_entries(cache, is_selected);
+        std::move(list.begin(), list.end(), std::back_inserter(entries));
+    }
+
+    // Apply the size limit to the entries in order of recency. (Timestamps
+    // have a fixed format, so they sort correctly as strings.)
+    std::stable_sort(
+        entries.begin(),
+        entries.end(),
+        [](pack_entry const& a, pack_entry const& b) {
+            return a.last_accessed > b.last_accessed;
+        });
+    if (selection.size_limit)
+    {
+        int64_t total_size = 0;
+        size_t count = 0;
+        for (; count != entries.size(); ++count)
+        {
+            total_size += entries[count].size;
+            if (total_size
+                > boost::numeric_cast<int64_t>(*selection.size_limit))
+            {
+                break;
+            }
+        }
+        entries.resize(count);
+    }
+
+    // Each file is read while holding its shard's lock (so it can't be
+    // evicted or rewritten in the meantime), and only if its entry still
+    // refers to it. Entries that have changed since they were listed are
+    // skipped.
+    disk_cache_pack_info info;
+    std::ofstream output;
+    open_file(
+        output, path, std::ios::out | std::ios::trunc | std::ios::binary);
+    output.write(pack_header.data(), pack_header.size());
+    for (auto entry = entries.rbegin(); entry != entries.rend(); ++entry)
+    {
+        auto& cache = *entry->shard;
+        std::scoped_lock<std::mutex> lock(cache.mutex);
+        auto size = is_current_pack_entry(cache, *entry)
+                        ? write_pack_entry(output, *entry)
+                        : none;
+        if (size)
+        {
+            ++info.entry_count;
+            info.total_size += *size;
+        }
+        else
+        {
+            ++info.skipped_count;
+        }
+    }
+    write_pack_integer(output, 0, 1);
+    output.close();
+    return info;
+}
+
+disk_cache_pack_info
+disk_cache::import_pack(file_path const& path)
+{
+    std::ifstream input;
+    open_file(input, path, std::ios::in | std::ios::binary);
+    // Check the header without letting a short file throw a stream error.
+    input.exceptions(std::ios::goodbit);
+    string header(pack_header.size(), '\0');
+    input.read(header.data(), header.size());
+    if (!input || header != pack_header)
+        throw_malformed_pack(path);
+    input.exceptions(std::ios::eofbit | std::ios::failbit | std::ios::badbit);
+
+    // Lock all the shards (in order, like everything else that locks more
+    // than one) and start a transaction in each of them.
+    std::vector<std::unique_lock<std::mutex>> locks;
+    std::vector<disk_cache_impl*> caches;
+    auto end_bulk_writes = [&] {
+        while (!caches.empty())
+        {
+            auto* cache = caches.back();
+            caches.pop_back();
+            end_bulk_write(*cache);
+        }
+    };
+    disk_cache_pack_info info;
+    try
+    {
+        for (auto& shard : impl_->shards)
+        {
+            if (!is_available(shard))
+                continue;
+            auto& cache = *shard.impl;
+            locks.emplace_back(cache.mutex);
+            record_activity(cache);
+            begin_bulk_write(cache);
+            caches.push_back(&cache);
+        }
+
+        pack_entry entry;
+        while (auto size = read_pack_entry(input, path, entry))
+        {
+            auto& cache
+                = *impl_->shards[get_shard_index_for_key(*impl_, entry.key)]
+                       .impl;
+            if (import_pack_entry(cache, input, entry, *size))
+            {
+                ++info.entry_count;
+                info.total_size += boost::numeric_cast<int64_t>(*size);
+            }
+            else
+            {
+                ++info.skipped_count;
+            }
+        }
+
+        end_bulk_writes();
+    }
+    catch (...)
+    {
+        // Keep whatever was imported before the failure. (Any entry that
+        // was in progress is still marked invalid.)
+        while (!caches.empty())
+        {
+            try
+            {
+                end_bulk_writes();
+            }
+            catch (...)
+            {
+            }
+        }
+        throw;
     }
+    return info;
 }
 
 } // namespace cradle
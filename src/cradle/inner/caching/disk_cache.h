@@ -1,6 +1,9 @@
 #ifndef CRADLE_INNER_CACHING_DISK_CACHE_H
 #define CRADLE_INNER_CACHING_DISK_CACHE_H
 
+#include <chrono>
+#include <functional>
+#include <map>
 #include <memory>
 #include <optional>
 #include <vector>
@@ -23,17 +26,138 @@ namespace cradle {
 // exceptions.
 
 // A cache is internally protected by a mutex, so it can be used concurrently
-// from multiple threads.
+// from multiple threads. (In WAL mode, lookups don't need the mutex. See
+// disk_cache_config::reader_count.)
+
+// the config for one shard of a disk cache (see below)
+struct disk_cache_shard_config
+{
+    std::string directory;
+    size_t size_limit;
+};
+
+// the config for a namespace within a disk cache
+//
+// Every entry belongs to a namespace, which is specified when the entry is
+// inserted. (The default namespace is the empty string.) Normally, all
+// namespaces share the cache's size limit, and the least recently used
+// entries are evicted first, regardless of their namespace. The config for a
+// namespace can change that.
+struct disk_cache_namespace_config
+{
+    std::string name;
+
+    // If this is nonzero, the namespace's entries are also evicted (least
+    // recently used first) whenever their total size exceeds this.
+    // (Shared content counts toward the size of every namespace that refers
+    // to it.)
+    size_t size_limit = 0;
+
+    // If this is true, the namespace's entries are pinned: when the cache as
+    // a whole is over its size limit, they're only evicted once there's
+    // nothing else left to evict. (They're still subject to :size_limit.)
+    bool pinned = false;
+};
 
 struct disk_cache_config
 {
     std::optional<std::string> directory;
     size_t size_limit;
+
+    // If this is nonzero, the index database uses WAL journaling, and
+    // find() goes through a pool of this many read-only connections, so
+    // lookups can proceed in parallel with each other and with writes. (All
+    // other operations still go through a single writer connection.)
+    // Otherwise, a single connection is used for everything.
+    unsigned reader_count = 0;
+
+    // If :write_batch_size is greater than 1, writes (inserts, usage
+    // records, evictions, etc.) are grouped into transactions. A batch is
+    // committed once :write_batch_size entries have been inserted into it,
+    // once :write_batch_delay has passed since it was started, when flush()
+    // is called, or when the cache is shut down.
+    // Note that reader connections (see above) only see committed batches.
+    unsigned write_batch_size = 1;
+    std::chrono::milliseconds write_batch_delay{100};
+
+    // If this is nonempty, the cache is split into independent shards, one
+    // per directory listed here (typically each on its own device), and
+    // :directory and :size_limit are ignored. Each shard has its own index
+    // database, size limit and lock, so I/O to different shards proceeds in
+    // parallel. Keys are assigned to shards by hash, in proportion to the
+    // shards' size limits.
+    // If a shard can't be opened, its keys are spread across the others
+    // (and the cache only fails if none of them can be opened). The same
+    // happens if a shard fails later (with an SQLite or I/O error), as long
+    // as another shard is still available.
+    // The settings above apply to each shard individually.
+    std::vector<disk_cache_shard_config> shards = {};
+
+    // the namespaces that need special treatment (see above) - In a sharded
+    // cache, each shard gets a share of each namespace's size limit (in
+    // proportion to its own size limit).
+    std::vector<disk_cache_namespace_config> namespaces = {};
+
+    // If :maintenance_interval is nonzero, the cache does maintenance in the
+    // background (see disk_cache::do_maintenance()) once it has been idle
+    // for that long (and then again every :maintenance_interval while it
+    // stays idle and there's something to do). Each run is limited to
+    // :maintenance_time_budget, so it never holds up other traffic for long.
+    std::chrono::milliseconds maintenance_interval{60'000};
+    std::chrono::milliseconds maintenance_time_budget{50};
+
+    // Index databases created by older versions of the cache don't support
+    // incremental vacuuming, so maintenance can't return their free space to
+    // the file system. If this is set, such a database is rebuilt when the
+    // cache is initialized (which can take a while for a large cache) to
+    // enable it.
+    bool rebuild_legacy_index = false;
+
+    // Unfinished inserts (and files that aren't referenced by the index)
+    // are only considered abandoned once they're this old, since they may
+    // belong to inserts that are still in progress.
+    std::chrono::seconds abandonment_age{3600};
+
+    // Before version 5 of the index format, the values of entries stored in
+    // the index were encoded by the cache's user before being handed to the
+    // cache. When an older index is upgraded, this decodes those values. If
+    // this is omitted (or it returns none for a value), the entries are
+    // dropped instead.
+    std::function<std::optional<std::string>(std::string const& encoded)>
+        legacy_value_decoder = nullptr;
+};
+
+// what a disk cache maintenance run did
+struct disk_cache_maintenance_report
+{
+    // the number of abandoned (never finished) inserts that were removed
+    int64_t abandoned_entry_count = 0;
+
+    // the number of files that weren't referenced by the index (and were
+    // removed), and their total size
+    int64_t orphaned_file_count = 0;
+    int64_t orphaned_file_bytes = 0;
+
+    // the amount by which the recovery journal was shrunk (by dropping the
+    // records of entries that are gone)
+    int64_t compacted_journal_bytes = 0;
+
+    // the amount of free space that was returned from the index database
+    // to the file system
+    int64_t vacuumed_bytes = 0;
+
+    // the number of index database tables that were reindexed
+    int64_t reindexed_table_count = 0;
+
+    // true iff the run got through all of the maintenance tasks (rather than
+    // running out of time)
+    bool completed = false;
 };
 
 struct disk_cache_info
 {
-    // the directory where the cache is stored
+    // the directory where the cache is stored (or the first one, if it's
+    // sharded)
     std::string directory;
 
     // the number of entries currently stored in the cache
@@ -41,6 +165,54 @@ struct disk_cache_info
 
     // the total size (in bytes)
     int64_t total_size;
+
+    // the number of shards that couldn't be opened or have failed since
+    // (see disk_cache_config)
+    int64_t failed_shard_count = 0;
+
+    // the total size of each namespace (see disk_cache_namespace_config)
+    std::map<std::string, int64_t> namespace_sizes = {};
+
+    // the totals of all the maintenance that has been done since the cache
+    // was initialized (with :completed indicating whether the most recent
+    // run completed)
+    disk_cache_maintenance_report maintenance = {};
+};
+
+// the algorithms that can be used for the checksums of file entries (which
+// are computed over the original, decompressed data)
+enum class disk_cache_checksum_algorithm
+{
+    // the standard CRC-32 (as computed by boost::crc_32_type)
+    CRC32,
+
+    // CRC-32C (see cradle/inner/encodings/crc32c.h), which is much faster to
+    // compute on machines with hardware support for it
+    CRC32C
+};
+
+// how thoroughly the service checks file entries against their checksums
+// when reading them
+enum class disk_cache_verification_mode
+{
+    // Every read is checked before its value is returned.
+    FULL,
+
+    // Only one out of every :sampling_interval reads is checked.
+    SAMPLED,
+
+    // Values are returned immediately and checked in the background.
+    // A value that fails its check is discarded from the cache, but the
+    // reader that requested it has already received it.
+    LAZY
+};
+
+struct disk_cache_verification_config
+{
+    disk_cache_verification_mode mode = disk_cache_verification_mode::FULL;
+
+    // (only used for SAMPLED verification)
+    unsigned sampling_interval = 16;
 };
 
 struct disk_cache_entry
@@ -54,9 +226,9 @@ struct disk_cache_entry
     // true iff the entry is stored directly in the database
     bool in_db;
 
-    // the value associated with the entry - This may be omitted, depending
-    // on how the entry is stored in the cache and how this info was
-    // queried.
+    // the value associated with the entry (as raw bytes) - This may be
+    // omitted, depending on how the entry is stored in the cache and how this
+    // info was queried.
     std::optional<std::string> value;
 
     // the size of the entry, as stored in the cache (in bytes)
@@ -67,6 +239,43 @@ struct disk_cache_entry
 
     // a 32-bit CRC of the contents of the entry
     uint32_t crc32;
+
+    // the ID of the shared content that holds the entry's data, if it's
+    // stored that way (see "content-addressed storage" below)
+    std::optional<int64_t> content_id;
+
+    // the algorithm that was used to compute :crc32
+    disk_cache_checksum_algorithm checksum_algorithm
+        = disk_cache_checksum_algorithm::CRC32;
+};
+
+// the selection of entries to export to a pack (see disk_cache::export_pack)
+struct disk_cache_pack_selection
+{
+    // If this is set, only entries in these namespaces are exported.
+    std::optional<std::vector<std::string>> namespaces;
+
+    // If this is set, only entries with these keys are exported.
+    std::optional<std::vector<std::string>> keys;
+
+    // If this is set, only the most recently used entries (of those that
+    // are otherwise selected) are exported, up to this total size (as
+    // stored in the cache).
+    std::optional<size_t> size_limit;
+};
+
+// what a pack export or import did
+struct disk_cache_pack_info
+{
+    // the number of entries that were exported/imported, and their total
+    // size (as stored in the cache)
+    int64_t entry_count = 0;
+    int64_t total_size = 0;
+
+    // the number of entries that were skipped - On export, these are
+    // entries whose files disappeared before they could be read. On import,
+    // these are entries whose keys were already in the cache.
+    int64_t skipped_count = 0;
 };
 
 // This exception indicates a failure in the operation of the disk cache.
@@ -75,7 +284,7 @@ CRADLE_DEFINE_EXCEPTION(disk_cache_failure)
 CRADLE_DEFINE_ERROR_INFO(file_path, disk_cache_path)
 // This exception also provides internal_error_message_info.
 
-struct disk_cache_impl;
+struct disk_cache_shards;
 
 struct disk_cache
 {
@@ -116,10 +325,24 @@ struct disk_cache
     std::vector<disk_cache_entry>
     get_entry_list();
 
+    // Get a list of the most recently used entries in the cache, starting
+    // with the most recent. The list stops before the total original size of
+    // the listed entries would exceed :size_limit.
+    // Unlike get_entry_list(), this includes the values of entries that are
+    // stored directly in the database.
+    std::vector<disk_cache_entry>
+    get_recently_used_entries(size_t size_limit);
+
     // Remove an individual entry from the cache.
     void
     remove_entry(int64_t id);
 
+    // Remove an entry whose data has turned out to be unreadable or corrupt.
+    // If the entry's data is shared with other entries (see below), they're
+    // all removed, since they're all affected.
+    void
+    discard_entry(int64_t id);
+
     // Clear the cache of all data.
     void
     clear();
@@ -141,14 +364,21 @@ struct disk_cache
     // a few kB. Below this level, it is more efficient (both in time and
     // storage) to store data directly in the SQLite database.
     //
+    // :value is stored as a raw SQLite blob, so it can hold arbitrary binary
+    // data.
+    //
     // :original_size is the original size of the data (if it's compressed).
     // This can be omitted and the data will be understood to be uncompressed.
     //
+    // :key_namespace is the namespace that the entry belongs to (see
+    // disk_cache_namespace_config).
+    //
     void
     insert(
         std::string const& key,
         std::string const& value,
-        std::optional<size_t> original_size = none);
+        std::optional<size_t> original_size = none,
+        std::string const& key_namespace = "");
 
     // Add an arbitrarily large entry to the cache.
     //
@@ -158,22 +388,67 @@ struct disk_cache
     // (If an error occurs in between, it's OK to simply abandon the entry,
     // as it will be marked as invalid initially.)
     //
+    // (:key_namespace is the same as for the other form of insert().)
+    //
     int64_t
-    initiate_insert(std::string const& key);
+    initiate_insert(
+        std::string const& key, std::string const& key_namespace = "");
     // :original_size is the original size of the data (if it's compressed).
     // This can be omitted and the data will be understood to be uncompressed.
+    // :crc32 is a checksum of the original data, computed with
+    // :checksum_algorithm.
     void
     finish_insert(
         int64_t id,
         uint32_t crc32,
-        std::optional<size_t> original_size = none);
+        std::optional<size_t> original_size = none,
+        disk_cache_checksum_algorithm checksum_algorithm
+        = disk_cache_checksum_algorithm::CRC32);
+
+    // Content-addressed storage
+    //
+    // Different keys often have identical values. To store (and compress)
+    // such values only once, a caller can supply a hash of an entry's
+    // original contents when inserting it. Entries with the same hash then
+    // share a single file, which is removed once no entries refer to it.
+    // (Shared files only count once toward the size of the cache.)
+    //
+    // The hash is opaque to the cache, but it's the caller's responsibility
+    // to make sure that it identifies the contents (e.g., SHA-256).
+    //
+    // First, call this after initiating the insert. If the cache already has
+    // content with the given hash, this completes the insert by pointing the
+    // entry at that content and returns true. Otherwise, it returns false.
+    bool
+    finish_insert_with_existing_content(
+        int64_t id, std::string const& content_hash);
+    // In the latter case, write the file to get_path_for_id(:id) as usual and
+    // then finish the insert with this. The file becomes the shared content
+    // for :content_hash. (If another entry has stored the same content in
+    // the meantime, the new file is simply discarded.)
+    void
+    finish_insert(
+        int64_t id,
+        uint32_t crc32,
+        std::optional<size_t> original_size,
+        std::string const& content_hash,
+        disk_cache_checksum_algorithm checksum_algorithm
+        = disk_cache_checksum_algorithm::CRC32);
 
     // Given an ID within the cache, this computes the path of the file that
     // would store the data associated with that ID (assuming that entry were
-    // actually stored in a file rather than in the database).
+    // actually stored in its own file rather than in the database or as
+    // shared content).
+    // This is where a file should be written when inserting an entry.
     file_path
     get_path_for_id(int64_t id);
 
+    // Get the path of the file that stores the data for an entry (that's
+    // stored in a file).
+    // This is where a file should be read from when looking up an entry.
+    file_path
+    get_path_for_entry(disk_cache_entry const& entry);
+
     // Record that an ID within the cache was just used.
     // When a lot of small objects are being read from the cache, the calls to
     // record_usage() can slow down the loading process.
@@ -194,8 +469,49 @@ struct disk_cache
     void
     do_idle_processing();
 
+    // Do some maintenance on the cache:
+    // - remove entries whose inserts were abandoned
+    // - remove files that aren't referenced by the index (e.g., left over
+    //   from crashes)
+    // - compact the recovery journal (if it has grown too large)
+    // - return free space in the index database to the file system
+    // - rebuild the index database's indices (after recovery)
+    // This stops once :time_budget has passed (or shortly after), and the
+    // next call picks up where it left off. (Individual steps are small, and
+    // other operations can proceed in between them.)
+    // This is done automatically when the cache is idle (see
+    // disk_cache_config), but it can also be invoked explicitly.
+    disk_cache_maintenance_report
+    do_maintenance(std::chrono::milliseconds time_budget);
+
+    // Commit any writes that are currently being batched (along with the
+    // buffered usage records).
+    void
+    flush();
+
+    // Packs
+    //
+    // A pack is a single file holding a set of cache entries (with their
+    // values, exactly as they're stored in the cache), written and read
+    // sequentially. Packs are used to seed the cache of a new node with the
+    // contents of an existing one.
+    //
+    // Export the selected entries to a pack at :path (overwriting it).
+    // Entries are written from least to most recently used, so importing
+    // the pack preserves their relative recency.
+    disk_cache_pack_info
+    export_pack(
+        file_path const& path,
+        disk_cache_pack_selection const& selection = {});
+    // Import all entries from the pack at :path. Entries whose keys are
+    // already in the cache are left alone. Each shard is locked (and its
+    // writes are made in a single transaction) for the duration of the
+    // import.
+    disk_cache_pack_info
+    import_pack(file_path const& path);
+
  private:
-    std::unique_ptr<disk_cache_impl> impl_;
+    std::unique_ptr<disk_cache_shards> impl_;
 };
 
 } // namespace cradle
@@ -19,8 +19,7 @@ immutable_cache::immutable_cache(immutable_cache_config config)
 void
 immutable_cache::reset(immutable_cache_config config)
 {
-    this->impl = std::make_unique<detail::immutable_cache>();
-    this->impl->config = std::move(config);
+    this->impl = std::make_unique<detail::immutable_cache>(std::move(config));
 }
 
 void
@@ -35,32 +34,131 @@ clear_unused_entries(immutable_cache& cache)
     detail::reduce_memory_cache_size(*cache.impl, 0);
 }
 
-immutable_cache_snapshot
-get_cache_snapshot(immutable_cache& cache_object)
+immutable_cache_admission_info
+get_admission_info(immutable_cache& cache_object)
 {
     auto& cache = *cache_object.impl;
-    std::scoped_lock<std::mutex> lock(cache.mutex);
-    immutable_cache_snapshot snapshot;
-    snapshot.in_use.reserve(cache.records.size());
-    for (auto const& [key, record] : cache.records)
+    return immutable_cache_admission_info{
+        cache.total_size.load(),
+        cache.admitted_count.load(),
+        cache.bypassed_count.load(),
+        cache.over_limit_count.load()};
+}
+
+immutable_cache_summary
+get_cache_summary(immutable_cache& cache_object)
+{
+    auto& cache = *cache_object.impl;
+    auto count = [&](immutable_cache_entry_state state) {
+        return cache.state_counts[static_cast<size_t>(state)].load();
+    };
+    return immutable_cache_summary{
+        count(immutable_cache_entry_state::LOADING),
+        count(immutable_cache_entry_state::READY),
+        count(immutable_cache_entry_state::FAILED),
+        cache.pending_eviction_count.load(),
+        cache.total_size.load(),
+        cache.unused_size.load(),
+        cache.cancelled_count.load()};
+}
+
+namespace {
+
+// If :record matches :filter, add it to :snapshot.
+// The shard mutex must be held by the caller.
+void
+add_matching_record(
+    immutable_cache_snapshot& snapshot,
+    detail::immutable_cache_record const& record,
+    immutable_cache_snapshot_filter const& filter)
+{
+    auto state = record.state.load(std::memory_order_relaxed);
+    if (filter.state && state != *filter.state)
+        return;
+    auto key = lexical_cast<string>(*record.key);
+    if (filter.key_prefix && !key.starts_with(*filter.key_prefix))
+        return;
+    immutable_cache_entry_snapshot entry{
+        std::move(key),
+        state,
+        // is_initialized(data) ? some(data.ptr->type_info()) : none,
+        record.size};
+    // Put the entry's info the appropriate list depending on whether or not
+    // its in the eviction list.
+    if (record.eviction.pending)
     {
-        immutable_cache_entry_snapshot entry{
-            lexical_cast<string>(*record->key),
-            record->state.load(std::memory_order_relaxed),
-            // is_initialized(data) ? some(data.ptr->type_info()) : none,
-            record->size};
-        // Put the entry's info the appropriate list depending on whether
-        // or not its in the eviction list.
-        if (record->eviction_list_iterator
-            != cache.eviction_list.records.end())
-        {
-            snapshot.pending_eviction.push_back(std::move(entry));
-        }
-        else
+        snapshot.pending_eviction.push_back(std::move(entry));
+    }
+    else
+    {
+        snapshot.in_use.push_back(std::move(entry));
+    }
+}
+
+} // namespace
+
+immutable_cache_snapshot_page
+get_cache_snapshot_page(
+    immutable_cache& cache_object,
+    immutable_cache_snapshot_cursor const& cursor,
+    size_t max_entries,
+    immutable_cache_snapshot_filter const& filter)
+{
+    auto& cache = *cache_object.impl;
+    immutable_cache_snapshot_page page;
+    size_t work = 0;
+    size_t bucket = cursor.bucket;
+    for (size_t shard_index = cursor.shard; shard_index < cache.shards.size();
+         ++shard_index, bucket = 0)
+    {
+        auto& shard = *cache.shards[shard_index];
+        std::scoped_lock<std::mutex> lock(shard.mutex);
+        auto const& records = shard.records;
+        size_t const bucket_count = records.bucket_count();
+        // If the shard has been rehashed since the cursor was created, the
+        // bucket index is meaningless, so start the shard over.
+        if (shard_index == cursor.shard && bucket_count != cursor.bucket_count)
+            bucket = 0;
+        for (; bucket < bucket_count; ++bucket)
         {
-            snapshot.in_use.push_back(std::move(entry));
+            // (Always make some progress, even if :max_entries is 0.)
+            if (work != 0 && work >= max_entries)
+            {
+                page.next = immutable_cache_snapshot_cursor{
+                    shard_index, bucket, bucket_count};
+                return page;
+            }
+            ++work;
+            for (auto i = records.begin(bucket); i != records.end(bucket); ++i)
+            {
+                add_matching_record(page.entries, *i->second, filter);
+                ++work;
+            }
         }
     }
+    return page;
+}
+
+immutable_cache_snapshot
+get_cache_snapshot(immutable_cache& cache)
+{
+    immutable_cache_snapshot snapshot;
+    immutable_cache_snapshot_cursor cursor;
+    while (true)
+    {
+        auto page = get_cache_snapshot_page(cache, cursor, 1024);
+        auto append = [](auto& to, auto& from) {
+            to.insert(
+                to.end(),
+                std::make_move_iterator(from.begin()),
+                std::make_move_iterator(from.end()));
+        };
+        append(snapshot.in_use, page.entries.in_use);
+        append(snapshot.pending_eviction, page.entries.pending_eviction);
+        if (!page.next)
+            break;
+        cursor = *page.next;
+    }
     return snapshot;
 }
 
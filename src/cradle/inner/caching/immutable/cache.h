@@ -1,10 +1,15 @@
 #ifndef CRADLE_INNER_CACHING_IMMUTABLE_CACHE_H
 #define CRADLE_INNER_CACHING_IMMUTABLE_CACHE_H
 
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <optional>
+#include <string>
 #include <vector>
 
 #include <cradle/inner/core/id.h>
+#include <cradle/inner/core/type_definitions.h>
 
 // This file provides the top-level interface to the immutable cache.
 // This includes interfaces for instantiating a cache, configuring it, and
@@ -18,11 +23,75 @@ struct immutable_cache;
 
 } // namespace detail
 
+// the policy that decides which unused entries are evicted first
+enum class immutable_cache_eviction_policy
+{
+    // least recently used entries first
+    LRU,
+
+    // an approximation of LRU that gives recently reused entries a second
+    // chance
+    CLOCK,
+
+    // entries that have only been used once are evicted before those that
+    // have been used repeatedly (so large scans don't flush the cache)
+    TWO_Q,
+
+    // GreedyDual-Size: entries that are cheap to recompute relative to their
+    // size go first (using the measured time that it took to compute them)
+    GREEDY_DUAL_SIZE
+};
+
+// the policy for retrying entries that failed to compute
+struct immutable_cache_retry_policy
+{
+    // How long a failure is remembered before the entry may be retried.
+    // During this time, anyone who requests the entry simply gets the cached
+    // failure. (By default, failures are retried immediately.)
+    std::chrono::milliseconds initial_delay{0};
+
+    // Each consecutive failure multiplies the delay by this factor...
+    double backoff_factor = 2;
+
+    // ... up to this maximum.
+    std::chrono::milliseconds max_delay{60'000};
+
+    // the maximum number of attempts to compute an entry (including the
+    // first) - Once this is reached, the failure is cached until the entry
+    // is evicted. If this is omitted, there's no limit.
+    std::optional<unsigned> max_attempts = none;
+
+    // the clock used to time retries - If this is empty,
+    // std::chrono::steady_clock is used. (This exists mainly for testing.)
+    std::function<std::chrono::steady_clock::time_point()> clock;
+};
+
 struct immutable_cache_config
 {
     // The maximum amount of memory to use for caching results that are no
     // longer in use, in bytes.
     size_t unused_size_limit;
+
+    // The number of independent shards that the cache is split into.
+    // Each shard has its own record map, eviction list and mutex, so
+    // operations on keys in different shards don't contend with each other.
+    // (:unused_size_limit still applies to the cache as a whole.)
+    size_t shard_count = 1;
+
+    // the policy for choosing which unused entries to evict
+    immutable_cache_eviction_policy eviction_policy
+        = immutable_cache_eviction_policy::LRU;
+
+    // The maximum amount of memory to use for all cached results (whether or
+    // not they're in use), in bytes. If this is exceeded, unused entries are
+    // evicted to make room, and if that's not enough, new entries are
+    // computed without being retained in the cache (i.e., they're dropped as
+    // soon as nobody is using them anymore).
+    // If this is omitted, only :unused_size_limit applies.
+    std::optional<size_t> total_size_limit = none;
+
+    // the policy for retrying entries that failed
+    immutable_cache_retry_policy retry_policy = {};
 };
 
 struct immutable_cache
@@ -101,10 +170,128 @@ struct immutable_cache_snapshot
     operator<=>(immutable_cache_snapshot const& other) const = default;
 };
 
+// counters describing the cache's admission control
+struct immutable_cache_admission_info
+{
+    // the total size of all cached values (whether or not they're in use)
+    size_t total_size;
+
+    // the number of new entries that were admitted into the cache
+    uint64_t admitted_count;
+
+    // the number of new entries that bypassed the cache because the cache
+    // was over its total size limit
+    uint64_t bypassed_count;
+
+    // the number of times that the cache had to evict unused entries to
+    // stay within its total size limit
+    uint64_t over_limit_count;
+
+    auto
+    operator<=>(immutable_cache_admission_info const& other) const = default;
+};
+
+// Get the admission control counters for an immutable memory cache.
+immutable_cache_admission_info
+get_admission_info(immutable_cache& cache);
+
 // Get a snapshot of the contents of an immutable memory cache.
+// This is built up from pages (see below), so it never blocks cache traffic
+// for long, but it's also not an atomic view of the cache.
 immutable_cache_snapshot
 get_cache_snapshot(immutable_cache& cache);
 
+// aggregate statistics about an immutable memory cache - These are maintained
+// incrementally, so they can be read without visiting any entries.
+struct immutable_cache_summary
+{
+    // the number of entries in each state
+    size_t loading_count;
+    size_t ready_count;
+    size_t failed_count;
+
+    // the number of entries that are pending eviction (The rest are in use.)
+    size_t pending_eviction_count;
+
+    // the total size of all cached values
+    size_t total_size;
+
+    // the total size of the values that are pending eviction
+    size_t unused_size;
+
+    // the number of entries that were dropped while they were still loading
+    // because nobody was waiting for them anymore (and whose work was
+    // cancelled)
+    uint64_t cancelled_count;
+
+    auto
+    operator<=>(immutable_cache_summary const& other) const = default;
+};
+
+// Get aggregate statistics about an immutable memory cache.
+immutable_cache_summary
+get_cache_summary(immutable_cache& cache);
+
+// INCREMENTAL SNAPSHOTS
+//
+// For large caches, a snapshot can be retrieved incrementally, one page at a
+// time. Each call does a bounded amount of work while holding any one lock,
+// so introspection doesn't stall cache traffic.
+//
+// Pages are not consistent with each other. Entries that are added or removed
+// while the scan is in progress may or may not be reported, and if the cache
+// rehashes in the middle of a scan, some entries may be reported more than
+// once. However, every entry that remains in the cache for the duration of the
+// scan is reported at least once.
+
+// a position within an incremental snapshot - The default value starts at
+// the beginning of the cache.
+struct immutable_cache_snapshot_cursor
+{
+    size_t shard = 0;
+    size_t bucket = 0;
+    // the bucket count of the shard when the cursor was created (used to
+    // detect rehashing)
+    size_t bucket_count = 0;
+
+    auto
+    operator<=>(immutable_cache_snapshot_cursor const& other) const
+        = default;
+};
+
+// criteria for the entries to include in an incremental snapshot
+struct immutable_cache_snapshot_filter
+{
+    // If this is provided, only entries in this state are included.
+    std::optional<immutable_cache_entry_state> state = none;
+
+    // If this is provided, only entries whose keys start with this string are
+    // included.
+    std::optional<std::string> key_prefix = none;
+};
+
+struct immutable_cache_snapshot_page
+{
+    // the matching entries from this page
+    immutable_cache_snapshot entries;
+
+    // where the next page starts - If this is omitted, the scan is complete.
+    std::optional<immutable_cache_snapshot_cursor> next;
+};
+
+// Get the page of a snapshot that starts at :cursor.
+// :max_entries bounds the work done for the page: it visits roughly that many
+// hash buckets and entries in total (whether or not the entries match
+// :filter). Buckets are never split across pages, so a page may go slightly
+// over this, and a page may contain fewer entries even when the scan isn't
+// complete.
+immutable_cache_snapshot_page
+get_cache_snapshot_page(
+    immutable_cache& cache,
+    immutable_cache_snapshot_cursor const& cursor,
+    size_t max_entries,
+    immutable_cache_snapshot_filter const& filter = {});
+
 // Clear unused entries from the cache.
 void
 clear_unused_entries(immutable_cache& cache);
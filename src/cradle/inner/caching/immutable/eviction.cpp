@@ -0,0 +1,291 @@
+#include <cradle/inner/caching/immutable/eviction.h>
+
+#include <algorithm>
+
+#include <cradle/inner/caching/immutable/internals.h>
+
+namespace cradle {
+namespace detail {
+
+namespace {
+
+typedef std::list<immutable_cache_record*> record_queue;
+
+void
+push_back(record_queue& queue, immutable_cache_record* record)
+{
+    record->eviction.queue_position = queue.insert(queue.end(), record);
+}
+
+// LRU - Records are evicted in the order in which they became unused.
+struct lru_eviction_policy : eviction_policy
+{
+    void
+    add(immutable_cache_record* record) override
+    {
+        push_back(queue_, record);
+    }
+
+    void
+    remove(immutable_cache_record* record) override
+    {
+        queue_.erase(record->eviction.queue_position);
+    }
+
+    bool
+    empty() const override
+    {
+        return queue_.empty();
+    }
+
+    immutable_cache_record*
+    pop_victim() override
+    {
+        auto* victim = queue_.front();
+        queue_.pop_front();
+        return victim;
+    }
+
+ private:
+    record_queue queue_;
+};
+
+// CLOCK - Records stay in a circular queue (in the order in which they first
+// became unused) for as long as they're in the cache, and accessing a record
+// only sets its reference bit. When a victim is needed, the hand sweeps the
+// queue: records with their bit set get a second chance (and have it
+// cleared), records that are in use are skipped, and the first record that's
+// neither is evicted. (The front of the list is the hand's position, and
+// advancing the hand moves the front to the back.)
+struct clock_eviction_policy : eviction_policy
+{
+    void
+    on_access(immutable_cache_record* record) override
+    {
+        record->eviction.referenced = true;
+    }
+
+    void
+    add(immutable_cache_record* record) override
+    {
+        auto& hook = record->eviction;
+        if (!hook.queued)
+        {
+            push_back(queue_, record);
+            hook.queued = true;
+        }
+        ++pending_count_;
+    }
+
+    void
+    remove(immutable_cache_record* record) override
+    {
+        // The record keeps its place.
+        --pending_count_;
+    }
+
+    void
+    forget(immutable_cache_record* record) override
+    {
+        auto& hook = record->eviction;
+        if (hook.queued)
+        {
+            queue_.erase(hook.queue_position);
+            hook.queued = false;
+        }
+    }
+
+    bool
+    empty() const override
+    {
+        return pending_count_ == 0;
+    }
+
+    immutable_cache_record*
+    pop_victim() override
+    {
+        // This terminates because there's at least one pending record, and
+        // each pass clears the reference bits of the pending records.
+        while (true)
+        {
+            auto* candidate = queue_.front();
+            auto& hook = candidate->eviction;
+            if (hook.pending && !hook.referenced)
+            {
+                queue_.pop_front();
+                hook.queued = false;
+                --pending_count_;
+                return candidate;
+            }
+            if (hook.pending)
+                hook.referenced = false;
+            queue_.splice(queue_.end(), queue_, queue_.begin());
+        }
+    }
+
+ private:
+    record_queue queue_;
+    // the number of records in :queue_ that are pending eviction
+    size_t pending_count_ = 0;
+};
+
+// 2Q (simplified) - Records that have only been used once go into a FIFO
+// queue (A1), while records that have been used more than once go into an LRU
+// queue (Am). A1 is allowed to hold a fixed fraction of the unused size limit
+// and is evicted first, so a scan over lots of one-off entries can't flush out
+// the entries that are repeatedly used.
+struct two_q_eviction_policy : eviction_policy
+{
+    two_q_eviction_policy(size_t fifo_size_limit)
+        : fifo_size_limit_(fifo_size_limit)
+    {
+    }
+
+    void
+    on_access(immutable_cache_record* record) override
+    {
+        auto& hook = record->eviction;
+        hook.frequently_used = true;
+        // A record that's reused while it's waiting in A1 moves to Am.
+        if (hook.pending && !hook.in_secondary_queue)
+        {
+            unlink(record);
+            link(record, true);
+        }
+    }
+
+    void
+    add(immutable_cache_record* record) override
+    {
+        record->eviction.queued_size = record->size;
+        link(record, record->eviction.frequently_used);
+    }
+
+    void
+    remove(immutable_cache_record* record) override
+    {
+        unlink(record);
+    }
+
+    bool
+    empty() const override
+    {
+        return fifo_.empty() && lru_.empty();
+    }
+
+    immutable_cache_record*
+    pop_victim() override
+    {
+        bool from_fifo = !fifo_.empty()
+                         && (fifo_size_ > fifo_size_limit_ || lru_.empty());
+        auto* victim = from_fifo ? fifo_.front() : lru_.front();
+        unlink(victim);
+        return victim;
+    }
+
+    size_t
+    queued_size() const override
+    {
+        return fifo_size_ + lru_size_;
+    }
+
+ private:
+    void
+    link(immutable_cache_record* record, bool secondary)
+    {
+        auto& hook = record->eviction;
+        hook.in_secondary_queue = secondary;
+        push_back(secondary ? lru_ : fifo_, record);
+        (secondary ? lru_size_ : fifo_size_) += hook.queued_size;
+    }
+
+    void
+    unlink(immutable_cache_record* record)
+    {
+        auto& hook = record->eviction;
+        (hook.in_secondary_queue ? lru_ : fifo_).erase(hook.queue_position);
+        (hook.in_secondary_queue ? lru_size_ : fifo_size_)
+            -= hook.queued_size;
+    }
+
+    size_t fifo_size_limit_;
+    size_t fifo_size_ = 0;
+    size_t lru_size_ = 0;
+    record_queue fifo_;
+    record_queue lru_;
+};
+
+// GreedyDual-Size - Each record is assigned a priority of
+//   L + cost / size
+// where cost is the time that it took to compute the record's value and L is
+// an "inflation" value that is raised to the priority of each evicted record.
+// Cheap-to-recompute and large records go first, while records that haven't
+// been used in a while gradually lose their advantage as L grows.
+struct greedy_dual_size_eviction_policy : eviction_policy
+{
+    void
+    add(immutable_cache_record* record) override
+    {
+        double cost = double(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                record->compute_time)
+                .count());
+        double size = double(record->size);
+        double priority
+            = inflation_ + std::max(cost, 1.) / std::max(size, 1.);
+        record->eviction.priority_position
+            = queue_.emplace(priority, record);
+    }
+
+    void
+    remove(immutable_cache_record* record) override
+    {
+        queue_.erase(record->eviction.priority_position);
+    }
+
+    bool
+    empty() const override
+    {
+        return queue_.empty();
+    }
+
+    immutable_cache_record*
+    pop_victim() override
+    {
+        auto lowest = queue_.begin();
+        inflation_ = lowest->first;
+        auto* victim = lowest->second;
+        queue_.erase(lowest);
+        return victim;
+    }
+
+ private:
+    double inflation_ = 0;
+    std::multimap<double, immutable_cache_record*> queue_;
+};
+
+} // namespace
+
+std::unique_ptr<eviction_policy>
+make_eviction_policy(immutable_cache_config const& config)
+{
+    switch (config.eviction_policy)
+    {
+        case immutable_cache_eviction_policy::LRU:
+        default:
+            return std::make_unique<lru_eviction_policy>();
+        case immutable_cache_eviction_policy::CLOCK:
+            return std::make_unique<clock_eviction_policy>();
+        case immutable_cache_eviction_policy::TWO_Q:
+            // As suggested in the 2Q paper, the FIFO queue gets a quarter of
+            // the (per-shard) space.
+            return std::make_unique<two_q_eviction_policy>(
+                config.unused_size_limit
+                / std::max<size_t>(config.shard_count, 1) / 4);
+        case immutable_cache_eviction_policy::GREEDY_DUAL_SIZE:
+            return std::make_unique<greedy_dual_size_eviction_policy>();
+    }
+}
+
+} // namespace detail
+} // namespace cradle
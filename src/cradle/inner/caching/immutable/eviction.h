@@ -0,0 +1,116 @@
+#ifndef CRADLE_INNER_CACHING_IMMUTABLE_EVICTION_H
+#define CRADLE_INNER_CACHING_IMMUTABLE_EVICTION_H
+
+#include <chrono>
+#include <list>
+#include <map>
+#include <memory>
+
+#include <cradle/inner/caching/immutable/cache.h>
+
+// This file provides the eviction policies that decide which unused records
+// are evicted first when the immutable cache needs to reclaim memory.
+//
+// A policy only evicts records that are no longer in use (i.e., whose
+// :ref_count is 0). Records that are in use are never evicted (although a
+// policy may keep track of them).
+//
+// All policy operations are performed while holding the mutex of the shard
+// that owns the policy.
+
+namespace cradle {
+namespace detail {
+
+struct immutable_cache_record;
+
+// eviction_hook is the per-record bookkeeping that's maintained by the
+// eviction policies. Each policy only uses the fields that it needs.
+struct eviction_hook
+{
+    // Is the record currently pending eviction?
+    bool pending = false;
+
+    // Has the record been accessed since the policy last looked at it?
+    // (This is the CLOCK reference bit.)
+    bool referenced = false;
+
+    // Has the record been accessed more than once? (This determines which
+    // queue it goes into under 2Q.)
+    bool frequently_used = false;
+
+    // Is the record in the policy's secondary queue? (This is only used by
+    // 2Q, where a record can become frequently used while it's still sitting
+    // in the primary queue.)
+    bool in_secondary_queue = false;
+
+    // Is the record in the policy's queue? (This is only used by CLOCK, which
+    // leaves records in place while they're in use.)
+    bool queued = false;
+
+    // the size that the policy accounted for when it queued the record
+    size_t queued_size = 0;
+
+    // the record's position in its policy's queue (for list-based policies)
+    std::list<immutable_cache_record*>::iterator queue_position;
+
+    // the record's position in the priority queue (for GreedyDual-Size)
+    std::multimap<double, immutable_cache_record*>::iterator
+        priority_position;
+};
+
+struct eviction_policy
+{
+    virtual ~eviction_policy() = default;
+
+    // Called whenever an existing record is acquired.
+    virtual void
+    on_access(immutable_cache_record* record)
+    {
+    }
+
+    // Add a record to the set of records pending eviction.
+    virtual void
+    add(immutable_cache_record* record)
+        = 0;
+
+    // Remove a record from the set of records pending eviction (because it's
+    // in use again).
+    virtual void
+    remove(immutable_cache_record* record)
+        = 0;
+
+    // Called when a record is removed from the cache entirely (other than
+    // via pop_victim()). The record isn't pending eviction, but the policy
+    // may still be tracking it.
+    virtual void
+    forget(immutable_cache_record* record)
+    {
+    }
+
+    // Is the set of records pending eviction empty?
+    virtual bool
+    empty() const = 0;
+
+    // Select the next record to be evicted and remove it from the set.
+    // The set must not be empty.
+    virtual immutable_cache_record*
+    pop_victim()
+        = 0;
+
+    // Get the total size of the records pending eviction, as accounted for
+    // by the policy. (This is only tracked by policies that need it.)
+    virtual size_t
+    queued_size() const
+    {
+        return 0;
+    }
+};
+
+// Create an eviction policy for one shard of a cache with the given config.
+std::unique_ptr<eviction_policy>
+make_eviction_policy(immutable_cache_config const& config);
+
+} // namespace detail
+} // namespace cradle
+
+#endif
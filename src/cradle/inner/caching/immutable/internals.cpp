@@ -1,5 +1,6 @@
 #include <cradle/inner/caching/immutable/internals.h>
 
+#include <algorithm>
 #include <mutex>
 
 #include <cradle/inner/utilities/text.h>
@@ -8,19 +9,147 @@ namespace cradle {
 
 namespace detail {
 
+immutable_cache::immutable_cache(immutable_cache_config config)
+    : config(std::move(config))
+{
+    size_t shard_count = std::max<size_t>(this->config.shard_count, 1);
+    shards.reserve(shard_count);
+    for (size_t i = 0; i != shard_count; ++i)
+    {
+        auto shard = std::make_unique<immutable_cache_shard>();
+        shard->eviction = make_eviction_policy(this->config);
+        shards.push_back(std::move(shard));
+    }
+}
+
+immutable_cache_shard&
+get_shard(immutable_cache& cache, id_interface const& key)
+{
+    if (cache.shards.size() == 1)
+        return *cache.shards.front();
+    // Many IDs hash trivially (e.g., integers hash to themselves), so mix the
+    // bits before selecting a shard. Otherwise, all keys in a shard would
+    // share the same low bits, which would also degrade the distribution of
+    // the shard's own hash table.
+    uint64_t mixed = uint64_t(key.hash()) * 0x9e37'79b9'7f4a'7c15;
+    return *cache.shards[(mixed >> 32) % cache.shards.size()];
+}
+
+void
+set_record_state(
+    immutable_cache& cache,
+    immutable_cache_record& record,
+    immutable_cache_entry_state state)
+{
+    auto old_state = record.state.exchange(state, std::memory_order_relaxed);
+    --cache.state_counts[static_cast<size_t>(old_state)];
+    ++cache.state_counts[static_cast<size_t>(state)];
+}
+
+void
+remove_record(
+    immutable_cache& cache,
+    immutable_cache_shard& shard,
+    immutable_cache_record& record)
+{
+    --cache.state_counts[static_cast<size_t>(
+        record.state.load(std::memory_order_relaxed))];
+    cache.total_size -= record.size;
+    shard.eviction->forget(&record);
+    shard.records.erase(&*record.key);
+}
+
+namespace {
+
+// what's left of an evicted record whose eviction handler still needs to be
+// called
+struct evicted_record
+{
+    captured_id key;
+    std::any task;
+    immutable_cache_eviction_handler handler;
+};
+
+// Evict the entry in :shard that its eviction policy chooses. If it has an
+// eviction handler, what the handler needs is added to :evicted.
+// The shard mutex must be held by the caller.
+void
+evict_one_entry(
+    immutable_cache& cache,
+    immutable_cache_shard& shard,
+    std::vector<evicted_record>& evicted)
+{
+    auto* record = shard.eviction->pop_victim();
+    record->eviction.pending = false;
+    --cache.pending_eviction_count;
+    auto data_size = record->size;
+    shard.unused_size -= data_size;
+    cache.unused_size -= data_size;
+    if (record->eviction_handler
+        && record->state.load(std::memory_order_relaxed)
+               == immutable_cache_entry_state::READY)
+    {
+        evicted.push_back(evicted_record{
+            captured_id(*record->key),
+            std::move(record->task),
+            std::move(record->eviction_handler)});
+    }
+    remove_record(cache, shard, *record);
+}
+
+} // namespace
+
 void
 reduce_memory_cache_size(immutable_cache& cache, uint64_t desired_size)
 {
-    std::scoped_lock<std::mutex> lock(cache.mutex);
-    while (!cache.eviction_list.records.empty()
-           && cache.eviction_list.total_size > desired_size)
+    size_t const shard_count = cache.shards.size();
+    size_t const start = cache.eviction_cursor++;
+    std::vector<evicted_record> evicted;
+    bool made_progress = true;
+    while (cache.unused_size.load() > desired_size && made_progress)
+    {
+        made_progress = false;
+        for (size_t i = 0; i != shard_count; ++i)
+        {
+            auto& shard = *cache.shards[(start + i) % shard_count];
+            std::scoped_lock<std::mutex> lock(shard.mutex);
+            if (cache.unused_size.load() <= desired_size)
+                break;
+            if (!shard.eviction->empty())
+            {
+                evict_one_entry(cache, shard, evicted);
+                made_progress = true;
+            }
+        }
+    }
+    for (auto& record : evicted)
+        record.handler(*record.key, record.task);
+}
+
+bool
+is_over_total_size_limit(immutable_cache const& cache)
+{
+    return cache.config.total_size_limit
+           && cache.total_size.load() > *cache.config.total_size_limit;
+}
+
+void
+enforce_memory_cache_limits(immutable_cache& cache)
+{
+    uint64_t desired_size = cache.config.unused_size_limit;
+    if (is_over_total_size_limit(cache))
     {
-        auto const& record = cache.eviction_list.records.front();
-        auto data_size = record->size;
-        cache.records.erase(&*record->key);
-        cache.eviction_list.records.pop_front();
-        cache.eviction_list.total_size -= data_size;
+        ++cache.over_limit_count;
+        // Reduce the unused entries by (at least) the amount that we're over.
+        size_t excess = cache.total_size.load()
+                        - std::min(
+                            cache.total_size.load(),
+                            *cache.config.total_size_limit);
+        size_t unused_size = cache.unused_size.load();
+        desired_size = std::min<uint64_t>(
+            desired_size, unused_size > excess ? unused_size - excess : 0);
     }
+    reduce_memory_cache_size(cache, desired_size);
 }
 
 } // namespace detail
@@ -3,13 +3,17 @@
 
 #include <any>
 #include <atomic>
-#include <list>
+#include <chrono>
+#include <functional>
 #include <mutex>
 #include <unordered_map>
+#include <vector>
 
 #include <boost/core/noncopyable.hpp>
+#include <cppcoro/cancellation_source.hpp>
 
 #include <cradle/inner/caching/immutable/cache.h>
+#include <cradle/inner/caching/immutable/eviction.h>
 
 namespace cradle {
 
@@ -18,26 +22,33 @@ struct immutable_cache_entry_watcher;
 namespace detail {
 
 struct immutable_cache;
+struct immutable_cache_shard;
+
+// a function that's called with the key and task of a READY record when the
+// cache evicts it
+typedef std::function<void(id_interface const& key, std::any const& task)>
+    immutable_cache_eviction_handler;
 
 struct immutable_cache_record
 {
     // These remain constant for the life of the record.
     immutable_cache* owner_cache;
+    immutable_cache_shard* owner_shard;
     captured_id key;
 
-    // All of the following fields are protected by the cache mutex. The only
+    // All of the following fields are protected by the shard mutex. The only
     // exception is that the :state and :progress fields can be polled for
     // informational purposes. However, before accessing any other fields based
     // on the value of :state, you should acquire the mutex and recheck state.
 
     // This is a count of how many active pointers reference this data.
     // If this is 0, the data is no longer actively in use and is queued for
-    // eviction. In this case, :eviction_list_iterator points to this record's
-    // entry in the eviction list.
+    // eviction. In this case, :eviction.pending is true and the shard's
+    // eviction policy is tracking the record.
     unsigned ref_count = 0;
 
     // (See :ref_count comment.)
-    std::list<immutable_cache_record*>::iterator eviction_list_iterator;
+    eviction_hook eviction;
 
     // Is the data ready?
     std::atomic<immutable_cache_entry_state> state
@@ -48,8 +59,35 @@ struct immutable_cache_record
     // of data associated with this record.
     std::any task;
 
+    // the source of the cancellation token that :task was created with - If
+    // :ref_count drops to 0 while the record is still LOADING, nobody is
+    // waiting for the data anymore, so the record is dropped and this is
+    // used to cancel the work that's producing it. (Each new attempt at
+    // producing the data gets a new source.)
+    cppcoro::cancellation_source cancellation;
+
     // the size of the data (if it's ready)
     std::size_t size = 0;
+
+    // how long it took to produce the data (if it's ready) - This is used as
+    // the cost of recomputing the data by cost-aware eviction policies.
+    std::chrono::steady_clock::duration compute_time{0};
+
+    // Is the record only kept while it's in use? This is the case for records
+    // that were created while the cache was over its total size limit. Such
+    // records are removed as soon as their :ref_count drops to 0 (rather than
+    // being queued for eviction).
+    bool transient = false;
+
+    // the number of consecutive times that the data has failed to compute
+    unsigned failure_count = 0;
+
+    // If the data failed, this is when it may be retried.
+    std::chrono::steady_clock::time_point retry_time;
+
+    // If this is set and the record is evicted while READY, this is called
+    // after the record has been removed (and outside of the shard mutex).
+    immutable_cache_eviction_handler eviction_handler;
 };
 
 typedef std::unordered_map<
@@ -59,28 +97,103 @@ typedef std::unordered_map<
     id_interface_pointer_equality_test>
     cache_record_map;
 
-struct cache_record_eviction_list
+// A shard holds the records for a subset of the cache's keys (as determined
+// by their hashes). All fields are protected by the shard's mutex.
+struct immutable_cache_shard : boost::noncopyable
 {
-    std::list<immutable_cache_record*> records;
-    size_t total_size;
-    cache_record_eviction_list() : total_size(0)
-    {
-    }
+    cache_record_map records;
+
+    // the policy that tracks the unused records and decides which of them to
+    // evict first
+    std::unique_ptr<eviction_policy> eviction;
+
+    // the total size of the unused records in this shard
+    size_t unused_size = 0;
+
+    std::mutex mutex;
 };
 
 struct immutable_cache : boost::noncopyable
 {
     immutable_cache_config config;
-    cache_record_map records;
-    cache_record_eviction_list eviction_list;
-    std::mutex mutex;
+
+    // the shards - These are allocated once (when the cache is created) and
+    // remain valid for the life of the cache.
+    std::vector<std::unique_ptr<immutable_cache_shard>> shards;
+
+    // the total size of the unused entries across all shards - Each shard
+    // also tracks its own total, and this is updated while holding the
+    // relevant shard's mutex.
+    std::atomic<size_t> unused_size = 0;
+
+    // where the next eviction sweep starts (so that evictions are spread
+    // evenly across the shards)
+    std::atomic<size_t> eviction_cursor = 0;
+
+    // the total size of all ready records (whether or not they're in use)
+    std::atomic<size_t> total_size = 0;
+
+    // admission control counters (see immutable_cache_admission_info)
+    std::atomic<uint64_t> admitted_count = 0;
+    std::atomic<uint64_t> bypassed_count = 0;
+    std::atomic<uint64_t> over_limit_count = 0;
+
+    // the number of records that were dropped while LOADING (and had their
+    // work cancelled)
+    std::atomic<uint64_t> cancelled_count = 0;
+
+    // the number of records in each state (indexed by
+    // immutable_cache_entry_state) - These are updated while holding the
+    // relevant shard's mutex (via set_record_state() and remove_record()).
+    std::atomic<size_t> state_counts[3] = {0, 0, 0};
+
+    // the number of records that are pending eviction
+    std::atomic<size_t> pending_eviction_count = 0;
+
+    immutable_cache(immutable_cache_config config);
 };
 
-// Evict unused entries (in LRU order) until the total size of unused entries
-// in the cache is at most :desired_size (in bytes).
+// Update the state of :record (and the cache's state counts).
+// The shard mutex must be held by the caller.
+void
+set_record_state(
+    immutable_cache& cache,
+    immutable_cache_record& record,
+    immutable_cache_entry_state state);
+
+// Remove :record from :shard (and from the cache's state counts).
+// The record must not be pending eviction.
+// The shard mutex must be held by the caller.
+void
+remove_record(
+    immutable_cache& cache,
+    immutable_cache_shard& shard,
+    immutable_cache_record& record);
+
+// Get the shard that's responsible for the given key.
+immutable_cache_shard&
+get_shard(immutable_cache& cache, id_interface const& key);
+
+// Evict unused entries until the total size of unused entries in the cache is
+// at most :desired_size (in bytes).
+//
+// Within each shard, entries are evicted in the order chosen by the
+// configured eviction policy. Across shards, the sweep visits each shard in
+// turn, so the global ordering is only approximate when the cache has more
+// than one shard.
+//
 void
 reduce_memory_cache_size(immutable_cache& cache, uint64_t desired_size);
 
+// Evict unused entries as necessary to bring the cache back within its
+// configured limits (both :unused_size_limit and :total_size_limit).
+void
+enforce_memory_cache_limits(immutable_cache& cache);
+
+// Is the cache currently over its total size limit?
+bool
+is_over_total_size_limit(immutable_cache const& cache);
+
 } // namespace detail
 } // namespace cradle
 
@@ -1,35 +1,93 @@
 #include <cradle/inner/caching/immutable/ptr.h>
 
+#include <algorithm>
+#include <cmath>
+#include <optional>
+
 #include <cradle/inner/caching/immutable/internals.h>
 
 namespace cradle {
 namespace detail {
 
+namespace {
+
+std::chrono::steady_clock::time_point
+retry_clock_now(immutable_cache_retry_policy const& policy)
+{
+    return policy.clock ? policy.clock() : std::chrono::steady_clock::now();
+}
+
+} // namespace
+
 void
 record_immutable_cache_value(
-    immutable_cache& cache, id_interface const& key, size_t size)
+    immutable_cache& cache,
+    id_interface const& key,
+    cppcoro::cancellation_token const& cancellation,
+    size_t size,
+    std::chrono::steady_clock::duration compute_time)
 {
-    std::scoped_lock<std::mutex> lock(cache.mutex);
-    cache_record_map::iterator i = cache.records.find(&key);
-    if (i != cache.records.end())
+    auto& shard = get_shard(cache, key);
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    if (cancellation.is_cancellation_requested())
+        return;
+    cache_record_map::iterator i = shard.records.find(&key);
+    // (The record may already be READY if it was dropped and recreated just
+    // before the old task's cancellation was requested.)
+    if (i != shard.records.end()
+        && i->second->state.load(std::memory_order_relaxed)
+               == immutable_cache_entry_state::LOADING)
     {
         immutable_cache_record& record = *i->second;
-        record.state.store(
-            immutable_cache_entry_state::READY, std::memory_order_relaxed);
+        set_record_state(cache, record, immutable_cache_entry_state::READY);
+        // A success ends any run of consecutive failures.
+        record.failure_count = 0;
         record.size = size;
+        record.compute_time = compute_time;
+        cache.total_size += size;
+        // If nobody is interested in the record anymore, it's already pending
+        // eviction, so its size has to be accounted for there.
+        if (record.eviction.pending)
+        {
+            shard.unused_size += size;
+            cache.unused_size += size;
+        }
+    }
+    else
+    {
+        return;
     }
+    lock.unlock();
+    // The new value may have pushed the cache over one of its limits.
+    enforce_memory_cache_limits(cache);
 }
 
 void
-record_immutable_cache_failure(immutable_cache& cache, id_interface const& key)
+record_immutable_cache_failure(
+    immutable_cache& cache,
+    id_interface const& key,
+    cppcoro::cancellation_token const& cancellation)
 {
-    std::scoped_lock<std::mutex> lock(cache.mutex);
-    cache_record_map::iterator i = cache.records.find(&key);
-    if (i != cache.records.end())
+    auto& shard = get_shard(cache, key);
+    std::scoped_lock<std::mutex> lock(shard.mutex);
+    if (cancellation.is_cancellation_requested())
+        return;
+    cache_record_map::iterator i = shard.records.find(&key);
+    if (i != shard.records.end()
+        && i->second->state.load(std::memory_order_relaxed)
+               == immutable_cache_entry_state::LOADING)
     {
         immutable_cache_record& record = *i->second;
-        record.state.store(
-            immutable_cache_entry_state::FAILED, std::memory_order_relaxed);
+        set_record_state(cache, record, immutable_cache_entry_state::FAILED);
+        // Determine how long the failure should be cached.
+        auto const& policy = cache.config.retry_policy;
+        double delay = std::min(
+            double(policy.initial_delay.count())
+                * std::pow(policy.backoff_factor, record.failure_count),
+            double(policy.max_delay.count()));
+        ++record.failure_count;
+        record.retry_time = retry_clock_now(policy)
+                            + std::chrono::milliseconds(int64_t(delay));
     }
 }
 
@@ -37,31 +95,42 @@ namespace {
 
 void
 remove_from_eviction_list(
-    immutable_cache& cache, immutable_cache_record* record)
+    immutable_cache& cache,
+    immutable_cache_shard& shard,
+    immutable_cache_record* record)
 {
-    auto& list = cache.eviction_list;
-    assert(record->eviction_list_iterator != list.records.end());
-    list.records.erase(record->eviction_list_iterator);
-    record->eviction_list_iterator = list.records.end();
-    if (record->state.load(std::memory_order_relaxed)
-        == immutable_cache_entry_state::READY)
-    {
-        list.total_size -= record->size;
-    }
+    assert(record->eviction.pending);
+    shard.eviction->remove(record);
+    record->eviction.pending = false;
+    --cache.pending_eviction_count;
+    shard.unused_size -= record->size;
+    cache.unused_size -= record->size;
 }
 
 void
 acquire_cache_record_no_lock(immutable_cache_record* record)
 {
     ++record->ref_count;
-    auto& evictions = record->owner_cache->eviction_list.records;
-    if (record->eviction_list_iterator != evictions.end())
+    auto& shard = *record->owner_shard;
+    if (record->eviction.pending)
     {
         assert(record->ref_count == 1);
-        remove_from_eviction_list(*record->owner_cache, record);
+        remove_from_eviction_list(*record->owner_cache, shard, record);
     }
 }
 
+// Is it time to retry a record that failed?
+// If not, the record's task (which rethrows the failure) is reused as is.
+bool
+is_retry_allowed(
+    immutable_cache_retry_policy const& policy,
+    immutable_cache_record const& record)
+{
+    if (policy.max_attempts && record.failure_count >= *policy.max_attempts)
+        return false;
+    return retry_clock_now(policy) >= record.retry_time;
+}
+
 // create_task() is called with a key that will live until the task has run.
 // `key` may not live long enough.
 immutable_cache_record*
@@ -69,28 +138,46 @@ acquire_cache_record(
     immutable_cache& cache,
     id_interface const& key,
     function_view<std::any(
-        immutable_cache& cache, id_interface const& key)> const& create_task)
+        immutable_cache& cache,
+        id_interface const& key,
+        cppcoro::cancellation_token cancellation)> const& create_task)
 {
-    std::scoped_lock<std::mutex> lock(cache.mutex);
-    cache_record_map::iterator i = cache.records.find(&key);
-    if (i == cache.records.end())
+    // If the cache is over its total size limit, try to make room before
+    // (possibly) adding a new record.
+    if (is_over_total_size_limit(cache))
+        enforce_memory_cache_limits(cache);
+
+    auto& shard = get_shard(cache, key);
+    std::scoped_lock<std::mutex> lock(shard.mutex);
+    cache_record_map::iterator i = shard.records.find(&key);
+    if (i == shard.records.end())
     {
         auto record = std::make_unique<immutable_cache_record>();
         record->owner_cache = &cache;
-        record->eviction_list_iterator = cache.eviction_list.records.end();
+        record->owner_shard = &shard;
         record->key.capture(key);
         record->ref_count = 0;
-        record->task = create_task(cache, *(record->key));
-        i = cache.records.emplace(&*record->key, std::move(record)).first;
+        record->transient = is_over_total_size_limit(cache);
+        ++(record->transient ? cache.bypassed_count : cache.admitted_count);
+        record->task = create_task(
+            cache, *(record->key), record->cancellation.token());
+        ++cache.state_counts[static_cast<size_t>(
+            immutable_cache_entry_state::LOADING)];
+        i = shard.records.emplace(&*record->key, std::move(record)).first;
+    }
+    else
+    {
+        shard.eviction->on_access(i->second.get());
     }
     immutable_cache_record* record = i->second.get();
-    // TODO: Better (optional) retry logic.
     if (record->state.load(std::memory_order_relaxed)
-        == immutable_cache_entry_state::FAILED)
+            == immutable_cache_entry_state::FAILED
+        && is_retry_allowed(cache.config.retry_policy, *record))
     {
-        record->task = create_task(cache, *(record->key));
-        record->state.store(
-            immutable_cache_entry_state::LOADING, std::memory_order_relaxed);
+        record->cancellation = cppcoro::cancellation_source();
+        record->task = create_task(
+            cache, *(record->key), record->cancellation.token());
+        set_record_state(cache, *record, immutable_cache_entry_state::LOADING);
     }
     acquire_cache_record_no_lock(record);
     return record;
@@ -99,37 +186,65 @@ acquire_cache_record(
 void
 acquire_cache_record(immutable_cache_record* record)
 {
-    std::scoped_lock<std::mutex> lock(record->owner_cache->mutex);
+    std::scoped_lock<std::mutex> lock(record->owner_shard->mutex);
     acquire_cache_record_no_lock(record);
 }
 
 void
-add_to_eviction_list(immutable_cache& cache, immutable_cache_record* record)
+add_to_eviction_list(
+    immutable_cache& cache,
+    immutable_cache_shard& shard,
+    immutable_cache_record* record)
 {
-    auto& list = cache.eviction_list;
-    assert(record->eviction_list_iterator == list.records.end());
-    record->eviction_list_iterator
-        = list.records.insert(list.records.end(), record);
-    list.total_size += record->size;
+    assert(!record->eviction.pending);
+    shard.eviction->add(record);
+    record->eviction.pending = true;
+    ++cache.pending_eviction_count;
+    shard.unused_size += record->size;
+    cache.unused_size += record->size;
 }
 
 void
 release_cache_record(immutable_cache_record* record)
 {
     auto& cache = *record->owner_cache;
+    auto& shard = *record->owner_shard;
     bool do_lru_eviction = false;
+    std::optional<cppcoro::cancellation_source> abandoned_work;
     {
-        std::scoped_lock<std::mutex> lock(cache.mutex);
+        std::scoped_lock<std::mutex> lock(shard.mutex);
         --record->ref_count;
         if (record->ref_count == 0)
         {
-            add_to_eviction_list(cache, record);
-            do_lru_eviction = true;
+            if (record->state.load(std::memory_order_relaxed)
+                == immutable_cache_entry_state::LOADING)
+            {
+                // Nobody is waiting for the data anymore, so there's no
+                // point in finishing it.
+                abandoned_work = record->cancellation;
+                remove_record(cache, shard, *record);
+                ++cache.cancelled_count;
+            }
+            else if (record->transient)
+            {
+                remove_record(cache, shard, *record);
+            }
+            else
+            {
+                add_to_eviction_list(cache, shard, record);
+                do_lru_eviction = true;
+            }
         }
     }
+    // This is done outside the lock since cancelling the work may release
+    // other records (that the work was waiting for).
+    if (abandoned_work)
+    {
+        abandoned_work->request_cancellation();
+    }
     if (do_lru_eviction)
     {
-        reduce_memory_cache_size(cache, cache.config.unused_size_limit);
+        enforce_memory_cache_limits(cache);
     }
 }
 
@@ -153,12 +268,23 @@ untyped_immutable_cache_ptr::acquire(
     cradle::immutable_cache& cache,
     id_interface const& key,
     function_view<std::any(
-        immutable_cache& cache, id_interface const& key)> const& create_task)
+        immutable_cache& cache,
+        id_interface const& key,
+        cppcoro::cancellation_token cancellation)> const& create_task)
 {
     record_ = detail::acquire_cache_record(*cache.impl, key, create_task);
     key_.capture(key);
 }
 
+void
+untyped_immutable_cache_ptr::set_eviction_handler(
+    immutable_cache_eviction_handler handler)
+{
+    std::scoped_lock<std::mutex> lock(record_->owner_shard->mutex);
+    if (!record_->eviction_handler)
+        record_->eviction_handler = std::move(handler);
+}
+
 void
 untyped_immutable_cache_ptr::copy(untyped_immutable_cache_ptr const& other)
 {
@@ -1,6 +1,11 @@
 #ifndef CRADLE_INNER_CACHING_IMMUTABLE_PTR_H
 #define CRADLE_INNER_CACHING_IMMUTABLE_PTR_H
 
+#include <chrono>
+#include <functional>
+#include <type_traits>
+
+#include <cppcoro/cancellation_token.hpp>
 #include <cppcoro/shared_task.hpp>
 
 #include <cradle/inner/caching/immutable/cache.h>
@@ -62,9 +67,10 @@ struct untyped_immutable_cache_ptr
     reset(
         cradle::immutable_cache& cache,
         id_interface const& key,
-        function_view<
-            std::any(immutable_cache& cache, id_interface const& key)> const&
-            create_task)
+        function_view<std::any(
+            immutable_cache& cache,
+            id_interface const& key,
+            cppcoro::cancellation_token cancellation)> const& create_task)
     {
         this->reset();
         acquire(cache, key, create_task);
@@ -91,6 +97,11 @@ struct untyped_immutable_cache_ptr
         return record_;
     }
 
+    // Set the function that's called if the entry is evicted while it's
+    // READY. If the entry already has such a function, this does nothing.
+    void
+    set_eviction_handler(immutable_cache_eviction_handler handler);
+
  private:
     void
     copy(untyped_immutable_cache_ptr const& other);
@@ -102,9 +113,10 @@ struct untyped_immutable_cache_ptr
     acquire(
         cradle::immutable_cache& cache,
         id_interface const& key,
-        function_view<
-            std::any(immutable_cache& cache, id_interface const& key)> const&
-            create_task);
+        function_view<std::any(
+            immutable_cache& cache,
+            id_interface const& key,
+            cppcoro::cancellation_token cancellation)> const& create_task);
 
     // the key of the entry
     captured_id key_;
@@ -113,40 +125,78 @@ struct untyped_immutable_cache_ptr
     detail::immutable_cache_record* record_ = nullptr;
 };
 
+// Record the outcome of a task that was created with :cancellation.
+// (If :cancellation has been requested, the task's record has already been
+// dropped, so these do nothing.)
+
 void
 record_immutable_cache_value(
-    immutable_cache& cache, id_interface const& key, size_t size);
+    immutable_cache& cache,
+    id_interface const& key,
+    cppcoro::cancellation_token const& cancellation,
+    size_t size,
+    std::chrono::steady_clock::duration compute_time);
 
 void
 record_immutable_cache_failure(
-    immutable_cache& cache, id_interface const& key);
+    immutable_cache& cache,
+    id_interface const& key,
+    cppcoro::cancellation_token const& cancellation);
 
 template<class Value>
 cppcoro::shared_task<Value>
 cache_task_wrapper(
-    immutable_cache& cache, captured_id key, cppcoro::task<Value> task)
+    immutable_cache& cache,
+    captured_id key,
+    cppcoro::cancellation_token cancellation,
+    cppcoro::task<Value> task)
 {
     try
     {
+        auto start_time = std::chrono::steady_clock::now();
         Value value = co_await task;
-        record_immutable_cache_value(cache, *key, deep_sizeof(value));
+        record_immutable_cache_value(
+            cache,
+            *key,
+            cancellation,
+            deep_sizeof(value),
+            std::chrono::steady_clock::now() - start_time);
         co_return value;
     }
     catch (...)
     {
-        record_immutable_cache_failure(cache, *key);
+        record_immutable_cache_failure(cache, *key, cancellation);
         throw;
     }
 }
 
+// The task creator can optionally take a cancellation token (after the key).
+// If it does, it's passed the token that's cancelled when nobody is waiting
+// for the entry anymore.
 template<class Value, class CreateTask>
 auto
 wrap_task_creator(CreateTask&& create_task)
 {
     return [create_task = std::forward<CreateTask>(create_task)](
-               immutable_cache& cache, id_interface const& key) {
-        return cache_task_wrapper<Value>(
-            cache, captured_id{key}, create_task(key));
+               immutable_cache& cache,
+               id_interface const& key,
+               cppcoro::cancellation_token cancellation) {
+        if constexpr (std::is_invocable_v<
+                          std::decay_t<CreateTask> const&,
+                          id_interface const&,
+                          cppcoro::cancellation_token>)
+        {
+            return cache_task_wrapper<Value>(
+                cache,
+                captured_id{key},
+                cancellation,
+                create_task(key, cancellation));
+        }
+        else
+        {
+            return cache_task_wrapper<Value>(
+                cache, captured_id{key}, cancellation, create_task(key));
+        }
     };
 }
 
@@ -160,6 +210,10 @@ wrap_task_creator(CreateTask&& create_task)
 //
 // This is a polling-based approach to observing a cache value.
 //
+// If all the pointers to an entry are released while it's still loading,
+// the entry is dropped, and the cancellation token that was passed to its
+// task creator is cancelled (so that the work can stop early).
+//
 template<class T>
 struct immutable_cache_ptr
 {
@@ -256,6 +310,24 @@ struct immutable_cache_ptr
         return untyped_.key();
     }
 
+    // Set the function that's called (with the entry's key and task) if the
+    // entry is evicted while it's ready. This gives the caller a chance to
+    // keep the value in some other form. If the entry already has such a
+    // function, this does nothing.
+    void
+    on_eviction(
+        std::function<void(
+            id_interface const& key, cppcoro::shared_task<T> const& task)>
+            handler)
+    {
+        untyped_.set_eviction_handler(
+            [handler = std::move(handler)](
+                id_interface const& key, std::any const& task) {
+                handler(
+                    key, std::any_cast<cppcoro::shared_task<T> const&>(task));
+            });
+    }
+
  private:
     detail::untyped_immutable_cache_ptr untyped_;
 };
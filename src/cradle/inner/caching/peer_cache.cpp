@@ -0,0 +1,673 @@
+#include <cradle/inner/caching/peer_cache.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <mutex>
+#include <string_view>
+#include <thread>
+
+// Boost ASIO complains if we don't define this.
+#if defined(WIN32) && !defined(_WIN32_WINNT)
+#define _WIN32_WINNT 0x0601 // Windows 7
+#endif
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <cradle/inner/core/type_interfaces.h>
+#include <cradle/inner/utilities/errors.h>
+
+using std::optional;
+using std::string;
+
+namespace cradle {
+
+namespace asio = boost::asio;
+namespace beast = boost::beast;
+namespace http = boost::beast::http;
+using tcp = boost::asio::ip::tcp;
+
+// PEER RING
+
+// Compute a 64-bit hash of :s.
+// This needs to be stable across runs, platforms and builds (since all the
+// peers have to agree on it), so it's FNV-1a followed by the SplitMix64
+// finalizer.
+static uint64_t
+hash_for_ring(string const& s)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (char c : s)
+    {
+        hash ^= uint8_t(c);
+        hash *= 0x100000001b3;
+    }
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111eb;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+peer_ring::peer_ring(
+    std::vector<string> const& peers, unsigned virtual_node_count)
+{
+    for (size_t i = 0; i != peers.size(); ++i)
+    {
+        for (unsigned j = 0; j != std::max(virtual_node_count, 1u); ++j)
+        {
+            points_.emplace_back(
+                hash_for_ring(peers[i] + "#" + std::to_string(j)), i);
+        }
+    }
+    std::sort(points_.begin(), points_.end());
+}
+
+size_t
+peer_ring::get_owner(string const& key) const
+{
+    auto point = std::lower_bound(
+        points_.begin(),
+        points_.end(),
+        std::make_pair(hash_for_ring(key), size_t(0)));
+    if (point == points_.end())
+        point = points_.begin();
+    return point->second;
+}
+
+// IMPLEMENTATION
+
+struct peer_cache_impl
+{
+    peer_cache_config config;
+    peer_cache_handlers handlers;
+
+    // the current peers (initially :config.peers) and their ring, the index
+    // of this peer among them, and when each of them can be tried again
+    // after a failure - These are all protected by :mutex, since the peers
+    // can change (see peer_cache::set_peers()).
+    std::vector<string> peers;
+    peer_ring ring;
+    size_t self_index = 0;
+    std::vector<std::chrono::steady_clock::time_point> retry_times;
+    std::mutex mutex;
+
+    std::atomic<int64_t> hit_count{0};
+    std::atomic<int64_t> miss_count{0};
+    std::atomic<int64_t> store_count{0};
+    std::atomic<int64_t> failure_count{0};
+    std::atomic<int64_t> served_count{0};
+
+    // the server for requests from other peers
+    asio::io_context io;
+    tcp::acceptor acceptor{io};
+    std::vector<std::thread> threads;
+
+    peer_cache_impl(
+        peer_cache_config const& config, peer_cache_handlers handlers)
+        : config(config),
+          handlers(std::move(handlers)),
+          ring(config.peers, config.virtual_node_count)
+    {
+    }
+};
+
+// the number of threads that serve requests from other peers
+unsigned const server_thread_count = 2;
+
+// how long a connection from another peer can sit idle before it's closed
+std::chrono::seconds const server_idle_timeout{30};
+
+// the header that carries the shared secret (see peer_cache_config)
+char const secret_header[] = "X-Cradle-Peer-Secret";
+
+[[noreturn]] static void
+throw_peer_cache_failure(string const& peer, string const& message)
+{
+    CRADLE_THROW(
+        peer_cache_failure() << peer_address_info(peer)
+                             << internal_error_message_info(message));
+}
+
+// Split an address into its host and port.
+static std::pair<string, string>
+split_address(string const& address)
+{
+    auto colon = address.rfind(':');
+    if (colon == string::npos)
+        throw_peer_cache_failure(address, "peer address has no port");
+    return {address.substr(0, colon), address.substr(colon + 1)};
+}
+
+// Switch to a new list of peers.
+// The caller must hold the cache's mutex (unless nothing else can see the
+// cache yet).
+static void
+update_peers(peer_cache_impl& cache, std::vector<string> const& peers)
+{
+    auto self = std::find(peers.begin(), peers.end(), cache.config.self);
+    if (self == peers.end())
+    {
+        throw_peer_cache_failure(
+            cache.config.self,
+            "peer cache's own address isn't in its peer list");
+    }
+    cache.ring = peer_ring(peers, cache.config.virtual_node_count);
+    cache.peers = peers;
+    cache.self_index = size_t(self - peers.begin());
+    cache.retry_times.assign(
+        peers.size(), std::chrono::steady_clock::time_point());
+}
+
+static string const target_prefix = "/cache/";
+
+static string
+make_target(string const& key)
+{
+    static char const hex_digits[] = "0123456789ABCDEF";
+    string target = target_prefix;
+    for (char c : key)
+    {
+        if (std::isalnum(uint8_t(c)) || c == '-' || c == '_' || c == '.'
+            || c == '~')
+        {
+            target.push_back(c);
+        }
+        else
+        {
+            target.push_back('%');
+            target.push_back(hex_digits[uint8_t(c) >> 4]);
+            target.push_back(hex_digits[uint8_t(c) & 0xf]);
+        }
+    }
+    return target;
+}
+
+// Get the key from a request target (or none if the target isn't valid).
+static optional<string>
+parse_target(std::string_view target)
+{
+    if (!target.starts_with(target_prefix))
+        return std::nullopt;
+    target.remove_prefix(target_prefix.size());
+    string key;
+    for (size_t i = 0; i != target.size(); ++i)
+    {
+        if (target[i] != '%')
+        {
+            key.push_back(target[i]);
+            continue;
+        }
+        if (i + 2 >= target.size() || !std::isxdigit(uint8_t(target[i + 1]))
+            || !std::isxdigit(uint8_t(target[i + 2])))
+        {
+            return std::nullopt;
+        }
+        key.push_back(
+            char(std::stoi(string(target.substr(i + 1, 2)), nullptr, 16)));
+        i += 2;
+    }
+    return key;
+}
+
+// SERVER
+
+typedef http::request<http::string_body> peer_request;
+typedef http::response<http::string_body> peer_response;
+
+static peer_response
+make_response(peer_request const& request, http::status status)
+{
+    peer_response response{status, request.version()};
+    response.keep_alive(request.keep_alive());
+    response.prepare_payload();
+    return response;
+}
+
+// Does :supplied match :secret? This takes the same time no matter where
+// they differ, so that the secret can't be guessed one character at a time.
+static bool
+matches_secret(std::string_view supplied, string const& secret)
+{
+    if (supplied.size() != secret.size())
+        return false;
+    uint8_t difference = 0;
+    for (size_t i = 0; i != secret.size(); ++i)
+        difference |= uint8_t(supplied[i]) ^ uint8_t(secret[i]);
+    return difference == 0;
+}
+
+static peer_response
+handle_request(peer_cache_impl& cache, peer_request& request)
+{
+    if (!cache.config.shared_secret.empty())
+    {
+        auto secret = request[secret_header];
+        if (!matches_secret(
+                std::string_view(secret.data(), secret.size()),
+                cache.config.shared_secret))
+        {
+            return make_response(request, http::status::forbidden);
+        }
+    }
+    auto key = parse_target(
+        std::string_view(request.target().data(), request.target().size()));
+    if (!key)
+        return make_response(request, http::status::not_found);
+    ++cache.served_count;
+    try
+    {
+        switch (request.method())
+        {
+            case http::verb::get: {
+                auto value = cache.handlers.find(*key);
+                if (!value)
+                    return make_response(request, http::status::not_found);
+                auto response = make_response(request, http::status::ok);
+                response.body().assign(
+                    reinterpret_cast<char const*>(value->data()),
+                    value->size());
+                response.prepare_payload();
+                return response;
+            }
+            case http::verb::put: {
+                auto header = request["X-Cradle-Namespace"];
+                string key_namespace(header.data(), header.size());
+                cache.handlers.insert(
+                    *key,
+                    make_blob(std::move(request.body())),
+                    key_namespace);
+                return make_response(request, http::status::no_content);
+            }
+            default:
+                return make_response(
+                    request, http::status::method_not_allowed);
+        }
+    }
+    catch (...)
+    {
+        return make_response(request, http::status::internal_server_error);
+    }
+}
+
+// a connection from another peer
+struct peer_session : std::enable_shared_from_this<peer_session>
+{
+    peer_session(peer_cache_impl& cache, tcp::socket socket)
+        : cache(cache), stream(std::move(socket))
+    {
+    }
+
+    void
+    read_request()
+    {
+        parser.emplace();
+        // (A request that's too large fails, which closes the connection.)
+        parser->body_limit(cache.config.max_value_size);
+        stream.expires_after(server_idle_timeout);
+        http::async_read(
+            stream,
+            buffer,
+            *parser,
+            [self = shared_from_this()](beast::error_code error, size_t) {
+                self->on_read(error);
+            });
+    }
+
+    void
+    on_read(beast::error_code error)
+    {
+        // This includes the other peer closing the connection.
+        if (error)
+        {
+            close();
+            return;
+        }
+        auto request = parser->release();
+        response = handle_request(cache, request);
+        http::async_write(
+            stream,
+            response,
+            [self = shared_from_this()](beast::error_code error, size_t) {
+                self->on_write(error);
+            });
+    }
+
+    void
+    on_write(beast::error_code error)
+    {
+        if (error || !response.keep_alive())
+        {
+            close();
+            return;
+        }
+        read_request();
+    }
+
+    void
+    close()
+    {
+        beast::error_code ignored;
+        stream.socket().shutdown(tcp::socket::shutdown_send, ignored);
+    }
+
+    peer_cache_impl& cache;
+    beast::tcp_stream stream;
+    beast::flat_buffer buffer;
+    optional<http::request_parser<http::string_body>> parser;
+    peer_response response;
+};
+
+static void
+accept_next_connection(peer_cache_impl& cache)
+{
+    cache.acceptor.async_accept(
+        asio::make_strand(cache.io),
+        [&cache](beast::error_code error, tcp::socket socket) {
+            // This is how the acceptor reports that it's been closed.
+            if (error == asio::error::operation_aborted)
+                return;
+            if (!error)
+            {
+                std::make_shared<peer_session>(cache, std::move(socket))
+                    ->read_request();
+            }
+            accept_next_connection(cache);
+        });
+}
+
+static void
+start_server(peer_cache_impl& cache)
+{
+    auto port = split_address(cache.config.self).second;
+    tcp::endpoint endpoint(
+        asio::ip::make_address(cache.config.bind_address),
+        uint16_t(std::stoi(port)));
+    cache.acceptor.open(endpoint.protocol());
+    cache.acceptor.set_option(asio::socket_base::reuse_address(true));
+    cache.acceptor.bind(endpoint);
+    cache.acceptor.listen();
+    accept_next_connection(cache);
+    for (unsigned i = 0; i != server_thread_count; ++i)
+        cache.threads.emplace_back([&cache] { cache.io.run(); });
+}
+
+static void
+stop_server(peer_cache_impl& cache)
+{
+    cache.io.stop();
+    for (auto& thread : cache.threads)
+        thread.join();
+    cache.threads.clear();
+}
+
+// CLIENT
+
+// Send a request to :peer and wait for the response.
+// Each request gets its own connection, which keeps things simple (and
+// avoids any shared state between the threads that make requests).
+static peer_response
+send_request(peer_cache_impl& cache, string const& peer, peer_request request)
+{
+    auto [host, port] = split_address(peer);
+    request.set(http::field::host, peer);
+    if (!cache.config.shared_secret.empty())
+        request.set(secret_header, cache.config.shared_secret);
+    request.keep_alive(false);
+    request.prepare_payload();
+
+    asio::io_context io;
+    tcp::resolver resolver(io);
+    beast::tcp_stream stream(io);
+    beast::flat_buffer buffer;
+    http::response_parser<http::string_body> parser;
+    parser.body_limit(cache.config.max_value_size);
+    beast::error_code result;
+
+    // The timeout covers the whole exchange (after name resolution).
+    stream.expires_after(cache.config.request_timeout);
+    resolver.async_resolve(
+        host,
+        port,
+        [&](beast::error_code error, tcp::resolver::results_type endpoints) {
+            if (error)
+            {
+                result = error;
+                return;
+            }
+            stream.async_connect(
+                endpoints,
+                [&](beast::error_code error, tcp::endpoint const&) {
+                    if (error)
+                    {
+                        result = error;
+                        return;
+                    }
+                    http::async_write(
+                        stream,
+                        request,
+                        [&](beast::error_code error, size_t) {
+                            if (error)
+                            {
+                                result = error;
+                                return;
+                            }
+                            http::async_read(
+                                stream,
+                                buffer,
+                                parser,
+                                [&](beast::error_code error, size_t) {
+                                    result = error;
+                                });
+                        });
+                });
+        });
+    io.run();
+
+    if (result)
+        throw_peer_cache_failure(peer, result.message());
+    return parser.release();
+}
+
+// Send a request to :peer (as above), and if it fails, leave the peer alone
+// for a while.
+static peer_response
+call_peer(peer_cache_impl& cache, string const& peer, peer_request request)
+{
+    try
+    {
+        return send_request(cache, peer, std::move(request));
+    }
+    catch (...)
+    {
+        ++cache.failure_count;
+        std::scoped_lock<std::mutex> lock(cache.mutex);
+        auto const& peers = cache.peers;
+        auto index = size_t(
+            std::find(peers.begin(), peers.end(), peer) - peers.begin());
+        if (index < cache.retry_times.size())
+        {
+            cache.retry_times[index] = std::chrono::steady_clock::now()
+                                       + cache.config.retry_delay;
+        }
+        throw;
+    }
+}
+
+// API
+
+peer_cache::peer_cache()
+{
+}
+
+peer_cache::peer_cache(
+    peer_cache_config const& config, peer_cache_handlers handlers)
+{
+    reset(config, std::move(handlers));
+}
+
+peer_cache::~peer_cache()
+{
+    reset();
+}
+
+void
+peer_cache::reset(
+    peer_cache_config const& config, peer_cache_handlers handlers)
+{
+    reset();
+
+    auto self
+        = std::find(config.peers.begin(), config.peers.end(), config.self);
+    if (self == config.peers.end())
+    {
+        throw_peer_cache_failure(
+            config.self, "peer cache's own address isn't in its peer list");
+    }
+
+    // Peers on other machines could fill this one's caches with anything,
+    // so they have to know the secret.
+    boost::system::error_code error;
+    auto bind_address = asio::ip::make_address(config.bind_address, error);
+    if (error)
+    {
+        throw_peer_cache_failure(
+            config.self, "invalid bind address: " + config.bind_address);
+    }
+    if (!bind_address.is_loopback() && config.shared_secret.empty())
+    {
+        throw_peer_cache_failure(
+            config.self,
+            "peer cache needs a shared secret to listen on "
+                + config.bind_address);
+    }
+
+    auto impl = std::make_unique<peer_cache_impl>(config, std::move(handlers));
+    try
+    {
+        start_server(*impl);
+    }
+    catch (boost::system::system_error& e)
+    {
+        stop_server(*impl);
+        throw_peer_cache_failure(config.self, e.what());
+    }
+    catch (std::logic_error& e)
+    {
+        stop_server(*impl);
+        throw_peer_cache_failure(config.self, e.what());
+    }
+
+    // If the system picked the port, the other peers need to know it.
+    auto& peers = impl->config.peers;
+    if (split_address(config.self).second == "0")
+    {
+        impl->config.self
+            = split_address(config.self).first + ":"
+              + std::to_string(impl->acceptor.local_endpoint().port());
+        std::replace(
+            peers.begin(), peers.end(), config.self, impl->config.self);
+    }
+    update_peers(*impl, peers);
+
+    impl_ = std::move(impl);
+}
+
+void
+peer_cache::reset()
+{
+    if (impl_)
+    {
+        stop_server(*impl_);
+        impl_.reset();
+    }
+}
+
+string
+peer_cache::get_address()
+{
+    return impl_->config.self;
+}
+
+void
+peer_cache::set_peers(std::vector<string> const& peers)
+{
+    auto& cache = *impl_;
+    std::scoped_lock<std::mutex> lock(cache.mutex);
+    update_peers(cache, peers);
+}
+
+optional<string>
+peer_cache::get_remote_owner(string const& key)
+{
+    auto& cache = *impl_;
+    std::scoped_lock<std::mutex> lock(cache.mutex);
+    auto owner = cache.ring.get_owner(key);
+    if (owner == cache.self_index)
+        return std::nullopt;
+    if (std::chrono::steady_clock::now() < cache.retry_times[owner])
+        return std::nullopt;
+    return cache.peers[owner];
+}
+
+optional<blob>
+peer_cache::fetch(string const& peer, string const& key)
+{
+    auto& cache = *impl_;
+    auto response = call_peer(
+        cache, peer, peer_request{http::verb::get, make_target(key), 11});
+    switch (response.result())
+    {
+        case http::status::ok:
+            ++cache.hit_count;
+            return make_blob(std::move(response.body()));
+        case http::status::not_found:
+            ++cache.miss_count;
+            return std::nullopt;
+        default:
+            ++cache.failure_count;
+            throw_peer_cache_failure(
+                peer, "unexpected response: "
+                      + std::to_string(response.result_int()));
+    }
+}
+
+void
+peer_cache::store(
+    string const& peer,
+    string const& key,
+    blob const& value,
+    string const& key_namespace)
+{
+    auto& cache = *impl_;
+    peer_request request{http::verb::put, make_target(key), 11};
+    request.set("X-Cradle-Namespace", key_namespace);
+    request.body().assign(
+        reinterpret_cast<char const*>(value.data()), value.size());
+    auto response = call_peer(cache, peer, std::move(request));
+    if (response.result() != http::status::no_content)
+    {
+        ++cache.failure_count;
+        throw_peer_cache_failure(
+            peer, "unexpected response: "
+                      + std::to_string(response.result_int()));
+    }
+    ++cache.store_count;
+}
+
+peer_cache_info
+peer_cache::get_summary_info()
+{
+    auto& cache = *impl_;
+    peer_cache_info info;
+    info.hit_count = cache.hit_count;
+    info.miss_count = cache.miss_count;
+    info.store_count = cache.store_count;
+    info.failure_count = cache.failure_count;
+    info.served_count = cache.served_count;
+    return info;
+}
+
+} // namespace cradle
@@ -0,0 +1,206 @@
+#ifndef CRADLE_INNER_CACHING_PEER_CACHE_H
+#define CRADLE_INNER_CACHING_PEER_CACHE_H
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cradle/inner/core/exception.h>
+#include <cradle/inner/core/type_definitions.h>
+
+namespace cradle {
+
+// A peer cache lets a group of servers (the "peers") share the values that
+// they've cached, so that a value only has to be retrieved or computed once
+// across the whole group.
+//
+// Every key is owned by one of the peers, as determined by consistent
+// hashing (see peer_ring below), so all peers agree on where a value should
+// be without any coordination. When a peer can't find a value in its own
+// caches, it asks the key's owner, and when it computes a value for a key
+// that another peer owns, it sends the value to the owner.
+//
+// Peers talk to each other over a minimal HTTP protocol:
+//
+//   GET /cache/<key> returns the value (as the body), or 404 if the peer
+//   doesn't have it.
+//
+//   PUT /cache/<key> (with the value as the body) asks the peer to store the
+//   value. The namespace of the value (see disk_cache_namespace_config) is
+//   given by the X-Cradle-Namespace header.
+//
+// Keys are percent-encoded in the URL. If the peers share a secret (see
+// below), every request carries it in the X-Cradle-Peer-Secret header, and
+// requests without it are rejected with 403.
+//
+// The peer cache itself doesn't store anything. It serves requests from
+// other peers through the handlers that its owner provides (see below).
+
+struct peer_cache_config
+{
+    // the addresses ("host:port") of all the peers, including this one -
+    // Every peer must be given the same addresses (in any order), since keys
+    // are assigned to peers by hashing their addresses.
+    std::vector<std::string> peers;
+
+    // the address of this peer (which must appear in :peers) - The peer
+    // listens for requests on its port (on :bind_address). If the port is 0,
+    // the system picks one, and this (and the matching entry in :peers) is
+    // updated to match (see peer_cache::get_address()).
+    std::string self;
+
+    // the number of points that each peer gets on the hash ring (More points
+    // spread the keys more evenly.)
+    unsigned virtual_node_count = 64;
+
+    // how long to wait for another peer to respond to a request
+    std::chrono::milliseconds request_timeout{1000};
+
+    // After a request to another peer fails, the peer is left alone for this
+    // long. (Its keys simply aren't shared in the meantime.)
+    std::chrono::milliseconds retry_delay{10'000};
+
+    // the local address that the peer listens on - By default, only peers on
+    // the same machine can reach it. Listening on any other address (e.g.,
+    // "0.0.0.0" for all interfaces) requires a :shared_secret.
+    std::string bind_address = "127.0.0.1";
+
+    // If this is nonempty, it's sent with every request to another peer, and
+    // requests from other peers are only served if they include it. All the
+    // peers must be given the same secret.
+    std::string shared_secret = "";
+
+    // the largest value (in bytes) that this peer accepts from another peer,
+    // either as a request to store it or in response to a fetch
+    uint64_t max_value_size = 0x10'00'00'00;
+};
+
+// the handlers through which a peer cache serves requests from other peers -
+// These are called from the peer cache's own threads.
+struct peer_cache_handlers
+{
+    // Look up a value in this peer's own caches.
+    std::function<std::optional<blob>(std::string const& key)> find;
+
+    // Store a value that another peer has sent.
+    std::function<void(
+        std::string const& key,
+        blob const& value,
+        std::string const& key_namespace)>
+        insert;
+};
+
+struct peer_cache_info
+{
+    // the outcomes of the requests that this peer has made to others
+    int64_t hit_count = 0;
+    int64_t miss_count = 0;
+    int64_t store_count = 0;
+    int64_t failure_count = 0;
+
+    // the number of requests that this peer has served for others
+    int64_t served_count = 0;
+};
+
+// This exception indicates a failure to communicate with a peer (or a
+// problem with the peer cache config).
+CRADLE_DEFINE_EXCEPTION(peer_cache_failure)
+// This provides the address of the peer involved.
+CRADLE_DEFINE_ERROR_INFO(std::string, peer_address)
+// This exception also provides internal_error_message_info.
+
+// A peer ring assigns keys to peers by consistent hashing: each peer gets
+// several points on a ring of hash values, and a key belongs to the peer
+// whose point comes first at or after the key's own hash. When a peer joins
+// or leaves, only the keys next to its points change owners.
+struct peer_ring
+{
+    peer_ring(
+        std::vector<std::string> const& peers, unsigned virtual_node_count);
+
+    // Get the index (within the list of peers) of the peer that owns :key.
+    size_t
+    get_owner(std::string const& key) const;
+
+ private:
+    // (hash, peer index) pairs, sorted by hash
+    std::vector<std::pair<uint64_t, size_t>> points_;
+};
+
+struct peer_cache_impl;
+
+struct peer_cache
+{
+    // The default constructor creates an invalid peer cache that must be
+    // initialized via reset().
+    peer_cache();
+
+    // Create a peer cache that's initialized with the given config (and
+    // starts listening for requests from other peers).
+    peer_cache(peer_cache_config const& config, peer_cache_handlers handlers);
+
+    ~peer_cache();
+
+    // Reset the cache with a new config.
+    void
+    reset(peer_cache_config const& config, peer_cache_handlers handlers);
+
+    // Reset the cache to an uninitialized state (and stop listening).
+    void
+    reset();
+
+    // Is the cache initialized?
+    bool
+    is_initialized()
+    {
+        return impl_ ? true : false;
+    }
+
+    // The rest of this interface should only be used if is_initialized()
+    // returns true.
+
+    // Get the address of this peer (with the port that it's actually
+    // listening on).
+    std::string
+    get_address();
+
+    // Change the list of peers (e.g., when a peer joins or leaves the group).
+    // This peer's own address must still be in the list.
+    void
+    set_peers(std::vector<std::string> const& peers);
+
+    // Get the address of the peer that owns :key. This returns none if this
+    // peer owns it (or if the owner recently failed and is being left
+    // alone).
+    std::optional<std::string>
+    get_remote_owner(std::string const& key);
+
+    // Ask :peer for the value associated with :key. This returns none if the
+    // peer doesn't have it.
+    // This blocks until the peer responds (or the request times out), and it
+    // throws a peer_cache_failure if the request fails.
+    std::optional<blob>
+    fetch(std::string const& peer, std::string const& key);
+
+    // Send a value to :peer to store. (This blocks and throws like fetch().)
+    void
+    store(
+        std::string const& peer,
+        std::string const& key,
+        blob const& value,
+        std::string const& key_namespace = "");
+
+    peer_cache_info
+    get_summary_info();
+
+ private:
+    std::unique_ptr<peer_cache_impl> impl_;
+};
+
+} // namespace cradle
+
+#endif
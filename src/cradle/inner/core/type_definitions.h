@@ -46,6 +46,14 @@ struct blob
         return size_;
     }
 
+    // Get the shared pointer that owns the data. (This allows other blobs to
+    // share ownership of the same data without copying it.)
+    std::shared_ptr<std::byte const> const&
+    shared_data() const
+    {
+        return data_;
+    }
+
  private:
     std::shared_ptr<std::byte const> data_;
     std::size_t size_;
@@ -0,0 +1,216 @@
+#include <cradle/inner/encodings/crc32c.h>
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CRADLE_CRC32C_X86
+#include <nmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang need to be told that the hardware implementation may use
+// SSE 4.2 instructions. (Whether it actually runs is decided at runtime.)
+#if defined(__GNUC__)
+#define CRADLE_TARGET_SSE42 __attribute__((target("sse4.2")))
+#else
+#define CRADLE_TARGET_SSE42
+#endif
+
+namespace cradle {
+
+namespace {
+
+// the CRC-32C polynomial (in reversed bit order)
+uint32_t const polynomial = 0x82f63b78;
+
+// the tables for the slicing-by-8 software implementation
+typedef std::array<std::array<uint32_t, 256>, 8> crc_tables;
+
+constexpr crc_tables
+make_crc_tables()
+{
+    crc_tables tables{};
+    for (uint32_t i = 0; i != 256; ++i)
+    {
+        uint32_t crc = i;
+        for (int j = 0; j != 8; ++j)
+            crc = (crc & 1) ? (crc >> 1) ^ polynomial : crc >> 1;
+        tables[0][i] = crc;
+    }
+    for (uint32_t i = 0; i != 256; ++i)
+    {
+        for (int t = 1; t != 8; ++t)
+        {
+            tables[t][i] = (tables[t - 1][i] >> 8)
+                           ^ tables[0][tables[t - 1][i] & 0xff];
+        }
+    }
+    return tables;
+}
+
+constexpr crc_tables tables = make_crc_tables();
+
+// Note that the raw implementations below operate on the internal
+// (pre-inverted) form of the CRC.
+
+uint32_t
+raw_crc32c_software(uint8_t const* data, size_t size, uint32_t crc)
+{
+    while (size >= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        // This assumes a little-endian machine.
+        word ^= crc;
+        crc = tables[7][word & 0xff] ^ tables[6][(word >> 8) & 0xff]
+              ^ tables[5][(word >> 16) & 0xff]
+              ^ tables[4][(word >> 24) & 0xff]
+              ^ tables[3][(word >> 32) & 0xff]
+              ^ tables[2][(word >> 40) & 0xff]
+              ^ tables[1][(word >> 48) & 0xff] ^ tables[0][word >> 56];
+        data += 8;
+        size -= 8;
+    }
+    while (size != 0)
+    {
+        crc = (crc >> 8) ^ tables[0][(crc ^ *data) & 0xff];
+        ++data;
+        --size;
+    }
+    return crc;
+}
+
+#ifdef CRADLE_CRC32C_X86
+
+CRADLE_TARGET_SSE42 uint32_t
+raw_crc32c_hardware(uint8_t const* data, size_t size, uint32_t crc)
+{
+    uint64_t crc64 = crc;
+    while (size >= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = uint32_t(crc64);
+    while (size != 0)
+    {
+        crc = _mm_crc32_u8(crc, *data);
+        ++data;
+        --size;
+    }
+    return crc;
+}
+
+bool
+detect_hardware_support()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#endif
+
+// Multiply two polynomials modulo the CRC polynomial. :a must be nonzero.
+uint32_t
+multiply_mod_polynomial(uint32_t a, uint32_t b)
+{
+    uint32_t m = uint32_t(1) << 31;
+    uint32_t product = 0;
+    while (true)
+    {
+        if (a & m)
+        {
+            product ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ polynomial : b >> 1;
+    }
+    return product;
+}
+
+// Compute x^(8 * :n) modulo the CRC polynomial (i.e., the operator that
+// appends :n zero bytes to a CRC).
+uint32_t
+zero_bytes_operator(size_t n)
+{
+    // x^(2^k) for k = 0..63, starting from x^1 (which is 1 << 30 in reversed
+    // bit order)
+    static auto const powers = [] {
+        std::array<uint32_t, 64> powers{};
+        uint32_t p = uint32_t(1) << 30;
+        for (auto& power : powers)
+        {
+            power = p;
+            p = multiply_mod_polynomial(p, p);
+        }
+        return powers;
+    }();
+    // x^0
+    uint32_t result = uint32_t(1) << 31;
+    // Start at x^8 since :n is in bytes.
+    unsigned k = 3;
+    for (; n != 0; n >>= 1, ++k)
+    {
+        if (n & 1)
+            result = multiply_mod_polynomial(powers[k & 63], result);
+    }
+    return result;
+}
+
+} // namespace
+
+namespace detail {
+
+uint32_t
+crc32c_software(void const* data, size_t size, uint32_t crc)
+{
+    return ~raw_crc32c_software(
+        reinterpret_cast<uint8_t const*>(data), size, ~crc);
+}
+
+bool
+crc32c_hardware_available()
+{
+#ifdef CRADLE_CRC32C_X86
+    static bool const available = detect_hardware_support();
+    return available;
+#else
+    return false;
+#endif
+}
+
+} // namespace detail
+
+uint32_t
+crc32c(void const* data, size_t size, uint32_t crc)
+{
+#ifdef CRADLE_CRC32C_X86
+    if (detail::crc32c_hardware_available())
+    {
+        return ~raw_crc32c_hardware(
+            reinterpret_cast<uint8_t const*>(data), size, ~crc);
+    }
+#endif
+    return detail::crc32c_software(data, size, crc);
+}
+
+uint32_t
+crc32c_combine(uint32_t crc1, uint32_t crc2, size_t size2)
+{
+    return multiply_mod_polynomial(zero_bytes_operator(size2), crc1) ^ crc2;
+}
+
+} // namespace cradle
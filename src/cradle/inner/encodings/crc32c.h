@@ -0,0 +1,40 @@
+#ifndef CRADLE_INNER_ENCODINGS_CRC32C_H
+#define CRADLE_INNER_ENCODINGS_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+// This file provides CRC-32C (the Castagnoli CRC, as used by iSCSI, ext4,
+// etc.). Unlike the standard CRC-32, it has direct hardware support on x86
+// (via SSE 4.2), which is used when the CPU supports it.
+
+namespace cradle {
+
+// Compute the CRC-32C of a block of data.
+// To compute the CRC of data that's split into pieces, pass the CRC of the
+// previous pieces as :crc.
+uint32_t
+crc32c(void const* data, size_t size, uint32_t crc = 0);
+
+// Given the CRCs of two consecutive blocks of data (:crc1 and :crc2) and the
+// size of the second block, compute the CRC of the combined data.
+// This allows the CRC of a large block of data to be computed in parallel.
+uint32_t
+crc32c_combine(uint32_t crc1, uint32_t crc2, size_t size2);
+
+namespace detail {
+
+// the portable (table-driven) implementation of crc32c() - This is exposed
+// for testing purposes.
+uint32_t
+crc32c_software(void const* data, size_t size, uint32_t crc);
+
+// Is the hardware implementation available on this machine?
+bool
+crc32c_hardware_available();
+
+} // namespace detail
+
+} // namespace cradle
+
+#endif
@@ -1,8 +1,14 @@
 #include <cradle/inner/encodings/lz4.h>
 
+#include <algorithm>
+#include <cstring>
+
 #include <boost/numeric/conversion/cast.hpp>
 
 #include <lz4.h>
+#include <lz4frame.h>
+
+#include <cradle/inner/utilities/errors.h>
 
 namespace cradle {
 
@@ -44,6 +50,185 @@ decompress(void* dst, size_t dst_size, void const* src, size_t src_size)
     }
 }
 
+namespace {
+
+// Check the result of an LZ4F function, throwing an lz4_error if it's an
+// error code.
+size_t
+check_frame_result(size_t result)
+{
+    if (LZ4F_isError(result))
+    {
+        CRADLE_THROW(
+            lz4_error()
+            << internal_error_message_info(LZ4F_getErrorName(result)));
+    }
+    return result;
+}
+
+} // namespace
+
+bool
+is_frame(void const* src, size_t src_size)
+{
+    // the frame magic number (0x184D2204), little-endian
+    static unsigned char const magic[] = {0x04, 0x22, 0x4d, 0x18};
+    return src_size >= sizeof(magic)
+           && std::memcmp(src, magic, sizeof(magic)) == 0;
+}
+
+struct frame_compressor_impl
+{
+    LZ4F_cctx* context = nullptr;
+    LZ4F_preferences_t preferences;
+
+    frame_compressor::output_function output;
+
+    // the buffer that compressed data is staged in before it's passed to
+    // :output - This is big enough for the output from compressing
+    // :frame_chunk_size bytes.
+    std::unique_ptr<std::byte[]> buffer;
+    size_t buffer_size = 0;
+
+    size_t compressed_size = 0;
+    bool finished = false;
+
+    ~frame_compressor_impl()
+    {
+        LZ4F_freeCompressionContext(context);
+    }
+};
+
+namespace {
+
+void
+emit_buffer(frame_compressor_impl& compressor, size_t size)
+{
+    if (size != 0)
+    {
+        compressor.output(compressor.buffer.get(), size);
+        compressor.compressed_size += size;
+    }
+}
+
+} // namespace
+
+frame_compressor::frame_compressor(
+    output_function output, std::optional<size_t> content_size)
+    : impl_(std::make_unique<frame_compressor_impl>())
+{
+    auto& compressor = *impl_;
+    check_frame_result(
+        LZ4F_createCompressionContext(&compressor.context, LZ4F_VERSION));
+    std::memset(&compressor.preferences, 0, sizeof(LZ4F_preferences_t));
+    if (content_size)
+        compressor.preferences.frameInfo.contentSize = *content_size;
+    compressor.output = std::move(output);
+    compressor.buffer_size = std::max(
+        LZ4F_compressBound(frame_chunk_size, &compressor.preferences),
+        size_t(LZ4F_HEADER_SIZE_MAX));
+    compressor.buffer.reset(new std::byte[compressor.buffer_size]);
+    emit_buffer(
+        compressor,
+        check_frame_result(LZ4F_compressBegin(
+            compressor.context,
+            compressor.buffer.get(),
+            compressor.buffer_size,
+            &compressor.preferences)));
+}
+
+frame_compressor::~frame_compressor()
+{
+}
+
+void
+frame_compressor::write(void const* src, size_t src_size)
+{
+    auto& compressor = *impl_;
+    auto data = reinterpret_cast<std::byte const*>(src);
+    while (src_size != 0)
+    {
+        size_t chunk_size = std::min(src_size, frame_chunk_size);
+        emit_buffer(
+            compressor,
+            check_frame_result(LZ4F_compressUpdate(
+                compressor.context,
+                compressor.buffer.get(),
+                compressor.buffer_size,
+                data,
+                chunk_size,
+                nullptr)));
+        data += chunk_size;
+        src_size -= chunk_size;
+    }
+}
+
+void
+frame_compressor::finish()
+{
+    auto& compressor = *impl_;
+    if (compressor.finished)
+        return;
+    emit_buffer(
+        compressor,
+        check_frame_result(LZ4F_compressEnd(
+            compressor.context,
+            compressor.buffer.get(),
+            compressor.buffer_size,
+            nullptr)));
+    compressor.finished = true;
+}
+
+size_t
+frame_compressor::compressed_size() const
+{
+    return impl_->compressed_size;
+}
+
+void
+decompress_frame(void* dst, size_t dst_size, void const* src, size_t src_size)
+{
+    LZ4F_dctx* context;
+    check_frame_result(
+        LZ4F_createDecompressionContext(&context, LZ4F_VERSION));
+    std::unique_ptr<LZ4F_dctx, decltype(&LZ4F_freeDecompressionContext)>
+        context_owner(context, &LZ4F_freeDecompressionContext);
+
+    auto out = reinterpret_cast<std::byte*>(dst);
+    auto const out_end = out + dst_size;
+    auto in = reinterpret_cast<std::byte const*>(src);
+    auto const in_end = in + src_size;
+    while (true)
+    {
+        // Feed the input in chunks. LZ4F decompresses straight into :dst
+        // when there's room for a whole block, so this doesn't need any
+        // buffering of our own.
+        size_t in_size = std::min(size_t(in_end - in), frame_chunk_size);
+        size_t out_size = size_t(out_end - out);
+        size_t hint = check_frame_result(LZ4F_decompress(
+            context, out, &out_size, in, &in_size, nullptr));
+        in += in_size;
+        out += out_size;
+        // A hint of 0 means that the frame is complete.
+        if (hint == 0)
+            break;
+        // If no progress was made, either the input is truncated or the
+        // output is too small.
+        if (in_size == 0 && out_size == 0)
+        {
+            CRADLE_THROW(
+                lz4_error() << internal_error_message_info(
+                    "LZ4 frame doesn't match expected size"));
+        }
+    }
+    if (out != out_end)
+    {
+        CRADLE_THROW(
+            lz4_error() << internal_error_message_info(
+                "LZ4 frame doesn't match expected size"));
+    }
+}
+
 } // namespace lz4
 
 } // namespace cradle
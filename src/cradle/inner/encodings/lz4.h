@@ -1,6 +1,10 @@
 #ifndef CRADLE_INNER_ENCODINGS_LZ4_HPP
 #define CRADLE_INNER_ENCODINGS_LZ4_HPP
 
+#include <functional>
+#include <memory>
+#include <optional>
+
 #include <cradle/inner/core/exception.h>
 #include <cradle/inner/fs/types.h>
 
@@ -25,6 +29,62 @@ compress(void* dst, size_t dst_size, void const* src, size_t src_size);
 void
 decompress(void* dst, size_t dst_size, void const* src, size_t src_size);
 
+// The functions above work on single blocks of data, which means that both
+// the compressed and decompressed forms have to be in memory in their
+// entirety. The LZ4 frame format allows data to be compressed and
+// decompressed in pieces, so that memory usage is bounded by the size of the
+// pieces rather than the size of the data.
+
+// the size of the pieces that the frame functions below work in
+size_t const frame_chunk_size = 0x10'00'00;
+
+// Does :src (which is :src_size bytes long) start with an LZ4 frame header?
+// (Data compressed with compress() above never does.)
+bool
+is_frame(void const* src, size_t src_size);
+
+struct frame_compressor_impl;
+
+// A frame_compressor compresses a stream of data into a single LZ4 frame.
+// The compressed data is passed to an output function as it's produced, in
+// pieces of no more than roughly :frame_chunk_size bytes.
+struct frame_compressor
+{
+    typedef std::function<void(void const* data, size_t size)>
+        output_function;
+
+    // If :content_size is provided, it's recorded in the frame header, and
+    // the total amount of data written must match it.
+    frame_compressor(
+        output_function output,
+        std::optional<size_t> content_size = std::nullopt);
+
+    ~frame_compressor();
+
+    // Compress some more data.
+    void
+    write(void const* src, size_t src_size);
+
+    // Finish the frame. No more data can be written after this.
+    void
+    finish();
+
+    // Get the total size of the compressed data produced so far.
+    size_t
+    compressed_size() const;
+
+ private:
+    std::unique_ptr<frame_compressor_impl> impl_;
+};
+
+// Decompress a single LZ4 frame.
+// As with decompress(), the caller is expected to know the size of the
+// decompressed data and allocate it in full. The frame is decompressed
+// directly into :dst (without ever buffering the whole thing anywhere else),
+// and it's an error if it doesn't exactly fill :dst.
+void
+decompress_frame(void* dst, size_t dst_size, void const* src, size_t src_size);
+
 } // namespace lz4
 
 // This is thrown when lz4 reports an error.
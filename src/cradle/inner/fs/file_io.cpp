@@ -1,5 +1,9 @@
 #include <cradle/inner/fs/file_io.h>
 
+#include <filesystem>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <boost/numeric/conversion/cast.hpp>
 
 #include <cradle/inner/utilities/errors.h>
@@ -59,6 +63,35 @@ read_file_contents(file_path const& path)
     return contents;
 }
 
+blob
+map_file_contents(file_path const& path)
+{
+    namespace ipc = boost::interprocess;
+    try
+    {
+        // Empty files can't be mapped.
+        if (std::filesystem::file_size(path) == 0)
+            return blob();
+        ipc::file_mapping mapping(path.string().c_str(), ipc::read_only);
+        // The region keeps the mapping alive on its own, so it's all that the
+        // blob needs to hold onto.
+        auto region
+            = std::make_shared<ipc::mapped_region>(mapping, ipc::read_only);
+        auto data = static_cast<std::byte const*>(region->get_address());
+        size_t size = region->get_size();
+        return blob(
+            std::shared_ptr<std::byte const>(std::move(region), data), size);
+    }
+    catch (std::exception& e)
+    {
+        CRADLE_THROW(
+            open_file_error()
+            << file_path_info(path)
+            << open_mode_info(std::ios::in | std::ios::binary)
+            << internal_error_message_info(e.what()));
+    }
+}
+
 void
 dump_string_to_file(file_path const& path, string const& contents)
 {
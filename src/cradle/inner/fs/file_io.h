@@ -5,6 +5,7 @@
 #include <string>
 
 #include <cradle/inner/core/exception.h>
+#include <cradle/inner/core/type_definitions.h>
 #include <cradle/inner/fs/types.h>
 
 namespace cradle {
@@ -28,6 +29,18 @@ CRADLE_DEFINE_ERROR_INFO(std::ios::openmode, open_mode)
 std::string
 read_file_contents(file_path const& path);
 
+// Map a file into memory (read-only) and return a blob that references the
+// mapping directly, so that the contents are never copied. The mapping stays
+// alive as long as the blob (or any copy of it) does.
+//
+// Note that the blob reflects any later in-place changes to the file, so
+// this should only be used on files that are replaced rather than rewritten.
+//
+// If the file can't be opened or mapped, this throws an open_file_error.
+//
+blob
+map_file_contents(file_path const& path);
+
 // Write a string to a file (overwriting anything that might have been in it).
 void
 dump_string_to_file(file_path const& path, std::string const& contents);
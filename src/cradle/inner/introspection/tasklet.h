@@ -3,6 +3,7 @@
 
 #include <string>
 
+#include <cppcoro/cancellation_token.hpp>
 #include <cppcoro/shared_task.hpp>
 
 #include <cradle/inner/core/id.h>
@@ -170,6 +171,7 @@ shared_task_wrapper(
  * - Is or wraps a cppcoro::shared_task<Value> object.
  * - The cacheable object is identified by a captured_id.
  * - client will be nullptr while introspection is disabled.
+ * - cancellation is the requester's token (see cached()).
  *
  * This construct has to be used when needing to co_await on a coroutine that
  * calculates the cache key. If co_await and key calculation are co-located, a
@@ -182,10 +184,17 @@ make_shared_task_for_cacheable(
     captured_id cache_key,
     TaskCreator task_creator,
     tasklet_tracker* client,
-    std::string summary)
+    std::string summary,
+    cppcoro::cancellation_token cancellation = {})
 {
-    auto shared_task
-        = fully_cached<Value>(service, *cache_key, std::move(task_creator));
+    // The summary (i.e., the function name) doubles as the disk cache
+    // namespace for the value.
+    auto shared_task = fully_cached<Value>(
+        service,
+        *cache_key,
+        std::move(task_creator),
+        summary,
+        std::move(cancellation));
     if (client)
     {
         return detail::shared_task_wrapper<Value>(
@@ -1,4 +1,10 @@
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+
 #include <cppcoro/fmap.hpp>
+#include <cppcoro/when_all.hpp>
+#include <picosha2.h>
 #include <spdlog/spdlog.h>
 
 // Boost.Crc triggers some warnings on MSVC.
@@ -13,7 +19,9 @@
 #endif
 
 #include <cradle/inner/core/type_definitions.h>
+#include <cradle/inner/core/type_interfaces.h>
 #include <cradle/inner/encodings/base64.h>
+#include <cradle/inner/encodings/crc32c.h>
 #include <cradle/inner/encodings/lz4.h>
 #include <cradle/inner/fs/file_io.h>
 #include <cradle/inner/fs/types.h>
@@ -23,6 +31,42 @@ using std::string;
 
 namespace cradle {
 
+namespace detail {
+
+// Start preloading the compressed memory cache from the disk cache.
+void
+start_cache_warm_up(
+    inner_service_core_internals& internals,
+    cache_warm_up_config const& config);
+
+// Start the queue that writes values to the disk cache in the background.
+void
+start_disk_write_queue(
+    inner_service_core_internals& internals,
+    disk_write_queue_config const& config);
+
+// Start sharing cached values with other services.
+void
+start_peer_cache(
+    inner_service_core_internals& internals,
+    peer_cache_config const& config);
+
+} // namespace detail
+
+namespace {
+
+// Older versions of the service base64-encoded the values that they stored
+// in the disk cache's index (see disk_cache_config::legacy_value_decoder).
+std::optional<std::string>
+decode_legacy_disk_cache_value(std::string const& encoded)
+{
+    blob decoded = base64_decode(encoded, get_mime_base64_character_set());
+    return std::string(
+        reinterpret_cast<char const*>(decoded.data()), decoded.size());
+}
+
+} // namespace
+
 void
 inner_service_core::inner_reset()
 {
@@ -32,22 +76,63 @@ inner_service_core::inner_reset()
 void
 inner_service_core::inner_reset(inner_service_config const& config)
 {
-    size_t ic_size{
-        config.immutable_cache ? config.immutable_cache->unused_size_limit
-                               : 0x40'00'00'00};
-    std::optional<string> dc_directory;
-    if (config.disk_cache && config.disk_cache->directory)
-    {
-        dc_directory = *config.disk_cache->directory;
-    }
-    size_t dc_size{
-        config.disk_cache ? config.disk_cache->size_limit : 0x1'00'00'00'00};
-    disk_cache_config dc_config{dc_directory, dc_size};
+    immutable_cache_config ic_config{
+        config.immutable_cache ? *config.immutable_cache
+                               : immutable_cache_config{0x40'00'00'00}};
+    disk_cache_config dc_config{
+        config.disk_cache ? *config.disk_cache
+                          : disk_cache_config{none, 0x1'00'00'00'00}};
+    if (!dc_config.legacy_value_decoder)
+        dc_config.legacy_value_decoder = decode_legacy_disk_cache_value;
+    // The old internals have to be completely shut down first. (Their
+    // background work refers to them, and they may hold resources that the
+    // new ones need, like the disk cache.)
+    impl_.reset();
     impl_.reset(new detail::inner_service_core_internals{
-        .cache = immutable_cache_config{ic_size},
+        .cache = ic_config,
+        .compressed_cache{},
         .disk_cache = dc_config,
-        .disk_read_pool = cppcoro::static_thread_pool(2),
-        .disk_write_pool = thread_pool(2)});
+        .scheduler = task_scheduler(
+            config.scheduler ? *config.scheduler : task_scheduler_config{}),
+        .disk_read_pool{},
+        .disk_write_pool{},
+        .compression_pool{},
+        .checksum_pool{},
+        .disk_write_queue{},
+        .warm_up{},
+        .disk_cache_verification = config.disk_cache_verification
+                                       ? *config.disk_cache_verification
+                                       : disk_cache_verification_config{},
+        .disk_cache_file_read_count{0},
+        .deduplicate_disk_cache_files = config.deduplicate_disk_cache_files,
+        .peer_cache{},
+        .peer_read_pool{},
+        .peer_write_pool{}});
+    impl_->disk_read_pool = impl_->scheduler.get_queue("disk_read", 2);
+    impl_->disk_write_pool = impl_->scheduler.get_queue("disk_write", 2);
+    impl_->compression_pool = impl_->scheduler.get_queue("compression", 1);
+    // Checksums are pure computation, so they can use all the workers.
+    impl_->checksum_pool = impl_->scheduler.get_queue(
+        "checksum", impl_->scheduler.get_thread_count());
+    detail::start_disk_write_queue(
+        *impl_,
+        config.disk_write_queue ? *config.disk_write_queue
+                                : disk_write_queue_config{});
+    if (config.compressed_memory_cache)
+    {
+        impl_->compressed_cache.reset(*config.compressed_memory_cache);
+        if (config.cache_warm_up)
+            detail::start_cache_warm_up(*impl_, *config.cache_warm_up);
+    }
+    if (config.peer_cache)
+        detail::start_peer_cache(*impl_, *config.peer_cache);
+}
+
+void
+inner_service_core::wait_for_cache_warm_up()
+{
+    if (impl_ && impl_->warm_up)
+        impl_->warm_up->pool.wait_for_tasks();
 }
 
 cppcoro::task<std::string>
@@ -67,60 +152,702 @@ blob_to_string(blob const& x)
     return os.str();
 }
 
+namespace {
+
+// Decode the value of a disk cache entry that's stored in the database.
+// As with files, the value is LZ4-compressed (as a single block) iff its
+// stored size differs from its original size.
+blob
+decode_db_entry(disk_cache_entry const& entry)
+{
+    if (entry.size == entry.original_size)
+        return make_blob(*entry.value);
+    auto original_size = boost::numeric_cast<size_t>(entry.original_size);
+    std::unique_ptr<uint8_t[]> decompressed_data(new uint8_t[original_size]);
+    lz4::decompress(
+        decompressed_data.get(),
+        original_size,
+        entry.value->data(),
+        entry.value->size());
+    return blob{
+        reinterpret_pointer_cast<std::byte const>(
+            std::shared_ptr<uint8_t[]>{std::move(decompressed_data)}),
+        original_size};
+}
+
+// Compute the checksum of a block of data using the given algorithm.
+uint32_t
+compute_checksum(
+    disk_cache_checksum_algorithm algorithm, void const* data, size_t size)
+{
+    switch (algorithm)
+    {
+        case disk_cache_checksum_algorithm::CRC32C:
+            return crc32c(data, size);
+        case disk_cache_checksum_algorithm::CRC32:
+        default: {
+            boost::crc_32_type crc;
+            crc.process_bytes(data, size);
+            return crc.checksum();
+        }
+    }
+}
+
+// Does :value match the checksum recorded for :entry?
+bool
+matches_checksum(disk_cache_entry const& entry, blob const& value)
+{
+    return compute_checksum(
+               entry.checksum_algorithm, value.data(), value.size())
+           == entry.crc32;
+}
+
+// CRC-32C checksums of values that are at least twice this size are
+// computed in chunks of this size, in parallel.
+size_t const parallel_checksum_chunk_size = 0x40'00'00;
+
+cppcoro::task<uint32_t>
+compute_chunk_crc32c(
+    task_queue const& pool, std::byte const* data, size_t size)
+{
+    co_await pool.schedule();
+    co_return crc32c(data, size);
+}
+
+// This is the asynchronous form of matches_checksum(). Large values are
+// split into jobs on the checksum queue (when the entry's checksum algorithm
+// allows it).
+cppcoro::task<bool>
+matches_checksum_in_parallel(
+    inner_service_core_internals& internals,
+    disk_cache_entry const& entry,
+    blob value)
+{
+    if (entry.checksum_algorithm != disk_cache_checksum_algorithm::CRC32C
+        || value.size() < 2 * parallel_checksum_chunk_size)
+    {
+        co_return matches_checksum(entry, value);
+    }
+    std::vector<cppcoro::task<uint32_t>> tasks;
+    for (size_t offset = 0; offset < value.size();
+         offset += parallel_checksum_chunk_size)
+    {
+        tasks.push_back(compute_chunk_crc32c(
+            internals.checksum_pool,
+            value.data() + offset,
+            std::min(parallel_checksum_chunk_size, value.size() - offset)));
+    }
+    auto chunk_crcs = co_await cppcoro::when_all(std::move(tasks));
+    uint32_t crc = chunk_crcs[0];
+    for (size_t i = 1; i != chunk_crcs.size(); ++i)
+    {
+        size_t offset = i * parallel_checksum_chunk_size;
+        crc = crc32c_combine(
+            crc,
+            chunk_crcs[i],
+            std::min(parallel_checksum_chunk_size, value.size() - offset));
+    }
+    co_return crc == entry.crc32;
+}
+
+// Decode the file data for a disk cache entry (without checking it against
+// the entry's checksum).
+// Files are LZ4-compressed (as a frame, or as a single block for older
+// entries) unless compression didn't save anything, in which case the
+// entry's size matches its original size and :data is returned as-is.
+// (When :data is a file mapping, this means that the value is never copied.)
+// If :data is obviously the wrong size, this returns none.
+std::optional<blob>
+decode_file_data(disk_cache_entry const& entry, blob const& data)
+{
+    auto original_size = boost::numeric_cast<size_t>(entry.original_size);
+    if (entry.size == entry.original_size)
+    {
+        if (data.size() != original_size)
+            return none;
+        return data;
+    }
+
+    std::unique_ptr<uint8_t[]> decompressed_data(new uint8_t[original_size]);
+    // Older entries are stored as single LZ4 blocks rather than frames.
+    if (lz4::is_frame(data.data(), data.size()))
+    {
+        lz4::decompress_frame(
+            decompressed_data.get(), original_size, data.data(), data.size());
+    }
+    else
+    {
+        lz4::decompress(
+            decompressed_data.get(), original_size, data.data(), data.size());
+    }
+
+    return blob{
+        reinterpret_pointer_cast<std::byte const>(
+            std::shared_ptr<uint8_t[]>{std::move(decompressed_data)}),
+        original_size};
+}
+
+// Decode the file data for a disk cache entry and check it against the
+// entry's checksum. If it doesn't match, this returns none.
+std::optional<blob>
+decode_file_entry(disk_cache_entry const& entry, blob const& data)
+{
+    auto value = decode_file_data(entry, data);
+    if (value && !matches_checksum(entry, *value))
+        return none;
+    return value;
+}
+
+// Decide whether a file read should be checked before its value is
+// returned. (Values read with LAZY verification are always checked, but
+// only afterwards.)
+bool
+should_verify_file_read(inner_service_core_internals& internals)
+{
+    auto const& config = internals.disk_cache_verification;
+    switch (config.mode)
+    {
+        case disk_cache_verification_mode::FULL:
+        default:
+            return true;
+        case disk_cache_verification_mode::SAMPLED:
+            return internals.disk_cache_file_read_count++
+                       % std::max(config.sampling_interval, 1u)
+                   == 0;
+        case disk_cache_verification_mode::LAZY:
+            return false;
+    }
+}
+
+// the number of concurrent requests that a service makes to other peers (in
+// each direction)
+unsigned const peer_request_concurrency = 4;
+
+// Load a single disk cache entry into the compressed memory cache.
+void
+warm_up_entry(
+    inner_service_core_internals& internals, disk_cache_entry const& entry)
+{
+    std::optional<blob> value;
+    if (entry.value)
+    {
+        value = decode_db_entry(entry);
+    }
+    else
+    {
+        value = decode_file_entry(
+            entry,
+            map_file_contents(internals.disk_cache.get_path_for_entry(entry)));
+    }
+    if (value)
+        internals.compressed_cache.insert(entry.key, *value);
+}
+
+// Write a (small) value to the disk cache as an entry in the database.
+// The value is stored as raw bytes, LZ4-compressed if that saves anything.
+void
+write_db_entry(
+    disk_cache& cache,
+    std::string const& key,
+    blob const& value,
+    std::string const& key_namespace)
+{
+    size_t max_compressed_size = lz4::max_compressed_size(value.size());
+    std::string compressed_data(max_compressed_size, '\0');
+    size_t compressed_size = lz4::compress(
+        compressed_data.data(),
+        max_compressed_size,
+        value.data(),
+        value.size());
+    if (compressed_size < value.size())
+    {
+        compressed_data.resize(compressed_size);
+        cache.insert(key, compressed_data, value.size(), key_namespace);
+    }
+    else
+    {
+        cache.insert(
+            key,
+            std::string(
+                reinterpret_cast<char const*>(value.data()), value.size()),
+            none,
+            key_namespace);
+    }
+}
+
+// A temporary file that's removed when this goes out of scope, unless it
+// has been moved into place by then.
+struct temporary_file
+{
+    temporary_file(file_path path) : path(std::move(path))
+    {
+    }
+    ~temporary_file()
+    {
+        if (!moved)
+        {
+            std::error_code error;
+            std::filesystem::remove(path, error);
+        }
+    }
+    temporary_file(temporary_file const&) = delete;
+    temporary_file&
+    operator=(temporary_file const&) = delete;
+
+    // Move the file to :destination.
+    void
+    move_to(file_path const& destination)
+    {
+        std::filesystem::rename(path, destination);
+        moved = true;
+    }
+
+    file_path path;
+    bool moved = false;
+};
+
+// Write a value to the disk cache as a file entry.
+// If :deduplicate is true, files are shared between entries with identical
+// values (as identified by their SHA-256 hashes), so if the cache already
+// has this value, nothing is actually written.
+void
+write_file_entry(
+    disk_cache& cache,
+    std::string const& key,
+    blob const& value,
+    std::string const& key_namespace,
+    bool deduplicate)
+{
+    std::optional<std::string> content_hash;
+    if (deduplicate)
+    {
+        auto data = reinterpret_cast<uint8_t const*>(value.data());
+        content_hash = picosha2::hash256_hex_string(data, data + value.size());
+    }
+
+    auto cache_id = cache.initiate_insert(key, key_namespace);
+    if (content_hash
+        && cache.finish_insert_with_existing_content(cache_id, *content_hash))
+    {
+        return;
+    }
+
+    // Readers may still have the previous version of the file mapped, so
+    // rather than rewriting it in place, write a new file and move it into
+    // place.
+    auto entry_path = cache.get_path_for_id(cache_id);
+    static std::atomic<uint64_t> temporary_file_counter = 0;
+    auto temporary_path = entry_path;
+    temporary_path += ".tmp" + std::to_string(++temporary_file_counter);
+    temporary_file temporary(temporary_path);
+
+    // The value is compressed as a stream of chunks, so (unlike the value
+    // itself) the memory needed for this is bounded.
+    bool compressed;
+    {
+        std::ofstream output;
+        open_file(
+            output,
+            temporary_path,
+            std::ios::out | std::ios::trunc | std::ios::binary);
+        lz4::frame_compressor compressor(
+            [&](void const* data, size_t size) {
+                output.write(reinterpret_cast<char const*>(data), size);
+            },
+            value.size());
+        compressor.write(value.data(), value.size());
+        compressor.finish();
+
+        // If compression doesn't save anything, store the value
+        // uncompressed instead so that reads can return the file mapping
+        // as-is. (The entry's original size then matches its stored size,
+        // which is how readers tell the difference.)
+        compressed = compressor.compressed_size() < value.size();
+        if (!compressed)
+        {
+            output.close();
+            open_file(
+                output,
+                temporary_path,
+                std::ios::out | std::ios::trunc | std::ios::binary);
+            output.write(
+                reinterpret_cast<char const*>(value.data()), value.size());
+        }
+    }
+    temporary.move_to(entry_path);
+
+    auto crc = crc32c(value.data(), value.size());
+    auto original_size
+        = compressed ? std::optional<size_t>(value.size()) : none;
+    if (content_hash)
+    {
+        cache.finish_insert(
+            cache_id,
+            crc,
+            original_size,
+            *content_hash,
+            disk_cache_checksum_algorithm::CRC32C);
+    }
+    else
+    {
+        cache.finish_insert(
+            cache_id,
+            crc,
+            original_size,
+            disk_cache_checksum_algorithm::CRC32C);
+    }
+}
+
+// Check a value that was returned from the disk cache with LAZY
+// verification. If it's bad, its entry is discarded so that it's
+// recomputed the next time it's requested.
+void
+verify_in_background(
+    inner_service_core_internals& internals,
+    std::string const& key,
+    disk_cache_entry const& entry,
+    blob const& value)
+{
+    try
+    {
+        if (!matches_checksum(entry, value))
+        {
+            spdlog::get("cradle")->warn(
+                "disk cache entry {} failed verification", key);
+            internals.disk_cache.discard_entry(entry.id);
+        }
+    }
+    catch (...)
+    {
+        spdlog::get("cradle")->warn(
+            "error verifying disk cache entry {}", key);
+    }
+}
+
+// Write a value to the disk cache (as whichever kind of entry suits it).
+// Errors are only logged, since the value itself is still good.
+void
+write_to_disk_cache(
+    inner_service_core_internals& internals,
+    std::string const& key,
+    blob const& value,
+    std::string const& key_namespace)
+{
+    auto& cache = internals.disk_cache;
+    try
+    {
+        if (value.size() > 1024)
+        {
+            write_file_entry(
+                cache,
+                key,
+                value,
+                key_namespace,
+                internals.deduplicate_disk_cache_files);
+        }
+        else
+        {
+            write_db_entry(cache, key, value, key_namespace);
+        }
+    }
+    catch (...)
+    {
+        // Something went wrong trying to write the cached value, so issue a
+        // warning and move on.
+        spdlog::get("cradle")->warn("error writing disk cache entry {}", key);
+    }
+}
+
+// Queue a value to be written to the disk cache. If the queue is full, the
+// write is dropped.
+void
+write_to_disk_cache_in_background(
+    inner_service_core_internals& internals,
+    std::string const& key,
+    blob const& value,
+    std::string const& key_namespace)
+{
+    if (!internals.disk_write_queue.push(key, value, key_namespace))
+    {
+        spdlog::get("cradle")->warn(
+            "disk write queue is full; not caching {}", key);
+    }
+}
+
+// Look up a value in the service's own caches on behalf of another peer.
+// (Unlike generic_disk_cached(), this always checks file entries against
+// their checksums, since a bad value would spread to the other peer.)
+std::optional<blob>
+find_for_peer(inner_service_core_internals& internals, std::string const& key)
+{
+    if (internals.compressed_cache.is_initialized())
+    {
+        auto value = internals.compressed_cache.find(key);
+        if (value)
+            return value;
+    }
+    auto entry = internals.disk_cache.find(key);
+    if (!entry)
+        return none;
+    internals.disk_cache.record_usage(entry->id);
+    if (entry->value)
+        return decode_db_entry(*entry);
+    return decode_file_entry(
+        *entry,
+        map_file_contents(internals.disk_cache.get_path_for_entry(*entry)));
+}
+
+// Ask the peer that owns :key for its value (if that's another peer).
+// Failures are only logged, since the value can still be computed locally.
+cppcoro::task<std::optional<blob>>
+fetch_from_peer(inner_service_core_internals& internals, std::string key)
+{
+    if (!internals.peer_cache.is_initialized())
+        co_return none;
+    auto owner = internals.peer_cache.get_remote_owner(key);
+    if (!owner)
+        co_return none;
+    co_await internals.peer_read_pool.schedule();
+    try
+    {
+        auto value = internals.peer_cache.fetch(*owner, key);
+        if (value)
+        {
+            spdlog::get("cradle")->info(
+                "peer cache hit on {} (from {})", key, *owner);
+        }
+        co_return value;
+    }
+    catch (...)
+    {
+        spdlog::get("cradle")->warn(
+            "error fetching {} from peer {}", key, *owner);
+    }
+    co_return none;
+}
+
+// Send a value to the peer that owns :key (if that's another peer).
+void
+store_with_peer_in_background(
+    inner_service_core_internals& internals,
+    std::string const& key,
+    blob const& value,
+    std::string const& key_namespace)
+{
+    if (!internals.peer_cache.is_initialized())
+        return;
+    auto owner = internals.peer_cache.get_remote_owner(key);
+    if (!owner)
+        return;
+    internals.peer_write_pool.push_task(
+        [&internals, owner = *owner, key, value, key_namespace] {
+            try
+            {
+                internals.peer_cache.store(owner, key, value, key_namespace);
+            }
+            catch (...)
+            {
+                spdlog::get("cradle")->warn(
+                    "error sending {} to peer {}", key, owner);
+            }
+        });
+}
+
+} // namespace
+
+void
+start_disk_write_queue(
+    inner_service_core_internals& internals,
+    disk_write_queue_config const& config)
+{
+    internals.disk_write_queue.reset(
+        config,
+        internals.disk_write_pool,
+        [&internals](
+            std::string const& key,
+            blob const& value,
+            std::string const& key_namespace) {
+            write_to_disk_cache(internals, key, value, key_namespace);
+        });
+}
+
+void
+start_cache_warm_up(
+    inner_service_core_internals& internals,
+    cache_warm_up_config const& config)
+{
+    internals.warm_up = std::make_unique<cache_warm_up_state>(
+        std::max(config.concurrency, 1u));
+    auto& warm_up = *internals.warm_up;
+    // Querying the disk cache might take a while with a large cache, so that
+    // also happens in the background.
+    warm_up.pool.push_task(
+        [&internals, &warm_up, size_limit = config.size_limit] {
+            std::vector<disk_cache_entry> entries;
+            try
+            {
+                entries = internals.disk_cache.get_recently_used_entries(
+                    size_limit);
+            }
+            catch (...)
+            {
+                spdlog::get("cradle")->warn(
+                    "error listing entries for warm-up");
+                return;
+            }
+            spdlog::get("cradle")->info(
+                "warming up {} cache entries", entries.size());
+            for (auto& entry : entries)
+            {
+                warm_up.pool.push_task([&internals, &warm_up, entry] {
+                    if (warm_up.canceled)
+                        return;
+                    try
+                    {
+                        warm_up_entry(internals, entry);
+                        ++warm_up.loaded_count;
+                    }
+                    catch (...)
+                    {
+                        spdlog::get("cradle")->warn(
+                            "error warming up cache entry {}", entry.key);
+                    }
+                });
+            }
+        });
+}
+
+void
+remember_evicted_value(
+    inner_service_core_internals& internals,
+    id_interface const& key,
+    std::function<blob()> get_value)
+{
+    internals.compression_pool.push_task([&internals,
+                                          key = captured_id(key),
+                                          get_value = std::move(get_value)] {
+        auto key_string = boost::lexical_cast<string>(*key);
+        try
+        {
+            internals.compressed_cache.insert(key_string, get_value());
+        }
+        catch (...)
+        {
+            spdlog::get("cradle")->warn(
+                "error writing compressed memory cache entry {}", key_string);
+        }
+    });
+}
+
+void
+start_peer_cache(
+    inner_service_core_internals& internals,
+    peer_cache_config const& config)
+{
+    internals.peer_read_pool = internals.scheduler.get_queue(
+        "peer_read", peer_request_concurrency, task_queue_kind::BLOCKING);
+    internals.peer_write_pool = internals.scheduler.get_queue(
+        "peer_write", peer_request_concurrency, task_queue_kind::BLOCKING);
+    internals.peer_cache.reset(
+        config,
+        peer_cache_handlers{
+            .find =
+                [&internals](std::string const& key) {
+                    return find_for_peer(internals, key);
+                },
+            .insert =
+                [&internals](
+                    std::string const& key,
+                    blob const& value,
+                    std::string const& key_namespace) {
+                    write_to_disk_cache_in_background(
+                        internals, key, value, key_namespace);
+                }});
+}
+
 cppcoro::task<blob>
 generic_disk_cached(
     inner_service_core& core,
     id_interface const& id_key,
-    std::function<cppcoro::task<blob>()> create_task)
+    std::function<cppcoro::task<blob>()> create_task,
+    std::string key_namespace)
 {
+    auto& internals = core.inner_internals();
     std::string key{boost::lexical_cast<std::string>(id_key)};
-    // Check the cache for an existing value.
-    auto& cache = core.inner_internals().disk_cache;
+    // Check the compressed memory cache first, since that doesn't require any
+    // I/O.
+    auto& compressed_cache = internals.compressed_cache;
+    if (compressed_cache.is_initialized())
+    {
+        try
+        {
+            auto value = compressed_cache.find(key);
+            if (value)
+            {
+                spdlog::get("cradle")->info(
+                    "compressed memory cache hit on {}", key);
+                co_return *value;
+            }
+        }
+        catch (...)
+        {
+            spdlog::get("cradle")->warn(
+                "error reading compressed memory cache entry {}", key);
+        }
+    }
+    // Check the disk cache for an existing value.
+    auto& cache = internals.disk_cache;
+    std::optional<int64_t> found_entry_id;
     try
     {
         auto entry = cache.find(key);
         if (entry)
         {
             spdlog::get("cradle")->info("disk cache hit on {}", key);
+            found_entry_id = entry->id;
+
+            // Keep the usage information up to date (so that LRU eviction
+            // and warm-up both see it).
+            cache.record_usage(entry->id);
 
             if (entry->value)
             {
-                blob x{base64_decode(
-                    *entry->value, get_mime_base64_character_set())};
+                blob x{decode_db_entry(*entry)};
                 spdlog::get("cradle")->debug(
                     "deserialized: {}", blob_to_string(x));
                 co_return x;
             }
             else
             {
-                spdlog::get("cradle")->debug("reading file", key);
-                auto data = co_await read_file_contents(
-                    core, cache.get_path_for_id(entry->id));
-
-                spdlog::get("cradle")->debug("decompressing", key);
-                auto original_size
-                    = boost::numeric_cast<size_t>(entry->original_size);
-                std::unique_ptr<uint8_t[]> decompressed_data(
-                    new uint8_t[original_size]);
-                lz4::decompress(
-                    decompressed_data.get(),
-                    original_size,
-                    data.data(),
-                    data.size());
-
-                spdlog::get("cradle")->debug("checking CRC", key);
-                boost::crc_32_type crc;
-                crc.process_bytes(decompressed_data.get(), original_size);
-                if (crc.checksum() == entry->crc32)
+                // Map the file rather than reading it so that it can be
+                // decompressed (or returned) straight from the page cache.
+                // The mapping is cheap, but touching its pages isn't, so that
+                // still happens on the disk read pool.
+                spdlog::get("cradle")->debug("mapping file", key);
+                co_await internals.disk_read_pool.schedule();
+                auto data
+                    = map_file_contents(cache.get_path_for_entry(*entry));
+
+                spdlog::get("cradle")->debug("decoding", key);
+                auto decoded = decode_file_data(*entry, data);
+                if (decoded
+                    && internals.disk_cache_verification.mode
+                           == disk_cache_verification_mode::LAZY)
+                {
+                    // Check the value in the background.
+                    internals.disk_write_pool.push_task(
+                        [&internals, key, entry = *entry, value = *decoded] {
+                            verify_in_background(internals, key, entry, value);
+                        });
+                    co_return *decoded;
+                }
+                if (decoded
+                    && (!should_verify_file_read(internals)
+                        || co_await matches_checksum_in_parallel(
+                            internals, *entry, *decoded)))
                 {
-                    spdlog::get("cradle")->debug("decoding", key);
-                    blob decoded{
-                        reinterpret_pointer_cast<std::byte const>(
-                            std::shared_ptr<uint8_t[]>{
-                                std::move(decompressed_data)}),
-                        original_size};
                     spdlog::get("cradle")->debug("returning", key);
-                    co_return decoded;
+                    co_return *decoded;
                 }
             }
         }
@@ -128,67 +855,42 @@ generic_disk_cached(
     catch (...)
     {
         // Something went wrong trying to load the cached value, so just
-        // pretend it's not there. (It will be overwritten.)
+        // pretend it's not there.
         spdlog::get("cradle")->warn("error reading disk cache entry {}", key);
     }
-    spdlog::get("cradle")->debug("disk cache miss on {}", key);
-
-    // We didn't get it from the cache, so actually create the task to compute
-    // the result.
-    auto result = co_await create_task();
-
-    // Cache the result.
-    core.inner_internals().disk_write_pool.push_task([&core, key, result] {
-        auto& cache = core.inner_internals().disk_cache;
+    // If there was an entry but it couldn't be used, discard it. (Simply
+    // overwriting it isn't enough, since its file may be shared, in which
+    // case the new value would just end up pointing at the same file.)
+    if (found_entry_id)
+    {
         try
         {
-            if (result.size() > 1024)
-            {
-                size_t max_compressed_size
-                    = lz4::max_compressed_size(result.size());
-
-                std::unique_ptr<uint8_t[]> compressed_data(
-                    new uint8_t[max_compressed_size]);
-                size_t actual_compressed_size = lz4::compress(
-                    compressed_data.get(),
-                    max_compressed_size,
-                    result.data(),
-                    result.size());
-
-                auto cache_id = cache.initiate_insert(key);
-                {
-                    auto entry_path = cache.get_path_for_id(cache_id);
-                    std::ofstream output;
-                    open_file(
-                        output,
-                        entry_path,
-                        std::ios::out | std::ios::trunc | std::ios::binary);
-                    output.write(
-                        reinterpret_cast<char const*>(compressed_data.get()),
-                        actual_compressed_size);
-                }
-                boost::crc_32_type crc;
-                crc.process_bytes(result.data(), result.size());
-                cache.finish_insert(cache_id, crc.checksum(), result.size());
-            }
-            else
-            {
-                cache.insert(
-                    key,
-                    base64_encode(
-                        reinterpret_cast<uint8_t const*>(result.data()),
-                        result.size(),
-                        get_mime_base64_character_set()));
-            }
+            cache.discard_entry(*found_entry_id);
         }
         catch (...)
         {
-            // Something went wrong trying to write the cached value, so issue
-            // a warning and move on.
             spdlog::get("cradle")->warn(
-                "error writing disk cache entry {}", key);
+                "error discarding disk cache entry {}", key);
         }
-    });
+    }
+    spdlog::get("cradle")->debug("disk cache miss on {}", key);
+
+    // If another peer owns the key, it may already have the value.
+    auto peer_value = co_await fetch_from_peer(internals, key);
+    if (peer_value)
+    {
+        write_to_disk_cache_in_background(
+            internals, key, *peer_value, key_namespace);
+        co_return *peer_value;
+    }
+
+    // We didn't get it from the cache, so actually create the task to compute
+    // the result.
+    auto result = co_await create_task();
+
+    // Cache the result (and share it with its owner).
+    write_to_disk_cache_in_background(internals, key, result, key_namespace);
+    store_with_peer_in_background(internals, key, result, key_namespace);
 
     co_return result;
 }
@@ -201,9 +903,11 @@ cppcoro::task<blob>
 disk_cached(
     inner_service_core& core,
     id_interface const& key,
-    std::function<cppcoro::task<blob>()> create_task)
+    std::function<cppcoro::task<blob>()> create_task,
+    std::string key_namespace)
 {
-    return detail::generic_disk_cached(core, key, std::move(create_task));
+    return detail::generic_disk_cached(
+        core, key, std::move(create_task), std::move(key_namespace));
 }
 
 } // namespace cradle
@@ -2,17 +2,34 @@
 #define CRADLE_INNER_SERVICE_CORE_H
 
 #include <optional>
+#include <type_traits>
 
+#include <cppcoro/cancellation_registration.hpp>
+#include <cppcoro/cancellation_token.hpp>
+#include <cppcoro/sync_wait.hpp>
 #include <cppcoro/task.hpp>
 
+#include <cradle/inner/caching/compressed_memory_cache.h>
 #include <cradle/inner/caching/disk_cache.h>
 #include <cradle/inner/caching/immutable.h>
 #include <cradle/inner/caching/immutable/cache.h>
+#include <cradle/inner/caching/peer_cache.h>
 #include <cradle/inner/introspection/tasklet.h>
+#include <cradle/inner/service/disk_write_queue.h>
+#include <cradle/inner/service/task_scheduler.h>
 #include <cradle/inner/service/internals.h>
 
 namespace cradle {
 
+struct cache_warm_up_config
+{
+    // the maximum total (original) size of the entries to preload, in bytes
+    size_t size_limit;
+
+    // the maximum number of entries to load concurrently
+    unsigned concurrency = 1;
+};
+
 struct inner_service_config
 {
     // config for the immutable memory cache
@@ -20,6 +37,44 @@ struct inner_service_config
 
     // config for the disk cache
     std::optional<disk_cache_config> disk_cache;
+
+    // config for the compressed memory cache that sits between the immutable
+    // cache and the disk cache - If this is omitted, there is no such tier.
+    std::optional<compressed_memory_cache_config> compressed_memory_cache
+        = none;
+
+    // If this is provided, the most recently used entries in the disk cache
+    // are preloaded into the compressed memory cache in the background
+    // (starting with the most recent). This only has an effect if there is a
+    // compressed memory cache.
+    std::optional<cache_warm_up_config> cache_warm_up = none;
+
+    // how disk cache files are checked against their checksums when they're
+    // read - By default, every read is fully checked.
+    std::optional<disk_cache_verification_config> disk_cache_verification
+        = none;
+
+    // If this is provided, the service shares its cached values with other
+    // services (see peer_cache.h). A value that isn't found locally is
+    // requested from the peer that owns its key, and values that are
+    // computed locally are also sent to their owners. (The local disk cache
+    // still keeps a copy of every value that the service uses.)
+    std::optional<peer_cache_config> peer_cache = none;
+
+    // config for the queue of values waiting to be written to the disk cache
+    // (see disk_write_queue.h) - If this is omitted, the defaults are used.
+    std::optional<disk_write_queue_config> disk_write_queue = none;
+
+    // config for the scheduler that runs the service's background work (see
+    // task_scheduler.h) - By default, there's one thread per processor core.
+    std::optional<task_scheduler_config> scheduler = none;
+
+    // Should disk cache files with identical values be shared? (See
+    // disk_cache::finish_insert_with_existing_content().) This saves space
+    // and avoids compressing and writing duplicate values, but every value
+    // that's written to a file has to be hashed (with SHA-256) first, so
+    // it's off by default.
+    bool deduplicate_disk_cache_files = false;
 };
 
 struct inner_service_core
@@ -29,6 +84,10 @@ struct inner_service_core
     void
     inner_reset(inner_service_config const& config);
 
+    // If a cache warm-up is in progress, wait for it to finish.
+    void
+    wait_for_cache_warm_up();
+
     detail::inner_service_core_internals&
     inner_internals()
     {
@@ -39,12 +98,15 @@ struct inner_service_core
     std::unique_ptr<detail::inner_service_core_internals> impl_;
 };
 
+// :key_namespace is the disk cache namespace that the value is stored in
+// (see disk_cache_namespace_config).
 template<typename Value>
 cppcoro::task<Value>
 disk_cached(
     inner_service_core& core,
     id_interface const& key,
-    std::function<cppcoro::task<Value>()> create_task);
+    std::function<cppcoro::task<Value>()> create_task,
+    std::string key_namespace = "");
 
 // The inner core has just this one specialization.
 template<>
@@ -52,18 +114,69 @@ cppcoro::task<blob>
 disk_cached(
     inner_service_core& core,
     id_interface const& key,
-    std::function<cppcoro::task<blob>()> create_task);
+    std::function<cppcoro::task<blob>()> create_task,
+    std::string key_namespace);
+
+// Get the blob that disk_cached<Value> stores for :value. (This is also the
+// form that the compressed memory cache holds values in.)
+template<typename Value>
+blob
+to_cached_blob(Value const& value);
 
+template<>
+inline blob
+to_cached_blob(blob const& value)
+{
+    return value;
+}
+
+namespace detail {
+
+// Add a value that the immutable cache has evicted to the compressed memory
+// cache. :get_value produces the value's blob. This is called when it's
+// evicted, but the value is only serialized and compressed later, on the
+// service's compression queue.
+void
+remember_evicted_value(
+    inner_service_core_internals& internals,
+    id_interface const& key,
+    std::function<blob()> get_value);
+
+// Await the task for the cache entry that :ptr refers to. :ptr is held for as
+// long as the returned task is, so the entry knows that it's still wanted.
+//
+// If :cancellation is requested first, :ptr is released early. If that was
+// the last interest in the entry, the entry's own work is cancelled, and the
+// task fails with cppcoro::operation_cancelled. Otherwise, the task still
+// waits for the result. (Task creators often capture references to their
+// caller's state, so the caller can't leave while the work is running.)
+template<class Value>
+cppcoro::shared_task<Value>
+await_cache_entry(
+    immutable_cache_ptr<Value> ptr, cppcoro::cancellation_token cancellation)
+{
+    auto task = ptr.task();
+    cppcoro::cancellation_registration registration(
+        std::move(cancellation), [&ptr] { ptr.reset(); });
+    co_return co_await task;
+}
+
+} // namespace detail
+
+// :cancellation is the caller's own token. The task creator can also take a
+// token (see wrap_task_creator()), in which case it gets one that's only
+// cancelled once everyone that wants the value has gone away.
 template<class Value, class TaskCreator>
 cppcoro::shared_task<Value>
 cached(
     inner_service_core& core,
     id_interface const& key,
-    TaskCreator task_creator)
+    TaskCreator task_creator,
+    cppcoro::cancellation_token cancellation = {})
 {
     immutable_cache_ptr<Value> ptr(
         core.inner_internals().cache, key, task_creator);
-    return ptr.task();
+    return detail::await_cache_entry(std::move(ptr), std::move(cancellation));
 }
 
 template<class Value, class TaskCreator>
@@ -71,16 +184,54 @@ cppcoro::shared_task<Value>
 fully_cached(
     inner_service_core& core,
     id_interface const& key,
-    TaskCreator task_creator)
+    TaskCreator task_creator,
+    std::string key_namespace = "",
+    cppcoro::cancellation_token cancellation = {})
 {
-    // cached() will ensure that a captured id_interface object exists
+    // The cache will ensure that a captured id_interface object exists
     // equalling `key`; it will pass a reference to that object to the lambda.
     // It will be a different object from `key`; `key` may no longer exist when
     // the lambda is called.
-    return cached<Value>(
-        core, key, [&core, task_creator](id_interface const& key1) {
-            return disk_cached<Value>(core, key1, std::move(task_creator));
+    //
+    // If :task_creator takes a cancellation token, it gets the one for the
+    // cache entry.
+    immutable_cache_ptr<Value> ptr(
+        core.inner_internals().cache,
+        key,
+        [&core, task_creator, key_namespace](
+            id_interface const& key1,
+            cppcoro::cancellation_token entry_cancellation) {
+            std::function<cppcoro::task<Value>()> create_task;
+            if constexpr (std::is_invocable_v<
+                              TaskCreator const&,
+                              cppcoro::cancellation_token>)
+            {
+                create_task = [task_creator, entry_cancellation] {
+                    return task_creator(entry_cancellation);
+                };
+            }
+            else
+            {
+                create_task = std::move(task_creator);
+            }
+            return disk_cached<Value>(
+                core, key1, std::move(create_task), key_namespace);
         });
+    // If there's a compressed memory cache, the value goes there once the
+    // immutable cache is done with it. (The entry belongs to this particular
+    // set of internals, so that's what the handler refers to.)
+    auto& internals = core.inner_internals();
+    if (internals.compressed_cache.is_initialized())
+    {
+        ptr.on_eviction([&internals](
+                            id_interface const& key,
+                            cppcoro::shared_task<Value> const& task) {
+            detail::remember_evicted_value(internals, key, [task]() mutable {
+                return to_cached_blob<Value>(cppcoro::sync_wait(task));
+            });
+        });
+    }
+    return detail::await_cache_entry(std::move(ptr), std::move(cancellation));
 }
 
 } // namespace cradle
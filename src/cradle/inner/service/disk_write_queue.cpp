@@ -0,0 +1,166 @@
+#include <cradle/inner/service/disk_write_queue.h>
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+namespace cradle {
+
+namespace {
+
+typedef std::chrono::steady_clock clock_type;
+
+struct pending_write
+{
+    blob value;
+    std::string key_namespace;
+    clock_type::time_point queued_at;
+};
+
+} // namespace
+
+struct disk_write_queue_state
+{
+    disk_write_queue_config config;
+    disk_write_function write;
+    task_queue pool;
+
+    std::mutex mutex;
+
+    // all the writes in the queue (including the ones in progress), by key
+    std::unordered_map<std::string, pending_write> pending;
+    // the keys of the writes that haven't started yet, in the order that they
+    // were queued
+    std::deque<std::string> waiting;
+    // the total size of the values in :pending
+    size_t pending_size = 0;
+
+    int64_t written_count = 0;
+    int64_t coalesced_count = 0;
+    int64_t shed_count = 0;
+    std::chrono::microseconds total_latency{0};
+    std::chrono::microseconds max_latency{0};
+};
+
+namespace {
+
+// Is there room in the queue for a value of the given size? - An empty queue
+// always has room, so that oversized values can still be written.
+bool
+has_room(disk_write_queue_state const& state, size_t size)
+{
+    return state.pending_size == 0
+           || state.pending_size + size <= state.config.size_limit;
+}
+
+// Do the oldest write that hasn't started yet. (Each queued write gets one
+// job on the pool, so there's always one waiting when this runs.)
+void
+write_next(std::shared_ptr<disk_write_queue_state> const& state_ptr)
+{
+    auto& state = *state_ptr;
+    std::string key;
+    pending_write write;
+    {
+        std::scoped_lock<std::mutex> lock(state.mutex);
+        if (state.waiting.empty())
+            return;
+        key = std::move(state.waiting.front());
+        state.waiting.pop_front();
+        // The entry stays in :pending while it's being written so that other
+        // writes for the same key are still merged with it.
+        write = state.pending.at(key);
+    }
+
+    state.write(key, write.value, write.key_namespace);
+
+    {
+        std::scoped_lock<std::mutex> lock(state.mutex);
+        state.pending.erase(key);
+        state.pending_size -= write.value.size();
+        auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+            clock_type::now() - write.queued_at);
+        ++state.written_count;
+        state.total_latency += latency;
+        state.max_latency = (std::max)(state.max_latency, latency);
+    }
+}
+
+} // namespace
+
+disk_write_queue::disk_write_queue()
+{
+}
+
+disk_write_queue::disk_write_queue(
+    disk_write_queue_config const& config,
+    task_queue const& pool,
+    disk_write_function write)
+{
+    this->reset(config, pool, std::move(write));
+}
+
+disk_write_queue::~disk_write_queue()
+{
+}
+
+void
+disk_write_queue::reset(
+    disk_write_queue_config const& config,
+    task_queue const& pool,
+    disk_write_function write)
+{
+    auto state = std::make_shared<disk_write_queue_state>();
+    state->config = config;
+    state->write = std::move(write);
+    state->pool = pool;
+    state_ = std::move(state);
+}
+
+bool
+disk_write_queue::push(
+    std::string const& key,
+    blob const& value,
+    std::string const& key_namespace)
+{
+    auto& state = *state_;
+    {
+        std::scoped_lock<std::mutex> lock(state.mutex);
+        if (state.pending.find(key) != state.pending.end())
+        {
+            ++state.coalesced_count;
+            return true;
+        }
+        if (!has_room(state, value.size()))
+        {
+            ++state.shed_count;
+            return false;
+        }
+        state.pending.emplace(
+            key, pending_write{value, key_namespace, clock_type::now()});
+        state.waiting.push_back(key);
+        state.pending_size += value.size();
+    }
+    state.pool.push_task([state = state_] { write_next(state); });
+    return true;
+}
+
+disk_write_queue_info
+disk_write_queue::get_summary_info()
+{
+    auto& state = *state_;
+    std::scoped_lock<std::mutex> lock(state.mutex);
+    disk_write_queue_info info;
+    info.pending_count = state.pending.size();
+    info.pending_size = state.pending_size;
+    info.written_count = state.written_count;
+    info.coalesced_count = state.coalesced_count;
+    info.shed_count = state.shed_count;
+    if (state.written_count != 0)
+        info.average_latency = state.total_latency / state.written_count;
+    info.max_latency = state.max_latency;
+    return info;
+}
+
+} // namespace cradle
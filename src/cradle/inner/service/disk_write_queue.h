@@ -0,0 +1,114 @@
+#ifndef CRADLE_INNER_SERVICE_DISK_WRITE_QUEUE_H
+#define CRADLE_INNER_SERVICE_DISK_WRITE_QUEUE_H
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <cradle/inner/core/type_definitions.h>
+#include <cradle/inner/service/task_scheduler.h>
+
+namespace cradle {
+
+// A disk write queue holds the values that are waiting to be written to the
+// disk cache (in the background, as jobs on a task queue).
+//
+// Values are held in memory until they're written, so the queue has a size
+// limit. When a new write would go over that limit, it's simply dropped.
+// (The value can always be computed again, so dropping it is better than
+// letting a slow disk eat up all the memory, and writers are often pool
+// threads that shouldn't be held up waiting for the disk.)
+//
+// Since a key always identifies the same value, a write for a key that's
+// already in the queue is redundant and is merged with the existing one.
+
+struct disk_write_queue_config
+{
+    // the maximum total size of the values in the queue (including the ones
+    // that are being written), in bytes
+    size_t size_limit = 0x10'00'00'00;
+};
+
+struct disk_write_queue_info
+{
+    // the writes that are currently in the queue (including the ones that are
+    // being written) and the total size of their values
+    size_t pending_count = 0;
+    size_t pending_size = 0;
+
+    // the number of writes that have finished
+    int64_t written_count = 0;
+    // the number of writes that were merged with one already in the queue
+    int64_t coalesced_count = 0;
+    // the number of writes that were dropped for lack of room
+    int64_t shed_count = 0;
+
+    // the time from when writes entered the queue to when they finished
+    // (over all the finished writes)
+    std::chrono::microseconds average_latency{0};
+    std::chrono::microseconds max_latency{0};
+};
+
+// the function that actually writes a value to the disk cache (which must
+// deal with its own errors)
+typedef std::function<void(
+    std::string const& key,
+    blob const& value,
+    std::string const& key_namespace)>
+    disk_write_function;
+
+struct disk_write_queue_state;
+
+struct disk_write_queue
+{
+    // The default constructor creates an invalid queue that must be
+    // initialized via reset().
+    disk_write_queue();
+
+    // Create a queue that writes values by calling :write in jobs on :pool.
+    disk_write_queue(
+        disk_write_queue_config const& config,
+        task_queue const& pool,
+        disk_write_function write);
+
+    ~disk_write_queue();
+
+    // Reset the queue with a new config. Any writes that are already queued
+    // still go through the old one.
+    void
+    reset(
+        disk_write_queue_config const& config,
+        task_queue const& pool,
+        disk_write_function write);
+
+    // Is the queue initialized?
+    bool
+    is_initialized()
+    {
+        return state_ ? true : false;
+    }
+
+    // The rest of this interface should only be used if is_initialized()
+    // returns true.
+
+    // Queue a value to be written. This never blocks. It returns false if
+    // the write was dropped because the queue is full.
+    bool
+    push(
+        std::string const& key,
+        blob const& value,
+        std::string const& key_namespace = "");
+
+    disk_write_queue_info
+    get_summary_info();
+
+ private:
+    // The state is shared with the jobs on the pool, since they may outlive
+    // the queue itself.
+    std::shared_ptr<disk_write_queue_state> state_;
+};
+
+} // namespace cradle
+
+#endif
@@ -1,23 +1,86 @@
 #ifndef CRADLE_INNER_SERVICE_INTERNALS_H
 #define CRADLE_INNER_SERVICE_INTERNALS_H
 
-#include <cppcoro/static_thread_pool.hpp>
+#include <atomic>
 
 #include <thread-pool/thread_pool.hpp>
 
+#include <cradle/inner/caching/compressed_memory_cache.h>
 #include <cradle/inner/caching/disk_cache.h>
 #include <cradle/inner/caching/immutable.h>
+#include <cradle/inner/caching/peer_cache.h>
+#include <cradle/inner/service/disk_write_queue.h>
+#include <cradle/inner/service/task_scheduler.h>
 
 namespace cradle {
 
 namespace detail {
 
+// the state of a background cache warm-up
+struct cache_warm_up_state
+{
+    cache_warm_up_state(unsigned concurrency) : pool(concurrency)
+    {
+    }
+
+    ~cache_warm_up_state()
+    {
+        // Skip whatever work is left. (The pool still waits for the jobs that
+        // are already running.)
+        canceled = true;
+    }
+
+    std::atomic<bool> canceled{false};
+
+    // the number of entries that have been loaded so far
+    std::atomic<size_t> loaded_count{0};
+
+    thread_pool pool;
+};
+
 struct inner_service_core_internals
 {
     cradle::immutable_cache cache;
+    cradle::compressed_memory_cache compressed_cache;
     cradle::disk_cache disk_cache;
-    cppcoro::static_thread_pool disk_read_pool;
-    thread_pool disk_write_pool;
+    // the threads that do the service's background work (shared by all of
+    // its queues, including those of higher layers)
+    task_scheduler scheduler;
+    task_queue disk_read_pool;
+    task_queue disk_write_pool;
+    // where values that the immutable cache evicts are compressed (for the
+    // compressed memory cache)
+    task_queue compression_pool;
+    // where large values are checked against their checksums (in chunks, in
+    // parallel)
+    task_queue checksum_pool;
+    // the values waiting to be written to the disk cache (on the write pool)
+    cradle::disk_write_queue disk_write_queue;
+    std::unique_ptr<cache_warm_up_state> warm_up;
+    disk_cache_verification_config disk_cache_verification;
+    // the number of disk cache files read so far (for sampled verification)
+    std::atomic<uint64_t> disk_cache_file_read_count{0};
+    // (see inner_service_config::deduplicate_disk_cache_files)
+    bool deduplicate_disk_cache_files = false;
+    // the peer cache tier (if any) - Requests to other peers are made from
+    // their own (BLOCKING) queues so that they don't hold up local I/O.
+    // (These only exist if the peer cache is initialized.)
+    cradle::peer_cache peer_cache;
+    task_queue peer_read_pool;
+    task_queue peer_write_pool;
+
+    ~inner_service_core_internals()
+    {
+        // The peer cache is destroyed first (so that it stops serving other
+        // peers), but the requests to other peers use it, so they have to
+        // finish before that. (All the other background work finishes when
+        // the scheduler is destroyed.)
+        if (peer_cache.is_initialized())
+        {
+            peer_read_pool.wait_for_tasks();
+            peer_write_pool.wait_for_tasks();
+        }
+    }
 };
 
 } // namespace detail
@@ -0,0 +1,404 @@
+#include <cradle/inner/service/task_scheduler.h>
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <spdlog/spdlog.h>
+
+namespace cradle {
+
+namespace {
+
+typedef std::chrono::steady_clock clock_type;
+
+struct pending_job
+{
+    std::function<void()> job;
+    clock_type::time_point queued_at;
+};
+
+// the priority of the job that's running on this thread
+thread_local task_priority current_priority = task_priority::NORMAL;
+
+} // namespace
+
+task_priority
+get_current_task_priority()
+{
+    return current_priority;
+}
+
+struct task_queue_state
+{
+    std::string name;
+    task_queue_kind kind = task_queue_kind::COMPUTE;
+    unsigned concurrency = 1;
+    // the pending jobs, by priority
+    std::array<std::deque<pending_job>, task_priority_count> pending;
+    size_t pending_count = 0;
+    unsigned running_count = 0;
+    int64_t completed_count = 0;
+    int64_t overdue_count = 0;
+};
+
+struct task_scheduler_impl
+{
+    task_scheduler_config config;
+
+    std::mutex mutex;
+    // signaled when there may be a job that a thread can take, by the kind of
+    // queue that it's for
+    std::array<std::condition_variable, 2> work_available;
+    // signaled when a job finishes
+    std::condition_variable job_finished;
+
+    // (These are never removed, so handles to them stay valid.)
+    std::vector<std::unique_ptr<task_queue_state>> queues;
+    // the queue where the next search for a job starts
+    size_t next_queue = 0;
+    // the total number of pending jobs (across all queues)
+    size_t pending_count = 0;
+    bool stopping = false;
+
+    std::vector<std::thread> workers;
+    // the threads for the jobs of BLOCKING queues
+    std::vector<std::thread> blocking_threads;
+};
+
+namespace {
+
+// a job that a worker could take next
+struct job_choice
+{
+    task_queue_state* queue = nullptr;
+    size_t priority = 0;
+    // the priority after any promotions (which can go past HIGH)
+    size_t promoted_priority = 0;
+};
+
+std::condition_variable&
+get_work_signal(task_scheduler_impl& scheduler, task_queue_kind kind)
+{
+    return scheduler.work_available[static_cast<size_t>(kind)];
+}
+
+// Choose the next job to run (among the queues of :kind that are under their
+// limits). A waiting job is promoted by one priority for every starvation
+// limit that it has waited, and the job with the highest promoted priority
+// comes first. Among equals, the one that's been promoted the most goes first
+// (since it's waited the longest for its turn), and otherwise ties go to the
+// first queue after the one that was chosen last time, so that every queue
+// gets its turn.
+job_choice
+choose_next_job(task_scheduler_impl& scheduler, task_queue_kind kind)
+{
+    auto now = clock_type::now();
+    auto interval = (std::max)(
+        scheduler.config.starvation_limit, std::chrono::milliseconds(1));
+    job_choice best;
+    auto queue_count = scheduler.queues.size();
+    size_t best_index = 0;
+    for (size_t i = 0; i != queue_count; ++i)
+    {
+        auto index = (scheduler.next_queue + i) % queue_count;
+        auto& queue = *scheduler.queues[index];
+        if (queue.kind != kind || queue.pending_count == 0
+            || queue.running_count >= queue.concurrency)
+        {
+            continue;
+        }
+        for (size_t priority = task_priority_count; priority-- != 0;)
+        {
+            auto const& jobs = queue.pending[priority];
+            if (jobs.empty())
+                continue;
+            // (Each deque is oldest first, so its front job has been
+            // promoted the most.)
+            auto promoted = priority
+                            + static_cast<size_t>(
+                                (now - jobs.front().queued_at) / interval);
+            bool better
+                = !best.queue || promoted > best.promoted_priority
+                  || (promoted == best.promoted_priority
+                      && priority < best.priority);
+            if (better)
+            {
+                best = job_choice{&queue, priority, promoted};
+                best_index = index;
+            }
+        }
+    }
+    if (best.queue)
+        scheduler.next_queue = (best_index + 1) % queue_count;
+    return best;
+}
+
+// Once the scheduler is stopping and no jobs are left to take, wake every
+// thread (of either kind) so that it can exit. (Otherwise, threads that went
+// back to sleep while their queues were at their limits never wake up.)
+void
+notify_if_drained(task_scheduler_impl& scheduler)
+{
+    if (scheduler.stopping && scheduler.pending_count == 0)
+    {
+        for (auto& work_available : scheduler.work_available)
+            work_available.notify_all();
+    }
+}
+
+// Run jobs from the queues of :kind until the scheduler stops.
+void
+run_worker(task_scheduler_impl& scheduler, task_queue_kind kind)
+{
+    auto& work_available = get_work_signal(scheduler, kind);
+    std::unique_lock<std::mutex> lock(scheduler.mutex);
+    while (true)
+    {
+        job_choice choice;
+        work_available.wait(lock, [&] {
+            choice = choose_next_job(scheduler, kind);
+            return choice.queue
+                   || (scheduler.stopping && scheduler.pending_count == 0);
+        });
+        if (!choice.queue)
+            return;
+
+        auto* queue = choice.queue;
+        auto& jobs = queue->pending[choice.priority];
+        auto job = std::move(jobs.front().job);
+        jobs.pop_front();
+        --queue->pending_count;
+        --scheduler.pending_count;
+        ++queue->running_count;
+        if (choice.promoted_priority != choice.priority)
+            ++queue->overdue_count;
+        notify_if_drained(scheduler);
+        lock.unlock();
+
+        current_priority = static_cast<task_priority>(choice.priority);
+        try
+        {
+            job();
+        }
+        catch (std::exception& e)
+        {
+            spdlog::get("cradle")->error(
+                "error in {} job: {}", queue->name, e.what());
+        }
+        catch (...)
+        {
+            spdlog::get("cradle")->error("error in {} job", queue->name);
+        }
+        // Release the job before relocking, since destroying it may do
+        // arbitrary work.
+        job = nullptr;
+        current_priority = task_priority::NORMAL;
+
+        lock.lock();
+        --queue->running_count;
+        ++queue->completed_count;
+        // If the queue was at its limit, another of its jobs can run now.
+        if (queue->pending_count != 0)
+            work_available.notify_one();
+        notify_if_drained(scheduler);
+        scheduler.job_finished.notify_all();
+    }
+}
+
+unsigned
+get_concurrency(
+    task_scheduler_impl& scheduler,
+    std::string const& name,
+    unsigned requested)
+{
+    auto configured = scheduler.config.queue_concurrency.find(name);
+    if (configured != scheduler.config.queue_concurrency.end())
+        requested = configured->second;
+    return (std::max)(requested, 1u);
+}
+
+task_queue
+create_queue(
+    task_scheduler_impl& scheduler,
+    std::string const& name,
+    unsigned concurrency,
+    task_queue_kind kind)
+{
+    auto queue = std::make_unique<task_queue_state>();
+    queue->name = name;
+    queue->kind = kind;
+    queue->concurrency = get_concurrency(scheduler, name, concurrency);
+    // A BLOCKING queue brings enough threads to run as many of its jobs as
+    // its limit allows. (They can also take the jobs of other BLOCKING
+    // queues.)
+    if (kind == task_queue_kind::BLOCKING)
+    {
+        for (unsigned i = 0; i != queue->concurrency; ++i)
+        {
+            scheduler.blocking_threads.emplace_back([&scheduler] {
+                run_worker(scheduler, task_queue_kind::BLOCKING);
+            });
+        }
+    }
+    scheduler.queues.push_back(std::move(queue));
+    return task_queue(scheduler, *scheduler.queues.back());
+}
+
+task_queue_info
+make_queue_info(task_queue_state const& queue)
+{
+    task_queue_info info;
+    info.name = queue.name;
+    info.kind = queue.kind;
+    info.concurrency = queue.concurrency;
+    info.pending_count = queue.pending_count;
+    info.running_count = queue.running_count;
+    info.completed_count = queue.completed_count;
+    info.overdue_count = queue.overdue_count;
+    return info;
+}
+
+} // namespace
+
+void
+task_queue::push_task(
+    std::function<void()> task, task_priority priority) const
+{
+    {
+        std::scoped_lock<std::mutex> lock(scheduler_->mutex);
+        state_->pending[static_cast<size_t>(priority)].push_back(
+            pending_job{std::move(task), clock_type::now()});
+        ++state_->pending_count;
+        ++scheduler_->pending_count;
+    }
+    get_work_signal(*scheduler_, state_->kind).notify_one();
+}
+
+void
+task_queue::wait_for_tasks() const
+{
+    std::unique_lock<std::mutex> lock(scheduler_->mutex);
+    scheduler_->job_finished.wait(lock, [&] {
+        return state_->pending_count == 0 && state_->running_count == 0;
+    });
+}
+
+size_t
+task_queue::get_tasks_total() const
+{
+    std::scoped_lock<std::mutex> lock(scheduler_->mutex);
+    return state_->pending_count + state_->running_count;
+}
+
+task_queue_info
+task_queue::get_summary_info() const
+{
+    std::scoped_lock<std::mutex> lock(scheduler_->mutex);
+    return make_queue_info(*state_);
+}
+
+task_scheduler::task_scheduler()
+{
+}
+
+task_scheduler::task_scheduler(task_scheduler_config const& config)
+{
+    this->reset(config);
+}
+
+task_scheduler::~task_scheduler()
+{
+    this->reset();
+}
+
+void
+task_scheduler::reset(task_scheduler_config const& config)
+{
+    this->reset();
+    impl_ = std::make_unique<task_scheduler_impl>();
+    impl_->config = config;
+    auto thread_count = config.thread_count != 0
+                            ? config.thread_count
+                            : std::thread::hardware_concurrency();
+    thread_count = (std::max)(thread_count, 1u);
+    for (unsigned i = 0; i != thread_count; ++i)
+    {
+        impl_->workers.emplace_back(
+            [&scheduler = *impl_] {
+                run_worker(scheduler, task_queue_kind::COMPUTE);
+            });
+    }
+}
+
+void
+task_scheduler::reset()
+{
+    if (!impl_)
+        return;
+    {
+        std::scoped_lock<std::mutex> lock(impl_->mutex);
+        impl_->stopping = true;
+    }
+    for (auto& work_available : impl_->work_available)
+        work_available.notify_all();
+    for (auto& worker : impl_->workers)
+        worker.join();
+    // Jobs can still create BLOCKING queues (and so threads) until they've
+    // all finished.
+    while (true)
+    {
+        std::thread thread;
+        {
+            std::scoped_lock<std::mutex> lock(impl_->mutex);
+            if (impl_->blocking_threads.empty())
+                break;
+            thread = std::move(impl_->blocking_threads.back());
+            impl_->blocking_threads.pop_back();
+        }
+        thread.join();
+    }
+    impl_.reset();
+}
+
+task_queue
+task_scheduler::get_queue(
+    std::string const& name, unsigned concurrency, task_queue_kind kind)
+{
+    std::scoped_lock<std::mutex> lock(impl_->mutex);
+    for (auto& queue : impl_->queues)
+    {
+        if (queue->name == name)
+            return task_queue(*impl_, *queue);
+    }
+    return create_queue(*impl_, name, concurrency, kind);
+}
+
+task_queue
+task_scheduler::add_queue(
+    std::string const& name, unsigned concurrency, task_queue_kind kind)
+{
+    std::scoped_lock<std::mutex> lock(impl_->mutex);
+    return create_queue(*impl_, name, concurrency, kind);
+}
+
+unsigned
+task_scheduler::get_thread_count()
+{
+    return static_cast<unsigned>(impl_->workers.size());
+}
+
+std::vector<task_queue_info>
+task_scheduler::get_summary_info()
+{
+    std::scoped_lock<std::mutex> lock(impl_->mutex);
+    std::vector<task_queue_info> info;
+    for (auto const& queue : impl_->queues)
+        info.push_back(make_queue_info(*queue));
+    return info;
+}
+
+} // namespace cradle
@@ -0,0 +1,269 @@
+#ifndef CRADLE_INNER_SERVICE_TASK_SCHEDULER_H
+#define CRADLE_INNER_SERVICE_TASK_SCHEDULER_H
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <cppcoro/coroutine.hpp>
+
+namespace cradle {
+
+// A task scheduler runs all of a service's background work (disk I/O, HTTP
+// requests, local calculations, etc.) on a single set of worker threads
+// (normally one per processor core), apart from BLOCKING work (see below).
+//
+// The work is organized into named queues, each of which has a limit on how
+// many of its jobs can run at once. Within those limits, an idle worker takes
+// work from whichever queue has it, so one kind of work can use the threads
+// that another isn't using, without any one kind taking all of them. (Which
+// job comes next is decided by priority, as described below. Among jobs of
+// equal priority, workers go around the queues in turn, and each queue takes
+// its oldest job first.)
+//
+// A job is either a plain function or a coroutine that's resumed on the
+// worker (via co_await queue.schedule()). A job holds its worker until it
+// returns (or suspends), so a queue whose jobs mostly wait (e.g., on network
+// requests) is created as a BLOCKING queue. Its jobs run on threads of their
+// own (one per unit of its limit) rather than on the workers, so however many
+// of them are stuck, the workers stay free for everything else.
+//
+// Every job also has a priority, and workers take higher-priority jobs first
+// (across all queues). Unless it's given explicitly, a job gets the priority
+// of the job that scheduled it, so the work done for a request (and any
+// coroutines that it awaits) keeps the priority of the request itself. So
+// that low-priority work isn't starved, a job that's still waiting is
+// promoted by one priority for every starvation limit that passes (but still
+// yields to jobs whose priorities are higher than its own promoted one).
+
+enum class task_priority
+{
+    LOW,
+    NORMAL,
+    HIGH
+};
+
+size_t const task_priority_count = 3;
+
+// Get the priority of the job that's running on the current thread. (This is
+// NORMAL if the thread isn't a worker.)
+task_priority
+get_current_task_priority();
+
+// the kind of work that a queue's jobs do
+enum class task_queue_kind
+{
+    // Jobs keep their threads busy (computing or doing brief I/O), so they
+    // share the workers.
+    COMPUTE,
+    // Jobs spend most of their time waiting, so they get threads of their
+    // own.
+    BLOCKING
+};
+
+struct task_scheduler_config
+{
+    // the number of worker threads - If this is 0, there's one for each
+    // processor core.
+    unsigned thread_count = 0;
+
+    // the concurrency limits of individual queues, by name - These override
+    // the limits that the queues' creators ask for.
+    std::map<std::string, unsigned> queue_concurrency;
+
+    // how long a job waits before each promotion to the next priority
+    std::chrono::milliseconds starvation_limit{1000};
+};
+
+struct task_queue_info
+{
+    std::string name;
+    task_queue_kind kind = task_queue_kind::COMPUTE;
+    // the maximum number of the queue's jobs that can run at once
+    unsigned concurrency = 0;
+    // the number of jobs that are waiting to run
+    size_t pending_count = 0;
+    // the number of jobs that are currently running
+    unsigned running_count = 0;
+    // the number of jobs that have finished
+    int64_t completed_count = 0;
+    // the number of jobs that had been promoted (by waiting past the
+    // starvation limit) when they started
+    int64_t overdue_count = 0;
+};
+
+struct task_scheduler_impl;
+struct task_queue_state;
+
+// A task queue is a handle to one of a scheduler's queues. It's only valid
+// as long as the scheduler is.
+//
+// A handle can also carry a priority for the jobs that are added through it
+// (see with_priority()).
+struct task_queue
+{
+    // The default constructor creates an invalid handle.
+    task_queue() : scheduler_(nullptr), state_(nullptr)
+    {
+    }
+
+    task_queue(task_scheduler_impl& scheduler, task_queue_state& state)
+        : scheduler_(&scheduler), state_(&state)
+    {
+    }
+
+    bool
+    is_initialized() const
+    {
+        return state_ != nullptr;
+    }
+
+    // Get a handle to the same queue that adds its jobs with :priority.
+    task_queue
+    with_priority(task_priority priority) const
+    {
+        task_queue queue = *this;
+        queue.priority_ = priority;
+        return queue;
+    }
+
+    struct schedule_operation
+    {
+        task_scheduler_impl* scheduler;
+        task_queue_state* state;
+        std::optional<task_priority> priority;
+
+        bool
+        await_ready() noexcept
+        {
+            return false;
+        }
+
+        void
+        await_suspend(cppcoro::coroutine_handle<> coroutine)
+        {
+            task_queue(*scheduler, *state).push_task(
+                [coroutine] { coroutine.resume(); },
+                priority ? *priority : get_current_task_priority());
+        }
+
+        void
+        await_resume() noexcept
+        {
+        }
+    };
+
+    // co_await this to continue the calling coroutine as a job on this
+    // queue.
+    schedule_operation
+    schedule() const noexcept
+    {
+        return schedule_operation{scheduler_, state_, priority_};
+    }
+
+    // ... with an explicit priority
+    schedule_operation
+    schedule(task_priority priority) const noexcept
+    {
+        return schedule_operation{scheduler_, state_, priority};
+    }
+
+    // Add a job to the queue. (Any exception that it throws is logged and
+    // otherwise ignored.)
+    void
+    push_task(std::function<void()> task) const
+    {
+        push_task(
+            std::move(task),
+            priority_ ? *priority_ : get_current_task_priority());
+    }
+
+    // ... with an explicit priority
+    void
+    push_task(std::function<void()> task, task_priority priority) const;
+
+    // Wait until all of the queue's jobs have finished (including any that
+    // are added in the meantime).
+    void
+    wait_for_tasks() const;
+
+    // Get the number of jobs that are waiting or running.
+    size_t
+    get_tasks_total() const;
+
+    task_queue_info
+    get_summary_info() const;
+
+ private:
+    task_scheduler_impl* scheduler_;
+    task_queue_state* state_;
+    std::optional<task_priority> priority_;
+};
+
+struct task_scheduler
+{
+    // The default constructor creates an invalid scheduler that must be
+    // initialized via reset().
+    task_scheduler();
+
+    explicit task_scheduler(task_scheduler_config const& config);
+
+    // Destroying the scheduler finishes any jobs that are still queued.
+    ~task_scheduler();
+
+    // Reset the scheduler with a new config. (The old queues and their jobs
+    // are finished first.)
+    void
+    reset(task_scheduler_config const& config);
+
+    // Reset the scheduler to an uninitialized state.
+    void
+    reset();
+
+    // Is the scheduler initialized?
+    bool
+    is_initialized()
+    {
+        return impl_ ? true : false;
+    }
+
+    // The rest of this interface should only be used if is_initialized()
+    // returns true.
+
+    // Get the queue named :name, creating it if necessary. :concurrency is
+    // its limit unless the config overrides it. (:kind only matters if the
+    // queue is created.)
+    task_queue
+    get_queue(
+        std::string const& name,
+        unsigned concurrency,
+        task_queue_kind kind = task_queue_kind::COMPUTE);
+
+    // Add a new queue (even if there's already one with the same name, in
+    // which case they share any limit from the config but are otherwise
+    // independent).
+    task_queue
+    add_queue(
+        std::string const& name,
+        unsigned concurrency,
+        task_queue_kind kind = task_queue_kind::COMPUTE);
+
+    // Get the number of workers. (This doesn't include the threads of
+    // BLOCKING queues.)
+    unsigned
+    get_thread_count();
+
+    std::vector<task_queue_info>
+    get_summary_info();
+
+ private:
+    std::unique_ptr<task_scheduler_impl> impl_;
+};
+
+} // namespace cradle
+
+#endif
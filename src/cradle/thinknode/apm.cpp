@@ -33,15 +33,17 @@ get_app_version_info(
     string function_name{"get_app_version_info"};
     auto cache_key = make_captured_sha256_hashed_id(
         function_name, ctx.session.api_url, account, app, version);
-    auto create_task = [=]() {
-        return uncached::get_app_version_info(ctx, account, app, version);
+    auto create_task = [=](cppcoro::cancellation_token cancellation) {
+        return uncached::get_app_version_info(
+            with_cancellation(ctx, cancellation), account, app, version);
     };
     return make_shared_task_for_cacheable<thinknode_app_version_info>(
         ctx.service,
         std::move(cache_key),
         create_task,
         ctx.tasklet,
-        std::move(function_name));
+        std::move(function_name),
+        ctx.cancellation);
 }
 
 } // namespace cradle
@@ -123,15 +123,17 @@ post_calculation(
     string function_name{"post_calculation"};
     auto cache_key = make_captured_sha256_hashed_id(
         function_name, ctx.session.api_url, context_id, request);
-    auto create_task = [=]() {
-        return uncached::post_calculation(ctx, context_id, request);
+    auto create_task = [=](cppcoro::cancellation_token cancellation) {
+        return uncached::post_calculation(
+            with_cancellation(ctx, cancellation), context_id, request);
     };
     return make_shared_task_for_cacheable<string>(
         ctx.service,
         std::move(cache_key),
         create_task,
         ctx.tasklet,
-        std::move(function_name));
+        std::move(function_name),
+        ctx.cancellation);
 }
 
 optional<calculation_status>
@@ -323,16 +325,17 @@ retrieve_calculation_request(
     string function_name{"retrieve_calculation_request"};
     auto cache_key = make_captured_sha256_hashed_id(
         function_name, ctx.session.api_url, context_id, calc_id);
-    auto create_task = [=]() {
+    auto create_task = [=](cppcoro::cancellation_token cancellation) {
         return uncached::retrieve_calculation_request(
-            ctx, context_id, calc_id);
+            with_cancellation(ctx, cancellation), context_id, calc_id);
     };
     return make_shared_task_for_cacheable<thinknode_calc_request>(
         ctx.service,
         std::move(cache_key),
         create_task,
         ctx.tasklet,
-        std::move(function_name));
+        std::move(function_name),
+        ctx.cancellation);
 }
 
 // Substitute the variables in a Thinknode request for new requests.
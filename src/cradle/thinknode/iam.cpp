@@ -44,14 +44,17 @@ get_context_contents(thinknode_request_context ctx, string context_id)
     string function_name{"get_context_contents"};
     auto cache_key = make_captured_sha256_hashed_id(
         function_name, ctx.session.api_url, context_id);
-    auto create_task
-        = [=]() { return uncached::get_context_contents(ctx, context_id); };
+    auto create_task = [=](cppcoro::cancellation_token cancellation) {
+        return uncached::get_context_contents(
+            with_cancellation(ctx, cancellation), context_id);
+    };
     return make_shared_task_for_cacheable<thinknode_context_contents>(
         ctx.service,
         std::move(cache_key),
         create_task,
         ctx.tasklet,
-        std::move(function_name));
+        std::move(function_name),
+        ctx.cancellation);
 }
 
 cppcoro::shared_task<string>
@@ -78,16 +78,20 @@ resolve_iss_object_to_immutable(
         ctx.session.api_url,
         ignore_upgrades ? "n/a" : context_id,
         object_id);
-    auto create_task = [=]() {
+    auto create_task = [=](cppcoro::cancellation_token cancellation) {
         return uncached::resolve_iss_object_to_immutable(
-            ctx, context_id, object_id, ignore_upgrades);
+            with_cancellation(ctx, cancellation),
+            context_id,
+            object_id,
+            ignore_upgrades);
     };
     return make_shared_task_for_cacheable<string>(
         ctx.service,
         std::move(cache_key),
         create_task,
         ctx.tasklet,
-        std::move(function_name));
+        std::move(function_name),
+        ctx.cancellation);
 }
 
 namespace uncached {
@@ -142,15 +146,17 @@ get_iss_object_metadata(
     string function_name{"get_iss_object_metadata"};
     auto cache_key = make_captured_sha256_hashed_id(
         function_name, ctx.session.api_url, context_id, object_id);
-    auto create_task = [=]() {
-        return uncached::get_iss_object_metadata(ctx, context_id, object_id);
+    auto create_task = [=](cppcoro::cancellation_token cancellation) {
+        return uncached::get_iss_object_metadata(
+            with_cancellation(ctx, cancellation), context_id, object_id);
     };
     return make_shared_task_for_cacheable<std::map<string, string>>(
         ctx.service,
         std::move(cache_key),
         create_task,
         ctx.tasklet,
-        std::move(function_name));
+        std::move(function_name),
+        ctx.cancellation);
 }
 
 namespace uncached {
@@ -180,15 +186,17 @@ retrieve_immutable(
     string function_name{"retrieve_immutable"};
     auto cache_key = make_captured_sha256_hashed_id(
         function_name, ctx.session.api_url, immutable_id);
-    auto create_task = [=]() {
-        return uncached::retrieve_immutable(ctx, context_id, immutable_id);
+    auto create_task = [=](cppcoro::cancellation_token cancellation) {
+        return uncached::retrieve_immutable(
+            with_cancellation(ctx, cancellation), context_id, immutable_id);
     };
     return make_shared_task_for_cacheable<dynamic>(
         ctx.service,
         std::move(cache_key),
         create_task,
         ctx.tasklet,
-        std::move(function_name));
+        std::move(function_name),
+        ctx.cancellation);
 }
 
 namespace uncached {
@@ -218,16 +226,17 @@ retrieve_immutable_blob(
     string function_name{"retrieve_immutable_blob"};
     auto cache_key = make_captured_sha256_hashed_id(
         function_name, ctx.session.api_url, immutable_id);
-    auto create_task = [=]() {
+    auto create_task = [=](cppcoro::cancellation_token cancellation) {
         return uncached::retrieve_immutable_blob(
-            ctx, context_id, immutable_id);
+            with_cancellation(ctx, cancellation), context_id, immutable_id);
     };
     return make_shared_task_for_cacheable<blob>(
         ctx.service,
         std::move(cache_key),
         create_task,
         ctx.tasklet,
-        std::move(function_name));
+        std::move(function_name),
+        ctx.cancellation);
 }
 
 string
@@ -507,15 +516,20 @@ post_iss_object(
         context_id,
         get_url_type_string(ctx.session, schema),
         data_hash);
-    auto create_task = [=]() {
-        return uncached::post_iss_object(ctx, context_id, schema, object_data);
+    auto create_task = [=](cppcoro::cancellation_token cancellation) {
+        return uncached::post_iss_object(
+            with_cancellation(ctx, cancellation),
+            context_id,
+            schema,
+            object_data);
     };
     return make_shared_task_for_cacheable<string>(
         ctx.service,
         std::move(cache_key),
         create_task,
         ctx.tasklet,
-        std::move(function_name));
+        std::move(function_name),
+        ctx.cancellation);
 }
 
 cppcoro::shared_task<string>
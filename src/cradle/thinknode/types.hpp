@@ -1,6 +1,8 @@
 #ifndef CRADLE_THINKNODE_TYPES_HPP
 #define CRADLE_THINKNODE_TYPES_HPP
 
+#include <cppcoro/cancellation_token.hpp>
+
 #include <cradle/typing/core.h>
 
 namespace cradle {
@@ -32,6 +34,9 @@ struct thinknode_request_context
     service_core& service;
     thinknode_session session;
     tasklet_tracker* tasklet;
+    // cancelled when the result of the request is no longer wanted (e.g.,
+    // because the client that made it has disconnected)
+    cppcoro::cancellation_token cancellation = {};
 };
 
 struct thinknode_array_info;
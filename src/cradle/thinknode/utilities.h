@@ -22,7 +22,19 @@ get_thinknode_service_id(string const& thinknode_id);
 inline cppcoro::task<http_response>
 async_http_request(thinknode_request_context ctx, http_request request)
 {
-    return async_http_request(ctx.service, std::move(request), ctx.tasklet);
+    return async_http_request(
+        ctx.service, std::move(request), ctx.tasklet, ctx.cancellation);
+}
+
+// Get a copy of :ctx whose work is cancelled via :cancellation. Work that's
+// shared through the cache uses the cache entry's token (rather than that of
+// whichever request happened to start it).
+inline thinknode_request_context
+with_cancellation(
+    thinknode_request_context ctx, cppcoro::cancellation_token cancellation)
+{
+    ctx.cancellation = std::move(cancellation);
+    return ctx;
 }
 
 void
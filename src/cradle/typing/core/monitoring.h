@@ -1,6 +1,8 @@
 #ifndef CRADLE_TYPING_CORE_MONITORING_HPP
 #define CRADLE_TYPING_CORE_MONITORING_HPP
 
+#include <cppcoro/cancellation_token.hpp>
+
 namespace cradle {
 
 // A lot of CRADLE algorithms use callbacks to report progress or check in with
@@ -108,6 +110,25 @@ struct null_check_in : check_in_interface
     }
 };
 
+// This aborts the algorithm (with cppcoro::operation_cancelled) once
+// cancellation is requested for :token.
+struct cancellation_check_in : check_in_interface
+{
+    cancellation_check_in(cppcoro::cancellation_token token)
+        : token_(std::move(token))
+    {
+    }
+
+    void
+    operator()()
+    {
+        token_.throw_if_cancellation_requested();
+    }
+
+ private:
+    cppcoro::cancellation_token token_;
+};
+
 // If you need an algorithm to check in with two different controllers, you
 // can use this to merge the check_in objects supplied by the two controllers.
 struct merged_check_in : check_in_interface
@@ -17,20 +17,199 @@ namespace cradle {
 
 namespace {
 
+immutable_cache_eviction_policy
+to_immutable_cache_eviction_policy(
+    service_immutable_cache_eviction_policy policy)
+{
+    switch (policy)
+    {
+        case service_immutable_cache_eviction_policy::LRU:
+        default:
+            return immutable_cache_eviction_policy::LRU;
+        case service_immutable_cache_eviction_policy::CLOCK:
+            return immutable_cache_eviction_policy::CLOCK;
+        case service_immutable_cache_eviction_policy::TWO_Q:
+            return immutable_cache_eviction_policy::TWO_Q;
+        case service_immutable_cache_eviction_policy::GREEDY_DUAL_SIZE:
+            return immutable_cache_eviction_policy::GREEDY_DUAL_SIZE;
+    }
+}
+
+disk_cache_verification_mode
+to_disk_cache_verification_mode(service_disk_cache_verification_mode mode)
+{
+    switch (mode)
+    {
+        case service_disk_cache_verification_mode::FULL:
+        default:
+            return disk_cache_verification_mode::FULL;
+        case service_disk_cache_verification_mode::SAMPLED:
+            return disk_cache_verification_mode::SAMPLED;
+        case service_disk_cache_verification_mode::LAZY:
+            return disk_cache_verification_mode::LAZY;
+    }
+}
+
 inner_service_config
 make_inner_service_config(service_config const& svc_config)
 {
     inner_service_config res;
     if (svc_config.immutable_cache)
     {
-        res.immutable_cache = immutable_cache_config{static_cast<size_t>(
-            svc_config.immutable_cache->unused_size_limit)};
+        auto const& ic_config = *svc_config.immutable_cache;
+        res.immutable_cache = immutable_cache_config{
+            static_cast<size_t>(ic_config.unused_size_limit)};
+        if (ic_config.shard_count)
+        {
+            res.immutable_cache->shard_count
+                = static_cast<size_t>(*ic_config.shard_count);
+        }
+        if (ic_config.eviction_policy)
+        {
+            res.immutable_cache->eviction_policy
+                = to_immutable_cache_eviction_policy(
+                    *ic_config.eviction_policy);
+        }
+        if (ic_config.total_size_limit)
+        {
+            res.immutable_cache->total_size_limit
+                = static_cast<size_t>(*ic_config.total_size_limit);
+        }
+        if (ic_config.retry_policy)
+        {
+            auto const& svc_retry = *ic_config.retry_policy;
+            auto& retry = res.immutable_cache->retry_policy;
+            retry.initial_delay
+                = std::chrono::milliseconds(svc_retry.initial_delay);
+            retry.max_delay = std::chrono::milliseconds(svc_retry.max_delay);
+            if (svc_retry.max_attempts)
+            {
+                retry.max_attempts
+                    = static_cast<unsigned>(*svc_retry.max_attempts);
+            }
+            if (svc_retry.backoff_factor)
+                retry.backoff_factor = *svc_retry.backoff_factor;
+        }
+    }
+    if (svc_config.compressed_memory_cache)
+    {
+        res.compressed_memory_cache = compressed_memory_cache_config{
+            static_cast<size_t>(
+                svc_config.compressed_memory_cache->size_limit)};
     }
     if (svc_config.disk_cache)
     {
         res.disk_cache = disk_cache_config{
             svc_config.disk_cache->directory,
             static_cast<size_t>(svc_config.disk_cache->size_limit)};
+        if (svc_config.disk_cache->reader_count)
+        {
+            res.disk_cache->reader_count
+                = static_cast<unsigned>(*svc_config.disk_cache->reader_count);
+        }
+        if (svc_config.disk_cache->write_batch_size)
+        {
+            res.disk_cache->write_batch_size = static_cast<unsigned>(
+                *svc_config.disk_cache->write_batch_size);
+        }
+        if (svc_config.disk_cache->write_batch_delay)
+        {
+            res.disk_cache->write_batch_delay = std::chrono::milliseconds(
+                *svc_config.disk_cache->write_batch_delay);
+        }
+        if (svc_config.disk_cache->shards)
+        {
+            for (auto const& shard : *svc_config.disk_cache->shards)
+            {
+                res.disk_cache->shards.push_back(disk_cache_shard_config{
+                    shard.directory, static_cast<size_t>(shard.size_limit)});
+            }
+        }
+        if (svc_config.disk_cache->maintenance_interval)
+        {
+            res.disk_cache->maintenance_interval = std::chrono::milliseconds(
+                *svc_config.disk_cache->maintenance_interval);
+        }
+        if (svc_config.disk_cache->rebuild_legacy_index)
+        {
+            res.disk_cache->rebuild_legacy_index
+                = *svc_config.disk_cache->rebuild_legacy_index;
+        }
+        if (svc_config.disk_cache->namespaces)
+        {
+            for (auto const& ns : *svc_config.disk_cache->namespaces)
+            {
+                disk_cache_namespace_config namespace_config;
+                namespace_config.name = ns.name;
+                if (ns.size_limit)
+                {
+                    namespace_config.size_limit
+                        = static_cast<size_t>(*ns.size_limit);
+                }
+                if (ns.pinned)
+                    namespace_config.pinned = *ns.pinned;
+                res.disk_cache->namespaces.push_back(namespace_config);
+            }
+        }
+        if (svc_config.disk_cache->write_queue_size_limit)
+        {
+            res.disk_write_queue = disk_write_queue_config{};
+            res.disk_write_queue->size_limit = static_cast<size_t>(
+                *svc_config.disk_cache->write_queue_size_limit);
+        }
+        if (svc_config.disk_cache->deduplicate_files)
+        {
+            res.deduplicate_disk_cache_files
+                = *svc_config.disk_cache->deduplicate_files;
+        }
+        if (svc_config.disk_cache->verification_mode)
+        {
+            res.disk_cache_verification = disk_cache_verification_config{
+                to_disk_cache_verification_mode(
+                    *svc_config.disk_cache->verification_mode)};
+            if (svc_config.disk_cache->verification_sampling_interval)
+            {
+                res.disk_cache_verification->sampling_interval
+                    = static_cast<unsigned>(
+                        *svc_config.disk_cache
+                             ->verification_sampling_interval);
+            }
+        }
+    }
+    if (svc_config.cache_warm_up)
+    {
+        auto const& warm_up = *svc_config.cache_warm_up;
+        res.cache_warm_up = cache_warm_up_config{
+            static_cast<size_t>(warm_up.size_limit)};
+        if (warm_up.concurrency)
+        {
+            res.cache_warm_up->concurrency
+                = static_cast<unsigned>(*warm_up.concurrency);
+        }
+    }
+    res.scheduler = task_scheduler_config{};
+    if (svc_config.thread_count)
+    {
+        res.scheduler->thread_count
+            = static_cast<unsigned>(*svc_config.thread_count);
+    }
+    if (svc_config.task_queues)
+    {
+        for (auto const& queue : *svc_config.task_queues)
+        {
+            res.scheduler->queue_concurrency[queue.name]
+                = static_cast<unsigned>(queue.concurrency);
+        }
+    }
+    if (svc_config.peer_cache)
+    {
+        auto const& peer_cache = *svc_config.peer_cache;
+        res.peer_cache = peer_cache_config{peer_cache.peers, peer_cache.self};
+        if (peer_cache.request_timeout)
+        {
+            res.peer_cache->request_timeout
+                = std::chrono::milliseconds(*peer_cache.request_timeout);
+        }
     }
     return res;
 }
@@ -48,15 +227,30 @@ void
 service_core::reset(service_config const& svc_config)
 {
     inner_reset(make_inner_service_config(svc_config));
+    unsigned http_concurrency
+        = svc_config.http_concurrency
+              ? static_cast<unsigned>(*svc_config.http_concurrency)
+              : 36;
+    unsigned compute_concurrency
+        = svc_config.compute_concurrency
+              ? static_cast<unsigned>(*svc_config.compute_concurrency)
+              : 4;
     impl_.reset(new detail::service_core_internals{
-        .http_pool = cppcoro::static_thread_pool(
-            svc_config.http_concurrency ? *svc_config.http_concurrency : 36),
+        // HTTP requests mostly wait on the network, so they get threads of
+        // their own.
+        .http_pool = inner_internals().scheduler.get_queue(
+            "http", http_concurrency, task_queue_kind::BLOCKING),
+        .local_compute_concurrency = compute_concurrency,
         .local_compute_pool{},
+        .local_compute_pool_mutex{},
         .mock_http{}});
 }
 
 service_core::~service_core()
 {
+    // Shut down the inner core first, since jobs that are still running on
+    // its scheduler may use this layer's internals.
+    inner_reset();
 }
 
 http_connection_interface&
@@ -78,34 +272,49 @@ http_connection_for_thread(service_core& core)
 
 cppcoro::task<http_response>
 async_http_request(
-    service_core& core, http_request request, tasklet_tracker* client)
+    service_core& core,
+    http_request request,
+    tasklet_tracker* client,
+    cppcoro::cancellation_token cancellation)
 {
     std::ostringstream s;
     s << "HTTP: " << request.method << " " << request.url;
     auto tasklet = create_tasklet_tracker("HTTP", s.str(), client);
     co_await core.internals().http_pool.schedule();
+    // The request may have waited in the queue for a while, so check before
+    // starting it (and during the transfer).
+    cancellation.throw_if_cancellation_requested();
     tasklet_run tasklet_run(tasklet);
-    null_check_in check_in;
+    cancellation_check_in check_in(cancellation);
     null_progress_reporter reporter;
     co_return http_connection_for_thread(core).perform_request(
         check_in, reporter, request);
 }
 
+template<>
+blob
+to_cached_blob(dynamic const& value)
+{
+    return make_blob(write_natively_encoded_value(value));
+}
+
 template<>
 cppcoro::task<dynamic>
 disk_cached(
     inner_service_core& core,
     id_interface const& key,
-    std::function<cppcoro::task<dynamic>()> create_task)
+    std::function<cppcoro::task<dynamic>()> create_task,
+    std::string key_namespace)
 {
     auto dynamic_to_blob = [](dynamic x) -> blob {
-        return make_blob(write_natively_encoded_value(x));
+        return to_cached_blob(x);
     };
     auto create_blob_task = [&]() {
         return cppcoro::make_task(
             cppcoro::fmap(dynamic_to_blob, create_task()));
     };
-    blob x = co_await disk_cached<blob>(core, key, create_blob_task);
+    blob x = co_await disk_cached<blob>(
+        core, key, create_blob_task, std::move(key_namespace));
     auto data = reinterpret_cast<uint8_t const*>(x.data());
     co_return read_natively_encoded_value(data, x.size());
 }
@@ -118,11 +327,30 @@ init_test_service(service_core& core)
     reset_directory(cache_dir);
 
     core.reset(service_config(
-        service_immutable_cache_config(0x40'00'00'00),
-        service_disk_cache_config(some(cache_dir.string()), 0x40'00'00'00),
+        service_immutable_cache_config(
+            0x40'00'00'00, none, none, none, none),
+        service_disk_cache_config(
+            some(cache_dir.string()),
+            0x40'00'00'00,
+            none,
+            none,
+            none,
+            none,
+            none,
+            none,
+            none,
+            none,
+            none,
+            none,
+            none),
+        2,
         2,
         2,
-        2));
+        none,
+        none,
+        none,
+        none,
+        none));
 }
 
 mock_http_session&
@@ -47,33 +47,52 @@ struct service_core : public inner_service_core
 http_connection_interface&
 http_connection_for_thread(service_core& core);
 
+// If :cancellation is requested, the request is abandoned (and the task
+// fails with cppcoro::operation_cancelled).
 cppcoro::task<http_response>
 async_http_request(
     service_core& core,
     http_request request,
-    tasklet_tracker* client = nullptr);
+    tasklet_tracker* client = nullptr,
+    cppcoro::cancellation_token cancellation = {});
+
+template<>
+blob
+to_cached_blob(dynamic const& value);
+
+template<class Value>
+blob
+to_cached_blob(Value const& value)
+{
+    return to_cached_blob(to_dynamic(value));
+}
 
 template<>
 cppcoro::task<dynamic>
 disk_cached(
     inner_service_core& core,
     id_interface const& key,
-    std::function<cppcoro::task<dynamic>()> create_task);
+    std::function<cppcoro::task<dynamic>()> create_task,
+    std::string key_namespace);
 
 template<class Value>
 cppcoro::task<Value>
 disk_cached(
     inner_service_core& core,
     id_interface const& key,
-    std::function<cppcoro::task<Value>()> create_task)
+    std::function<cppcoro::task<Value>()> create_task,
+    std::string key_namespace)
 {
     return cppcoro::make_task(cppcoro::fmap(
         CRADLE_LAMBDIFY(from_dynamic<Value>),
         disk_cached<dynamic>(
-            core, key, [create_task = std::move(create_task)]() {
+            core,
+            key,
+            [create_task = std::move(create_task)]() {
                 return cppcoro::make_task(cppcoro::fmap(
                     CRADLE_LAMBDIFY(to_dynamic<Value>), create_task()));
-            })));
+            },
+            std::move(key_namespace))));
 }
 
 // Initialize a service for unit testing purposes.
@@ -1,7 +1,7 @@
 #ifndef CRADLE_TYPING_SERVICE_INTERNALS_H
 #define CRADLE_TYPING_SERVICE_INTERNALS_H
 
-#include <cppcoro/static_thread_pool.hpp>
+#include <mutex>
 
 #include <cradle/inner/service/internals.h>
 #include <cradle/thinknode/types.hpp>
@@ -13,12 +13,14 @@ namespace detail {
 
 struct service_core_internals
 {
-    cppcoro::static_thread_pool http_pool;
+    // (The queues belong to the inner core's scheduler.)
+    task_queue http_pool;
 
-    std::map<
-        std::pair<string, thinknode_provider_image_info>,
-        cppcoro::static_thread_pool>
+    // the concurrency limit for each image's local compute queue
+    unsigned local_compute_concurrency;
+    std::map<std::pair<string, thinknode_provider_image_info>, task_queue>
         local_compute_pool;
+    std::mutex local_compute_pool_mutex;
 
     std::unique_ptr<mock_http_session> mock_http;
 };
@@ -6,12 +6,102 @@
 
 namespace cradle {
 
+api(enum)
+enum class service_immutable_cache_eviction_policy
+{
+    LRU,
+    CLOCK,
+    TWO_Q,
+    GREEDY_DUAL_SIZE
+};
+
+api(struct)
+struct service_immutable_cache_retry_config
+{
+    // how long a failure is remembered before the entry may be retried, in
+    // milliseconds
+    integer initial_delay;
+
+    // the maximum delay (after exponential backoff), in milliseconds
+    integer max_delay;
+
+    // the maximum number of attempts to compute an entry - By default, there
+    // is no limit.
+    omissible<integer> max_attempts;
+
+    // the factor by which each consecutive failure multiplies the delay -
+    // The default is 2.
+    omissible<double> backoff_factor;
+};
+
 api(struct)
 struct service_immutable_cache_config
 {
     // The maximum amount of memory to use for caching results that are no
     // longer in use, in bytes.
     integer unused_size_limit;
+
+    // the number of independent shards to split the cache into -
+    // The default is a single shard.
+    omissible<integer> shard_count;
+
+    // the policy for choosing which unused entries to evict -
+    // The default is LRU.
+    omissible<service_immutable_cache_eviction_policy> eviction_policy;
+
+    // The maximum amount of memory to use for all cached results (whether or
+    // not they're in use), in bytes. By default, there is no such limit.
+    omissible<integer> total_size_limit;
+
+    // the policy for retrying entries that failed - By default, failures are
+    // retried immediately.
+    omissible<service_immutable_cache_retry_config> retry_policy;
+};
+
+api(struct)
+struct service_compressed_memory_cache_config
+{
+    // the maximum amount of memory to use for compressed values, in bytes
+    integer size_limit;
+};
+
+api(struct)
+struct service_cache_warm_up_config
+{
+    // the maximum total size of the entries to preload, in bytes
+    integer size_limit;
+
+    // the maximum number of entries to load concurrently - The default is 1.
+    omissible<integer> concurrency;
+};
+
+api(enum)
+enum class service_disk_cache_verification_mode
+{
+    FULL,
+    SAMPLED,
+    LAZY
+};
+
+api(struct)
+struct service_disk_cache_shard_config
+{
+    std::string directory;
+    integer size_limit;
+};
+
+api(struct)
+struct service_disk_cache_namespace_config
+{
+    std::string name;
+
+    // If this is provided (and nonzero), the namespace's entries are evicted
+    // whenever their total size exceeds this many bytes.
+    omissible<integer> size_limit;
+
+    // If this is true, the namespace's entries are only evicted (to satisfy
+    // the cache's overall size limit) when there's nothing else to evict.
+    omissible<bool> pinned;
 };
 
 api(struct)
@@ -19,6 +109,80 @@ struct service_disk_cache_config
 {
     optional<std::string> directory;
     integer size_limit;
+
+    // the number of read-only connections to use for lookups - If this is
+    // provided (and nonzero), the disk cache uses WAL journaling so that
+    // lookups can proceed in parallel.
+    omissible<integer> reader_count;
+
+    // If this is provided (and greater than 1), writes are grouped into
+    // transactions of up to this many entries...
+    omissible<integer> write_batch_size;
+
+    // ... which are committed after at most this many milliseconds.
+    omissible<integer> write_batch_delay;
+
+    // how files are checked against their checksums when they're read -
+    // The default is FULL.
+    omissible<service_disk_cache_verification_mode> verification_mode;
+
+    // for SAMPLED verification, how many reads there are per checked read -
+    // The default is 16.
+    omissible<integer> verification_sampling_interval;
+
+    // If this is provided, the cache is split across these directories
+    // (typically on separate devices), and :directory and :size_limit are
+    // ignored.
+    omissible<std::vector<service_disk_cache_shard_config>> shards;
+
+    // how long (in milliseconds) the cache must be idle before it does
+    // maintenance in the background (0 disables it) - The default is one
+    // minute.
+    omissible<integer> maintenance_interval;
+
+    // namespaces with their own size limits or pinning (e.g.,
+    // "local_function_calc" or "retrieve_immutable")
+    omissible<std::vector<service_disk_cache_namespace_config>> namespaces;
+
+    // the maximum total size (in bytes) of the values waiting to be written
+    // to the cache (beyond which writes are dropped) - The default is
+    // 256 MB.
+    omissible<integer> write_queue_size_limit;
+
+    // Should files with identical values be shared? This requires hashing
+    // every value that's written to a file. The default is false.
+    omissible<bool> deduplicate_files;
+
+    // Should an index from an older version be rebuilt at startup so that
+    // maintenance can return its free space to the file system? This can
+    // take a while for a large cache. The default is false.
+    omissible<bool> rebuild_legacy_index;
+};
+
+api(struct)
+struct service_peer_cache_config
+{
+    // the addresses ("host:port") of all the services that share their
+    // caches, including this one - All of them must be given the same list.
+    std::vector<std::string> peers;
+
+    // this service's own address (which must appear in :peers) - The service
+    // listens on its port for requests from the other peers.
+    std::string self;
+
+    // how long (in milliseconds) to wait for another peer to respond -
+    // The default is one second.
+    omissible<integer> request_timeout;
+};
+
+api(struct)
+struct service_task_queue_config
+{
+    // the name of the queue (e.g., "http", "disk_read", or "request")
+    std::string name;
+
+    // the maximum number of the queue's jobs that can run at once
+    integer concurrency;
 };
 
 api(struct)
@@ -30,16 +194,36 @@ struct service_config
     // config for the disk cache
     omissible<service_disk_cache_config> disk_cache;
 
-    // how many concurrent threads to use for request handling -
-    // The default is one thread for each processor core.
+    // how many requests to handle concurrently -
+    // The default is one for each processor core.
     omissible<integer> request_concurrency;
 
-    // how many concurrent threads to use for computing -
-    // The default is one thread for each processor core.
+    // how many local calculations to run concurrently for each image -
+    // The default is 4.
     omissible<integer> compute_concurrency;
 
-    // how many concurrent threads to use for HTTP requests
+    // how many HTTP requests to make concurrently - The default is 36.
     omissible<integer> http_concurrency;
+
+    // If this is provided, the most recently used disk cache entries are
+    // preloaded into the compressed memory cache at startup.
+    omissible<service_cache_warm_up_config> cache_warm_up;
+
+    // If this is provided, the service shares its cached values with other
+    // services.
+    omissible<service_peer_cache_config> peer_cache;
+
+    // the number of threads that do the service's work (for all of the above)
+    // - The default is one for each processor core.
+    omissible<integer> thread_count;
+
+    // concurrency limits for individual task queues (which override the
+    // limits given above)
+    omissible<std::vector<service_task_queue_config>> task_queues;
+
+    // config for the compressed memory cache that holds values evicted from
+    // the immutable memory cache - By default, there is no such cache.
+    omissible<service_compressed_memory_cache_config> compressed_memory_cache;
 };
 
 } // namespace cradle
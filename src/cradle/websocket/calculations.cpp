@@ -48,6 +48,7 @@ perform_lambda_calc(
     co_await get_local_compute_pool_for_image(
         ctx.service, std::make_pair(app, image))
         .schedule();
+    ctx.cancellation.throw_if_cancellation_requested();
 
     auto run_guard = tasklet_run(tasklet);
     co_return function.object(std::move(args), tasklet);
@@ -69,10 +70,15 @@ perform_lambda_calc(
 
     auto await_guard = tasklet_await(ctx.tasklet, function_name, cache_key);
     co_return co_await cached<dynamic>(
-        ctx.service, cache_key, [&](id_interface const&) {
+        ctx.service,
+        cache_key,
+        [&](id_interface const&, cppcoro::cancellation_token cancellation) {
             return uncached::perform_lambda_calc(
-                ctx, function, std::move(args));
-        });
+                with_cancellation(ctx, cancellation),
+                function,
+                std::move(args));
+        },
+        ctx.cancellation);
 }
 
 cppcoro::task<std::string>
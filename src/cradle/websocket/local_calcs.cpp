@@ -27,14 +27,27 @@
 
 namespace cradle {
 
-cppcoro::static_thread_pool&
+task_queue
 get_local_compute_pool_for_image(
     service_core& service,
     std::pair<std::string, thinknode_provider_image_info> const& tag)
 {
-    return service.internals()
-        .local_compute_pool.try_emplace(tag, 4)
-        .first->second;
+    auto& internals = service.internals();
+    std::scoped_lock<std::mutex> lock(internals.local_compute_pool_mutex);
+    auto pool = internals.local_compute_pool.find(tag);
+    if (pool == internals.local_compute_pool.end())
+    {
+        // Each image gets its own queue (and limit), but they're all named
+        // after the app, so they share any limit from the config.
+        pool = internals.local_compute_pool
+                   .emplace(
+                       tag,
+                       service.inner_internals().scheduler.add_queue(
+                           "local@" + tag.first,
+                           internals.local_compute_concurrency))
+                   .first;
+    }
+    return pool->second;
 }
 
 namespace uncached {
@@ -58,6 +71,9 @@ perform_local_function_calc(
     co_await get_local_compute_pool_for_image(
         ctx.service, std::make_pair(app, image))
         .schedule();
+    // The calculation itself can't be interrupted, but if nobody wants its
+    // result anymore, there's no point in starting it.
+    ctx.cancellation.throw_if_cancellation_requested();
 
     auto run_guard = tasklet_run(tasklet);
     co_return supervise_thinknode_calculation(
@@ -86,12 +102,21 @@ perform_local_function_calc(
 
     tasklet_await around_await(
         ctx.tasklet, "perform_local_function_calc", cache_key);
-    auto task_creator = [&] {
+    auto task_creator = [&](cppcoro::cancellation_token cancellation) {
         return uncached::perform_local_function_calc(
-            ctx, context_id, account, app, name, std::move(args));
+            with_cancellation(ctx, cancellation),
+            context_id,
+            account,
+            app,
+            name,
+            std::move(args));
     };
-    auto result
-        = co_await fully_cached<dynamic>(ctx.service, cache_key, task_creator);
+    auto result = co_await fully_cached<dynamic>(
+        ctx.service,
+        cache_key,
+        task_creator,
+        "local_function_calc",
+        ctx.cancellation);
     co_return result;
 }
 
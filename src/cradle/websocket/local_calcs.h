@@ -4,15 +4,15 @@
 #include <string>
 #include <utility>
 
-#include <cppcoro/static_thread_pool.hpp>
-
 #include <cradle/inner/introspection/tasklet.h>
+#include <cradle/inner/service/task_scheduler.h>
 #include <cradle/thinknode/types.hpp>
 #include <cradle/typing/service/core.h>
 
 namespace cradle {
 
-cppcoro::static_thread_pool&
+// Get the task queue for local calculations with the given image.
+task_queue
 get_local_compute_pool_for_image(
     service_core& service,
     std::pair<std::string, thinknode_provider_image_info> const& tag);
@@ -31,8 +31,8 @@
 #endif
 
 #include <cppcoro/async_scope.hpp>
-#include <cppcoro/schedule_on.hpp>
-#include <cppcoro/static_thread_pool.hpp>
+#include <cppcoro/cancellation_source.hpp>
+#include <cppcoro/operation_cancelled.hpp>
 #include <cppcoro/sync_wait.hpp>
 #include <cppcoro/task.hpp>
 #include <cppcoro/when_all.hpp>
@@ -42,6 +42,7 @@
 #include <cradle/inner/fs/app_dirs.h>
 #include <cradle/inner/fs/file_io.h>
 #include <cradle/inner/introspection/tasklet.h>
+#include <cradle/inner/service/task_scheduler.h>
 #include <cradle/inner/utilities/errors.h>
 #include <cradle/inner/utilities/functional.h>
 #include <cradle/inner/utilities/text.h>
@@ -114,6 +115,9 @@ struct client_connection
     int id;
     string name;
     thinknode_session session;
+    // cancelled when the client disconnects (so that work that's only being
+    // done for it can stop)
+    cppcoro::cancellation_source cancellation;
 };
 
 struct client_connection_list
@@ -175,8 +179,34 @@ struct client_request
     connection_hdl client;
     websocket_client_message message;
     tasklet_tracker* tasklet;
+    // the priority of the request's work (on all of the service's queues)
+    task_priority priority;
 };
 
+// Get the priority for a request. Quick lookups that the UI waits on come
+// first, and bulk copies come last.
+static task_priority
+get_request_priority(client_message_content const& content)
+{
+    switch (get_tag(content))
+    {
+        case client_message_content_tag::REGISTRATION:
+        case client_message_content_tag::CACHE_QUERY:
+        case client_message_content_tag::ISS_OBJECT:
+        case client_message_content_tag::RESOLVE_ISS_OBJECT:
+        case client_message_content_tag::ISS_OBJECT_METADATA:
+        case client_message_content_tag::RESOLVE_META_CHAIN:
+        case client_message_content_tag::INTROSPECTION_CONTROL:
+        case client_message_content_tag::INTROSPECTION_STATUS_QUERY:
+            return task_priority::HIGH;
+        case client_message_content_tag::COPY_ISS_OBJECT:
+        case client_message_content_tag::COPY_CALCULATION:
+            return task_priority::LOW;
+        default:
+            return task_priority::NORMAL;
+    }
+}
+
 struct websocket_server_impl
 {
     server_config config;
@@ -185,7 +215,8 @@ struct websocket_server_impl
     client_connection_list clients;
     service_core core;
     cppcoro::async_scope async_scope;
-    cppcoro::static_thread_pool pool;
+    // the queue (on the core's scheduler) where requests are processed
+    task_queue pool;
 };
 
 static void
@@ -325,15 +356,17 @@ resolve_named_type_reference(
     string function_name{"resolve_named_type_reference"};
     auto cache_key = make_captured_sha256_hashed_id(
         function_name, ctx.session.api_url, context_id, ref);
-    auto create_task = [=]() {
-        return uncached::resolve_named_type_reference(ctx, context_id, ref);
+    auto create_task = [=](cppcoro::cancellation_token cancellation) {
+        return uncached::resolve_named_type_reference(
+            with_cancellation(ctx, cancellation), context_id, ref);
     };
     return make_shared_task_for_cacheable<api_type_info>(
         ctx.service,
         std::move(cache_key),
         create_task,
         ctx.tasklet,
-        std::move(function_name));
+        std::move(function_name),
+        ctx.cancellation);
 }
 
 namespace uncached {
@@ -410,16 +443,21 @@ coerce_encoded_object(
         schema,
         encoding,
         data_hash);
-    auto create_task = [=]() {
+    auto create_task = [=](cppcoro::cancellation_token cancellation) {
         return uncached::coerce_encoded_object(
-            ctx, context_id, schema, encoding, encoded_object);
+            with_cancellation(ctx, cancellation),
+            context_id,
+            schema,
+            encoding,
+            encoded_object);
     };
     return make_shared_task_for_cacheable<blob>(
         ctx.service,
         std::move(cache_key),
         create_task,
         ctx.tasklet,
-        std::move(function_name));
+        std::move(function_name),
+        ctx.cancellation);
 }
 
 static cppcoro::task<string>
@@ -547,11 +585,15 @@ type_contains_references(
 
     auto cache_key = make_sha256_hashed_id(
         "type_contains_references", ctx.session.api_url, context_id, type);
-    auto create_task = [&] {
+    auto create_task = [&](cppcoro::cancellation_token cancellation) {
         return uncached::type_contains_references(
-            ctx, already_visited, context_id, type);
+            with_cancellation(ctx, cancellation),
+            already_visited,
+            context_id,
+            type);
     };
-    co_return co_await fully_cached<bool>(ctx.service, cache_key, create_task);
+    co_return co_await fully_cached<bool>(
+        ctx.service, cache_key, create_task, "", ctx.cancellation);
 }
 
 cppcoro::task<nil_t>
@@ -745,16 +787,16 @@ deeply_copy_iss_object(
         destination_context_id,
         object_id);
 
-    auto create_task = [&] {
+    auto create_task = [&](cppcoro::cancellation_token cancellation) {
         return uncached::deeply_copy_iss_object(
-            ctx,
+            with_cancellation(ctx, cancellation),
             source_bucket,
             source_context_id,
             destination_context_id,
             object_id);
     };
     co_return co_await fully_cached<nil_t>(
-        ctx.service, cache_key, create_task);
+        ctx.service, cache_key, create_task, "", ctx.cancellation);
 }
 
 cppcoro::task<nil_t>
@@ -925,16 +967,16 @@ deeply_copy_calculation(
         source_context_id,
         destination_context_id,
         calculation_id);
-    auto create_task = [&] {
+    auto create_task = [&](cppcoro::cancellation_token cancellation) {
         return uncached::deeply_copy_calculation(
-            ctx,
+            with_cancellation(ctx, cancellation),
             source_bucket,
             source_context_id,
             destination_context_id,
             calculation_id);
     };
     co_return co_await fully_cached<nil_t>(
-        ctx.service, cache_key, create_task);
+        ctx.service, cache_key, create_task, "", ctx.cancellation);
 }
 
 static bool
@@ -1363,12 +1405,16 @@ resolve_results_api_query(
         function,
         args);
 
-    auto create_task = [&] {
+    auto create_task = [&](cppcoro::cancellation_token cancellation) {
         return uncached::uncached_resolve_results_api_query(
-            ctx, context_id, plan_iss_id, function, args);
+            with_cancellation(ctx, cancellation),
+            context_id,
+            plan_iss_id,
+            function,
+            args);
     };
     co_return co_await fully_cached<string>(
-        ctx.service, cache_key, create_task);
+        ctx.service, cache_key, create_task, "", ctx.cancellation);
 }
 
 cppcoro::task<dynamic>
@@ -1390,12 +1436,16 @@ locally_resolve_results_api_query(
         plan_iss_id,
         function,
         args);
-    auto create_task = [&] {
+    auto create_task = [&](cppcoro::cancellation_token cancellation) {
         return uncached::locally_resolve_results_api_query(
-            ctx, context_id, plan_iss_id, function, args);
+            with_cancellation(ctx, cancellation),
+            context_id,
+            plan_iss_id,
+            function,
+            args);
     };
     co_return co_await fully_cached<dynamic>(
-        ctx.service, cache_key, create_task);
+        ctx.service, cache_key, create_task, "", ctx.cancellation);
 }
 
 static void
@@ -1426,10 +1476,12 @@ static thinknode_request_context
 make_thinknode_request_context(
     websocket_server_impl& server, client_request& request)
 {
+    auto client = get_client(server.clients, request.client);
     return thinknode_request_context{
         server.core,
-        get_client(server.clients, request.client).session,
-        request.tasklet};
+        client.session,
+        request.tasklet,
+        client.cancellation.token()};
 }
 
 static cppcoro::task<>
@@ -1747,11 +1799,20 @@ static cppcoro::task<>
 process_message_with_error_handling(
     websocket_server_impl& server, client_request request)
 {
+    // Everything that the request leads to (HTTP requests, disk I/O, local
+    // calculations, etc.) inherits its priority from this.
+    co_await server.pool.schedule(request.priority);
     tasklet_run tasklet_run(request.tasklet);
     try
     {
         co_await process_message(server, request);
     }
+    catch (cppcoro::operation_cancelled&)
+    {
+        // The client has gone away, so there's nobody to respond to.
+        spdlog::get("cradle")->info(
+            "request {} cancelled", request.message.request_id);
+    }
     catch (bad_http_status_code& e)
     {
         spdlog::get("cradle")->error(e.what());
@@ -1786,7 +1847,9 @@ on_open(websocket_server_impl& server, connection_hdl hdl)
 static void
 on_close(websocket_server_impl& server, connection_hdl hdl)
 {
+    auto cancellation = get_client(server.clients, hdl).cancellation;
     remove_client(server.clients, hdl);
+    cancellation.request_cancellation();
 }
 
 static void
@@ -1819,11 +1882,10 @@ on_message(
             std::ostringstream os;
             os << "websocket: " << get_tag(message.content);
             tasklet = create_tasklet_tracker("server", os.str());
-            server.async_scope.spawn(schedule_on(
-                server.pool,
-                process_message_with_error_handling(
-                    server,
-                    client_request{hdl, std::move(message), tasklet})));
+            auto priority = get_request_priority(message.content);
+            server.async_scope.spawn(process_message_with_error_handling(
+                server,
+                client_request{hdl, std::move(message), tasklet, priority}));
         }
     }
     catch (std::exception& e)
@@ -1847,6 +1909,11 @@ initialize(websocket_server_impl& server, server_config const& config)
     server.config = config;
 
     server.core.reset(config);
+    server.pool = server.core.inner_internals().scheduler.get_queue(
+        "request",
+        config.request_concurrency
+            ? static_cast<unsigned>(*config.request_concurrency)
+            : std::thread::hardware_concurrency());
 
     server.ws.clear_access_channels(websocketpp::log::alevel::all);
     server.ws.init_asio();
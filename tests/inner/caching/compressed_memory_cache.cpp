@@ -0,0 +1,145 @@
+#include <cradle/inner/caching/compressed_memory_cache.h>
+
+#include <cstring>
+#include <string>
+
+#include <catch2/catch.hpp>
+
+using std::string;
+
+using namespace cradle;
+
+namespace {
+
+blob
+make_blob(string const& contents)
+{
+    std::shared_ptr<std::byte[]> data(new std::byte[contents.size()]);
+    std::memcpy(data.get(), contents.data(), contents.size());
+    return blob(
+        std::static_pointer_cast<std::byte const>(std::move(data)),
+        contents.size());
+}
+
+string
+blob_contents(blob const& x)
+{
+    return string(reinterpret_cast<char const*>(x.data()), x.size());
+}
+
+// Generate a (highly compressible) value for the item with the given ID.
+string
+generate_value_string(int item_id)
+{
+    return string(1000, char('a' + item_id % 26));
+}
+
+// Generate a value that LZ4 can't compress.
+string
+generate_random_string(size_t size)
+{
+    string result(size, '\0');
+    uint32_t state = 12345;
+    for (auto& c : result)
+    {
+        state = state * 1103515245 + 12345;
+        c = char(state >> 24);
+    }
+    return result;
+}
+
+} // namespace
+
+TEST_CASE("compressed memory cache basics", "[compressed_memory_cache]")
+{
+    compressed_memory_cache cache;
+    REQUIRE(!cache.is_initialized());
+    cache.reset(compressed_memory_cache_config{0x10000});
+    REQUIRE(cache.is_initialized());
+
+    REQUIRE(!cache.find("a"));
+
+    cache.insert("a", make_blob(generate_value_string(0)));
+    auto value = cache.find("a");
+    REQUIRE(value);
+    REQUIRE(blob_contents(*value) == generate_value_string(0));
+
+    auto info = cache.get_summary_info();
+    REQUIRE(info.entry_count == 1);
+    REQUIRE(info.original_size == 1000);
+    // The value should have been compressed.
+    REQUIRE(info.total_size < 100);
+    REQUIRE(info.hit_count == 1);
+    REQUIRE(info.miss_count == 1);
+
+    // Replacing an entry shouldn't leak its size.
+    cache.insert("a", make_blob(generate_value_string(1)));
+    REQUIRE(blob_contents(*cache.find("a")) == generate_value_string(1));
+    REQUIRE(cache.get_summary_info().entry_count == 1);
+    REQUIRE(cache.get_summary_info().original_size == 1000);
+
+    cache.clear();
+    REQUIRE(!cache.find("a"));
+    REQUIRE(cache.get_summary_info().entry_count == 0);
+    REQUIRE(cache.get_summary_info().total_size == 0);
+}
+
+TEST_CASE(
+    "compressed memory cache incompressible values",
+    "[compressed_memory_cache]")
+{
+    compressed_memory_cache cache(compressed_memory_cache_config{0x10000});
+
+    auto original = make_blob(generate_random_string(1000));
+    cache.insert("r", original);
+    auto info = cache.get_summary_info();
+    REQUIRE(info.total_size == 1000);
+    REQUIRE(info.original_size == 1000);
+
+    // Uncompressed values are shared rather than copied.
+    auto value = cache.find("r");
+    REQUIRE(value);
+    REQUIRE(value->data() == original.data());
+
+    // Values that can't fit are ignored.
+    cache.insert("big", make_blob(generate_random_string(0x20000)));
+    REQUIRE(!cache.find("big"));
+    REQUIRE(cache.get_summary_info().entry_count == 1);
+}
+
+TEST_CASE("compressed memory cache eviction", "[compressed_memory_cache]")
+{
+    compressed_memory_cache cache(compressed_memory_cache_config{3000});
+
+    // These are all a little over 1000 bytes, so the cache can't quite hold
+    // all three.
+    for (int i = 0; i != 3; ++i)
+    {
+        cache.insert(
+            std::to_string(i), make_blob(generate_random_string(1000 + i)));
+    }
+    REQUIRE(cache.get_summary_info().entry_count == 2);
+    REQUIRE(!cache.find("0"));
+
+    // Touch "1" so that "2" becomes the least recently used.
+    REQUIRE(cache.find("1"));
+    cache.insert("3", make_blob(generate_random_string(1000)));
+    REQUIRE(cache.find("1"));
+    REQUIRE(!cache.find("2"));
+    REQUIRE(cache.find("3"));
+    REQUIRE(cache.get_summary_info().total_size <= 3000);
+
+    // Compressed entries take up far less of the budget.
+    cache.clear();
+    for (int i = 0; i != 20; ++i)
+        cache.insert(std::to_string(i), make_blob(generate_value_string(i)));
+    auto info = cache.get_summary_info();
+    REQUIRE(info.entry_count == 20);
+    REQUIRE(info.original_size == 20000);
+    for (int i = 0; i != 20; ++i)
+    {
+        auto value = cache.find(std::to_string(i));
+        REQUIRE(value);
+        REQUIRE(blob_contents(*value) == generate_value_string(i));
+    }
+}
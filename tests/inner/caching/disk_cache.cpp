@@ -1,7 +1,9 @@
 #include <cradle/inner/caching/disk_cache.h>
 
+#include <atomic>
 #include <chrono>
 #include <filesystem>
+#include <fstream>
 #include <thread>
 
 #include <catch2/catch.hpp>
@@ -80,7 +82,7 @@ test_item_access(disk_cache& cache, int item_id)
         if (entry)
         {
             auto cached_contents
-                = read_file_contents(cache.get_path_for_id(entry->id));
+                = read_file_contents(cache.get_path_for_entry(*entry));
             REQUIRE(cached_contents == value);
             REQUIRE(entry->crc32 == computed_crc);
             cache.record_usage(entry->id);
@@ -363,3 +365,876 @@ TEST_CASE("incompatible cache", "[disk_cache]")
     init_disk_cache(cache);
     REQUIRE(!exists(extraneous_file));
 }
+
+TEST_CASE("WAL mode", "[disk_cache]")
+{
+    reset_directory("disk_cache");
+    disk_cache cache(disk_cache_config{some(string("disk_cache")), 500, 4});
+    REQUIRE(cache.is_initialized());
+
+    // The basic operations all work the same way.
+    REQUIRE(!test_item_access(cache, 0));
+    REQUIRE(test_item_access(cache, 0));
+    REQUIRE(!test_item_access(cache, 1));
+    REQUIRE(test_item_access(cache, 1));
+    {
+        auto entry = cache.find(generate_key_string(0));
+        REQUIRE(entry);
+        cache.remove_entry(entry->id);
+    }
+    REQUIRE(!cache.find(generate_key_string(0)));
+    REQUIRE(cache.get_summary_info().entry_count == 1);
+
+    // Lookups can be done from many threads at once (more than there are
+    // reader connections).
+    for (int i = 2; i != 10; ++i)
+        test_item_access(cache, i);
+    std::atomic<int> hit_count = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t != 8; ++t)
+    {
+        threads.emplace_back([&] {
+            for (int i = 1; i != 10; ++i)
+            {
+                auto entry = cache.find(generate_key_string(i));
+                if (entry)
+                    ++hit_count;
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    REQUIRE(hit_count == 8 * 9);
+
+    // The cache can be reopened in the default mode.
+    cache.reset(disk_cache_config{some(string("disk_cache")), 500});
+    REQUIRE(test_item_access(cache, 1));
+}
+
+TEST_CASE("write batching", "[disk_cache]")
+{
+    reset_directory("disk_cache");
+    // Readers only see committed batches, so a reader connection is used to
+    // observe the batching.
+    disk_cache_config config{some(string("disk_cache")), 500};
+    config.reader_count = 1;
+    config.write_batch_size = 4;
+    config.write_batch_delay = std::chrono::milliseconds(50);
+
+    SECTION("batches are committed when full")
+    {
+        config.write_batch_delay = std::chrono::milliseconds(60'000);
+        disk_cache cache(config);
+        for (int i = 0; i != 3; ++i)
+        {
+            cache.insert(generate_key_string(i), generate_value_string(i));
+            REQUIRE(!cache.find(generate_key_string(i)));
+        }
+        cache.insert(generate_key_string(3), generate_value_string(3));
+        for (int i = 0; i != 4; ++i)
+            REQUIRE(cache.find(generate_key_string(i)));
+    }
+    SECTION("batches are committed after a delay")
+    {
+        disk_cache cache(config);
+        cache.insert(generate_key_string(0), generate_value_string(0));
+        REQUIRE(!cache.find(generate_key_string(0)));
+        bool committed = false;
+        for (int i = 0; i != 100 && !committed; ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            committed = cache.find(generate_key_string(0)).has_value();
+        }
+        REQUIRE(committed);
+    }
+    SECTION("batches can be flushed explicitly")
+    {
+        config.write_batch_delay = std::chrono::milliseconds(60'000);
+        disk_cache cache(config);
+        auto id = cache.initiate_insert(generate_key_string(1));
+        dump_string_to_file(
+            cache.get_path_for_id(id), generate_value_string(1));
+        cache.finish_insert(id, 0);
+        REQUIRE(!cache.find(generate_key_string(1)));
+        cache.flush();
+        REQUIRE(cache.find(generate_key_string(1)));
+    }
+    SECTION("files are only removed once their removal is committed")
+    {
+        config.write_batch_delay = std::chrono::milliseconds(60'000);
+        disk_cache cache(config);
+        auto id = cache.initiate_insert(generate_key_string(1));
+        auto path = cache.get_path_for_id(id);
+        dump_string_to_file(path, generate_value_string(1));
+        cache.finish_insert(id, 0);
+        cache.flush();
+        cache.remove_entry(id);
+        REQUIRE(std::filesystem::exists(path));
+        cache.flush();
+        REQUIRE(!std::filesystem::exists(path));
+    }
+    SECTION("batches are committed on shutdown")
+    {
+        config.write_batch_delay = std::chrono::milliseconds(60'000);
+        {
+            disk_cache cache(config);
+            cache.insert(generate_key_string(0), generate_value_string(0));
+        }
+        disk_cache cache(config);
+        REQUIRE(cache.find(generate_key_string(0)));
+    }
+}
+
+TEST_CASE("cache upgrade from version 3", "[disk_cache]")
+{
+    // Set up a cache directory with a version 3 database. (Values in these
+    // were base64-encoded.)
+    reset_directory("disk_cache");
+    {
+        sqlite3* db = nullptr;
+        REQUIRE(sqlite3_open("disk_cache/index.db", &db) == SQLITE_OK);
+        REQUIRE(
+            sqlite3_exec(
+                db,
+                "create table entries("
+                " id integer primary key,"
+                " key text unique not null,"
+                " valid boolean not null,"
+                " last_accessed datetime,"
+                " in_db boolean,"
+                " value blob,"
+                " size integer,"
+                " original_size integer,"
+                " crc32 integer);"
+                "insert into entries(key, valid, in_db, value, size)"
+                " values('a', 1, 1, 'YWJj', 4), ('b', 1, 1, 'ZGVmZw==', 8),"
+                " ('c', 0, 0, null, null), ('d', 1, 1, 'not base64!', 11);"
+                "pragma user_version = 3;",
+                0,
+                0,
+                0)
+            == SQLITE_OK);
+        sqlite3_close(db);
+    }
+
+    // The existing entries should be preserved (and decoded by the user's
+    // decoder) and accounted for. (Any that can't be decoded are dropped.)
+    disk_cache_config config{some(string("disk_cache")), 500};
+    config.legacy_value_decoder = [](string const& encoded) {
+        blob decoded
+            = base64_decode(encoded, get_mime_base64_character_set());
+        return some(string(
+            reinterpret_cast<char const*>(decoded.data()), decoded.size()));
+    };
+    disk_cache cache(config);
+    auto info = cache.get_summary_info();
+    REQUIRE(info.entry_count == 2);
+    REQUIRE(info.total_size == 7);
+    REQUIRE(*cache.find("a")->value == "abc");
+    REQUIRE(*cache.find("b")->value == "defg");
+    REQUIRE(cache.find("b")->original_size == 4);
+    REQUIRE(!cache.find("d"));
+
+    // And the totals should be maintained from here on.
+    test_item_access(cache, 0);
+    info = cache.get_summary_info();
+    REQUIRE(info.entry_count == 3);
+    REQUIRE(info.total_size == int64_t(7 + generate_value_string(0).size()));
+
+    // Enabling incremental vacuuming (which rewrites the database) is only
+    // done on request, and only at initialization.
+    auto get_auto_vacuum_mode = [] {
+        sqlite3* db = nullptr;
+        REQUIRE(sqlite3_open("disk_cache/index.db", &db) == SQLITE_OK);
+        int mode = -1;
+        sqlite3_exec(
+            db,
+            "pragma auto_vacuum;",
+            [](void* mode, int, char** values, char**) {
+                *static_cast<int*>(mode) = std::atoi(values[0]);
+                return 0;
+            },
+            &mode,
+            0);
+        sqlite3_close(db);
+        return mode;
+    };
+    REQUIRE(cache.do_maintenance(std::chrono::milliseconds(60'000)).completed);
+    cache.reset();
+    REQUIRE(get_auto_vacuum_mode() == 0);
+    config.rebuild_legacy_index = true;
+    cache.reset(config);
+    REQUIRE(cache.find("b"));
+    cache.reset();
+    REQUIRE(get_auto_vacuum_mode() == 2);
+}
+
+TEST_CASE("binary values", "[disk_cache]")
+{
+    reset_directory("disk_cache");
+    disk_cache cache(disk_cache_config{some(string("disk_cache")), 500});
+
+    auto value = string("a\0b\0\xff", 5);
+    cache.insert("a", value);
+    REQUIRE(*cache.find("a")->value == value);
+
+    // Replacing a value updates it in place.
+    auto other_value = string("\0\0c", 3);
+    cache.insert("a", other_value, 10);
+    auto entry = cache.find("a");
+    REQUIRE(*entry->value == other_value);
+    REQUIRE(entry->size == 3);
+    REQUIRE(entry->original_size == 10);
+    REQUIRE(cache.get_summary_info().total_size == 3);
+}
+
+// Insert a file entry (through the content-addressed interface) and return
+// whether its content was already in the cache.
+bool
+insert_shared_entry(
+    disk_cache& cache,
+    string const& key,
+    string const& value,
+    string const& content_hash)
+{
+    auto id = cache.initiate_insert(key);
+    if (cache.finish_insert_with_existing_content(id, content_hash))
+        return true;
+    dump_string_to_file(cache.get_path_for_id(id), value);
+    cache.finish_insert(id, 17, none, content_hash);
+    return false;
+}
+
+TEST_CASE("content-addressed storage", "[disk_cache]")
+{
+    disk_cache cache;
+    init_disk_cache(cache);
+
+    auto value = string(100, 'x');
+    REQUIRE(!insert_shared_entry(cache, "a", value, "hash_x"));
+    REQUIRE(insert_shared_entry(cache, "b", value, "hash_x"));
+    REQUIRE(!insert_shared_entry(cache, "c", string(50, 'y'), "hash_y"));
+
+    // The shared content is only stored (and counted) once.
+    auto info = cache.get_summary_info();
+    REQUIRE(info.entry_count == 3);
+    REQUIRE(info.total_size == 150);
+    auto a = cache.find("a");
+    auto b = cache.find("b");
+    REQUIRE(a);
+    REQUIRE(b);
+    REQUIRE(a->content_id);
+    REQUIRE(a->content_id == b->content_id);
+    REQUIRE(a->size == 100);
+    REQUIRE(a->crc32 == 17);
+    REQUIRE(cache.get_path_for_entry(*a) == cache.get_path_for_entry(*b));
+    REQUIRE(read_file_contents(cache.get_path_for_entry(*b)) == value);
+    REQUIRE(!exists(cache.get_path_for_id(a->id)));
+
+    // The content stays around as long as any entry refers to it.
+    auto shared_path = cache.get_path_for_entry(*a);
+    cache.remove_entry(a->id);
+    REQUIRE(exists(shared_path));
+    REQUIRE(cache.get_summary_info().total_size == 150);
+    cache.remove_entry(b->id);
+    REQUIRE(!exists(shared_path));
+    REQUIRE(cache.get_summary_info().total_size == 50);
+
+    // Replacing an entry with an in-database value releases its content.
+    auto c_path = cache.get_path_for_entry(*cache.find("c"));
+    cache.insert("c", "small");
+    REQUIRE(!exists(c_path));
+    REQUIRE(cache.get_summary_info().total_size == 5);
+
+    // Racing inserts of the same content end up sharing it.
+    auto d = cache.initiate_insert("d");
+    auto e = cache.initiate_insert("e");
+    REQUIRE(!cache.finish_insert_with_existing_content(d, "hash_z"));
+    REQUIRE(!cache.finish_insert_with_existing_content(e, "hash_z"));
+    dump_string_to_file(cache.get_path_for_id(d), "zzz");
+    dump_string_to_file(cache.get_path_for_id(e), "zzz");
+    cache.finish_insert(d, 0, none, "hash_z");
+    cache.finish_insert(e, 0, none, "hash_z");
+    REQUIRE(!exists(cache.get_path_for_id(e)));
+    REQUIRE(cache.find("d")->content_id == cache.find("e")->content_id);
+    REQUIRE(cache.get_summary_info().total_size == 8);
+
+    // Discarding an entry with corrupt content discards everything that
+    // shares it.
+    cache.discard_entry(d);
+    REQUIRE(!cache.find("d"));
+    REQUIRE(!cache.find("e"));
+    REQUIRE(cache.get_summary_info().total_size == 5);
+}
+
+TEST_CASE("checksum algorithms", "[disk_cache]")
+{
+    disk_cache cache;
+    init_disk_cache(cache);
+
+    // Entries default to (and older entries are read as) CRC-32.
+    auto a = cache.initiate_insert("a");
+    dump_string_to_file(cache.get_path_for_id(a), "aaa");
+    cache.finish_insert(a, 1);
+    REQUIRE(
+        cache.find("a")->checksum_algorithm
+        == disk_cache_checksum_algorithm::CRC32);
+
+    // The algorithm is recorded with the entry...
+    auto b = cache.initiate_insert("b");
+    dump_string_to_file(cache.get_path_for_id(b), "bbb");
+    cache.finish_insert(b, 2, none, disk_cache_checksum_algorithm::CRC32C);
+    REQUIRE(
+        cache.find("b")->checksum_algorithm
+        == disk_cache_checksum_algorithm::CRC32C);
+
+    // ... or with its shared content.
+    for (auto key : {"c", "d"})
+    {
+        auto id = cache.initiate_insert(key);
+        if (!cache.finish_insert_with_existing_content(id, "hash_c"))
+        {
+            dump_string_to_file(cache.get_path_for_id(id), "ccc");
+            cache.finish_insert(
+                id, 3, none, "hash_c", disk_cache_checksum_algorithm::CRC32C);
+        }
+    }
+    for (auto const& entry : cache.get_entry_list())
+    {
+        if (entry.key == "c" || entry.key == "d")
+        {
+            REQUIRE(entry.crc32 == 3);
+            REQUIRE(
+                entry.checksum_algorithm
+                == disk_cache_checksum_algorithm::CRC32C);
+        }
+    }
+}
+
+TEST_CASE("shared content eviction", "[disk_cache]")
+{
+    disk_cache cache;
+    init_disk_cache(cache);
+
+    // Fill the cache with pairs of entries that share content.
+    for (int i = 0; i != 20; ++i)
+    {
+        auto value = string(40, char('a' + i));
+        auto hash = "hash_" + lexical_cast<string>(i);
+        insert_shared_entry(cache, generate_key_string(i * 2), value, hash);
+        insert_shared_entry(
+            cache, generate_key_string(i * 2 + 1), value, hash);
+    }
+    // Eviction only counts content that's actually freed, so the cache
+    // should still be nearly full.
+    auto info = cache.get_summary_info();
+    REQUIRE(info.total_size <= 500);
+    REQUIRE(info.total_size > 450);
+}
+
+TEST_CASE("eviction in batches", "[disk_cache]")
+{
+    reset_directory("disk_cache");
+    disk_cache_config config{some(string("disk_cache")), 0x10000};
+    // Fill the cache with many more entries than are considered in a single
+    // eviction batch.
+    {
+        disk_cache cache(config);
+        for (int i = 0; i != 1000; ++i)
+            cache.insert(generate_key_string(i), generate_value_string(i));
+        REQUIRE(cache.get_summary_info().entry_count == 1000);
+    }
+
+    // Reopening the cache with a smaller limit evicts the oldest entries.
+    config.size_limit = 500;
+    disk_cache cache(config);
+    auto info = cache.get_summary_info();
+    REQUIRE(info.total_size <= 500);
+    REQUIRE(info.total_size > 450);
+    int64_t total_size = 0;
+    for (auto const& entry : cache.get_entry_list())
+        total_size += entry.size;
+    REQUIRE(total_size == info.total_size);
+    REQUIRE(cache.find(generate_key_string(999)));
+    REQUIRE(!cache.find(generate_key_string(0)));
+}
+
+TEST_CASE("sharded cache", "[disk_cache]")
+{
+    disk_cache_config config{none, 0};
+    for (auto shard : {"a", "b", "c"})
+    {
+        reset_directory(string("disk_cache_") + shard);
+        config.shards.push_back(
+            disk_cache_shard_config{string("disk_cache_") + shard, 0x10000});
+    }
+
+    int const item_count = 60;
+    {
+        disk_cache cache(config);
+        for (int i = 0; i != item_count; ++i)
+            REQUIRE(!test_item_access(cache, i));
+        for (int i = 0; i != item_count; ++i)
+            REQUIRE(test_item_access(cache, i));
+        auto info = cache.get_summary_info();
+        REQUIRE(info.entry_count == item_count);
+        REQUIRE(info.failed_shard_count == 0);
+        REQUIRE(cache.get_entry_list().size() == item_count);
+        REQUIRE(!cache.get_recently_used_entries(0x10000).empty());
+    }
+
+    // Every shard holds some of the entries (in its own index).
+    int64_t total_count = 0;
+    for (auto const& shard : config.shards)
+    {
+        disk_cache shard_cache(
+            disk_cache_config{shard.directory, shard.size_limit});
+        auto count = shard_cache.get_summary_info().entry_count;
+        REQUIRE(count > 0);
+        total_count += count;
+    }
+    REQUIRE(total_count == item_count);
+
+    // If a shard can't be opened, the others take over its keys.
+    std::filesystem::remove_all("disk_cache_b");
+    dump_string_to_file("disk_cache_b", "not a directory");
+    {
+        disk_cache cache(config);
+        REQUIRE(cache.get_summary_info().failed_shard_count == 1);
+        for (int i = 0; i != item_count; ++i)
+            test_item_access(cache, i);
+        for (int i = 0; i != item_count; ++i)
+            REQUIRE(test_item_access(cache, i));
+        REQUIRE(cache.get_summary_info().entry_count == item_count);
+    }
+    std::filesystem::remove("disk_cache_b");
+
+    // If none can be opened, the cache fails.
+    config.shards.resize(1);
+    config.shards[0].directory = "disk_cache_b";
+    dump_string_to_file("disk_cache_b", "not a directory");
+    disk_cache cache;
+    REQUIRE_THROWS(cache.reset(config));
+    REQUIRE(!cache.is_initialized());
+    std::filesystem::remove("disk_cache_b");
+}
+
+TEST_CASE("shard failure at runtime", "[disk_cache]")
+{
+    disk_cache_config config{none, 0};
+    for (auto shard : {"a", "b", "c"})
+    {
+        reset_directory(string("disk_cache_") + shard);
+        config.shards.push_back(
+            disk_cache_shard_config{string("disk_cache_") + shard, 0x10000});
+    }
+
+    // (In WAL mode, the connections notice when the files change under
+    // them.)
+    config.reader_count = 2;
+
+    int const item_count = 60;
+    disk_cache cache(config);
+    for (int i = 0; i != item_count; ++i)
+        REQUIRE(!test_item_access(cache, i));
+
+    // Clobber one shard's index while the cache is using it.
+    for (auto file : {"index.db", "index.db-wal", "index.db-shm"})
+    {
+        auto path = file_path("disk_cache_b") / file;
+        std::fstream stream(
+            path, std::ios::in | std::ios::out | std::ios::binary);
+        stream << string(std::filesystem::file_size(path), '\x5a');
+    }
+
+    // Its keys move to the other shards, where they're missing at first.
+    for (int i = 0; i != item_count; ++i)
+        test_item_access(cache, i);
+    REQUIRE(cache.get_summary_info().failed_shard_count == 1);
+    for (int i = 0; i != item_count; ++i)
+        REQUIRE(test_item_access(cache, i));
+    REQUIRE(cache.get_summary_info().entry_count == item_count);
+}
+
+TEST_CASE("index recovery", "[disk_cache]")
+{
+    disk_cache_config config{some(string("disk_cache")), 0x10000};
+    reset_directory("disk_cache");
+    {
+        disk_cache cache(config);
+        for (int i = 0; i != 10; ++i)
+            REQUIRE(!test_item_access(cache, i));
+        REQUIRE(!insert_shared_entry(cache, "s1", "shared", "hash_s"));
+        REQUIRE(insert_shared_entry(cache, "s2", "shared", "hash_s"));
+        // Entries whose values have moved into the database aren't
+        // recovered (like any other in-database entries).
+        cache.insert("s1", "now in the database");
+        // Removed entries aren't recovered.
+        cache.remove_entry(cache.find(generate_key_string(1))->id);
+    }
+
+    // Corrupt the index, lose one of the files, and add some stray ones.
+    dump_string_to_file("disk_cache/index.db", "invalid database contents");
+    file_path stray_entry_file;
+    {
+        disk_cache cache(config);
+        remove(cache.get_path_for_entry(*cache.find(generate_key_string(3))));
+        stray_entry_file = cache.get_path_for_id(12345);
+    }
+    dump_string_to_file("disk_cache/index.db", "invalid database contents");
+    dump_string_to_file(stray_entry_file, "abc");
+    // (Files that the cache didn't create are left alone.)
+    file_path extraneous_file("disk_cache/some_other_file");
+    dump_string_to_file(extraneous_file, "abc");
+
+    SECTION("corrupt index")
+    {
+    }
+    SECTION("missing index")
+    {
+        remove(file_path("disk_cache/index.db"));
+    }
+
+    disk_cache cache(config);
+    REQUIRE(!exists(stray_entry_file));
+    REQUIRE(exists(extraneous_file));
+    // The remaining file entries are still there, and the in-database ones
+    // (and the lost and removed ones) aren't.
+    for (int i = 0; i != 10; ++i)
+    {
+        INFO(i);
+        bool recovered = i % 2 == 1 && i != 1 && i != 3;
+        REQUIRE(bool(cache.find(generate_key_string(i))) == recovered);
+        REQUIRE(test_item_access(cache, i) == recovered);
+    }
+    REQUIRE(!cache.find("s1"));
+    auto s2 = cache.find("s2");
+    REQUIRE(s2);
+    REQUIRE(s2->content_id);
+    REQUIRE(read_file_contents(cache.get_path_for_entry(*s2)) == "shared");
+    REQUIRE(s2->crc32 == 17);
+
+    // The totals are consistent with the recovered entries.
+    auto info = cache.get_summary_info();
+    REQUIRE(info.entry_count == 11);
+    int64_t total_size = 0;
+    for (auto const& entry : cache.get_entry_list())
+        total_size += entry.size;
+    REQUIRE(info.total_size == total_size);
+
+    // Shared content is still reference counted.
+    REQUIRE(!insert_shared_entry(cache, "s3", "other", "hash_o"));
+    REQUIRE(insert_shared_entry(cache, "s1", "shared", "hash_s"));
+    cache.remove_entry(s2->id);
+    REQUIRE(exists(cache.get_path_for_entry(*cache.find("s1"))));
+
+    // The next maintenance pass rebuilds the indices (once).
+    auto report = cache.do_maintenance(std::chrono::milliseconds(60'000));
+    REQUIRE(report.completed);
+    REQUIRE(report.reindexed_table_count == 2);
+    report = cache.do_maintenance(std::chrono::milliseconds(60'000));
+    REQUIRE(report.reindexed_table_count == 0);
+}
+
+TEST_CASE("journal compaction", "[disk_cache]")
+{
+    disk_cache_config config{some(string("disk_cache")), 0x10000};
+    config.maintenance_interval = std::chrono::milliseconds(0);
+    reset_directory("disk_cache");
+    file_path journal_path("disk_cache/entries.journal");
+    {
+        disk_cache cache(config);
+        for (int i = 0; i != 10; ++i)
+            REQUIRE(!test_item_access(cache, i));
+        cache.flush();
+
+        // Simulate a long history of entries that have since been removed.
+        {
+            std::ofstream journal(
+                journal_path,
+                std::ios::out | std::ios::app | std::ios::binary);
+            for (int i = 0; i != 100'000; ++i)
+                journal << "I " << (1'000'000 + i) << " a2V5\n";
+        }
+        auto original_size = int64_t(file_size(journal_path));
+        REQUIRE(original_size > 0x10'00'00);
+
+        // Maintenance rewrites the journal without them.
+        auto report = cache.do_maintenance(std::chrono::milliseconds(60'000));
+        REQUIRE(report.completed);
+        auto compacted_size = int64_t(file_size(journal_path));
+        REQUIRE(compacted_size < 0x1000);
+        REQUIRE(
+            report.compacted_journal_bytes == original_size - compacted_size);
+
+        // Once it's back within its allowance, it's left alone.
+        report = cache.do_maintenance(std::chrono::milliseconds(60'000));
+        REQUIRE(report.compacted_journal_bytes == 0);
+    }
+
+    // The compacted journal still has everything that recovery needs.
+    dump_string_to_file("disk_cache/index.db", "invalid database contents");
+    disk_cache cache(config);
+    for (int i = 0; i != 10; ++i)
+        REQUIRE(bool(cache.find(generate_key_string(i))) == (i % 2 == 1));
+}
+
+TEST_CASE("maintenance", "[disk_cache]")
+{
+    reset_directory("disk_cache");
+    disk_cache_config config{some(string("disk_cache")), 0x1'00'00'00};
+    // Consider unfinished inserts and stray files abandoned immediately.
+    config.abandonment_age = std::chrono::seconds(0);
+    // Only do maintenance when it's explicitly requested.
+    config.maintenance_interval = std::chrono::milliseconds(0);
+    disk_cache cache(config);
+
+    for (int i = 0; i != 10; ++i)
+        REQUIRE(!test_item_access(cache, i));
+
+    // Abandon an insert (after writing part of its file).
+    auto abandoned_id = cache.initiate_insert("abandoned");
+    dump_string_to_file(cache.get_path_for_id(abandoned_id), "partial");
+    // Add some files that the index doesn't know about (including a
+    // leftover temporary file).
+    dump_string_to_file(cache.get_path_for_id(12345), "abc");
+    file_path temporary_file = cache.get_path_for_id(12346);
+    temporary_file += ".tmp1";
+    dump_string_to_file(temporary_file, "abcd");
+    // Files that the cache didn't create are left alone.
+    file_path unrelated_file("disk_cache/unrelated_file");
+    dump_string_to_file(unrelated_file, "abcde");
+    // Leave some free pages in the index database.
+    for (int i = 0; i != 200; ++i)
+        cache.insert("big_" + std::to_string(i), string(2000, 'x'));
+    for (int i = 0; i != 200; ++i)
+        cache.remove_entry(cache.find("big_" + std::to_string(i))->id);
+
+    // Make sure that everything is strictly older than the cutoff.
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    // Without any time to work with, a run only gets through one step.
+    auto report = cache.do_maintenance(std::chrono::milliseconds(0));
+    REQUIRE(!report.completed);
+    REQUIRE(report.abandoned_entry_count == 1);
+    // The next one picks up where that left off.
+    report = cache.do_maintenance(std::chrono::milliseconds(60'000));
+    REQUIRE(report.completed);
+    REQUIRE(report.abandoned_entry_count == 0);
+    // (The abandoned insert's file was removed along with its entry.)
+    REQUIRE(report.orphaned_file_count == 2);
+    REQUIRE(report.orphaned_file_bytes == 7);
+    REQUIRE(report.vacuumed_bytes > 0);
+    // (The indices are only rebuilt after recovery.)
+    REQUIRE(report.reindexed_table_count == 0);
+
+    REQUIRE(!exists(cache.get_path_for_id(abandoned_id)));
+    REQUIRE(!exists(cache.get_path_for_id(12345)));
+    REQUIRE(!exists(temporary_file));
+    REQUIRE(exists(unrelated_file));
+    // The real entries are untouched.
+    for (int i = 0; i != 10; ++i)
+        REQUIRE(test_item_access(cache, i));
+
+    // The totals are reported in the summary info.
+    auto info = cache.get_summary_info();
+    REQUIRE(info.maintenance.abandoned_entry_count == 1);
+    REQUIRE(info.maintenance.orphaned_file_count == 2);
+    REQUIRE(info.maintenance.vacuumed_bytes == report.vacuumed_bytes);
+    REQUIRE(info.maintenance.completed);
+
+    // Once everything is in order, there's nothing more to reclaim.
+    report = cache.do_maintenance(std::chrono::milliseconds(60'000));
+    REQUIRE(report.completed);
+    REQUIRE(report.abandoned_entry_count == 0);
+    REQUIRE(report.orphaned_file_count == 0);
+    REQUIRE(report.vacuumed_bytes == 0);
+}
+
+TEST_CASE("background maintenance", "[disk_cache]")
+{
+    reset_directory("disk_cache");
+    disk_cache_config config{some(string("disk_cache")), 0x10000};
+    config.maintenance_interval = std::chrono::milliseconds(20);
+    disk_cache cache(config);
+
+    // Recent files are left alone, since they may belong to inserts that
+    // are still in progress, but old ones are removed.
+    auto recent_file = cache.get_path_for_id(1000);
+    dump_string_to_file(recent_file, "abc");
+    auto old_file = cache.get_path_for_id(1001);
+    dump_string_to_file(old_file, "abcd");
+    last_write_time(
+        old_file,
+        std::filesystem::file_time_type::clock::now()
+            - std::chrono::hours(2));
+
+    // Once the cache is idle, the maintainer takes care of it. (The totals
+    // are only updated at the end of a pass, after the file is removed.)
+    for (int i = 0; i != 500; ++i)
+    {
+        if (cache.get_summary_info().maintenance.orphaned_file_count != 0)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    REQUIRE(!exists(old_file));
+    REQUIRE(exists(recent_file));
+    auto info = cache.get_summary_info();
+    REQUIRE(info.maintenance.orphaned_file_count == 1);
+    REQUIRE(info.maintenance.orphaned_file_bytes == 4);
+}
+
+TEST_CASE("namespaces", "[disk_cache]")
+{
+    reset_directory("disk_cache");
+    disk_cache_config config{some(string("disk_cache")), 1000};
+    config.namespaces = {
+        disk_cache_namespace_config{"bulk", 300},
+        disk_cache_namespace_config{"calc", 0, true}};
+    auto key = [](string const& key_namespace, int i) {
+        return key_namespace + "_" + std::to_string(i);
+    };
+    string const value(100, 'x');
+    {
+        disk_cache cache(config);
+        for (int i = 0; i != 5; ++i)
+            cache.insert(key("calc", i), value, none, "calc");
+
+        // The bulk namespace is held to its own limit.
+        for (int i = 0; i != 10; ++i)
+            cache.insert(key("bulk", i), value, none, "bulk");
+        auto info = cache.get_summary_info();
+        REQUIRE(info.namespace_sizes["bulk"] == 300);
+        REQUIRE(info.namespace_sizes["calc"] == 500);
+        REQUIRE(!cache.find(key("bulk", 6)));
+        REQUIRE(cache.find(key("bulk", 7)));
+
+        // Pinned entries outlive unpinned ones, even more recent ones.
+        for (int i = 0; i != 8; ++i)
+            cache.insert(key("", i), value);
+        info = cache.get_summary_info();
+        REQUIRE(info.total_size <= 1000);
+        REQUIRE(info.namespace_sizes["bulk"] == 0);
+        for (int i = 0; i != 5; ++i)
+            REQUIRE(cache.find(key("calc", i)));
+        REQUIRE(!cache.find(key("", 2)));
+        REQUIRE(cache.find(key("", 3)));
+
+        // But they're still evicted when there's nothing else left.
+        for (int i = 5; i != 12; ++i)
+            cache.insert(key("calc", i), value, none, "calc");
+        info = cache.get_summary_info();
+        REQUIRE(info.total_size == 1000);
+        REQUIRE(info.namespace_sizes["calc"] == 1000);
+        REQUIRE(!cache.find(key("calc", 1)));
+        REQUIRE(cache.find(key("calc", 2)));
+    }
+
+    // If the namespace is no longer pinned, its entries are ordinary LRU
+    // entries again.
+    config.namespaces.clear();
+    disk_cache cache(config);
+    REQUIRE(cache.get_summary_info().namespace_sizes["calc"] == 1000);
+    cache.insert(key("", 0), value);
+    REQUIRE(!cache.find(key("calc", 2)));
+    REQUIRE(cache.find(key("calc", 3)));
+}
+
+TEST_CASE("packs", "[disk_cache]")
+{
+    disk_cache source;
+    init_disk_cache(source, "disk_cache_pack_source");
+    source.reset(
+        disk_cache_config{some(string("disk_cache_pack_source")), 10000});
+    source.insert("db_a", "value_a", 20, "a");
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    source.insert("db_b", "value_b", none, "b");
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    {
+        auto id = source.initiate_insert("file_a", "a");
+        dump_string_to_file(source.get_path_for_id(id), string(100, 'f'));
+        source.finish_insert(
+            id, 3, 200, disk_cache_checksum_algorithm::CRC32C);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    insert_shared_entry(source, "shared_1", string(50, 's'), "hash_s");
+    insert_shared_entry(source, "shared_2", string(50, 's'), "hash_s");
+    // This insert is never finished, so it isn't exported.
+    source.initiate_insert("unfinished");
+
+    // Export everything and import it into a sharded cache.
+    file_path pack_path("disk_cache.pack");
+    auto exported = source.export_pack(pack_path);
+    REQUIRE(exported.entry_count == 5);
+    REQUIRE(exported.total_size == 7 + 7 + 100 + 50 + 50);
+    REQUIRE(exported.skipped_count == 0);
+
+    reset_directory("disk_cache_pack_shard_0");
+    reset_directory("disk_cache_pack_shard_1");
+    disk_cache_config config{none, 0};
+    config.shards
+        = {disk_cache_shard_config{"disk_cache_pack_shard_0", 10000},
+           disk_cache_shard_config{"disk_cache_pack_shard_1", 10000}};
+    config.write_batch_size = 2;
+    disk_cache destination(config);
+    auto imported = destination.import_pack(pack_path);
+    REQUIRE(imported.entry_count == 5);
+    REQUIRE(imported.total_size == exported.total_size);
+    REQUIRE(imported.skipped_count == 0);
+
+    auto info = destination.get_summary_info();
+    REQUIRE(info.entry_count == 5);
+    REQUIRE(info.namespace_sizes["a"] == 107);
+    REQUIRE(info.namespace_sizes["b"] == 7);
+    auto db_a = destination.find("db_a");
+    REQUIRE(db_a);
+    REQUIRE(db_a->in_db);
+    REQUIRE(db_a->value == "value_a");
+    REQUIRE(db_a->original_size == 20);
+    auto file_a = destination.find("file_a");
+    REQUIRE(file_a);
+    REQUIRE(!file_a->in_db);
+    REQUIRE(
+        read_file_contents(destination.get_path_for_entry(*file_a))
+        == string(100, 'f'));
+    REQUIRE(file_a->original_size == 200);
+    REQUIRE(file_a->crc32 == 3);
+    REQUIRE(
+        file_a->checksum_algorithm == disk_cache_checksum_algorithm::CRC32C);
+    for (auto key : {"shared_1", "shared_2"})
+    {
+        auto entry = destination.find(key);
+        REQUIRE(entry);
+        REQUIRE(entry->content_id);
+        REQUIRE(
+            read_file_contents(destination.get_path_for_entry(*entry))
+            == string(50, 's'));
+    }
+    REQUIRE(!destination.find("unfinished"));
+
+    // Importing the same pack again doesn't change anything.
+    imported = destination.import_pack(pack_path);
+    REQUIRE(imported.entry_count == 0);
+    REQUIRE(imported.skipped_count == 5);
+    REQUIRE(destination.get_summary_info().entry_count == 5);
+
+    // Entries can be selected by namespace, key and recency.
+    disk_cache_pack_selection selection;
+    selection.namespaces = std::vector<string>{"a"};
+    REQUIRE(source.export_pack(pack_path, selection).entry_count == 2);
+    selection.keys = std::vector<string>{"file_a", "db_b"};
+    REQUIRE(source.export_pack(pack_path, selection).entry_count == 1);
+    selection = disk_cache_pack_selection();
+    selection.size_limit = 110;
+    exported = source.export_pack(pack_path, selection);
+    REQUIRE(exported.entry_count == 2);
+    destination.clear();
+    destination.import_pack(pack_path);
+    REQUIRE(destination.find("shared_1"));
+    REQUIRE(destination.find("shared_2"));
+    REQUIRE(!destination.find("file_a"));
+
+    // Malformed packs are rejected.
+    dump_string_to_file(pack_path, "not a pack");
+    REQUIRE_THROWS_AS(destination.import_pack(pack_path), disk_cache_failure);
+}
@@ -1,6 +1,8 @@
 #include <cradle/inner/caching/immutable.h>
+#include <cradle/inner/caching/immutable/internals.h>
 
 #include <sstream>
+#include <thread>
 
 #include <catch2/catch.hpp>
 #include <cppcoro/sync_wait.hpp>
@@ -305,3 +307,513 @@ TEST_CASE("immutable cache LRU eviction", "[immutable_cache]")
     REQUIRE(s.is_ready());
     REQUIRE(await_cache_value(s) == std::string(1024, 'b'));
 }
+
+TEST_CASE("sharded immutable cache", "[immutable_cache]")
+{
+    // Initialize the cache with 4 shards and 2.5kB of space for unused data.
+    immutable_cache_config config{2560};
+    config.shard_count = 4;
+    immutable_cache cache(config);
+
+    auto one_kb_string_task = [](char content) -> cppcoro::task<std::string> {
+        co_return std::string(1024, content);
+    };
+
+    // Declare an interest in eight different IDs, which will be spread
+    // across the shards.
+    std::vector<immutable_cache_ptr<std::string>> ptrs;
+    for (int i = 0; i != 8; ++i)
+    {
+        ptrs.emplace_back(cache, make_id(i), [&](id_interface const&) {
+            return one_kb_string_task(char('a' + i));
+        });
+        REQUIRE(await_cache_value(ptrs.back()) == std::string(1024, 'a' + i));
+    }
+    {
+        auto snapshot = get_cache_snapshot(cache);
+        REQUIRE(snapshot.in_use.size() == 8);
+        REQUIRE(snapshot.pending_eviction.empty());
+    }
+
+    // Revoke interest in all of them. The global budget only allows two of
+    // them to remain in the cache, regardless of which shards they're in.
+    ptrs.clear();
+    {
+        auto snapshot = get_cache_snapshot(cache);
+        REQUIRE(snapshot.in_use.empty());
+        REQUIRE(snapshot.pending_eviction.size() == 2);
+    }
+
+    // Reacquiring any ID works whether or not it was evicted.
+    for (int i = 0; i != 8; ++i)
+    {
+        immutable_cache_ptr<std::string> p(
+            cache, make_id(i), [&](id_interface const&) {
+                return one_kb_string_task(char('a' + i));
+            });
+        REQUIRE(await_cache_value(p) == std::string(1024, 'a' + i));
+    }
+
+    clear_unused_entries(cache);
+    REQUIRE(get_cache_snapshot(cache) == immutable_cache_snapshot{});
+}
+
+namespace {
+
+cppcoro::task<std::string>
+string_task(size_t size, char content)
+{
+    co_return std::string(size, content);
+}
+
+// Acquire a pointer to a string of the given size in the cache, wait for it
+// to be ready and then release it again.
+// The return value indicates whether or not the value had to be created.
+bool
+use_string(immutable_cache& cache, int id, size_t size)
+{
+    bool needed_creation = false;
+    immutable_cache_ptr<std::string> p(
+        cache, make_id(id), [&](id_interface const&) {
+            needed_creation = true;
+            return string_task(size, 'a');
+        });
+    REQUIRE(await_cache_value(p) == std::string(size, 'a'));
+    return needed_creation;
+}
+
+} // namespace
+
+TEST_CASE("immutable cache CLOCK eviction", "[immutable_cache]")
+{
+    immutable_cache_config config{2560};
+    config.eviction_policy = immutable_cache_eviction_policy::CLOCK;
+    immutable_cache cache(config);
+
+    // Use ID(0) twice, which sets its reference bit.
+    {
+        immutable_cache_ptr<std::string> p(
+            cache, make_id(0), [&](id_interface const&) {
+                return string_task(1024, 'a');
+            });
+        await_cache_value(p);
+        REQUIRE(!use_string(cache, 0, 1024));
+    }
+    // Scanning over other IDs gives ID(0) a second chance, so it survives the
+    // first eviction.
+    REQUIRE(use_string(cache, 1, 1024));
+    REQUIRE(use_string(cache, 2, 1024));
+    REQUIRE(!use_string(cache, 0, 1024));
+}
+
+TEST_CASE("immutable cache CLOCK vs LRU", "[immutable_cache]")
+{
+    // Reusing entries in the opposite order from when they were added
+    // reorders them under LRU but not under CLOCK, where reuse only sets
+    // their reference bits. So LRU evicts ID(1), while CLOCK clears both bits
+    // and evicts ID(0).
+    auto test_policy = [](immutable_cache_eviction_policy policy) {
+        immutable_cache_config config{2560};
+        config.eviction_policy = policy;
+        immutable_cache cache(config);
+        REQUIRE(use_string(cache, 0, 1024));
+        REQUIRE(use_string(cache, 1, 1024));
+        REQUIRE(!use_string(cache, 1, 1024));
+        REQUIRE(!use_string(cache, 0, 1024));
+        REQUIRE(use_string(cache, 2, 1024));
+        return !use_string(cache, 1, 1024);
+    };
+    REQUIRE(!test_policy(immutable_cache_eviction_policy::LRU));
+    REQUIRE(test_policy(immutable_cache_eviction_policy::CLOCK));
+}
+
+TEST_CASE("immutable cache CLOCK with entries in use", "[immutable_cache]")
+{
+    immutable_cache_config config{2560};
+    config.eviction_policy = immutable_cache_eviction_policy::CLOCK;
+    immutable_cache cache(config);
+
+    REQUIRE(use_string(cache, 0, 1024));
+    REQUIRE(use_string(cache, 1, 1024));
+    {
+        // While ID(0) is in use, the hand skips over it...
+        immutable_cache_ptr<std::string> p(
+            cache, make_id(0), [&](id_interface const&) {
+                return string_task(1024, 'a');
+            });
+        REQUIRE(use_string(cache, 2, 1024));
+        REQUIRE(use_string(cache, 3, 1024));
+        REQUIRE(p.is_ready());
+    }
+    // ... and once it's released, it still has its place (and its reference
+    // bit), so it survives while newer entries are evicted.
+    REQUIRE(use_string(cache, 4, 1024));
+    REQUIRE(use_string(cache, 5, 1024));
+    REQUIRE(!use_string(cache, 0, 1024));
+    REQUIRE(use_string(cache, 4, 1024));
+
+    clear_unused_entries(cache);
+    REQUIRE(get_cache_snapshot(cache) == immutable_cache_snapshot{});
+}
+
+TEST_CASE("immutable cache 2Q eviction", "[immutable_cache]")
+{
+    immutable_cache_config config{2560};
+    config.eviction_policy = immutable_cache_eviction_policy::TWO_Q;
+    immutable_cache cache(config);
+
+    // Use ID(0) repeatedly so that it's considered frequently used.
+    REQUIRE(use_string(cache, 0, 1024));
+    REQUIRE(!use_string(cache, 0, 1024));
+
+    // A long scan over other IDs doesn't evict it.
+    for (int i = 1; i != 10; ++i)
+        REQUIRE(use_string(cache, i, 1024));
+    REQUIRE(!use_string(cache, 0, 1024));
+
+    // But the early parts of the scan are gone.
+    REQUIRE(use_string(cache, 1, 1024));
+}
+
+TEST_CASE("immutable cache 2Q size accounting", "[immutable_cache]")
+{
+    immutable_cache_config config{8192};
+    config.eviction_policy = immutable_cache_eviction_policy::TWO_Q;
+    immutable_cache cache(config);
+    auto& shard = *cache.impl->shards.front();
+
+    // The policy's total always matches the shard's, as entries move
+    // between the queues, are reacquired while queued and are evicted.
+    auto check_totals = [&] {
+        std::scoped_lock<std::mutex> lock(shard.mutex);
+        REQUIRE(shard.eviction->queued_size() == shard.unused_size);
+    };
+    for (int i = 0; i != 4; ++i)
+    {
+        use_string(cache, i, 1000 + i);
+        check_totals();
+    }
+    for (int i = 0; i != 4; i += 2)
+    {
+        REQUIRE(!use_string(cache, i, 1000 + i));
+        check_totals();
+    }
+    {
+        immutable_cache_ptr<std::string> p(
+            cache, make_id(1), [&](id_interface const&) {
+                return string_task(1001, 'a');
+            });
+        check_totals();
+    }
+    check_totals();
+    for (int i = 4; i != 20; ++i)
+    {
+        use_string(cache, i, 1000 + i);
+        check_totals();
+    }
+    clear_unused_entries(cache);
+    check_totals();
+    REQUIRE(shard.eviction->queued_size() == 0);
+}
+
+TEST_CASE("immutable cache GreedyDual-Size eviction", "[immutable_cache]")
+{
+    // Under LRU, the small entry is evicted because it's the oldest. Under
+    // GreedyDual-Size, the large entry goes first, which is enough to bring
+    // the cache back under its limit.
+    auto test_policy = [](immutable_cache_eviction_policy policy) {
+        immutable_cache_config config{1536};
+        config.eviction_policy = policy;
+        immutable_cache cache(config);
+        REQUIRE(use_string(cache, 0, 100));
+        REQUIRE(use_string(cache, 1, 1024));
+        REQUIRE(use_string(cache, 2, 1024));
+        return !use_string(cache, 0, 100);
+    };
+    REQUIRE(!test_policy(immutable_cache_eviction_policy::LRU));
+    REQUIRE(test_policy(immutable_cache_eviction_policy::GREEDY_DUAL_SIZE));
+}
+
+TEST_CASE("immutable cache admission control", "[immutable_cache]")
+{
+    // Allow plenty of space for unused entries but cap the total size at 2kB.
+    immutable_cache_config config{8192};
+    config.total_size_limit = 2048;
+    immutable_cache cache(config);
+
+    // Hold onto two 1kB entries, which puts the cache over its limit.
+    immutable_cache_ptr<std::string> p(
+        cache, make_id(0), [&](id_interface const&) {
+            return string_task(1024, 'a');
+        });
+    await_cache_value(p);
+    immutable_cache_ptr<std::string> q(
+        cache, make_id(1), [&](id_interface const&) {
+            return string_task(1024, 'b');
+        });
+    await_cache_value(q);
+    {
+        auto info = get_admission_info(cache);
+        REQUIRE(info.total_size > 2048);
+        REQUIRE(info.admitted_count == 2);
+        REQUIRE(info.bypassed_count == 0);
+    }
+
+    // A new entry can still be computed, but it bypasses the cache, so it's
+    // gone as soon as it's no longer in use.
+    REQUIRE(use_string(cache, 2, 1024));
+    REQUIRE(get_admission_info(cache).bypassed_count == 1);
+    REQUIRE(get_cache_snapshot(cache).pending_eviction.empty());
+    REQUIRE(use_string(cache, 2, 1024));
+    REQUIRE(get_admission_info(cache).bypassed_count == 2);
+
+    // Releasing one of the entries that's in use brings the cache back under
+    // its limit (by evicting that entry).
+    p.reset();
+    {
+        auto snapshot = sort_cache_snapshot(get_cache_snapshot(cache));
+        REQUIRE(snapshot.in_use.size() == 1);
+        REQUIRE(snapshot.pending_eviction.empty());
+        auto info = get_admission_info(cache);
+        REQUIRE(info.total_size <= 2048);
+        REQUIRE(info.over_limit_count > 0);
+    }
+
+    // Now new entries are admitted again.
+    REQUIRE(use_string(cache, 3, 100));
+    REQUIRE(get_admission_info(cache).admitted_count == 3);
+    REQUIRE(get_cache_snapshot(cache).pending_eviction.size() == 1);
+}
+
+namespace {
+
+cppcoro::task<int>
+failing_task()
+{
+    throw std::runtime_error("computation failed");
+    co_return 0;
+}
+
+// Acquire a pointer to an entry whose computation always fails and wait for
+// the failure.
+// The return value indicates whether or not the computation was (re)started.
+bool
+use_failing_entry(immutable_cache& cache)
+{
+    bool needed_creation = false;
+    immutable_cache_ptr<int> p(cache, make_id(0), [&](id_interface const&) {
+        needed_creation = true;
+        return failing_task();
+    });
+    REQUIRE_THROWS(await_cache_value(p));
+    REQUIRE(p.is_failed());
+    return needed_creation;
+}
+
+} // namespace
+
+TEST_CASE("immutable cache failure retries", "[immutable_cache]")
+{
+    SECTION("failures are retried immediately by default")
+    {
+        immutable_cache cache(immutable_cache_config{1024});
+        REQUIRE(use_failing_entry(cache));
+        REQUIRE(use_failing_entry(cache));
+        REQUIRE(use_failing_entry(cache));
+    }
+    SECTION("failures are cached until the retry delay expires")
+    {
+        auto now = std::chrono::steady_clock::now();
+        immutable_cache_config config{1024};
+        config.retry_policy.initial_delay = std::chrono::milliseconds(50);
+        config.retry_policy.backoff_factor = 3;
+        config.retry_policy.clock = [&] { return now; };
+        immutable_cache cache(config);
+        REQUIRE(use_failing_entry(cache));
+        REQUIRE(!use_failing_entry(cache));
+        now += std::chrono::milliseconds(49);
+        REQUIRE(!use_failing_entry(cache));
+        now += std::chrono::milliseconds(1);
+        REQUIRE(use_failing_entry(cache));
+        // The delay has now tripled.
+        now += std::chrono::milliseconds(149);
+        REQUIRE(!use_failing_entry(cache));
+        now += std::chrono::milliseconds(1);
+        REQUIRE(use_failing_entry(cache));
+    }
+    SECTION("a success resets the failure count")
+    {
+        auto now = std::chrono::steady_clock::now();
+        immutable_cache_config config{1024};
+        config.retry_policy.initial_delay = std::chrono::milliseconds(50);
+        config.retry_policy.clock = [&] { return now; };
+        immutable_cache cache(config);
+        REQUIRE(use_failing_entry(cache));
+        now += std::chrono::milliseconds(50);
+        REQUIRE(use_failing_entry(cache));
+        now += std::chrono::milliseconds(100);
+        immutable_cache_ptr<int> p(
+            cache, make_id(0), [&](id_interface const&) {
+                return test_task(1);
+            });
+        REQUIRE(await_cache_value(p) == 1);
+        auto& shard = detail::get_shard(*cache.impl, make_id(0));
+        std::scoped_lock<std::mutex> lock(shard.mutex);
+        REQUIRE(shard.records.begin()->second->failure_count == 0);
+    }
+    SECTION("the number of attempts can be limited")
+    {
+        immutable_cache_config config{1024};
+        config.retry_policy.max_attempts = 2;
+        immutable_cache cache(config);
+        REQUIRE(use_failing_entry(cache));
+        REQUIRE(use_failing_entry(cache));
+        REQUIRE(!use_failing_entry(cache));
+        REQUIRE(!use_failing_entry(cache));
+    }
+}
+
+TEST_CASE("incremental immutable cache snapshots", "[immutable_cache]")
+{
+    immutable_cache_config config{0x10000};
+    config.shard_count = 3;
+    immutable_cache cache(config);
+
+    // Keep entries 0-49 in use and let entries 50-99 become unused.
+    std::vector<immutable_cache_ptr<std::string>> ptrs;
+    for (int i = 0; i != 100; ++i)
+    {
+        immutable_cache_ptr<std::string> p(
+            cache, make_id(i), [&](id_interface const&) {
+                return string_task(10, 'a');
+            });
+        await_cache_value(p);
+        if (i < 50)
+            ptrs.push_back(std::move(p));
+    }
+    // Add a failed entry.
+    immutable_cache_ptr<int> failed(
+        cache, make_id(1000), [&](id_interface const&) {
+            return failing_task();
+        });
+    REQUIRE_THROWS(await_cache_value(failed));
+
+    {
+        auto summary = get_cache_summary(cache);
+        REQUIRE(summary.loading_count == 0);
+        REQUIRE(summary.ready_count == 100);
+        REQUIRE(summary.failed_count == 1);
+        REQUIRE(summary.pending_eviction_count == 50);
+        REQUIRE(summary.total_size == 100 * deep_sizeof(std::string(10, 'a')));
+        REQUIRE(summary.unused_size == 50 * deep_sizeof(std::string(10, 'a')));
+    }
+
+    // Paging through the whole cache yields the same entries as a full
+    // snapshot.
+    immutable_cache_snapshot paged;
+    immutable_cache_snapshot_cursor cursor;
+    int page_count = 0;
+    while (true)
+    {
+        auto page = get_cache_snapshot_page(cache, cursor, 7);
+        REQUIRE(
+            page.entries.in_use.size() + page.entries.pending_eviction.size()
+            <= 7);
+        paged.in_use.insert(
+            paged.in_use.end(),
+            page.entries.in_use.begin(),
+            page.entries.in_use.end());
+        paged.pending_eviction.insert(
+            paged.pending_eviction.end(),
+            page.entries.pending_eviction.begin(),
+            page.entries.pending_eviction.end());
+        ++page_count;
+        if (!page.next)
+            break;
+        cursor = *page.next;
+    }
+    REQUIRE(page_count > 10);
+    REQUIRE(paged.in_use.size() == 51);
+    REQUIRE(paged.pending_eviction.size() == 50);
+    REQUIRE(
+        sort_cache_snapshot(paged)
+        == sort_cache_snapshot(get_cache_snapshot(cache)));
+
+    // Filter by key prefix.
+    {
+        immutable_cache_snapshot_filter filter;
+        filter.key_prefix = "1";
+        auto page = get_cache_snapshot_page(cache, {}, 1000, filter);
+        REQUIRE(!page.next);
+        // 1, 10-19 and 1000
+        REQUIRE(page.entries.in_use.size() == 12);
+        REQUIRE(page.entries.pending_eviction.empty());
+    }
+
+    // Filter by state.
+    {
+        immutable_cache_snapshot_filter filter;
+        filter.state = immutable_cache_entry_state::FAILED;
+        auto page = get_cache_snapshot_page(cache, {}, 1000, filter);
+        REQUIRE(!page.next);
+        REQUIRE(
+            page.entries
+            == immutable_cache_snapshot{
+                {{"1000", immutable_cache_entry_state::FAILED, 0}}, {}});
+    }
+
+    ptrs.clear();
+    failed.reset();
+    clear_unused_entries(cache);
+    REQUIRE(get_cache_summary(cache) == immutable_cache_summary{});
+}
+
+TEST_CASE("immutable cache cancellation", "[immutable_cache]")
+{
+    immutable_cache cache(immutable_cache_config{1024});
+
+    cppcoro::cancellation_token cancellation;
+    int creation_count = 0;
+    auto create_task = [&](id_interface const&,
+                           cppcoro::cancellation_token token) {
+        ++creation_count;
+        cancellation = token;
+        return test_task(42);
+    };
+
+    // Releasing one of two pointers to a loading entry doesn't affect it.
+    immutable_cache_ptr<int> p(cache, make_id(0), create_task);
+    immutable_cache_ptr<int> q = p;
+    REQUIRE(creation_count == 1);
+    p.reset();
+    REQUIRE(!cancellation.is_cancellation_requested());
+    REQUIRE(q.is_loading());
+
+    // Releasing the last one drops the entry and cancels its work.
+    auto old_task = q.task();
+    auto old_cancellation = cancellation;
+    q.reset();
+    REQUIRE(old_cancellation.is_cancellation_requested());
+    REQUIRE(get_cache_snapshot(cache) == immutable_cache_snapshot{});
+    REQUIRE(get_cache_summary(cache).cancelled_count == 1);
+
+    // Requesting the entry again starts over.
+    immutable_cache_ptr<int> r(cache, make_id(0), create_task);
+    REQUIRE(creation_count == 2);
+    REQUIRE(!cancellation.is_cancellation_requested());
+
+    // If the old work finishes anyway, the new entry isn't affected.
+    REQUIRE(cppcoro::sync_wait(old_task) == 42);
+    REQUIRE(r.is_loading());
+    REQUIRE(await_cache_value(r) == 42);
+    REQUIRE(r.is_ready());
+
+    // Entries that are ready are kept (and nothing is cancelled).
+    r.reset();
+    REQUIRE(!cancellation.is_cancellation_requested());
+    REQUIRE(
+        get_cache_snapshot(cache)
+        == (immutable_cache_snapshot{
+            {}, {{"0", immutable_cache_entry_state::READY, sizeof(int)}}}));
+    REQUIRE(get_cache_summary(cache).cancelled_count == 1);
+}
@@ -0,0 +1,206 @@
+#include <cradle/inner/caching/peer_cache.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <catch2/catch.hpp>
+
+#include <cradle/inner/core/type_interfaces.h>
+
+using std::string;
+
+using namespace cradle;
+
+namespace {
+
+string
+blob_contents(blob const& x)
+{
+    return string(reinterpret_cast<char const*>(x.data()), x.size());
+}
+
+// Make the config for a peer that listens on a port that the system picks.
+// (Its address is added to :others to form the list of peers.)
+peer_cache_config
+make_test_config(std::vector<string> others)
+{
+    peer_cache_config config;
+    config.self = "127.0.0.1:0";
+    config.peers = std::move(others);
+    config.peers.push_back(config.self);
+    config.request_timeout = std::chrono::milliseconds(500);
+    return config;
+}
+
+// a peer whose own cache is just a map
+struct test_peer
+{
+    std::map<string, string> values;
+    std::map<string, string> namespaces;
+    std::mutex mutex;
+    peer_cache cache;
+
+    test_peer(peer_cache_config const& config)
+    {
+        cache.reset(
+            config,
+            peer_cache_handlers{
+                .find = [this](string const& key) -> std::optional<blob> {
+                    std::scoped_lock<std::mutex> lock(mutex);
+                    auto value = values.find(key);
+                    if (value == values.end())
+                        return std::nullopt;
+                    return make_blob(value->second);
+                },
+                .insert =
+                    [this](
+                        string const& key,
+                        blob const& value,
+                        string const& key_namespace) {
+                        std::scoped_lock<std::mutex> lock(mutex);
+                        values[key] = blob_contents(value);
+                        namespaces[key] = key_namespace;
+                    }});
+    }
+};
+
+} // namespace
+
+TEST_CASE("peer ring", "[peer_cache]")
+{
+    std::vector<string> peers{"a:1", "b:2", "c:3"};
+    peer_ring ring(peers, 64);
+
+    // Keys are spread across all the peers.
+    std::vector<int> counts(3, 0);
+    for (int i = 0; i != 3000; ++i)
+        ++counts[ring.get_owner("key_" + std::to_string(i))];
+    for (auto count : counts)
+        REQUIRE(count > 500);
+
+    // The order of the peers doesn't matter.
+    std::vector<string> reordered_peers{"c:3", "a:1", "b:2"};
+    peer_ring reordered(reordered_peers, 64);
+    for (int i = 0; i != 100; ++i)
+    {
+        auto key = "key_" + std::to_string(i);
+        REQUIRE(
+            peers[ring.get_owner(key)]
+            == reordered_peers[reordered.get_owner(key)]);
+    }
+
+    // When a peer leaves, only its own keys move.
+    peer_ring reduced({"a:1", "b:2"}, 64);
+    for (int i = 0; i != 1000; ++i)
+    {
+        auto key = "key_" + std::to_string(i);
+        auto owner = ring.get_owner(key);
+        if (owner != 2)
+            REQUIRE(reduced.get_owner(key) == owner);
+    }
+}
+
+TEST_CASE("peer cache requests", "[peer_cache]")
+{
+    // b can be told about a when it starts, but a only learns b's port once
+    // b is listening.
+    test_peer a(make_test_config({}));
+    test_peer b(make_test_config({a.cache.get_address()}));
+    std::vector<string> peers{a.cache.get_address(), b.cache.get_address()};
+    REQUIRE(peers[0] != "127.0.0.1:0");
+    REQUIRE(peers[1] != peers[0]);
+    a.cache.set_peers(peers);
+
+    // Find a key that b owns.
+    string key;
+    for (int i = 0; !a.cache.get_remote_owner(key); ++i)
+        key = "key/" + std::to_string(i);
+    REQUIRE(*a.cache.get_remote_owner(key) == peers[1]);
+    REQUIRE(!b.cache.get_remote_owner(key));
+
+    REQUIRE(!a.cache.fetch(peers[1], key));
+    a.cache.store(peers[1], key, make_blob(string(100'000, 'v')), "calc");
+    REQUIRE(b.values[key] == string(100'000, 'v'));
+    REQUIRE(b.namespaces[key] == "calc");
+    auto value = a.cache.fetch(peers[1], key);
+    REQUIRE(value);
+    REQUIRE(blob_contents(*value) == string(100'000, 'v'));
+
+    auto info = a.cache.get_summary_info();
+    REQUIRE(info.hit_count == 1);
+    REQUIRE(info.miss_count == 1);
+    REQUIRE(info.store_count == 1);
+    REQUIRE(info.failure_count == 0);
+    REQUIRE(b.cache.get_summary_info().served_count == 3);
+
+    // Once b is gone, requests to it fail, and it's left alone for a while.
+    b.cache.reset();
+    REQUIRE_THROWS_AS(a.cache.fetch(peers[1], key), peer_cache_failure);
+    REQUIRE(a.cache.get_summary_info().failure_count == 1);
+    REQUIRE(!a.cache.get_remote_owner(key));
+}
+
+TEST_CASE("peer cache security", "[peer_cache]")
+{
+    auto config = make_test_config({});
+    config.shared_secret = "open sesame";
+    config.max_value_size = 1000;
+    test_peer a(config);
+    auto address = a.cache.get_address();
+
+    // Requests without the secret are rejected.
+    test_peer intruder(make_test_config({address}));
+    REQUIRE_THROWS_AS(
+        intruder.cache.store(address, "k", make_blob(string("v"))),
+        peer_cache_failure);
+    REQUIRE_THROWS_AS(intruder.cache.fetch(address, "k"), peer_cache_failure);
+    auto wrong_config = make_test_config({address});
+    wrong_config.shared_secret = "open sesamf";
+    test_peer impostor(wrong_config);
+    REQUIRE_THROWS_AS(
+        impostor.cache.store(address, "k", make_blob(string("v"))),
+        peer_cache_failure);
+    REQUIRE(a.values.empty());
+    REQUIRE(a.cache.get_summary_info().served_count == 0);
+
+    // Peers that know it can store values (up to the size limit).
+    auto friend_config = make_test_config({address});
+    friend_config.shared_secret = "open sesame";
+    test_peer b(friend_config);
+    b.cache.store(address, "k", make_blob(string(1000, 'v')));
+    REQUIRE(a.values["k"] == string(1000, 'v'));
+    REQUIRE(blob_contents(*b.cache.fetch(address, "k")) == string(1000, 'v'));
+    REQUIRE_THROWS_AS(
+        b.cache.store(address, "big", make_blob(string(1001, 'v'))),
+        peer_cache_failure);
+    REQUIRE(!a.values.count("big"));
+}
+
+TEST_CASE("peer cache config errors", "[peer_cache]")
+{
+    peer_cache cache;
+
+    // The peer's own address has to be in the list.
+    peer_cache_config config;
+    config.peers = {"127.0.0.1:1"};
+    config.self = "127.0.0.1:0";
+    REQUIRE_THROWS_AS(
+        cache.reset(config, peer_cache_handlers{}), peer_cache_failure);
+    REQUIRE(!cache.is_initialized());
+
+    // Listening on anything but loopback requires a secret.
+    config = make_test_config({});
+    config.bind_address = "0.0.0.0";
+    REQUIRE_THROWS_AS(
+        cache.reset(config, peer_cache_handlers{}), peer_cache_failure);
+    config.bind_address = "not an address";
+    config.shared_secret = "open sesame";
+    REQUIRE_THROWS_AS(
+        cache.reset(config, peer_cache_handlers{}), peer_cache_failure);
+    REQUIRE(!cache.is_initialized());
+
+    // The same goes for changing the peers.
+    cache.reset(make_test_config({}), peer_cache_handlers{});
+    REQUIRE_THROWS_AS(cache.set_peers({"127.0.0.1:1"}), peer_cache_failure);
+}
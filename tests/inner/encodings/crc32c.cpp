@@ -0,0 +1,62 @@
+#include <cradle/inner/encodings/crc32c.h>
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+using std::string;
+using namespace cradle;
+
+TEST_CASE("CRC-32C check values", "[encodings][crc32c]")
+{
+    string text = "123456789";
+    REQUIRE(crc32c(text.data(), text.size()) == 0xe3069283);
+    REQUIRE(
+        detail::crc32c_software(text.data(), text.size(), 0) == 0xe3069283);
+
+    // 32 bytes of zeros/ones (from RFC 3720)
+    string zeros(32, '\0');
+    REQUIRE(crc32c(zeros.data(), zeros.size()) == 0x8a9136aa);
+    string ones(32, '\xff');
+    REQUIRE(crc32c(ones.data(), ones.size()) == 0x62a8ab43);
+
+    REQUIRE(crc32c(nullptr, 0) == 0);
+}
+
+TEST_CASE("CRC-32C implementations agree", "[encodings][crc32c]")
+{
+    std::vector<uint8_t> data(0x10000 + 13);
+    for (auto& byte : data)
+        byte = uint8_t(std::rand());
+    // Try various sizes and (mis)alignments.
+    for (size_t offset : {0, 1, 3, 7})
+    {
+        for (size_t size : {0, 1, 7, 8, 9, 100, 0x10000})
+        {
+            REQUIRE(
+                crc32c(data.data() + offset, size)
+                == detail::crc32c_software(data.data() + offset, size, 0));
+        }
+    }
+}
+
+TEST_CASE("CRC-32C incremental computation", "[encodings][crc32c]")
+{
+    std::vector<uint8_t> data(100'000);
+    for (auto& byte : data)
+        byte = uint8_t(std::rand());
+    auto full = crc32c(data.data(), data.size());
+
+    for (size_t split : {0, 1, 12'345, 99'999, 100'000})
+    {
+        auto first = crc32c(data.data(), split);
+        // continuing a CRC
+        REQUIRE(
+            crc32c(data.data() + split, data.size() - split, first) == full);
+        // combining independent CRCs
+        auto second = crc32c(data.data() + split, data.size() - split);
+        REQUIRE(crc32c_combine(first, second, data.size() - split) == full);
+    }
+}
@@ -1,6 +1,8 @@
 #include <cradle/inner/encodings/lz4.h>
 
+#include <algorithm>
 #include <cstring>
+#include <string>
 
 #include <catch2/catch.hpp>
 
@@ -47,3 +49,89 @@ TEST_CASE("lz4 decompression error", "[encodings][lz4]")
     char const* bad_lz4_data = "whatever";
     REQUIRE_THROWS(lz4::decompress(nullptr, 0, bad_lz4_data, 8));
 }
+
+TEST_CASE("lz4 frame compression", "[encodings][lz4]")
+{
+    // Use enough data to span several chunks.
+    size_t const original_data_size = lz4::frame_chunk_size * 3 + 0x1234;
+    std::unique_ptr<uint8_t[]> original_data(new uint8_t[original_data_size]);
+    for (size_t i = 0; i != original_data_size; ++i)
+        original_data[i] = (std::rand() & 0x3) + 0x70;
+
+    std::string compressed_data;
+    size_t largest_output = 0;
+    lz4::frame_compressor compressor(
+        [&](void const* data, size_t size) {
+            compressed_data.append(reinterpret_cast<char const*>(data), size);
+            largest_output = (std::max)(largest_output, size);
+        },
+        original_data_size);
+    // Write the data in uneven pieces.
+    size_t const piece_size = 0x54321;
+    for (size_t offset = 0; offset < original_data_size; offset += piece_size)
+    {
+        compressor.write(
+            original_data.get() + offset,
+            (std::min)(piece_size, original_data_size - offset));
+    }
+    compressor.finish();
+    REQUIRE(compressor.compressed_size() == compressed_data.size());
+    REQUIRE(compressed_data.size() < original_data_size);
+    // The output comes in bounded pieces.
+    REQUIRE(largest_output <= lz4::frame_chunk_size * 2);
+
+    REQUIRE(lz4::is_frame(compressed_data.data(), compressed_data.size()));
+
+    std::unique_ptr<uint8_t[]> decompressed_data(
+        new uint8_t[original_data_size]);
+    lz4::decompress_frame(
+        decompressed_data.get(),
+        original_data_size,
+        compressed_data.data(),
+        compressed_data.size());
+    REQUIRE(
+        std::memcmp(
+            original_data.get(), decompressed_data.get(), original_data_size)
+        == 0);
+
+    // Frames don't decompress into buffers of the wrong size.
+    REQUIRE_THROWS_AS(
+        lz4::decompress_frame(
+            decompressed_data.get(),
+            original_data_size - 1,
+            compressed_data.data(),
+            compressed_data.size()),
+        lz4_error);
+    std::unique_ptr<uint8_t[]> oversized_data(
+        new uint8_t[original_data_size + 1]);
+    REQUIRE_THROWS_AS(
+        lz4::decompress_frame(
+            oversized_data.get(),
+            original_data_size + 1,
+            compressed_data.data(),
+            compressed_data.size()),
+        lz4_error);
+
+    // Truncated frames are detected.
+    REQUIRE_THROWS_AS(
+        lz4::decompress_frame(
+            decompressed_data.get(),
+            original_data_size,
+            compressed_data.data(),
+            compressed_data.size() / 2),
+        lz4_error);
+}
+
+TEST_CASE("lz4 frame detection", "[encodings][lz4]")
+{
+    std::string text(100, 'a');
+    std::unique_ptr<uint8_t[]> block(
+        new uint8_t[lz4::max_compressed_size(text.size())]);
+    size_t block_size = lz4::compress(
+        block.get(),
+        lz4::max_compressed_size(text.size()),
+        text.data(),
+        text.size());
+    REQUIRE(!lz4::is_frame(block.get(), block_size));
+    REQUIRE(!lz4::is_frame("\x04\x22", 2));
+}
@@ -57,3 +57,32 @@ TEST_CASE("read_file_contents", "[fs][file_io]")
     dump_string_to_file(path, text);
     REQUIRE(read_file_contents(path) == text);
 }
+
+TEST_CASE("map_file_contents", "[fs][file_io]")
+{
+    auto path = file_path("map_file_contents.txt");
+    auto text = std::string("some mapped\n  text\n");
+    dump_string_to_file(path, text);
+    {
+        auto contents = map_file_contents(path);
+        REQUIRE(
+            std::string(
+                reinterpret_cast<char const*>(contents.data()),
+                contents.size())
+            == text);
+        // The mapping outlives the file itself.
+        remove(path);
+        REQUIRE(
+            std::string(
+                reinterpret_cast<char const*>(contents.data()),
+                contents.size())
+            == text);
+    }
+
+    dump_string_to_file(path, "");
+    REQUIRE(map_file_contents(path).size() == 0);
+
+    REQUIRE_THROWS_AS(
+        map_file_contents(file_path("very/likely/to-be/a/bad/path.txt")),
+        open_file_error);
+}
@@ -0,0 +1,595 @@
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include <catch2/catch.hpp>
+#include <cppcoro/cancellation_source.hpp>
+#include <cppcoro/operation_cancelled.hpp>
+#include <cppcoro/sync_wait.hpp>
+
+#include <cradle/inner/core/id.h>
+#include <cradle/inner/fs/utilities.h>
+#include <cradle/inner/service/core.h>
+
+using std::string;
+
+using namespace cradle;
+
+namespace {
+
+blob
+make_blob(string const& contents)
+{
+    std::shared_ptr<std::byte[]> data(new std::byte[contents.size()]);
+    std::memcpy(data.get(), contents.data(), contents.size());
+    return blob(
+        std::static_pointer_cast<std::byte const>(std::move(data)),
+        contents.size());
+}
+
+string
+blob_contents(blob const& x)
+{
+    return string(reinterpret_cast<char const*>(x.data()), x.size());
+}
+
+// Generate the value for item :i. Odd items are big enough to be stored in
+// files by the disk cache, while even items are stored in the database.
+string
+generate_value(int i)
+{
+    return string(i % 2 == 1 ? 5000 : 100, char('a' + i));
+}
+
+inner_service_config
+make_test_config(
+    string const& cache_dir,
+    std::optional<cache_warm_up_config> warm_up = none)
+{
+    return inner_service_config{
+        immutable_cache_config{0x40'00'00'00},
+        disk_cache_config{cache_dir, 0x40'00'00'00},
+        compressed_memory_cache_config{0x40'00'00'00},
+        warm_up};
+}
+
+// Get item :i through the disk-cached layer and return whether it had to be
+// computed.
+bool
+get_item(inner_service_core& core, int i)
+{
+    bool computed = false;
+    auto key = make_id(i);
+    std::function<cppcoro::task<blob>()> create_task
+        = [&]() -> cppcoro::task<blob> {
+        computed = true;
+        co_return make_blob(generate_value(i));
+    };
+    auto value
+        = cppcoro::sync_wait(disk_cached<blob>(core, key, create_task));
+    REQUIRE(blob_contents(value) == generate_value(i));
+    return computed;
+}
+
+// Generate a value that LZ4 can't compress.
+string
+generate_random_string(size_t size)
+{
+    string result(size, '\0');
+    uint32_t state = 12345;
+    for (auto& c : result)
+    {
+        state = state * 1103515245 + 12345;
+        c = char(state >> 24);
+    }
+    return result;
+}
+
+// Do some "work" that only ends when it's cancelled.
+cppcoro::task<int>
+wait_for_cancellation(cppcoro::cancellation_token cancellation)
+{
+    while (!cancellation.is_cancellation_requested())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    cancellation.throw_if_cancellation_requested();
+    co_return 0;
+}
+
+} // namespace
+
+TEST_CASE("uncompressed disk cache files", "[inner][service]")
+{
+    auto cache_dir = file_path("tests_inner_uncompressed_files");
+    reset_directory(cache_dir);
+
+    inner_service_core core;
+    core.inner_reset(inner_service_config{
+        immutable_cache_config{0x40'00'00'00},
+        disk_cache_config{cache_dir.string(), 0x40'00'00'00}});
+
+    auto key = make_id(0);
+    auto const original = generate_random_string(5000);
+    std::function<cppcoro::task<blob>()> create_task
+        = [&]() -> cppcoro::task<blob> {
+        co_return cradle::make_blob(original);
+    };
+    cppcoro::sync_wait(disk_cached<blob>(core, key, create_task));
+    core.inner_internals().disk_write_pool.wait_for_tasks();
+
+    // Since LZ4 can't compress the value, it's stored as-is.
+    auto& disk_cache = core.inner_internals().disk_cache;
+    auto entry = disk_cache.find(boost::lexical_cast<string>(key));
+    REQUIRE(entry);
+    REQUIRE(entry->size == 5000);
+    REQUIRE(entry->original_size == 5000);
+
+    // And it's read back directly from the file mapping.
+    create_task = []() -> cppcoro::task<blob> {
+        FAIL("value recomputed");
+        co_return blob();
+    };
+    auto value = cppcoro::sync_wait(disk_cached<blob>(core, key, create_task));
+    REQUIRE(blob_contents(value) == original);
+
+    // Corrupting the file is detected.
+    {
+        std::ofstream output(
+            disk_cache.get_path_for_entry(*entry),
+            std::ios::in | std::ios::out | std::ios::binary);
+        output.put(char(~original[0]));
+    }
+    bool computed = false;
+    create_task = [&]() -> cppcoro::task<blob> {
+        computed = true;
+        co_return cradle::make_blob(original);
+    };
+    value = cppcoro::sync_wait(disk_cached<blob>(core, key, create_task));
+    REQUIRE(computed);
+    REQUIRE(blob_contents(value) == original);
+}
+
+TEST_CASE("deduplicated disk cache files", "[inner][service]")
+{
+    auto cache_dir = file_path("tests_inner_deduplicated_files");
+    reset_directory(cache_dir);
+
+    inner_service_core core;
+    inner_service_config config{
+        immutable_cache_config{0x40'00'00'00},
+        disk_cache_config{cache_dir.string(), 0x40'00'00'00}};
+    config.deduplicate_disk_cache_files = true;
+    core.inner_reset(config);
+
+    // Store the same value under two different keys.
+    auto const value = generate_random_string(5000);
+    std::function<cppcoro::task<blob>()> create_task
+        = [&]() -> cppcoro::task<blob> {
+        co_return cradle::make_blob(value);
+    };
+    cppcoro::sync_wait(disk_cached<blob>(core, make_id(0), create_task));
+    cppcoro::sync_wait(disk_cached<blob>(core, make_id(1), create_task));
+    core.inner_internals().disk_write_pool.wait_for_tasks();
+
+    // Only one copy is stored.
+    auto& disk_cache = core.inner_internals().disk_cache;
+    auto info = disk_cache.get_summary_info();
+    REQUIRE(info.entry_count == 2);
+    REQUIRE(info.total_size == 5000);
+    auto entry_0 = disk_cache.find(boost::lexical_cast<string>(make_id(0)));
+    auto entry_1 = disk_cache.find(boost::lexical_cast<string>(make_id(1)));
+    REQUIRE(entry_0);
+    REQUIRE(entry_1);
+    REQUIRE(entry_0->content_id == entry_1->content_id);
+
+    // And both keys read it back.
+    create_task = []() -> cppcoro::task<blob> {
+        FAIL("value recomputed");
+        co_return blob();
+    };
+    for (int i = 0; i != 2; ++i)
+    {
+        auto result = cppcoro::sync_wait(
+            disk_cached<blob>(core, make_id(i), create_task));
+        REQUIRE(blob_contents(result) == value);
+    }
+}
+
+TEST_CASE("disk cache verification", "[inner][service]")
+{
+    auto cache_dir = file_path("tests_inner_disk_cache_verification");
+    reset_directory(cache_dir);
+
+    auto config = inner_service_config{
+        immutable_cache_config{0x40'00'00'00},
+        disk_cache_config{cache_dir.string(), 0x40'00'00'00}};
+    SECTION("full")
+    {
+    }
+    SECTION("lazy")
+    {
+        config.disk_cache_verification = disk_cache_verification_config{
+            disk_cache_verification_mode::LAZY};
+    }
+    SECTION("sampled")
+    {
+        config.disk_cache_verification = disk_cache_verification_config{
+            disk_cache_verification_mode::SAMPLED, 2};
+    }
+    inner_service_core core;
+    core.inner_reset(config);
+    auto const& verification = core.inner_internals().disk_cache_verification;
+
+    // This is big enough to be checked in parallel.
+    auto key = make_id(0);
+    auto const original = generate_random_string(0x90'00'00);
+    bool computed = false;
+    std::function<cppcoro::task<blob>()> create_task
+        = [&]() -> cppcoro::task<blob> {
+        computed = true;
+        co_return cradle::make_blob(original);
+    };
+    cppcoro::sync_wait(disk_cached<blob>(core, key, create_task));
+    core.inner_internals().disk_write_pool.wait_for_tasks();
+
+    auto& disk_cache = core.inner_internals().disk_cache;
+    auto entry = disk_cache.find(boost::lexical_cast<string>(key));
+    REQUIRE(entry);
+    REQUIRE(
+        entry->checksum_algorithm == disk_cache_checksum_algorithm::CRC32C);
+
+    // An intact file is read back in any mode.
+    computed = false;
+    auto value = cppcoro::sync_wait(disk_cached<blob>(core, key, create_task));
+    REQUIRE(!computed);
+    REQUIRE(blob_contents(value) == original);
+    core.inner_internals().disk_write_pool.wait_for_tasks();
+    // (In FULL mode, it was checked in chunks, on the checksum queue.)
+    if (verification.mode == disk_cache_verification_mode::FULL)
+    {
+        auto const& checksum_pool = core.inner_internals().checksum_pool;
+        // (A job only counts as completed once its worker is done with it.)
+        checksum_pool.wait_for_tasks();
+        REQUIRE(checksum_pool.get_summary_info().completed_count == 3);
+    }
+
+    // Corrupt the end of the file.
+    {
+        std::ofstream output(
+            disk_cache.get_path_for_entry(*entry),
+            std::ios::in | std::ios::out | std::ios::binary);
+        output.seekp(original.size() - 1);
+        output.put(char(~original.back()));
+    }
+    computed = false;
+    value = cppcoro::sync_wait(disk_cached<blob>(core, key, create_task));
+    switch (verification.mode)
+    {
+        case disk_cache_verification_mode::FULL:
+            REQUIRE(computed);
+            REQUIRE(blob_contents(value) == original);
+            break;
+        case disk_cache_verification_mode::LAZY:
+            // The corrupt value is returned, but its entry is discarded.
+            REQUIRE(!computed);
+            REQUIRE(blob_contents(value) != original);
+            core.inner_internals().disk_write_pool.wait_for_tasks();
+            REQUIRE(!disk_cache.find(boost::lexical_cast<string>(key)));
+            break;
+        case disk_cache_verification_mode::SAMPLED:
+            // The first read was checked, so this one isn't.
+            REQUIRE(!computed);
+            REQUIRE(blob_contents(value) != original);
+            // But the next one is.
+            value = cppcoro::sync_wait(
+                disk_cached<blob>(core, key, create_task));
+            REQUIRE(computed);
+            REQUIRE(blob_contents(value) == original);
+            break;
+    }
+}
+
+TEST_CASE("compressed memory cache tier", "[inner][service]")
+{
+    auto cache_dir = file_path("tests_inner_compressed_tier");
+    reset_directory(cache_dir);
+
+    inner_service_core core;
+    core.inner_reset(make_test_config(cache_dir.string()));
+    auto& internals = core.inner_internals();
+    // Get item :i through all of the caching layers and return whether it
+    // had to be computed.
+    auto get_fully_cached_item = [&](int i) {
+        bool computed = false;
+        auto value = cppcoro::sync_wait(
+            fully_cached<blob>(core, make_id(i), [&]() -> cppcoro::task<blob> {
+                computed = true;
+                co_return cradle::make_blob(generate_value(i));
+            }));
+        REQUIRE(blob_contents(value) == generate_value(i));
+        return computed;
+    };
+    REQUIRE(get_fully_cached_item(0));
+    REQUIRE(get_fully_cached_item(1));
+    internals.disk_write_pool.wait_for_tasks();
+
+    // The values only go into the compressed memory cache once the immutable
+    // cache evicts them.
+    internals.compression_pool.wait_for_tasks();
+    REQUIRE(internals.compressed_cache.get_summary_info().entry_count == 0);
+    clear_unused_entries(internals.cache);
+    internals.compression_pool.wait_for_tasks();
+    REQUIRE(internals.compressed_cache.get_summary_info().entry_count == 2);
+
+    // Even with the disk cache cleared, the items are still available.
+    internals.disk_cache.clear();
+    REQUIRE(!get_fully_cached_item(0));
+    REQUIRE(!get_fully_cached_item(1));
+    auto info = internals.compressed_cache.get_summary_info();
+    REQUIRE(info.entry_count == 2);
+    REQUIRE(info.hit_count == 2);
+
+    // Values that only pass through the disk-cached layer don't go in.
+    REQUIRE(get_item(core, 2));
+    internals.compression_pool.wait_for_tasks();
+    REQUIRE(internals.compressed_cache.get_summary_info().entry_count == 2);
+}
+
+TEST_CASE("cache warm-up", "[inner][service]")
+{
+    auto cache_dir = file_path("tests_inner_cache_warm_up");
+    reset_directory(cache_dir);
+
+    inner_service_core core;
+    core.inner_reset(make_test_config(cache_dir.string()));
+    for (int i = 0; i != 6; ++i)
+    {
+        REQUIRE(get_item(core, i));
+        core.inner_internals().disk_write_pool.wait_for_tasks();
+        // SQLite only maintains millisecond precision on its timestamps, so
+        // introduce a delay here to ensure that the timestamps in the cache
+        // are unique.
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    // Shut down the first instance completely before restarting, since the
+    // disk cache can only be opened by one instance at a time.
+    core.inner_reset();
+
+    SECTION("everything fits")
+    {
+        core.inner_reset(make_test_config(
+            cache_dir.string(), cache_warm_up_config{1'000'000, 2}));
+        core.wait_for_cache_warm_up();
+        REQUIRE(core.inner_internals().warm_up->loaded_count == 6);
+        // Clear the disk cache to prove that the values now come from memory.
+        core.inner_internals().disk_cache.clear();
+        for (int i = 0; i != 6; ++i)
+            REQUIRE(!get_item(core, i));
+    }
+    SECTION("limited budget")
+    {
+        // Only the two most recently used items fit in this budget.
+        core.inner_reset(make_test_config(
+            cache_dir.string(), cache_warm_up_config{5'300, 1}));
+        core.wait_for_cache_warm_up();
+        REQUIRE(core.inner_internals().warm_up->loaded_count == 2);
+        core.inner_internals().disk_cache.clear();
+        REQUIRE(!get_item(core, 5));
+        REQUIRE(!get_item(core, 4));
+        REQUIRE(get_item(core, 3));
+    }
+    SECTION("no warm-up")
+    {
+        core.inner_reset(make_test_config(cache_dir.string()));
+        core.wait_for_cache_warm_up();
+        REQUIRE(
+            core.inner_internals().compressed_cache.get_summary_info()
+                .entry_count
+            == 0);
+    }
+}
+
+TEST_CASE("resetting a busy service core", "[inner][service]")
+{
+    auto cache_dir = file_path("tests_inner_busy_reset");
+    reset_directory(cache_dir);
+
+    inner_service_core core;
+    core.inner_reset(make_test_config(
+        cache_dir.string(), cache_warm_up_config{1'000'000, 2}));
+    for (int i = 0; i != 6; ++i)
+        get_item(core, i);
+    // Reset while disk writes may still be queued. The old internals are
+    // shut down before the new ones (which use the same disk cache) start.
+    core.inner_reset(make_test_config(
+        cache_dir.string(), cache_warm_up_config{1'000'000, 2}));
+    core.wait_for_cache_warm_up();
+    for (int i = 0; i != 6; ++i)
+        get_item(core, i);
+}
+
+TEST_CASE("peer cache tier", "[inner][service]")
+{
+    // Each core listens on a port that the system picks, so the first one
+    // only learns the second one's address once it's running.
+    std::vector<string> peers;
+    inner_service_core cores[2];
+    for (int i = 0; i != 2; ++i)
+    {
+        auto cache_dir = file_path("tests_inner_peer_" + std::to_string(i));
+        reset_directory(cache_dir);
+        auto config = make_test_config(cache_dir.string());
+        config.compressed_memory_cache = none;
+        peer_cache_config peer_config;
+        peer_config.self = "127.0.0.1:0";
+        peer_config.peers = peers;
+        peer_config.peers.push_back(peer_config.self);
+        config.peer_cache = peer_config;
+        cores[i].inner_reset(config);
+        peers.push_back(cores[i].inner_internals().peer_cache.get_address());
+    }
+    cores[0].inner_internals().peer_cache.set_peers(peers);
+    auto& a = cores[0];
+    auto& b = cores[1];
+    auto wait_for_writes = [&] {
+        for (auto& core : cores)
+        {
+            core.inner_internals().peer_write_pool.wait_for_tasks();
+            core.inner_internals().disk_write_pool.wait_for_tasks();
+        }
+    };
+
+    // Find an item that b owns.
+    int item = 0;
+    while (!a.inner_internals().peer_cache.get_remote_owner(
+        boost::lexical_cast<string>(make_id(item))))
+    {
+        ++item;
+    }
+
+    // When a computes it, a copy goes to b.
+    REQUIRE(get_item(a, item));
+    wait_for_writes();
+    REQUIRE(b.inner_internals().disk_cache.find(
+        boost::lexical_cast<string>(make_id(item))));
+    REQUIRE(!get_item(b, item));
+
+    // And once a has lost its own copy, it gets it back from b.
+    a.inner_internals().disk_cache.clear();
+    REQUIRE(!get_item(a, item));
+    wait_for_writes();
+    REQUIRE(a.inner_internals().disk_cache.find(
+        boost::lexical_cast<string>(make_id(item))));
+    auto info = a.inner_internals().peer_cache.get_summary_info();
+    REQUIRE(info.hit_count == 1);
+    REQUIRE(info.store_count == 1);
+
+    // The requests (a miss and a hit, and a store) go through the service's
+    // scheduler (on threads of their own).
+    auto& peer_read_pool = a.inner_internals().peer_read_pool;
+    REQUIRE(
+        peer_read_pool.get_summary_info().kind == task_queue_kind::BLOCKING);
+    REQUIRE(peer_read_pool.get_summary_info().completed_count == 2);
+    auto& peer_write_pool = a.inner_internals().peer_write_pool;
+    REQUIRE(peer_write_pool.get_summary_info().completed_count == 1);
+
+    // If b goes away, a just computes the values that b owns.
+    b.inner_reset();
+    a.inner_internals().disk_cache.clear();
+    REQUIRE(get_item(a, item));
+}
+
+TEST_CASE("disk write queue in the service", "[inner][service]")
+{
+    auto cache_dir = file_path("tests_inner_disk_write_queue");
+    reset_directory(cache_dir);
+
+    auto config = make_test_config(cache_dir.string());
+    config.disk_write_queue = disk_write_queue_config{};
+    config.disk_write_queue->size_limit = 0x10'00'00;
+    inner_service_core core;
+    core.inner_reset(config);
+
+    // Computed values are written through the queue.
+    for (int i = 0; i != 4; ++i)
+        REQUIRE(get_item(core, i));
+    core.inner_internals().disk_write_pool.wait_for_tasks();
+    auto info = core.inner_internals().disk_write_queue.get_summary_info();
+    REQUIRE(info.written_count == 4);
+    REQUIRE(info.pending_count == 0);
+    REQUIRE(info.shed_count == 0);
+
+    // And they're read back from the disk cache.
+    core.inner_reset();
+    core.inner_reset(make_test_config(cache_dir.string()));
+    for (int i = 0; i != 4; ++i)
+        REQUIRE(!get_item(core, i));
+}
+
+TEST_CASE("service scheduler", "[inner][service]")
+{
+    auto cache_dir = file_path("tests_inner_service_scheduler");
+    reset_directory(cache_dir);
+
+    auto config = make_test_config(cache_dir.string());
+    config.scheduler = task_scheduler_config{};
+    config.scheduler->thread_count = 3;
+    config.scheduler->queue_concurrency["disk_write"] = 1;
+    inner_service_core core;
+    core.inner_reset(config);
+
+    // The disk pools are queues on the service's scheduler.
+    auto& internals = core.inner_internals();
+    REQUIRE(internals.scheduler.get_thread_count() == 3);
+    REQUIRE(internals.disk_read_pool.get_summary_info().concurrency == 2);
+    REQUIRE(internals.disk_write_pool.get_summary_info().concurrency == 1);
+    // (Checksums can use all the threads.)
+    REQUIRE(internals.checksum_pool.get_summary_info().concurrency == 3);
+
+    for (int i = 0; i != 4; ++i)
+        REQUIRE(get_item(core, i));
+    internals.disk_write_pool.wait_for_tasks();
+    REQUIRE(internals.disk_write_pool.get_summary_info().completed_count == 4);
+}
+
+TEST_CASE("cancellation of cached tasks", "[inner][service]")
+{
+    auto cache_dir = file_path("tests_inner_cached_cancellation");
+    reset_directory(cache_dir);
+    inner_service_core core;
+    core.inner_reset(make_test_config(cache_dir.string()));
+
+    // Two requesters are interested in the same value.
+    cppcoro::cancellation_token work_cancellation;
+    int creation_count = 0;
+    auto create_task = [&](id_interface const&,
+                           cppcoro::cancellation_token cancellation) {
+        ++creation_count;
+        work_cancellation = cancellation;
+        return wait_for_cancellation(cancellation);
+    };
+    auto key = make_id(0);
+    cppcoro::cancellation_source a, b;
+    auto task_a = cached<int>(core, key, create_task, a.token());
+    auto task_b = cached<int>(core, key, create_task, b.token());
+    REQUIRE(creation_count == 1);
+
+    std::atomic<int> cancelled_count = 0;
+    auto await_task = [&](cppcoro::shared_task<int> task) {
+        try
+        {
+            cppcoro::sync_wait(task);
+        }
+        catch (cppcoro::operation_cancelled&)
+        {
+            ++cancelled_count;
+        }
+    };
+    std::thread thread_a(await_task, task_a);
+    std::thread thread_b(await_task, task_b);
+
+    // The work continues as long as either of them is still interested...
+    a.request_cancellation();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    REQUIRE(!work_cancellation.is_cancellation_requested());
+
+    // ... but once they're both gone, it's cancelled.
+    b.request_cancellation();
+    thread_a.join();
+    thread_b.join();
+    REQUIRE(work_cancellation.is_cancellation_requested());
+    REQUIRE(cancelled_count == 2);
+
+    // The cancelled entry isn't kept, so the value can be requested again.
+    auto summary = get_cache_summary(core.inner_internals().cache);
+    REQUIRE(summary.loading_count == 0);
+    REQUIRE(summary.failed_count == 0);
+    REQUIRE(summary.cancelled_count == 1);
+    auto task_c = cached<int>(
+        core, key, [](id_interface const&) -> cppcoro::task<int> {
+            co_return 42;
+        });
+    REQUIRE(cppcoro::sync_wait(task_c) == 42);
+}
@@ -0,0 +1,127 @@
+#include <cradle/inner/service/disk_write_queue.h>
+
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <catch2/catch.hpp>
+
+#include <cradle/inner/core/type_interfaces.h>
+
+using std::string;
+
+using namespace cradle;
+
+namespace {
+
+// a stand-in for the disk cache whose writes can be held up
+struct test_disk
+{
+    std::map<string, string> values;
+    std::map<string, string> namespaces;
+    std::mutex mutex;
+
+    std::promise<void> release;
+    std::shared_future<void> released{release.get_future().share()};
+
+    disk_write_function
+    writer()
+    {
+        return [this](
+                   string const& key,
+                   blob const& value,
+                   string const& key_namespace) {
+            released.wait();
+            std::scoped_lock<std::mutex> lock(mutex);
+            values[key] = string(
+                reinterpret_cast<char const*>(value.data()), value.size());
+            namespaces[key] = key_namespace;
+        };
+    }
+};
+
+} // namespace
+
+TEST_CASE("disk write queue coalescing", "[disk_write_queue]")
+{
+    test_disk disk;
+    task_scheduler scheduler(task_scheduler_config{1, {}});
+    auto pool = scheduler.get_queue("disk_write", 1);
+    disk_write_queue queue(disk_write_queue_config{}, pool, disk.writer());
+
+    // The first write for a key is held up, so the second one for the same
+    // key is merged with it (even though it's already in progress).
+    REQUIRE(queue.push("a", make_blob(string(10, 'a')), "ns"));
+    REQUIRE(queue.push("b", make_blob(string(20, 'b'))));
+    REQUIRE(queue.push("a", make_blob(string(10, 'a')), "ns"));
+    REQUIRE(queue.push("b", make_blob(string(20, 'b'))));
+
+    auto info = queue.get_summary_info();
+    REQUIRE(info.pending_count == 2);
+    REQUIRE(info.pending_size == 30);
+    REQUIRE(info.coalesced_count == 2);
+    REQUIRE(info.written_count == 0);
+
+    disk.release.set_value();
+    pool.wait_for_tasks();
+
+    REQUIRE(disk.values["a"] == string(10, 'a'));
+    REQUIRE(disk.namespaces["a"] == "ns");
+    REQUIRE(disk.values["b"] == string(20, 'b'));
+    REQUIRE(disk.namespaces["b"] == "");
+
+    info = queue.get_summary_info();
+    REQUIRE(info.pending_count == 0);
+    REQUIRE(info.pending_size == 0);
+    REQUIRE(info.written_count == 2);
+    REQUIRE(info.max_latency >= info.average_latency);
+    REQUIRE(info.max_latency.count() > 0);
+
+    // Once a write is done, the key can be written again.
+    REQUIRE(queue.push("a", make_blob(string(10, 'a'))));
+    pool.wait_for_tasks();
+    REQUIRE(queue.get_summary_info().written_count == 3);
+}
+
+TEST_CASE("disk write queue backpressure", "[disk_write_queue]")
+{
+    test_disk disk;
+    task_scheduler scheduler(task_scheduler_config{1, {}});
+    auto pool = scheduler.get_queue("disk_write", 1);
+    disk_write_queue_config config;
+    config.size_limit = 100;
+    disk_write_queue queue(config, pool, disk.writer());
+
+    // An empty queue always accepts a write, even if it's too big.
+    REQUIRE(queue.push("big", make_blob(string(150, 'x'))));
+    // Anything else is dropped right away (without waiting for the disk,
+    // which is stuck).
+    auto start = std::chrono::steady_clock::now();
+    REQUIRE(!queue.push("small", make_blob(string(10, 'y'))));
+    REQUIRE(
+        std::chrono::steady_clock::now() - start
+        < std::chrono::milliseconds(50));
+
+    auto info = queue.get_summary_info();
+    REQUIRE(info.pending_count == 1);
+    REQUIRE(info.shed_count == 1);
+
+    // Once there's room again, writes go through.
+    disk.release.set_value();
+    pool.wait_for_tasks();
+    REQUIRE(queue.push("small", make_blob(string(10, 'y'))));
+    pool.wait_for_tasks();
+    info = queue.get_summary_info();
+    REQUIRE(info.shed_count == 1);
+    REQUIRE(disk.values["small"] == string(10, 'y'));
+    REQUIRE(disk.values["big"] == string(150, 'x'));
+    REQUIRE(info.pending_count == 0);
+    REQUIRE(info.pending_size == 0);
+
+    // Writes within the limit are all accepted.
+    REQUIRE(queue.push("c", make_blob(string(40, 'c'))));
+    REQUIRE(queue.push("d", make_blob(string(40, 'd'))));
+    pool.wait_for_tasks();
+    REQUIRE(queue.get_summary_info().shed_count == 1);
+}
@@ -0,0 +1,388 @@
+#include <cradle/inner/service/task_scheduler.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+
+#include <catch2/catch.hpp>
+#include <cppcoro/sync_wait.hpp>
+#include <cppcoro/task.hpp>
+
+using namespace cradle;
+
+namespace {
+
+// tracks how many jobs are running at once
+struct concurrency_tracker
+{
+    std::atomic<int> running{0};
+    std::atomic<int> max_running{0};
+    std::atomic<int> finished{0};
+
+    std::function<void()>
+    make_job(std::chrono::milliseconds duration)
+    {
+        return [this, duration] {
+            int now = ++running;
+            int max = max_running;
+            while (now > max && !max_running.compare_exchange_weak(max, now))
+            {
+            }
+            std::this_thread::sleep_for(duration);
+            --running;
+            ++finished;
+        };
+    }
+};
+
+cppcoro::task<std::thread::id>
+get_thread_on(task_queue queue)
+{
+    co_await queue.schedule();
+    co_return std::this_thread::get_id();
+}
+
+cppcoro::task<task_priority>
+get_priority_on(task_queue queue)
+{
+    co_await queue.schedule();
+    co_return get_current_task_priority();
+}
+
+} // namespace
+
+TEST_CASE("task scheduler queues", "[task_scheduler]")
+{
+    task_scheduler_config config;
+    config.thread_count = 4;
+    config.queue_concurrency["limited"] = 2;
+    task_scheduler scheduler(config);
+    REQUIRE(scheduler.get_thread_count() == 4);
+
+    // Queues are shared by name (but not when they're added explicitly).
+    auto a = scheduler.get_queue("a", 1);
+    a.push_task([] {});
+    a.wait_for_tasks();
+    REQUIRE(
+        scheduler.get_queue("a", 1).get_summary_info().completed_count == 1);
+    REQUIRE(
+        scheduler.add_queue("a", 1).get_summary_info().completed_count == 0);
+
+    // The config overrides the requested limits.
+    auto limited = scheduler.get_queue("limited", 4);
+    REQUIRE(limited.get_summary_info().concurrency == 2);
+    REQUIRE(scheduler.get_queue("b", 3).get_summary_info().concurrency == 3);
+
+    auto info = scheduler.get_summary_info();
+    REQUIRE(info.size() == 4);
+    REQUIRE(info[0].name == "a");
+    REQUIRE(info[3].name == "b");
+}
+
+TEST_CASE("task scheduler concurrency limits", "[task_scheduler]")
+{
+    task_scheduler_config config;
+    config.thread_count = 4;
+    task_scheduler scheduler(config);
+
+    std::chrono::milliseconds const short_job(5), long_job(20);
+
+    // A queue never runs more than its limit at once...
+    auto serial = scheduler.get_queue("serial", 1);
+    concurrency_tracker serial_tracker;
+    for (int i = 0; i != 6; ++i)
+        serial.push_task(serial_tracker.make_job(short_job));
+
+    // ... so the other threads are free for other queues, which can use all
+    // of them.
+    auto wide = scheduler.get_queue("wide", 4);
+    concurrency_tracker wide_tracker;
+    for (int i = 0; i != 12; ++i)
+        wide.push_task(wide_tracker.make_job(long_job));
+
+    serial.wait_for_tasks();
+    wide.wait_for_tasks();
+    REQUIRE(serial_tracker.finished == 6);
+    REQUIRE(serial_tracker.max_running == 1);
+    REQUIRE(wide_tracker.finished == 12);
+    REQUIRE(wide_tracker.max_running > 1);
+    REQUIRE(wide_tracker.max_running <= 4);
+    REQUIRE(serial.get_tasks_total() == 0);
+    REQUIRE(wide.get_summary_info().completed_count == 12);
+}
+
+TEST_CASE("task scheduler blocked queues", "[task_scheduler]")
+{
+    task_scheduler_config config;
+    config.thread_count = 2;
+    task_scheduler scheduler(config);
+
+    // While one queue's jobs are stuck, another's still get through.
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    auto stuck = scheduler.get_queue("stuck", 1);
+    for (int i = 0; i != 3; ++i)
+        stuck.push_task([released] { released.wait(); });
+
+    auto other = scheduler.get_queue("other", 1);
+    std::atomic<int> count{0};
+    for (int i = 0; i != 10; ++i)
+        other.push_task([&] { ++count; });
+    other.wait_for_tasks();
+    REQUIRE(count == 10);
+    REQUIRE(stuck.get_tasks_total() == 3);
+
+    release.set_value();
+    stuck.wait_for_tasks();
+    REQUIRE(stuck.get_tasks_total() == 0);
+}
+
+TEST_CASE("task scheduler blocking queues", "[task_scheduler]")
+{
+    task_scheduler_config config;
+    config.thread_count = 2;
+    task_scheduler scheduler(config);
+    auto http = scheduler.get_queue("http", 36, task_queue_kind::BLOCKING);
+    REQUIRE(http.get_summary_info().kind == task_queue_kind::BLOCKING);
+    REQUIRE(scheduler.get_thread_count() == 2);
+
+    // Saturate the blocking queue (and then some).
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    std::atomic<int> started{0};
+    for (int i = 0; i != 40; ++i)
+    {
+        http.push_task([&started, released] {
+            ++started;
+            released.wait();
+        });
+    }
+
+    // All of its jobs up to its limit get to run...
+    while (http.get_summary_info().running_count != 36)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    REQUIRE(started == 36);
+
+    // ... while the other queues still have all the workers.
+    auto local_a = scheduler.add_queue("local@a", 4);
+    auto local_b = scheduler.add_queue("local@b", 4);
+    concurrency_tracker tracker;
+    for (int i = 0; i != 8; ++i)
+    {
+        local_a.push_task(tracker.make_job(std::chrono::milliseconds(5)));
+        local_b.push_task(tracker.make_job(std::chrono::milliseconds(5)));
+    }
+    local_a.wait_for_tasks();
+    local_b.wait_for_tasks();
+    REQUIRE(tracker.finished == 16);
+    REQUIRE(tracker.max_running <= 2);
+    REQUIRE(http.get_tasks_total() == 40);
+
+    release.set_value();
+    http.wait_for_tasks();
+    REQUIRE(started == 40);
+    REQUIRE(http.get_summary_info().completed_count == 40);
+}
+
+TEST_CASE("task scheduler coroutines", "[task_scheduler]")
+{
+    task_scheduler_config config;
+    config.thread_count = 2;
+    task_scheduler scheduler(config);
+    auto queue = scheduler.get_queue("coroutines", 2);
+
+    REQUIRE(
+        cppcoro::sync_wait(get_thread_on(queue))
+        != std::this_thread::get_id());
+    queue.wait_for_tasks();
+    REQUIRE(queue.get_summary_info().completed_count == 1);
+}
+
+TEST_CASE("task scheduler shutdown", "[task_scheduler]")
+{
+    // Jobs that are still queued when the scheduler is destroyed are
+    // finished first.
+    std::atomic<int> count{0};
+    {
+        task_scheduler_config config;
+        config.thread_count = 1;
+        task_scheduler scheduler(config);
+        auto queue = scheduler.get_queue("jobs", 1);
+        for (int i = 0; i != 20; ++i)
+        {
+            queue.push_task([&] {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                ++count;
+            });
+        }
+    }
+    REQUIRE(count == 20);
+}
+
+TEST_CASE("task scheduler shutdown with a backlog", "[task_scheduler]")
+{
+    // Most of the threads (of both kinds) are idle while the limited queues
+    // work through their backlogs, but they still have to notice when it's
+    // time to exit.
+    std::atomic<int> count{0};
+    {
+        task_scheduler_config config;
+        config.thread_count = 4;
+        task_scheduler scheduler(config);
+        auto limited = scheduler.get_queue("limited", 1);
+        auto blocking
+            = scheduler.get_queue("blocking", 1, task_queue_kind::BLOCKING);
+        scheduler.get_queue("idle", 3, task_queue_kind::BLOCKING);
+        for (int i = 0; i != 3; ++i)
+        {
+            for (auto& queue : {limited, blocking})
+            {
+                queue.push_task([&] {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                    ++count;
+                });
+            }
+        }
+    }
+    REQUIRE(count == 6);
+}
+
+TEST_CASE("task scheduler priorities", "[task_scheduler]")
+{
+    task_scheduler_config config;
+    config.thread_count = 1;
+    task_scheduler scheduler(config);
+    auto a = scheduler.get_queue("a", 1);
+    auto b = scheduler.get_queue("b", 1);
+
+    // Hold up the only worker while the other jobs are queued.
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    b.push_task([released] { released.wait(); });
+
+    std::mutex mutex;
+    std::vector<std::string> order;
+    auto record = [&](std::string const& name) {
+        return [&, name] {
+            std::scoped_lock<std::mutex> lock(mutex);
+            order.push_back(name);
+        };
+    };
+    a.push_task(record("low"), task_priority::LOW);
+    b.push_task(record("normal"));
+    a.with_priority(task_priority::HIGH).push_task(record("high"));
+    b.push_task(record("high 2"), task_priority::HIGH);
+
+    release.set_value();
+    a.wait_for_tasks();
+    b.wait_for_tasks();
+    REQUIRE(
+        order
+        == std::vector<std::string>{"high", "high 2", "normal", "low"});
+}
+
+TEST_CASE("task scheduler priority inheritance", "[task_scheduler]")
+{
+    task_scheduler_config config;
+    config.thread_count = 2;
+    task_scheduler scheduler(config);
+    auto queue = scheduler.get_queue("jobs", 2);
+
+    REQUIRE(get_current_task_priority() == task_priority::NORMAL);
+
+    // A job that's added from within another job gets its priority.
+    std::atomic<task_priority> child_priority{task_priority::NORMAL};
+    queue.push_task(
+        [&] {
+            queue.push_task([&] {
+                child_priority = get_current_task_priority();
+            });
+        },
+        task_priority::HIGH);
+    queue.wait_for_tasks();
+    REQUIRE(child_priority == task_priority::HIGH);
+
+    // So does a coroutine that's scheduled from within one.
+    child_priority = task_priority::NORMAL;
+    queue.push_task(
+        [&] {
+            child_priority = cppcoro::sync_wait(get_priority_on(queue));
+        },
+        task_priority::LOW);
+    queue.wait_for_tasks();
+    REQUIRE(child_priority == task_priority::LOW);
+}
+
+TEST_CASE("task scheduler starvation guard", "[task_scheduler]")
+{
+    task_scheduler_config config;
+    config.thread_count = 1;
+    config.starvation_limit = std::chrono::milliseconds(20);
+    task_scheduler scheduler(config);
+    auto queue = scheduler.get_queue("jobs", 1);
+
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    queue.push_task([released] { released.wait(); });
+
+    // Once the low-priority job has waited long enough to be promoted all
+    // the way up, it goes ahead of newer high-priority jobs.
+    std::vector<task_priority> order;
+    queue.push_task(
+        [&] { order.push_back(task_priority::LOW); }, task_priority::LOW);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    for (int i = 0; i != 3; ++i)
+    {
+        queue.push_task(
+            [&] { order.push_back(task_priority::HIGH); },
+            task_priority::HIGH);
+    }
+
+    release.set_value();
+    queue.wait_for_tasks();
+    REQUIRE(order.size() == 4);
+    REQUIRE(order[0] == task_priority::LOW);
+    REQUIRE(queue.get_summary_info().overdue_count >= 1);
+}
+
+TEST_CASE("task scheduler sustained backlog", "[task_scheduler]")
+{
+    task_scheduler_config config;
+    config.thread_count = 1;
+    config.starvation_limit = std::chrono::milliseconds(100);
+    task_scheduler scheduler(config);
+    auto queue = scheduler.get_queue("jobs", 1);
+
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    queue.push_task([released] { released.wait(); });
+
+    std::mutex mutex;
+    std::vector<task_priority> order;
+    auto record = [&](task_priority priority) {
+        return [&, priority] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            std::scoped_lock<std::mutex> lock(mutex);
+            order.push_back(priority);
+        };
+    };
+
+    // A backlog of low-priority jobs that have all waited past the limit
+    // (but only long enough for one promotion) still yields to new
+    // high-priority jobs...
+    for (int i = 0; i != 20; ++i)
+        queue.push_task(record(task_priority::LOW), task_priority::LOW);
+    std::this_thread::sleep_for(std::chrono::milliseconds(120));
+    queue.push_task(record(task_priority::HIGH), task_priority::HIGH);
+    queue.push_task(record(task_priority::HIGH), task_priority::HIGH);
+
+    release.set_value();
+    queue.wait_for_tasks();
+    REQUIRE(order.size() == 22);
+    REQUIRE(order[0] == task_priority::HIGH);
+    REQUIRE(order[1] == task_priority::HIGH);
+    // ... and the promoted jobs are counted.
+    REQUIRE(queue.get_summary_info().overdue_count >= 20);
+}
@@ -168,7 +168,33 @@ TEST_CASE("generated type interfaces", "[core][types]")
     {
         INFO("Test a generated structure type.");
         test_regular_value_pair(
-            service_disk_cache_config(some(string("abc")), 12),
-            service_disk_cache_config(some(string("def")), 1));
+            service_disk_cache_config(
+                some(string("abc")),
+                12,
+                none,
+                none,
+                none,
+                none,
+                none,
+                none,
+                none,
+                none,
+                none,
+                none,
+                none),
+            service_disk_cache_config(
+                some(string("def")),
+                1,
+                some(2),
+                some(8),
+                some(50),
+                some(service_disk_cache_verification_mode::SAMPLED),
+                some(4),
+                none,
+                some(1000),
+                none,
+                some(0x100'000),
+                some(true),
+                some(false)));
     }
 }